@@ -22,12 +22,70 @@
 #include "qtutil.h"
 
 #include <cfloat>
+#include <queue>
+
+/// ColorDescriptor::colors as planes, for vectorized distance
+struct ColorPlanes {
+  enum { N = ColorDescriptor::NUM_DESC_COLORS };
+  uint16_t l[N], u[N], v[N], w[N];
+};
+
+/// decompressed ColorPlanes, see DescriptorColor::get()
+struct ColorPlanesF {
+  enum { N = ColorPlanes::N };
+  alignas(32) float l[N], u[N], v[N];
+  int numColors;
+
+  ColorPlanesF(const ColorPlanes& c, int num) {
+    // unused colors are far from everything so they are never the closest
+    constexpr float unused = 1e18f;
+    numColors = num;
+    for (int j = 0; j < N; ++j) {
+      const bool valid = j < num;
+      l[j] = valid ? c.l[j] * 100.0f / UINT16_MAX : unused;
+      u[j] = valid ? c.u[j] * 354.0f / UINT16_MAX - 134.0f : unused;
+      v[j] = valid ? c.v[j] * 262.0f / UINT16_MAX - 140.0f : unused;
+    }
+  }
+};
+
+/**
+ * Same as ColorDescriptor::distance(), except it gives up when the
+ * result would be >= maxScore (returning a partial sum >= maxScore)
+ * @note the numColors check must be done beforehand
+ */
+static float colorDistance(const ColorPlanesF& a_, const ColorPlanesF& b_, float maxScore) {
+  // a is the descriptor with more colors
+  const ColorPlanesF& a = a_.numColors < b_.numColors ? b_ : a_;
+  const ColorPlanesF& b = a_.numColors < b_.numColors ? a_ : b_;
+
+  float score = 1;
+  for (int i = 0; i < a.numColors; i++) {
+    const float l1 = a.l[i], u1 = a.u[i], v1 = a.v[i];
+
+    // fixed-length, the unused colors of b do not need masking
+    float minDist = FLT_MAX;
+    for (int j = 0; j < ColorPlanesF::N; j++) {
+      const float dl = l1 - b.l[j];
+      const float du = u1 - b.u[j];
+      const float dv = v1 - b.v[j];
+      minDist = std::min(minDist, dl * dl + du * du + dv * dv);
+    }
+
+    // sqrt is monotonic, so only the closest needs it
+    score += sqrtf(minDist);
+    if (score >= maxScore) break;
+  }
+
+  return score;
+}
 
 ColorDescIndex::ColorDescIndex() : Index() {
   _id = SearchParams::AlgoColor;
   _count = 0;
   _mediaId = nullptr;
-  _descriptors = nullptr;
+  _numColors = nullptr;
+  _colors = nullptr;
 }
 
 ColorDescIndex::~ColorDescIndex() { unload(); }
@@ -89,11 +147,39 @@ void ColorDescIndex::removeRecords(QSqlDatabase& db, const QVector<int>& mediaId
 
 void ColorDescIndex::unload() {
   free(_mediaId);
-  free(_descriptors);
+  free(_numColors);
+  free(_colors);
 
   _count = 0;
   _mediaId = nullptr;
-  _descriptors = nullptr;
+  _numColors = nullptr;
+  _colors = nullptr;
+}
+
+void ColorDescIndex::setDescriptor(int i, const ColorDescriptor& desc) {
+  ColorPlanes& planes = _colors[i];
+  for (int j = 0; j < ColorPlanes::N; ++j) {
+    const DescriptorColor& c = desc.colors[j];
+    planes.l[j] = c.l;
+    planes.u[j] = c.u;
+    planes.v[j] = c.v;
+    planes.w[j] = c.w;
+  }
+  _numColors[i] = desc.numColors;
+}
+
+ColorDescriptor ColorDescIndex::descriptor(int i) const {
+  ColorDescriptor desc;
+  const ColorPlanes& planes = _colors[i];
+  for (int j = 0; j < ColorPlanes::N; ++j) {
+    DescriptorColor& c = desc.colors[j];
+    c.l = planes.l[j];
+    c.u = planes.u[j];
+    c.v = planes.v[j];
+    c.w = planes.w[j];
+  }
+  desc.numColors = _numColors[i];
+  return desc;
 }
 
 bool ColorDescIndex::isLoaded() const { return _count > 0; }
@@ -102,7 +188,7 @@ int ColorDescIndex::count() const { return _count; }
 
 size_t ColorDescIndex::memoryUsage() const {
   size_t num = size_t(count());
-  return sizeof(ColorDescriptor) * num + sizeof(int) * num;
+  return (sizeof(ColorPlanes) + sizeof(*_numColors) + sizeof(*_mediaId)) * num;
 }
 
 void ColorDescIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
@@ -126,7 +212,8 @@ void ColorDescIndex::load(QSqlDatabase& db, const QString& cachePath, const QStr
   PROGRESS_LOGGER(pl, "<PL>%percent %bignum descriptors", _count);
 
   // allocate using malloc so we can use realloc() later
-  _descriptors = strict_malloc(_descriptors, _count);
+  _colors = strict_malloc(_colors, _count);
+  _numColors = strict_malloc(_numColors, _count);
   _mediaId = strict_malloc(_mediaId, _count);
 
   query.exec("select media_id,color_desc from color");
@@ -145,13 +232,14 @@ void ColorDescIndex::load(QSqlDatabase& db, const QString& cachePath, const QStr
 
     // convert the blob
     QByteArray bytes = query.value(1).toByteArray();
+    ColorDescriptor desc;
     if (bytes.length() == sizeof(ColorDescriptor))
-      memcpy(_descriptors + i, bytes.constData(), sizeof(ColorDescriptor));
+      memcpy(&desc, bytes.constData(), sizeof(ColorDescriptor));
     else {
       // this should not happen anymore since addRecords() prevents it
-      _descriptors[i].clear();
       qWarning("no color desc for id %d, correct by re-indexing", _mediaId[i]);
     }
+    setDescriptor(i, desc);
     i++;
 
     if (i % 20000 == 0)
@@ -172,12 +260,13 @@ void ColorDescIndex::add(const MediaGroup& media) {
   _count += media.count();
 
   _mediaId = strict_realloc(_mediaId, _count);
-  _descriptors = strict_realloc(_descriptors, _count);
+  _numColors = strict_realloc(_numColors, _count);
+  _colors = strict_realloc(_colors, _count);
 
   for (int i = 0; i < media.count(); i++) {
     const Media& m = media[i];
     _mediaId[i + end] = uint32_t(m.id());
-    _descriptors[i + end] = m.colorDescriptor();
+    setDescriptor(i + end, m.colorDescriptor());
   }
 }
 
@@ -192,7 +281,7 @@ void ColorDescIndex::remove(const QVector<int>& toRemove) {
   for (int i = 0; i < _count; i++)
     if (ids.contains(int(_mediaId[i]))) {
       _mediaId[i] = 0;
-      _descriptors[i].clear();
+      setDescriptor(i, ColorDescriptor());
     }
 }
 
@@ -200,7 +289,7 @@ bool ColorDescIndex::findIndexData(Media& m) const {
   uint32_t id = uint32_t(m.id());
   for (int i = 0; i < _count; i++)
     if (_mediaId[i] == id) {
-      m.setColorDescriptor(_descriptors[i]);
+      m.setColorDescriptor(descriptor(i));
       return true;
     }
   return false;
@@ -209,14 +298,16 @@ bool ColorDescIndex::findIndexData(Media& m) const {
 Index* ColorDescIndex::slice(const QSet<uint32_t>& mediaIds) const {
   ColorDescIndex* chunk = new ColorDescIndex;
   chunk->_count = mediaIds.count();
-  chunk->_descriptors = strict_malloc(chunk->_descriptors, chunk->_count);
+  chunk->_colors = strict_malloc(chunk->_colors, chunk->_count);
+  chunk->_numColors = strict_malloc(chunk->_numColors, chunk->_count);
   chunk->_mediaId = strict_malloc(chunk->_mediaId, chunk->_count);
 
   int j = 0;
   for (int i = 0; i < _count; ++i)
     if (mediaIds.contains(_mediaId[i])) {
       Q_ASSERT(j < chunk->_count);
-      chunk->_descriptors[j] = _descriptors[i];
+      chunk->_colors[j] = _colors[i];
+      chunk->_numColors[j] = _numColors[i];
       chunk->_mediaId[j] = _mediaId[i];
       j++;
     }
@@ -226,10 +317,6 @@ Index* ColorDescIndex::slice(const QSet<uint32_t>& mediaIds) const {
 }
 
 QVector<Index::Match> ColorDescIndex::find(const Media& m, const SearchParams& p) {
-  (void)p;
-
-  // TODO: search tree for histograms
-
   QVector<Index::Match> results;
 
   ColorDescriptor target = m.colorDescriptor();
@@ -241,13 +328,41 @@ QVector<Index::Match> ColorDescIndex::find(const Media& m, const SearchParams& p
       qWarning() << "needle has no color descriptor" << m.id() << m.path();
   }
 
+  const int numTarget = target.numColors;
+  if (numTarget <= 0) return results;
+
+  ColorPlanes planes = {};
+  for (int j = 0; j < ColorPlanes::N; ++j) {
+    planes.l[j] = target.colors[j].l;
+    planes.u[j] = target.colors[j].u;
+    planes.v[j] = target.colors[j].v;
+  }
+  const ColorPlanesF needle(planes, numTarget);
+
+  // the caller keeps the best maxMatches (+1 if the needle is indexed),
+  // anything scoring worse than all of those can be abandoned early;
+  // equal scores are kept so the result does not depend on index order
+  const size_t numBest = size_t(std::max(p.maxMatches, 0)) + 1;
+  std::priority_queue<int> best;  // lowest scores so far, highest on top
+  float maxScore = FLT_MAX;
+
   for (int i = 0; i < _count; i++) {
-    float distance = ColorDescriptor::distance(target, _descriptors[i]);
+    // same as the check in ColorDescriptor::distance()
+    const int num = _numColors[i];
+    if (num == 0 || abs(num - numTarget) > 2) continue;
 
-    if (distance < FLT_MAX) {
-      uint32_t id = _mediaId[i];
-      if (id != 0) results.append(Index::Match(id, int(distance)));
-    }
+    const float distance = colorDistance(needle, ColorPlanesF(_colors[i], num), maxScore);
+    if (distance >= maxScore) continue;
+
+    uint32_t id = _mediaId[i];
+    if (id == 0) continue;
+
+    const int score = int(distance);
+    results.append(Index::Match(id, score));
+
+    best.push(score);
+    if (best.size() > numBest) best.pop();
+    if (best.size() == numBest) maxScore = float(best.top() + 1);
   }
 
   return results;
@@ -21,11 +21,16 @@
 #pragma once
 #include "index.h"
 
+struct ColorPlanes;
+
 /**
  * @class ColorDescIndex
  * @brief Index for ColorDescriptor
  *
  * Detects images with similar colors
+ *
+ * Descriptors are stored as planes of L,u,v,w so the distance
+ * to all colors of a candidate can be computed with SIMD
  */
 class ColorDescIndex : public Index {
   Q_DISABLE_COPY_MOVE(ColorDescIndex)
@@ -55,8 +60,11 @@ class ColorDescIndex : public Index {
 
  private:
   void unload();
+  void setDescriptor(int i, const ColorDescriptor& desc);
+  ColorDescriptor descriptor(int i) const;
 
   int _count;
   uint32_t* _mediaId;
-  ColorDescriptor* _descriptors;
+  uint8_t* _numColors;    // ColorDescriptor::numColors, checked before reading _colors
+  ColorPlanes* _colors;   // ColorDescriptor::colors
 };
@@ -25,6 +25,8 @@
 #include "profile.h"
 #include "qtutil.h"
 
+#include "tree/lshindex.h"
+
 #include "opencv2/features2d.hpp"
 
 // there is a breaking change to flann interface at some point
@@ -34,12 +36,23 @@
 
 static QString cacheFile(const QString& cachePath) { return cachePath + qq("/cvfeatures.touch"); }
 
+static QString matrixFile(const QString& cachePath) { return cachePath + qq("/cvfeatures.mat"); }
+
+static QString lshFile(const QString& cachePath) { return cachePath + qq("/cvfeatures.lsh"); }
+
 CvFeaturesIndex::CvFeaturesIndex() {
   _id = SearchParams::AlgoCVFeatures;
+  _matrixFile = nullptr;
   _index = nullptr;
+  _isLoaded = false;
+  _numTables = SearchParams().cvTables;
 }
 
-CvFeaturesIndex::~CvFeaturesIndex() { delete _index; }
+CvFeaturesIndex::~CvFeaturesIndex() {
+  delete _index;
+  _descriptors = cv::Mat();
+  delete _matrixFile;
+}
 
 void CvFeaturesIndex::createTables(QSqlDatabase& db) const {
   QSqlQuery query(db);
@@ -97,7 +110,7 @@ void CvFeaturesIndex::removeRecords(QSqlDatabase& db, const QVector<int>& mediaI
     if (!query.exec("delete from matrix where media_id=" + QString::number(id))) SQL_FATAL(exec);
 }
 
-bool CvFeaturesIndex::isLoaded() const { return _index != nullptr; }
+bool CvFeaturesIndex::isLoaded() const { return _isLoaded; }
 
 int CvFeaturesIndex::count() const { return _descriptors.rows; }
 
@@ -107,19 +120,28 @@ size_t CvFeaturesIndex::memoryUsage() const {
   size_t mem = 0;
   const cv::Mat& d = _descriptors;
 
+  // mapped descriptors are counted, they are paged in by searching
   mem += uint(d.rows * d.cols) * d.elemSize();
 
-  // don't really know how much lsh index uses
-  mem *= 2;
+  if (_index) mem += _index->memoryUsage();
 
   // fixme:also memory for lookup trees
 
   return mem;
 }
 
+void CvFeaturesIndex::detach() {
+  if (!_matrixFile) return;
+  _descriptors = _descriptors.clone();
+  delete _matrixFile;
+  _matrixFile = nullptr;
+}
+
 void CvFeaturesIndex::add(const MediaGroup& media) {
   cv::Mat addedDescriptors;
 
+  detach();
+
   for (const Media& m : media) {
     const KeyPointDescriptors& desc = m.keyPointDescriptors();
     if (desc.rows <= 0) {
@@ -167,8 +189,10 @@ void CvFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QSt
 
   bool stale = DBHelper::isCacheFileStale(db, cacheFile(cachePath));
 
-  if (!_index || stale) {
+  if (!_isLoaded || stale) {
     _descriptors = cv::Mat();
+    delete _matrixFile;
+    _matrixFile = nullptr;
     delete _index;
     _index = nullptr;
 
@@ -239,7 +263,7 @@ void CvFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QSt
       pl.end();
       Q_ASSERT(_descriptors.rows == int(numDesc));
 
-      // build flann index
+      // build lsh index
       buildIndex({});
 
       saveIndex(cachePath);
@@ -248,6 +272,9 @@ void CvFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QSt
     // trailing values to get length of last value
     _idMap[UINT32_MAX] = uint32_t(_descriptors.rows);
     _indexMap[uint32_t(_descriptors.rows)] = 0;
+
+    // an empty matrix has no lsh index, but is loaded
+    _isLoaded = true;
   }
 
   qInfo("%d descriptors %dMB %dms", _descriptors.rows, int(memoryUsage() / 1000000),
@@ -276,12 +303,13 @@ Index* CvFeaturesIndex::slice(const QSet<uint32_t>& mediaIds) const {
   Q_ASSERT(chunk->_descriptors.rows == int(numDesc));
 
   chunk->buildIndex({});
+  chunk->_isLoaded = true;
 
   return chunk;
 }
 
 void CvFeaturesIndex::save(QSqlDatabase& db, const QString& cachePath) {
-  if (!_index) return;
+  if (!_isLoaded) return;
 
   if (DBHelper::isCacheFileStale(db, cacheFile(cachePath))) saveIndex(cachePath);
 }
@@ -302,63 +330,69 @@ void CvFeaturesIndex::buildIndex(const cv::Mat& addedDescriptors) {
   // The key size (K) determines the bucket sizes since the descriptors
   // are sorted into 2^K buckets, the bucket size on average is around N / 2^K
   //
-  // If the bucket size is too small, many hashes will miss and it takes
-  // a long time to build the index. If it is too big, the index build is fast,
-  // but query performance suffers.
+  // If the bucket size is too small, many hashes will miss. If it is too big,
+  // query performance suffers.
   //
   // This first attempt is to associate the bytes or memory/cache needed
-  // for each bucket and find a key size based on that.
+  // for each bucket and find a key size based on that (LshIndex::defaultKeySize)
   //
-  int tables = 1;
-  const int descSize = 32;  // OpenCV ORB default descriptor size (bytes)
+  const int descSize = LshIndex::DESC_BYTES;  // OpenCV ORB default descriptor size (bytes)
 
   // verify descriptor size
   if (_descriptors.cols > 0)
     Q_ASSERT(descSize == int(_descriptors.elemSize() * uint(_descriptors.cols)));
+  Q_ASSERT(_descriptors.isContinuous());
 
-  int bytesPerBucket = 4096;
-  int descPerBucket = bytesPerBucket / descSize;
-  int keySize = int(log2(_descriptors.rows / descPerBucket));
-  int numBuckets = 2 << keySize;
-  descPerBucket = _descriptors.rows / numBuckets;
-  int kbPerBucket = descPerBucket * descSize / 1024;
-
-  int indexKb = tables * numBuckets * descPerBucket * descSize / 1024;
+  const uint8_t* data = _descriptors.ptr<uint8_t>(0);
+  const size_t count = size_t(_descriptors.rows);
 
-  qDebug("descSize=%d keySize=%d buckets=%d descriptors/bucket=%d kb/bucket=%d indexKb=%d",
-         descSize, keySize, numBuckets, descPerBucket, kbPerBucket, indexKb);
-
-  cv::flann::LshIndexParams indexParams(tables, keySize, 1);
+  LshIndex::Params indexParams;
+  indexParams.tables = _numTables;
 
   // update with added descriptors, faster than full rebuild
   if (_index && addedDescriptors.rows > 0) {
-    _index->build(_descriptors, addedDescriptors, indexParams);
+    _index->add(data, count, indexParams);
   } else {
     delete _index;
-    //_index = new cv::flann::Index(_descriptors, indexParams); // non-incremental build
-    _index = new cv::flann::Index;
-
-    // build the index incrementally, it is a quite faster
-    // somehow, and does not seem to affect accuracy
-    PROGRESS_LOGGER(pl, "<PL>%percent %bignum descriptors", _descriptors.rows);
-
-    for (int i = 0; i < _descriptors.rows; i += 10000) {
-      int upper = std::min(i + 10000, _descriptors.rows);
-      _index->build(_descriptors.rowRange(0, upper), _descriptors.rowRange(i, upper), indexParams);
-      pl.step(i+upper);
-    }
-    pl.end();
+    _index = new LshIndex;
+    _index->build(data, count, indexParams);
   }
 
+  const int numBuckets = 1 << _index->keySize();
+  qDebug("descSize=%d tables=%d keySize=%d buckets=%d descriptors/bucket=%d", descSize,
+         _index->numTables(), _index->keySize(), numBuckets, int(count / size_t(numBuckets)));
+
   ms = QDateTime::currentMSecsSinceEpoch() - ms;
 
   qDebug("%d descriptors, %d added, %dms %.2fus/desc", _descriptors.rows, addedDescriptors.rows,
          int(ms), ms * 1000.0 / _descriptors.rows);
 }
 
+void CvFeaturesIndex::buildTables(int tables) {
+  tables = std::min(tables, int(LshIndex::MAX_TABLES));
+  {
+    QReadLocker locker(&_tablesLock);
+    if (_index->numTables() >= tables) return;
+  }
+
+  // tables are only built when a search needs them, and are written when the index is saved
+  QWriteLocker locker(&_tablesLock);
+  if (_index->numTables() >= tables) return;
+  qInfo("building %d lsh tables", tables);
+  _numTables = tables;
+  buildIndex({});
+}
+
 void CvFeaturesIndex::loadIndex(const QString& path) {
   uint64_t then = nanoTime();
-  loadMatrix(path + "/cvfeatures.mat", _descriptors);
+
+  // descriptors are mapped, falling back to reading if that fails
+  _matrixFile = new QFile(matrixFile(path));
+  if (!mapMatrix(*_matrixFile, _descriptors) || !_descriptors.isContinuous()) {
+    delete _matrixFile;
+    _matrixFile = nullptr;
+    loadMatrix(matrixFile(path), _descriptors);
+  }
   loadMap(_idMap, path + "/cvfeatures_idmap.map");
   loadMap(_indexMap, path + "/cvfeatures_indexmap.map");
 
@@ -366,8 +400,23 @@ void CvFeaturesIndex::loadIndex(const QString& path) {
   uint64_t nsLoad = now - then;
   then = now;
 
-  auto addedDescriptors = cv::Mat();
-  buildIndex(addedDescriptors);
+  // tables are only valid for the same descriptors, the count is checked
+  // and they were written before the marker file
+  if (_descriptors.rows > 0) {
+    _index = new LshIndex;
+    if (_index->map(lshFile(path), size_t(_descriptors.rows))) {
+      _numTables = _index->numTables();
+    } else {
+      qWarning("rebuilding lsh index");
+      delete _index;
+      _index = nullptr;
+      buildIndex(cv::Mat());
+      if (_index) {
+        LshIndex* index = _index;
+        writeFileAtomically(lshFile(path), [index](QFile& f) { index->write(f); });
+      }
+    }
+  }
 
   now = nanoTime();
   uint64_t nsBuild = now - then;
@@ -376,12 +425,22 @@ void CvFeaturesIndex::loadIndex(const QString& path) {
 }
 
 void CvFeaturesIndex::saveIndex(const QString& cachePath) {
-  qInfo() << "<PL>writing descriptors...";
-  saveMatrix(_descriptors, cachePath + "/cvfeatures.mat");
+  // if _descriptors is mapped from the file, it's already saved
+  if (!_matrixFile) {
+    qInfo() << "<PL>writing descriptors...";
+    saveMatrix(_descriptors, matrixFile(cachePath));
+  }
   qInfo() << "<PL>writing ids...        ";
   saveMap(_idMap, cachePath + "/cvfeatures_idmap.map");
   qInfo() << "<PL>writing indices...    ";
   saveMap(_indexMap, cachePath + "/cvfeatures_indexmap.map");
+  if (_index && !_index->isMapped()) {
+    // tail is not saved, and would fail validation on load
+    if (_index->tailSize() > 0) buildIndex(cv::Mat());
+    qInfo() << "<PL>writing lsh tables... ";
+    const LshIndex* index = _index;
+    writeFileAtomically(lshFile(cachePath), [index](QFile& f) { index->write(f); });
+  }
   qInfo() << "<PL>writing marker...     ";
   writeFileAtomically(cacheFile(cachePath), [](QFile& f) {
     QByteArray mark("this file indicates index was saved successfully");
@@ -420,12 +479,13 @@ QVector<Index::Match> CvFeaturesIndex::find(const Media& needle, const SearchPar
     return {};
   }
 
-  if (_descriptors.rows <= 0) {
+  if (_descriptors.rows <= 0 || !_index) {
     qWarning("empty index");
     return {};
   }
 
-  Q_ASSERT(_index != nullptr); // not possible if we have descriptors
+  buildTables(params.cvTables);
+  QReadLocker tablesLocker(&_tablesLock);
 
   // if we copied the features from db, we will have
   // a lot more than we need, reduce them while trying
@@ -464,20 +524,20 @@ QVector<Index::Match> CvFeaturesIndex::find(const Media& needle, const SearchPar
 
   // for every descriptor in the needle, find the 10 nearest in the index
   // TODO: how many do we actually have to find (should it be a parameter?)
-  cv::Mat flannIndices;
-  cv::Mat flannDists;
-  _index->knnSearch(descriptors, flannIndices, flannDists, 10);
+  const int knn = 10;
+  std::vector<LshIndex::Match> nearest;
+  const uint8_t* data = _descriptors.ptr<uint8_t>(0);
 
-  for (int i = 0; i < flannIndices.rows; i++)
-    for (int j = 0; j < flannIndices.cols; j++) {
-      int index = flannIndices.at<int>(i, j);
+  LshIndex::SearchParams lshParams;
+  lshParams.tables = params.cvTables;
+  lshParams.probeLevel = params.cvProbeLevel;
 
-      if (index < 0) {
-        // qWarning("zero index\n");
-        continue;
-      }
+  for (int i = 0; i < descriptors.rows; i++) {
+    _index->knnSearch(data, descriptors.ptr<uint8_t>(i), knn, lshParams, nearest);
 
-      int distance = flannDists.at<int>(i, j);
+    for (const LshIndex::Match& m : nearest) {
+      const uint32_t index = m.index;
+      const int distance = m.distance;
 
       // ignore bad matches
       if (distance >= params.cvThresh) continue;
@@ -501,11 +561,39 @@ QVector<Index::Match> CvFeaturesIndex::find(const Media& needle, const SearchPar
 
       maxMatches = std::max(match.count, maxMatches);
     }
+  }
 
   now = nanoTime();
   uint64_t nsFwd = now - then;
   then = now;
 
+  // recall of usable (< threshold) nearest neighbors, lsh vs brute force
+  if (params.cvRecall) {
+    std::vector<LshIndex::Match> exact;
+    int found = 0, expected = 0;
+    for (int i = 0; i < descriptors.rows; i++) {
+      const uint8_t* query = descriptors.ptr<uint8_t>(i);
+      _index->knnSearch(data, query, knn, lshParams, nearest);
+      _index->exhaustiveSearch(data, query, knn, exact);
+      for (const LshIndex::Match& e : exact) {
+        if (e.distance >= params.cvThresh) break;
+        expected++;
+        for (const LshIndex::Match& m : nearest)
+          if (m.index == e.index) {
+            found++;
+            break;
+          }
+      }
+    }
+
+    now = nanoTime();
+    qInfo("lsh recall=%.1f%% (%d/%d) tables=%d/%d probe=%d lsh=%.2fms check=%.2fms",
+          expected ? found * 100.0 / expected : 100.0, found, expected,
+          std::min(params.cvTables, _index->numTables()), _index->numTables(),
+          params.cvProbeLevel, nsFwd / 1000000.0, (now - then) / 1000000.0);
+    then = now;
+  }
+
   /*
       // do a reverse match to get better results
       cv::BFMatcher reverse(cv::NORM_HAMMING, false);
@@ -25,14 +25,16 @@
 
 #include "opencv2/core.hpp"
 
-namespace cv::flann {
-class Index;
-}
+class LshIndex;
+
 /**
  * @class CvFeaturesIndex
  * @brief Index for OpenCV feature descriptors
  *
  * Detects scaled, rotated, cropped images using ORB features
+ *
+ * The descriptor matrix and LSH tables are memory-mapped from
+ * the cache files, which are valid if cvfeatures.touch is not stale
  */
 class CvFeaturesIndex : public Index {
   Q_DISABLE_COPY_MOVE(CvFeaturesIndex)
@@ -61,13 +63,21 @@ class CvFeaturesIndex : public Index {
 
  private:
   void buildIndex(const cv::Mat& addedDescriptors);
+
+  /// rebuild with more tables if a search wants more than were built
+  void buildTables(int tables);
   void loadIndex(const QString& path);
   void saveIndex(const QString& path);
+  void detach();
 
   cv::Mat descriptorsForMediaId(uint32_t mediaId) const;
 
-  cv::Mat _descriptors;      // all descriptors merged into one fat cv::Mat
-  cv::flann::Index* _index;  // index of the cv::Mat
+  cv::Mat _descriptors;  // all descriptors merged into one fat cv::Mat
+  QFile* _matrixFile;    // if not null, _descriptors is mapped from it
+  LshIndex* _index;      // index of the cv::Mat, null if there are no descriptors
+  bool _isLoaded;
+  int _numTables;               // lsh tables to build, grows to SearchParams::cvTables
+  QReadWriteLock _tablesLock;   // searches vs. adding tables
 
   // map of first descriptor index to media Id, in ascending order,
   // INTMAX,0 as last item
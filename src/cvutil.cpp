@@ -155,6 +155,30 @@ void saveMatrix(const cv::Mat& mat, const QString& path) {
   });
 }
 
+bool mapMatrix(QFile& f, cv::Mat& mat) {
+  if (!f.isOpen() && !f.open(QFile::ReadOnly)) {
+    qWarning() << "open failed:" << f.fileName() << f.errorString();
+    return false;
+  }
+
+  const qint64 size = f.size();
+  const uchar* data = nullptr;
+  MatrixHeader h;
+
+  if (size >= qint64(sizeof(h))) data = f.map(0, size);
+  if (data) memcpy(&h, data, sizeof(h));
+
+  if (!data || h.rows < 0 || h.cols < 0 ||
+      h.stride != h.cols * int(CV_ELEM_SIZE(h.type)) ||
+      size != qint64(sizeof(h)) + qint64(h.rows) * h.stride) {
+    qWarning() << "invalid matrix file:" << f.fileName();
+    return false;
+  }
+
+  mat = cv::Mat(h.rows, h.cols, h.type, const_cast<uchar*>(data) + sizeof(h), size_t(h.stride));
+  return true;
+}
+
 void showImage(const cv::Mat& img) {
   const char* title = "showImage";
   cv::namedWindow(title, CV_WINDOW_AUTOSIZE);
@@ -423,15 +447,160 @@ void cvImgToQImageNoCopy(const cv::Mat& src, QImage& dst, QImage::Format forceFo
   dst = QImage(src.ptr(0), src.cols, src.rows, int(src.step[0]), format);
 }
 
+/**
+ * Rows 0-8 of the 32-point DCT-II matrix with the orthonormal scaling
+ * of cv::dct(). Since dctHash64 only uses the 9x9 lowest frequencies,
+ * the 2D transform reduces to freq = C * img * C^T with a 9x32 C.
+ *
+ * The transposed copy is padded to 16 columns so each pass is a
+ * fixed-length multiply-add across independent lanes, which the
+ * compiler vectorizes without reordering the sums.
+ *
+ * Sums are in double so rounding (or reassociation with -Ofast) is far
+ * below the differences that decide hash bits. Hashes in existing indexes
+ * came from a float cv::dct(), which rounds differently; bits too close to
+ * the threshold to tell are decided by that pipeline (dctHash64Float).
+ */
+struct DctHashBasis {
+  enum { N = 32, K = 9, Stride = 16 };
+  alignas(64) double rows[K][N];       // C[k][n]
+  alignas(64) double cols[N][Stride];  // C[k][n] stored as [n][k], zero padded
+  int coefs[64];                       // offsets of hashed coefficients into freq[K][Stride]
+
+  DctHashBasis() {
+    memset(cols, 0, sizeof(cols));
+    for (int k = 0; k < K; ++k)
+      for (int n = 0; n < N; ++n) {
+        double scale = k == 0 ? sqrt(1.0 / N) : sqrt(2.0 / N);
+        double c = scale * cos(CV_PI * (2 * n + 1) * k / (2 * N));
+        rows[k][n] = c;
+        cols[n][k] = c;
+      }
+
+    // v4: The frequency order is changed using zig-zag traversal,
+    // so near frequences appear together, lowest frequencies
+    // at the start.
+    constexpr char zigZag[] = {0,  9,  1,  2,  10, 18, 27, 19, 11, 3,  4,  12, 20, 28, 36, 45, 37,
+                               29, 21, 13, 5,  6,  14, 22, 30, 38, 46, 54, 63, 55, 47, 39, 31, 23,
+                               15, 7,  8,  16, 24, 32, 40, 48, 56, 64, 72, 73, 65, 57, 49, 41, 33,
+                               25, 17, 26, 34, 42, 50, 58, 66, 74, 75, 67, 59, 51, 43, 35, 44, 52,
+                               60, 68, 76, 77, 69, 61, 53, 62, 70, 78, 79, 71, 80};
+    Q_STATIC_ASSERT(sizeof(zigZag) == K * K);
+
+    // remove a few of the lowest frequencies, the theory
+    // is that they do not represent much structure or detail,
+    // and would be poor for differentiating
+    for (int i = 0; i < 64; ++i) {
+      int index = zigZag[i + 6];
+      coefs[i] = (index / K) * Stride + index % K;
+    }
+  }
+};
+
+static const DctHashBasis& dctHashBasis() {
+  static const DctHashBasis basis;
+  return basis;
+}
+
+/// hash a 32x32 8-bit grayscale image with the full float cv::dct(),
+/// which is how the hashes of existing indexes were computed
+static uint64_t dctHash64Float(const cv::Mat& img) {
+  const DctHashBasis& basis = dctHashBasis();
+
+  cv::Mat freq;
+  img.convertTo(freq, CV_32F);
+  cv::dct(freq, freq);
+
+  cv::Mat coefs(1, 64, CV_32F);
+  float* row = reinterpret_cast<float*>(coefs.ptr(0));
+  for (int i = 0; i < 64; ++i)
+    row[i] = freq.at<float>(basis.coefs[i] / DctHashBasis::Stride,
+                            basis.coefs[i] % DctHashBasis::Stride);
+
+  const float sum = float(cv::sum(coefs)[0]);
+  const float thresh = sum / 64;
+
+  uint64_t hash = 0;
+  for (int i = 1; i < 64; i++)
+    if (row[i] > thresh) hash |= 1ULL << i;
+
+  return hash;
+}
+
+/// hash a 32x32 8-bit grayscale image
+static uint64_t dctHash64Kernel(const cv::Mat& img) {
+  const DctHashBasis& basis = dctHashBasis();
+  constexpr int N = DctHashBasis::N;
+  constexpr int K = DctHashBasis::K;
+  constexpr int Stride = DctHashBasis::Stride;
+
+  Q_ASSERT(img.type() == CV_8UC(1) && img.rows == N && img.cols == N);
+
+  // horizontal pass, tmp = img * C^T
+  alignas(64) double tmp[N][Stride];
+  for (int r = 0; r < N; ++r) {
+    const uchar* src = img.ptr(r);
+    alignas(64) double acc[Stride] = {0};
+    for (int n = 0; n < N; ++n) {
+      const double x = src[n];
+      const double* c = basis.cols[n];
+      for (int k = 0; k < Stride; ++k) acc[k] += x * c[k];
+    }
+    memcpy(tmp[r], acc, sizeof(acc));
+  }
+
+  // vertical pass, freq = C * tmp
+  alignas(64) double freq[K][Stride];
+  for (int k = 0; k < K; ++k) {
+    alignas(64) double acc[Stride] = {0};
+    for (int r = 0; r < N; ++r) {
+      const double c = basis.rows[k][r];
+      const double* t = tmp[r];
+      for (int j = 0; j < Stride; ++j) acc[j] += c * t[j];
+    }
+    memcpy(freq[k], acc, sizeof(acc));
+  }
+
+  // take 64 of the 9x9 lowest frequencies of DCT (v4)
+  const double* f = &freq[0][0];
+  double coefs[64];
+  for (int i = 0; i < 64; ++i) coefs[i] = f[basis.coefs[i]];
+
+  // find the threshold for encoding hash
+  // v3: median value including DC; problem is hash distance
+  // ends up always being an even number
+  // v4: use average, solves the even number issue
+  double sum = 0;
+  for (int i = 0; i < 64; ++i) sum += coefs[i];
+  const double thresh = sum / 64;
+
+  // the float pipeline is off by much less than this, closer to
+  // the threshold it could have set the bit either way
+  constexpr double FloatMargin = 0.1;
+
+  // in a 64-bit ulong, for each bit position,
+  // set to 1 if the corresponding DCT coef is above the threshold
+  uint64_t hash = 0;
+  for (int i = 1; i < 64; i++) {
+    if (std::abs(coefs[i] - thresh) < FloatMargin) return dctHash64Float(img);
+    if (coefs[i] > thresh) hash |= 1ULL << i;
+  }
+
+  return hash;
+}
+
 uint64_t dctHash64(const cv::Mat& cvImg, bool inPlace) {
+  // scratch buffers are reused across calls on the same thread so
+  // hashing video frames or keypoints does not allocate; large images
+  // use a temporary so a full-size copy is not kept around per thread
+  static thread_local cv::Mat blurBuf, sizeBuf;
+
   cv::Mat gray;
   grayscale(cvImg, gray);
   bool isCopy = cvImg.data != gray.data;
   if (isCopy && inPlace)
     qWarning() << "input is not grayscale, taking a copy";
 
-  // cv::imwrite("1.gray.png", gray);
-
   // blur with 7x7 mean filter (all one's) convolution kernel
   // v3, blur small images less
   int kernelSize = 7;
@@ -446,89 +615,29 @@ uint64_t dctHash64(const cv::Mat& cvImg, bool inPlace) {
     kernelSize = 7;
 
   if (kernelSize) {
-    cv::Mat blur;
-    if (isCopy || inPlace)
-      blur = gray;
-    else
-      qDebug() << "blur() taking a copy"; // expected iif input is grayscale
-    cv::blur(gray, blur, cv::Size(kernelSize, kernelSize));
-    gray = blur;
+    if (isCopy || inPlace) {
+      cv::blur(gray, gray, cv::Size(kernelSize, kernelSize));
+    } else {
+      cv::Mat tmp;
+      cv::Mat& blur = area <= 1920 * 1080 ? blurBuf : tmp;
+      cv::blur(gray, blur, cv::Size(kernelSize, kernelSize));
+      gray = blur;
+    }
   }
 
-  // cv::imwrite("2.blur.png", gray);
-
   // resize to 32x32
   // v2: use INTER_AREA instead of INTER_NEAREST
-  cv::resize(gray, gray, cv::Size(32, 32), 0, 0, cv::INTER_AREA); // noop if gray is already 32x32
-  // cv::imwrite("3.size.png", gray);
-
-  // 32x32 DCT
-  cv::Mat freq;
-  gray.convertTo(freq, CV_32F);
-  cv::dct(freq, freq);
-  // cv::imwrite("4.freq.png", freq);
-
-  // take 8x8 lowest frequencies of DCT, into a 64 element array
-  // v4: take 9x9 and discard some lower freqs
-  freq = freq.rowRange(cv::Range(0, 9)).colRange(cv::Range(0, 9)).clone();
-  // cv::imwrite("4.structure.png", freq);
-
-  freq = freq.reshape(1, 1);
-  // cv::imwrite("5.reshape.png", freq);
-
-  // v4: The frequency order is changed using zig-zag traversal,
-  // so near frequences appear together, lowest frequencies
-  // at the start.
-  constexpr char zigZag[] = {0,  9,  1,  2,  10, 18, 27, 19, 11, 3,  4,  12, 20, 28, 36, 45, 37,
-                             29, 21, 13, 5,  6,  14, 22, 30, 38, 46, 54, 63, 55, 47, 39, 31, 23,
-                             15, 7,  8,  16, 24, 32, 40, 48, 56, 64, 72, 73, 65, 57, 49, 41, 33,
-                             25, 17, 26, 34, 42, 50, 58, 66, 74, 75, 67, 59, 51, 43, 35, 44, 52,
-                             60, 68, 76, 77, 69, 61, 53, 62, 70, 78, 79, 71, 80};
-  Q_STATIC_ASSERT(sizeof(zigZag) == 81);
-
-  //    constexpr char zigZag[64] = {
-  //        0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,
-  //        56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63
-  //    };
-
-  // convert to 64 element vector
-  {
-    cv::Mat tmp = freq.clone();
-    float* dst = reinterpret_cast<float*>(tmp.ptr(0));
-    float* src = reinterpret_cast<float*>(freq.ptr(0));
-    for (int i = 0; i < 81; i++) dst[i] = src[int(zigZag[i])];
-
-    // remove a few of the lowest frequencies, the theory
-    // is that they do not represent much structure or detail,
-    // and would be poor for differentiating
-    freq = tmp.colRange(6, 70).clone();
-  }
-  Q_ASSERT(freq.cols == 64);
-
-  // find the threshold for encoding hash
-  float thresh;
-  {
-    // v3: median value including DC; problem is hash distance
-    // ends up always being an even number
-    // cv::Mat sort;
-    // cv::sort(freq, sort, cv::SORT_ASCENDING);
-    // float* rowPtr = (float*)sort.ptr(0);
-    // thresh = (rowPtr[31]+rowPtr[32]) / 2;
-
-    // v4: use average, solves the even number issue
-    float sum = float(cv::sum(freq)[0]);
-    thresh = sum / 64;
+  if (gray.rows != 32 || gray.cols != 32) {
+    cv::resize(gray, sizeBuf, cv::Size(32, 32), 0, 0, cv::INTER_AREA);
+    gray = sizeBuf;
   }
 
-  // in a 64-bit ulong, for each bit position,
-  // set to 1 if the corresponding DCT coef is above the threshold
-  uint64_t hash = 0;
-
-  float* row = reinterpret_cast<float*>(freq.ptr(0));
-  for (int i = 1; i < 64; i++)
-    if (row[i] > thresh) hash |= 1ULL << i;
+  // 32x32 DCT, only the 9x9 lowest frequencies are computed
+  return dctHash64Kernel(gray);
+}
 
-  return hash;
+void dctHash64(const cv::Mat* images, int count, uint64_t* hashes, bool inPlace) {
+  for (int i = 0; i < count; ++i) hashes[i] = dctHash64(images[i], inPlace);
 }
 
 #ifdef ENABLE_LIBPHASH
@@ -160,6 +160,10 @@ void loadMatrix(const QString& path, cv::Mat& mat);
 
 void saveMatrix(const cv::Mat& mat, const QString& path);
 
+// use file written by saveMatrix() without reading it, mat is read-only
+// and valid while the file is open; @return false if file is invalid
+bool mapMatrix(QFile& file, cv::Mat& mat);
+
 // bit-exact compare
 bool compare(const cv::Mat& a, const cv::Mat& b);
 
@@ -203,6 +207,15 @@ uint64_t phash64_cimg(const cv::Mat& cvImg);
  */
 uint64_t dctHash64(const cv::Mat& cvImg, bool inPlace=false);
 
+/**
+ * @brief dctHash64 of several images, e.g. a batch of video frames or keypoints
+ * @param images input images
+ * @param count number of images
+ * @param hashes output, count elements
+ * @param inPlace if true then accept that inputs could be modified
+ */
+void dctHash64(const cv::Mat* images, int count, uint64_t* hashes, bool inPlace = false);
+
 /// average intensity with phash-like quantization
 uint64_t averageHash64(const cv::Mat& cvImg);
 
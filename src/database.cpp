@@ -20,10 +20,15 @@
    <https://www.gnu.org/licenses/>.  */
 #include "database.h"
 
+#include "ioutil.h"
 #include "profile.h"
 #include "qtutil.h"
 #include "templatematcher.h"
 
+#include <numeric>  // iota
+
+static QString mediaTableFile(const QString& cachePath) { return cachePath + qq("/media.cache"); }
+
 QAtomicInt& Database::connectionCount() {
   static auto* s = new QAtomicInt(0);
   return *s;
@@ -473,6 +478,12 @@ void Database::add(MediaGroup& inMedia) {
   for (Index* index : _algos)
     if (index->isLoaded()) index->add(media);
 
+  if (_mediaTableLoaded) {
+    for (const Media& m : qAsConst(media)) _mediaTable.append(m);
+    _mediaTable.sort();
+    _mediaTableModified = true;
+  }
+
   connect().commit();
   for (Index* i : _algos) connect(i->databaseId()).commit();
 
@@ -503,6 +514,7 @@ bool Database::setMd5(Media& m, const QString& md5) {
   }
 
   m.setMd5(md5);
+  unloadMediaTable();
   return true;
 }
 
@@ -553,8 +565,38 @@ void Database::remove(const QVector<int>& ids) {
   then = now;
 #endif
 
-  for (int id : ids)
-    if (!query.exec("delete from media where id=" + QString::number(id))) SQL_FATAL(exec);
+  // ids are integers, safe to put in the query; batched to limit its length
+  QStringList idLists;
+  for (int i = 0; i < ids.count(); i += 1000) {
+    QStringList list;
+    for (int id : ids.mid(i, 1000)) list.append(QString::number(id));
+    idLists.append(list.join(","));
+  }
+
+  // md5 of removed media, to drop their template matcher caches
+  QSet<QString> md5Set;
+  for (const QString& idList : qAsConst(idLists)) {
+    if (!query.exec("select distinct md5 from media where id in (" + idList + ")"))
+      SQL_FATAL(exec);
+    while (query.next())
+      if (!query.value(0).toString().isEmpty()) md5Set.insert(query.value(0).toString());
+  }
+
+  for (const QString& idList : qAsConst(idLists))
+    if (!query.exec("delete from media where id in (" + idList + ")")) SQL_FATAL(exec);
+
+  // duplicates that were not removed still use the caches
+  QStringList md5s = md5Set.values();
+  for (int i = 0; i < md5s.count(); i += 500) {
+    const QStringList batch = md5s.mid(i, 500);
+    const QStringList names(batch.count(), QString("?"));
+    if (!query.prepare("select distinct md5 from media where md5 in (" + names.join(",") + ")"))
+      SQL_FATAL(prepare);
+    for (const QString& md5 : batch) query.addBindValue(md5);
+    if (!query.exec()) SQL_FATAL(exec);
+    while (query.next()) md5Set.remove(query.value(0).toString());
+  }
+  md5s = md5Set.values();
 
   now = nanoTime();
   qInfo("<PL>delete media   =%dms", int((now - then) / 1000000));
@@ -593,6 +635,16 @@ void Database::remove(const QVector<int>& ids) {
   }
 
   for (Index* i : _algos) i->remove(ids);
+
+  if (_mediaTableLoaded) {
+    QSet<uint32_t> idSet;
+    for (int id : ids) idSet.insert(uint32_t(id));
+    _mediaTable.remove(idSet);
+    _mediaTableModified = true;
+  }
+
+  TemplateMatcher::removeScores(cachePath(), md5s);
+  TemplateMatcher::removeFeatures(cachePath(), md5s);
 }
 
 void Database::vacuum() {
@@ -783,6 +835,7 @@ bool Database::updatePaths(const MediaGroup& group, const QStringList& newPaths)
     return false;
   }
 
+  unloadMediaTable();
   return true;
 }
 
@@ -897,6 +950,32 @@ void Database::fillMediaGroup(QSqlQuery& query, MediaGroup& media, int maxLen) {
   pl.end(i-1);
 }
 
+void Database::fillMediaTable(QSqlQuery& query, MediaTable& table) {
+  int i = 1;
+  PROGRESS_LOGGER(pl, "sql query:<PL> %bignum rows", -1);
+
+  while (query.next()) {
+    int id = query.value(_mediaIndex.id).toInt();
+    int type = query.value(_mediaIndex.type).toInt();
+
+    const QString relPath = query.value(_mediaIndex.path).toString();
+    if (relPath.isEmpty()) {
+      qCritical() << "invalid database record (null path), id=" << id << "type=" << type;
+      continue;
+    }
+
+    table.append(uint32_t(id), type, query.value(_mediaIndex.width).toInt(),
+                 query.value(_mediaIndex.height).toInt(), relPath,
+                 query.value(_mediaIndex.md5).toString(),
+                 uint64_t(query.value(_mediaIndex.phash_dct).toLongLong()));
+
+    if (i % 1000 == 0) pl.step(i);
+    i++;
+  }
+  table.sort();
+  pl.end(i-1);
+}
+
 /*
 void Database::loadExtraData(MediaGroup& media)
 {
@@ -1171,18 +1250,30 @@ MediaGroupList Database::dupsByMd5(const SearchParams& params) {
       if (values.count() > 1) dups.append(values.toVector());
     }
   } else {
-    QSqlQuery query(connect());
-    if (!query.exec("select md5 from media "
-                    "group by md5 "
-                    "having count(md5) > 1 "))
-      SQL_FATAL(exec);
-
-    while (query.next()) {
-      const QString md5 = query.value(0).toString();
-      MediaGroup g = mediaWithMd5(md5);
-      for (auto& m : g)
-        if (isWeed(m)) m.setIsWeed();
-      if (!g.isEmpty()) dups.append(g);
+    // sort rows by md5, then runs of the same md5 are duplicates
+    const MediaTable table = mediaTable();
+    QVector<int> rows(table.count());
+    std::iota(rows.begin(), rows.end(), 0);
+
+    const auto md5Less = [&table](int a, int b) {
+      return memcmp(table.md5Bytes(a), table.md5Bytes(b), 16) < 0;
+    };
+    std::sort(rows.begin(), rows.end(), md5Less);
+
+    for (int i = 0; i < rows.count();) {
+      int end = i + 1;
+      while (end < rows.count() && !md5Less(rows[i], rows[end])) end++;
+
+      if (end - i > 1 && !table.md5(rows[i]).isEmpty()) {
+        MediaGroup g;
+        for (int j = i; j < end; ++j) {
+          Media m = table.media(rows[j]);
+          if (isWeed(m)) m.setIsWeed();
+          g.append(m);
+        }
+        dups.append(g);
+      }
+      i = end;
     }
   }
 
@@ -1252,28 +1343,28 @@ void Database::filterMatches(const SearchParams& params, MediaGroupList& matches
   // e.g. a matches b, b matches a, only include first one
   if (params.filterGroups) {
     MediaGroupList filtered;
-    QSet<uint> groupHash;
+    QSet<QVector<int>> groupIds;
+    QHash<QString, int> pathKeys;  // needles of -similar-to are not in the database
 
     // prevent mixing a=>b with b=>a matches by sorting
     Media::sortGroupList(matches, {"path"});
 
     for (const MediaGroup& group : matches) {
-      QString str;
-      MediaGroup copy = group;
-      Media::sortGroup(copy, {"path"});
-      for (const Media& m : copy) str += m.path();
+      QVector<int> ids;
+      ids.reserve(group.count());
+      for (const Media& m : group) ids.append(Media::groupKey(m, pathKeys));
+      std::sort(ids.begin(), ids.end());
 
-      uint hash = qHash(str);
-      if (!groupHash.contains(hash)) {
+      if (!groupIds.contains(ids)) {
         filtered.append(group);
-        groupHash.insert(hash);
+        groupIds.insert(ids);
       }
     }
     matches = filtered;
   }
 
   if (params.mergeGroups)
-    Media::mergeGroupList(matches);
+    Media::mergeGroupList(matches, params.mergeGroups);
   else if (params.expandGroups)
     Media::expandGroupList(matches);
 }
@@ -1283,40 +1374,19 @@ MediaGroupList Database::similar(const SearchParams& params) {
 
   if (params.mirrorMask) qWarning() << "reflected images unsupported, use -similar-to";
 
-  MediaGroup haystack;
+  // compact records of the search space, full Media is only made for needles and results
+  MediaTable haystack(path());
   if (params.inSet) {
-    haystack = params.set;
-  }
-  else {
-    // select all relevant media we'll need for the search space
-    QStringList queryTypes;
-    int mediaTypes = params.queryTypes;
-    mediaTypes |= params.resultTypes();
-
-    int type = 1;
-    while (mediaTypes) {
-      if (mediaTypes & 1) queryTypes << QString::number(type);
-      type++;
-      mediaTypes >>= 1;
-    }
-
-    QSqlQuery query(connect());
-    query.setForwardOnly(true);
-    if (!query.exec("select * from media where type in (" + queryTypes.join(",") + ")"))
-      SQL_FATAL(exec);
-    fillMediaGroup(query, haystack);
+    for (auto& m : params.set) haystack.append(m);
+    haystack.sort();
   }
-  int haystackSize = haystack.count();
+  else
+    haystack = mediaTable();
 
   qDebug("loading index for algo %d", params.algo);
   Index* index = loadIndex(params);
   Index* slice = nullptr;
 
-  // use id map to avoid slow database query in the work item
-  QHash<int, Media> idMap;
-  for (auto& m : qAsConst(haystack))
-    idMap.insert(m.id(), m);
-
   // slice the search index for fast subset search
   if (params.inSet) {
     QSet<uint32_t> ids;
@@ -1338,21 +1408,21 @@ MediaGroupList Database::similar(const SearchParams& params) {
 
   {
     int resultTypes = params.resultTypes();
-    size_t count = std::count_if(haystack.begin(),haystack.end(),[resultTypes](const Media& m)  {
-        return m.type() & resultTypes;
-    });
+    int count = 0;
+    for (int i = 0; i < haystack.count(); ++i)
+      if (haystack.type(i) & resultTypes) count++;
     if (count <= 0) {
       qWarning()  << "invalid search space, no media with type(s)" << Media::typeFlagsString(resultTypes);
       return MediaGroupList();
     }
   }
 
-  // haystack also includes result types we might not want
-  haystack.removeIf([&params](const Media& m) {
-    return 0 == (m.type() & params.queryTypes);
-  });
+  // haystack also includes result types we might not want as needles
+  QVector<int> needleRecords;
+  for (int i = 0; i < haystack.count(); ++i)
+    if (haystack.type(i) & params.queryTypes) needleRecords.append(i);
 
-  if (haystack.empty()) {
+  if (needleRecords.empty()) {
     qWarning()  << "empty search space, did you set -p.types correctly?";
     return MediaGroupList();
   }
@@ -1360,6 +1430,7 @@ MediaGroupList Database::similar(const SearchParams& params) {
   qInfo("index loaded in %dms", int(QDateTime::currentMSecsSinceEpoch() - start));
   start = QDateTime::currentMSecsSinceEpoch();
 
+  const int haystackSize = needleRecords.count();
   int progressInterval =
       haystackSize < 100 ? 1 : qBound(1, params.progressInterval, haystackSize / 100);
 
@@ -1372,42 +1443,60 @@ MediaGroupList Database::similar(const SearchParams& params) {
   MediaGroupList results;
   results.resize(progressTotal);
 
-  TemplateMatcher tm;
+  TemplateMatcher tm(cachePath());
 
   QSet<int> skip;
   QMutex mutex;
 
   PROGRESS_LOGGER(pl, "<PL>%percent %bignum lookups", progressTotal);
 
-  QFuture<void> f =
-      QtConcurrent::map(haystack, [&idMap, &results, &progress, &tm, &pl, progressInterval,
-                                   params, index, this](const Media& m) {
-
-        MediaGroup result = this->searchIndex(index, m, params, idMap);
-
-        // give each work item a (lockless) way to write results
-        int resultIndex = progress.fetchAndAddRelaxed(1);
-
-        if (result.count() > 0) {
-          Media needle = m;
-          // set the dstIn frame number of the needle
-          // to the frame matched in the first search result
-          for (const Media& m : result)
-            if (m.matchRange().dstIn >= 0) {
-              needle.setMatchRange(MatchRange(-1, m.matchRange().srcIn, 1));
-              break;
-            }
-
-          if (params.templateMatch) tm.match(needle, result, params);
+  // search in blocks of needles; indexes can share work between
+  // needles of a block (Index::findBatch), but need enough blocks
+  // to keep all threads busy
+  const int batchSize =
+      qBound(1, haystackSize / (QThreadPool::globalInstance()->maxThreadCount() * 4), 64);
 
-          // needle must be prepended for filtering step
-          result.prepend(needle);
+  QVector<QVector<int>> batches;
+  for (int i = 0; i < haystackSize; i += batchSize)
+    batches.append(needleRecords.mid(i, batchSize));
 
-          // we reserved the space so we can write without locks
-          results[resultIndex] = result;
+  QFuture<void> f =
+      QtConcurrent::map(batches, [&haystack, &results, &progress, &tm, &pl, progressInterval,
+                                   params, index, this](const QVector<int>& batch) {
+        MediaGroup needles;
+        for (int row : batch) needles.append(haystack.media(row));
+
+        const QVector<MediaGroup> batchResults =
+            this->searchIndex(index, needles, params, haystack);
+
+        for (int i = 0; i < needles.count(); ++i) {
+          const Media& m = needles[i];
+          MediaGroup result = batchResults[i];
+
+          // give each work item a (lockless) way to write results
+          int resultIndex = progress.fetchAndAddRelaxed(1);
+
+          if (result.count() > 0) {
+            Media needle = m;
+            // set the dstIn frame number of the needle
+            // to the frame matched in the first search result
+            for (const Media& m : result)
+              if (m.matchRange().dstIn >= 0) {
+                needle.setMatchRange(MatchRange(-1, m.matchRange().srcIn, 1));
+                break;
+              }
+
+            if (params.templateMatch) tm.match(needle, result, params);
+
+            // needle must be prepended for filtering step
+            result.prepend(needle);
+
+            // we reserved the space so we can write without locks
+            results[resultIndex] = result;
+          }
+          if ((resultIndex % progressInterval) == 0)
+            pl.step(resultIndex);
         }
-        if ((resultIndex % progressInterval) == 0)
-          pl.step(resultIndex);
       });
 
   f.waitForFinished();
@@ -1442,7 +1531,7 @@ MediaGroup Database::similarTo(const Media& needle, const SearchParams& params)
 
   Index* index = loadIndex(params);
 
-  QHash<int, Media> idMap;
+  const MediaTable table = mediaTable();
   Index* slice = nullptr;
   if (params.inSet) {
     QSet<uint32_t> ids;
@@ -1458,7 +1547,7 @@ MediaGroup Database::similarTo(const Media& needle, const SearchParams& params)
   }
 
   // TODO: multithread search, for *huge* indexes it's an issue
-  MediaGroup result = searchIndex(index, needle, params, idMap);
+  MediaGroup result = searchIndex(index, needle, params, table);
 
   delete slice;
 
@@ -1549,40 +1638,110 @@ void Database::saveIndices() {
     QSqlDatabase db = connect(i->databaseId());
     i->save(db, cachePath());
   }
+
+  QWriteLocker locker(&_rwLock);
+  const QString file = mediaTableFile(cachePath());
+  if (_mediaTableModified && DBHelper::isCacheFileStale(connect(), file)) {
+    qInfo() << "writing media table";
+    writeFileAtomically(file, [this](QFile& f) { _mediaTable.write(f); });
+  }
+  _mediaTableModified = false;
+}
+
+MediaTable Database::mediaTable() {
+  {
+    QReadLocker locker(&_rwLock);
+    if (_mediaTableLoaded) return _mediaTable;
+  }
+
+  QWriteLocker locker(&_rwLock);
+  if (!_mediaTableLoaded) {
+    qint64 then = QDateTime::currentMSecsSinceEpoch();
+
+    MediaTable table(path());
+    const QString file = mediaTableFile(cachePath());
+    if (!DBHelper::isCacheFileStale(connect(), file) && table.map(file)) {
+      qInfo("mapped %d media in %dms", table.count(),
+            int(QDateTime::currentMSecsSinceEpoch() - then));
+    } else {
+      table = MediaTable(path());
+      QSqlQuery query(connect());
+      query.setForwardOnly(true);
+      if (!query.exec("select * from media order by id")) SQL_FATAL(exec);
+      fillMediaTable(query, table);
+      _mediaTableModified = true;
+    }
+
+    _mediaTable = table;
+    _mediaTableLoaded = true;
+  }
+  return _mediaTable;
+}
+
+void Database::unloadMediaTable() {
+  QWriteLocker locker(&_rwLock);
+  _mediaTable = MediaTable();
+  _mediaTableLoaded = false;
+  _mediaTableModified = false;
 }
 
 MediaGroup Database::searchIndex(Index* index, const Media& needle, const SearchParams& params,
-                                 const QHash<int, Media>& idMap) {
+                                 const MediaTable& table) {
   QReadLocker locker(&_rwLock);
 
   QVector<Index::Match> matches = index->find(needle, params);
+  widenSearch(index, needle, params, matches);
+
+  return matchGroup(index, needle, matches, params, table);
+}
+
+QVector<MediaGroup> Database::searchIndex(Index* index, const MediaGroup& needles,
+                                          const SearchParams& params,
+                                          const MediaTable& table) {
+  QReadLocker locker(&_rwLock);
+
+  QVector<QVector<Index::Match>> matches = index->findBatch(needles, params);
+  Q_ASSERT(matches.count() == needles.count());
+
+  QVector<MediaGroup> groups(needles.count());
+  for (int i = 0; i < needles.count(); ++i) {
+    widenSearch(index, needles[i], params, matches[i]);
+    groups[i] = matchGroup(index, needles[i], matches[i], params, table);
+  }
+
+  return groups;
+}
 
+void Database::widenSearch(Index* index, const Media& needle, const SearchParams& params,
+                           QVector<Index::Match>& matches) {
   // increase threshold until is match is found or maxThresh is exceeded
-  if (params.maxThresh > 0) {
-    SearchParams tmp = params;
-    while (matches.count() <= params.minMatches) {
-      switch (params.algo) {
-        case SearchParams::AlgoDCT:
-        case SearchParams::AlgoDCTFeatures:
-        case SearchParams::AlgoVideo:
-          tmp.dctThresh++;
-          if (tmp.dctThresh > params.maxThresh) goto DONE;
-          break;
-        case SearchParams::AlgoCVFeatures:
-          tmp.cvThresh += 5;
-          if (tmp.cvThresh > params.maxThresh) goto DONE;
-          break;
-        case SearchParams::AlgoColor:
-          goto DONE;  // no thresholding
-        default:
-          qWarning() << "maxThresh: unsupported algorithm";
-          goto DONE;
-      }
-      matches = index->find(needle, tmp);
+  if (params.maxThresh <= 0) return;
+
+  SearchParams tmp = params;
+  while (matches.count() <= params.minMatches) {
+    switch (params.algo) {
+      case SearchParams::AlgoDCT:
+      case SearchParams::AlgoDCTFeatures:
+      case SearchParams::AlgoVideo:
+        tmp.dctThresh++;
+        if (tmp.dctThresh > params.maxThresh) return;
+        break;
+      case SearchParams::AlgoCVFeatures:
+        tmp.cvThresh += 5;
+        if (tmp.cvThresh > params.maxThresh) return;
+        break;
+      case SearchParams::AlgoColor:
+        return;  // no thresholding
+      default:
+        qWarning() << "maxThresh: unsupported algorithm";
+        return;
     }
+    matches = index->find(needle, tmp);
   }
-DONE:
+}
 
+MediaGroup Database::matchGroup(Index* index, const Media& needle, QVector<Index::Match>& matches,
+                                const SearchParams& params, const MediaTable& table) {
   // sort by score
   std::sort(matches.begin(), matches.end());
 
@@ -1595,9 +1754,9 @@ DONE:
     if (group.count() >= params.maxMatches) break;
 
     Media media;
-    if (!idMap.isEmpty()) {
-      auto ii = idMap.find(int(match.mediaId));
-      if (ii != idMap.end()) media = ii.value();
+    if (!table.isEmpty()) {
+      const int row = table.find(match.mediaId);
+      if (row >= 0) media = table.media(row);
     }
     else
       media = mediaWithId(int(match.mediaId));
@@ -22,6 +22,7 @@
 
 #include "index.h"
 #include "media.h"
+#include "mediatable.h"
 
 /// Manage and query media in a directory
 class Database {
@@ -163,6 +164,14 @@ class Database {
    */
   Index* loadIndex(const SearchParams& params);
 
+  /**
+   * @return every row of the media table, mapped from a snapshot file
+   *         or read from the database on first use
+   * @note the table is kept up to date by add() and remove(), and
+   *       saved with the indices
+   */
+  MediaTable mediaTable();
+
   /// Called after addIndex to do setup tasks like sql schema
   void setup();
 
@@ -217,11 +226,24 @@ private:
    * @param index  Index to search
    * @param needle Needle, processed for searching
    * @param params Search parameters
-   * @param idMap If not empty, used to lookup media info
+   * @param table If not empty, used to lookup media info
    */
   MediaGroup searchIndex(Index* index, const Media& needle,
                          const SearchParams& params,
-                         const QHash<int, Media>& idMap);
+                         const MediaTable& table);
+
+  /// Search many needles at once with Index::findBatch, @return one group per needle
+  QVector<MediaGroup> searchIndex(Index* index, const MediaGroup& needles,
+                                  const SearchParams& params,
+                                  const MediaTable& table);
+
+  /// Repeat search with higher threshold until params.minMatches or params.maxThresh
+  void widenSearch(Index* index, const Media& needle, const SearchParams& params,
+                   QVector<Index::Match>& matches);
+
+  /// Sort matches and convert to Media, omitting needle if params.filterSelf
+  MediaGroup matchGroup(Index* index, const Media& needle, QVector<Index::Match>& matches,
+                        const SearchParams& params, const MediaTable& table);
 
   /// Create database (sql) tables for index id 0, the others use Index interface
   void createTables();
@@ -229,6 +251,9 @@ private:
   /// Initialize media group with results from "select * from media ..."
   void fillMediaGroup(QSqlQuery& query, MediaGroup& media, int maxLen = 0);
 
+  /// Initialize media table with results from "select * from media ..."
+  void fillMediaTable(QSqlQuery& query, MediaTable& table);
+
   /**
    * Ask indices to write in-memory representation to disk so they may
    * bypass slow initialization
@@ -266,6 +291,9 @@ private:
   /// modify paths in database and update the group
   bool updatePaths(const MediaGroup& group, const QStringList& newPaths);
 
+  /// drop the media table, it will be reloaded on next use
+  void unloadMediaTable();
+
   /// Directory containing the indexed files and database file
   QString _indexDir;
 
@@ -275,6 +303,11 @@ private:
   /// Registered algorithms
   QVector<Index*> _algos;
 
+  /// Snapshot of media table for searching, see mediaTable()
+  MediaTable _mediaTable;
+  bool _mediaTableLoaded = false;
+  bool _mediaTableModified = false;  // out of sync with snapshot file
+
   /// Sql column index for "media" table
   struct {
     int id, type, path, width, height, md5, phash_dct;
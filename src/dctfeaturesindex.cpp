@@ -23,7 +23,7 @@
 #include "ioutil.h"
 #include "profile.h"
 #include "qtutil.h"
-#include "tree/hammingtree.h"
+#include "tree/dcttree.h"
 
 static QString cacheFile(const QString& cachePath) { return cachePath + qq("/dctfeatures.cache"); }
 
@@ -104,12 +104,14 @@ void DctFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QS
     qint64 then = QDateTime::currentMSecsSinceEpoch();
 
     unload();
-    _tree = new HammingTree;
+    _tree = new DctMultiTree;
 
     if (!stale) {
       qInfo("reading cache file");
-      _tree->read(qUtf8Printable(path));
-    } else {
+      stale = !_tree->read(qUtf8Printable(path));
+    }
+
+    if (stale) {
       QSqlQuery query(db);
       query.setForwardOnly(true);
 
@@ -122,8 +124,12 @@ void DctFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QS
       const QLocale locale;
       uint64_t numHashes = 0;  // total hashes seen
 
-      std::vector<HammingTree::Value> chunk;  // build tree in chunks to reduce temp memory
-      const int minChunkSize = 100000;
+      // build tree in chunks to reduce temp memory; the tree is built in another
+      // thread while the next chunk is read, since sql must stay in this thread
+      std::vector<DctMultiTree::Value> chunk, building;
+      const size_t minChunkSize = 1000000;
+      static QThreadPool loadPool;  // not global pool, it could be full
+      QFuture<void> built;
 
       PROGRESS_LOGGER(pl, "<PL>%percent %bignum images", rowCount);
 
@@ -144,27 +150,35 @@ void DctFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QS
         const int len = int(size_t(hashes.size()) / sizeof(uint64_t));
 
         for (int j = 0; j < len; ++j)
-          chunk.push_back(HammingTree::Value(mediaId, ptr[j]));
+          chunk.push_back(DctMultiTree::Value(mediaId, ptr[j]));
 
         numHashes += len;
 
-        if (chunk.size() >= minChunkSize) {  // TODO: this size seems to have some small effect
-          _tree->insert(chunk);
+        if (chunk.size() >= minChunkSize) {
+          built.waitForFinished();
+          std::swap(chunk, building);
           chunk.clear();  // no reallocation
+          built = QtConcurrent::run(&loadPool, [&]() { _tree->insert(building); });
           pl.step(currentRow);
         }
       }
+      built.waitForFinished();
       pl.end();
       _tree->insert(chunk);
       chunk.clear();
-      save(db, cachePath);
+      _tree->freeze();
+
+      // not save(), the cache file may be current but unreadable
+      qInfo() << "writing cache file";
+      writeFileAtomically(path, [this](QFile& f) { _tree->write(f); });
     }
 
-    HammingTree::Stats stats = _tree->stats();
+    DctMultiTree::Stats stats = _tree->stats();
 
-    qInfo("%dKhash, height=%d nodes=%d %dMB %dms", stats.numValues / 1000, stats.maxHeight,
-          stats.numNodes, int(stats.memory / 1000000),
-          int(QDateTime::currentMSecsSinceEpoch() - then));
+    qInfo("%dKhash, height=%d nodes=%d %dMB %dms (build %dms, %d tasks)",
+          stats.numValues / 1000, stats.maxHeight, stats.numNodes, int(stats.memory / 1000000),
+          int(QDateTime::currentMSecsSinceEpoch() - then), int(stats.buildTime / 1000000),
+          stats.buildTasks);
   }
 }
 
@@ -182,9 +196,9 @@ void DctFeaturesIndex::save(QSqlDatabase& db, const QString& cachePath) {
 void DctFeaturesIndex::add(const MediaGroup& media) {
   if (media.count() <= 0) return;
 
-  std::vector<HammingTree::Value> values;
+  std::vector<DctMultiTree::Value> values;
   for (const Media& m : media)
-    for (uint64_t hash : m.keyPointHashes()) values.push_back(HammingTree::Value(m.id(), hash));
+    for (uint64_t hash : m.keyPointHashes()) values.push_back(DctMultiTree::Value(m.id(), hash));
 
   _tree->insert(values);
 }
@@ -192,7 +206,7 @@ void DctFeaturesIndex::add(const MediaGroup& media) {
 void DctFeaturesIndex::remove(const QVector<int>& ids) {
   if (ids.count() <= 0 || !isLoaded()) return;
 
-  std::unordered_set<HammingTree::index_t> indices;
+  std::unordered_set<DctMultiTree::index_t> indices;
   for (int id : ids) indices.insert(uint32_t(id));
 
   _tree->remove(indices);
@@ -204,12 +218,12 @@ Index* DctFeaturesIndex::slice(const QSet<uint32_t>& mediaIds) const {
   qint64 then = QDateTime::currentMSecsSinceEpoch();
 
   // note: probably faster to slice from cache if it's available
-  std::unordered_set<HammingTree::index_t> ids;
+  std::unordered_set<DctMultiTree::index_t> ids;
   for (uint32_t id : mediaIds.values()) ids.insert(id);
 
   chunk->_tree = _tree->slice(ids);
 
-  HammingTree::Stats stats = chunk->_tree->stats();
+  DctMultiTree::Stats stats = chunk->_tree->stats();
 
   qDebug("%dKhash, height=%d nodes=%d %dMB %dms", stats.numValues / 1000, stats.maxHeight,
         stats.numNodes, int(stats.memory / 1000000),
@@ -218,15 +232,143 @@ Index* DctFeaturesIndex::slice(const QSet<uint32_t>& mediaIds) const {
   return chunk;
 }
 
-QVector<Index::Match> DctFeaturesIndex::find(const Media& needle, const SearchParams& params) {
-  KeyPointHashList hashes = needle.keyPointHashes();
+/// number of matches taken from each needle hash
+static constexpr int NEAREST_PER_HASH = 10;
+
+/**
+ * Vote counts of each media, flat open-addressing table
+ * @note mediaId 0 (removed) is never counted so it marks empty slots
+ * @note capacity is fixed, sized for the maximum number of votes
+ */
+class VoteTable {
+ public:
+  struct Entry {
+    uint32_t mediaId;
+    uint32_t count;  // number of votes
+    int distance;    // sum of distances of votes
+  };
+
+  explicit VoteTable(size_t maxVotes) {
+    size_t capacity = 64;
+    while (capacity < maxVotes * 2) capacity *= 2;
+    _entries.assign(capacity, Entry{0, 0, 0});
+    _mask = capacity - 1;
+  }
 
-  //
-  // for each needle hash
-  // - find the closest hash
-  // - image with most matches wins
-  //
-  uint64_t now, then = nanoTime();
+  Entry& operator[](uint32_t mediaId) {
+    size_t i = (mediaId * 2654435761u) & _mask;
+    while (_entries[i].mediaId != mediaId) {
+      if (_entries[i].mediaId == 0) {
+        _entries[i].mediaId = mediaId;
+        _used.push_back(uint32_t(i));
+        break;
+      }
+      i = (i + 1) & _mask;
+    }
+    return _entries[i];
+  }
+
+  /// @return entries with votes, in order of insertion
+  template <typename Fn>
+  void forEach(Fn fn) const {
+    for (uint32_t i : _used) fn(_entries[i]);
+  }
+
+ private:
+  std::vector<Entry> _entries;
+  std::vector<uint32_t> _used;
+  size_t _mask;
+};
+
+/// vote on the matches of each needle hash, image with most matches wins
+/// @return max votes of any media except the needle
+static uint32_t vote(const Media& needle, const std::vector<DctMultiTree::Match>* cand,
+                     int numNeedleHashes, VoteTable& votes) {
+  uint32_t maxMatches = 0;
+
+  for (int j = 0; j < numNeedleHashes; j++) {
+    // take the first 10, which gives us the 10 best matches
+    int len = std::min(NEAREST_PER_HASH, (int)cand[j].size());
+    for (int k = 0; k < len; k++) {
+      const DctMultiTree::Match& match = cand[j][k];
+      int index = match.value.index;
+
+      // zero index means deleted, negative must be bogus
+      if (index <= 0) continue;
+
+      int mediaId = index;
+
+      VoteTable::Entry& entry = votes[uint32_t(mediaId)];
+      entry.count++;
+      entry.distance += match.distance;
+
+      if (needle.id() != mediaId) maxMatches = std::max(entry.count, maxMatches);
+    }
+  }
+
+  return maxMatches;
+}
+
+/**
+ * @return true if more votes cannot change which media are the best matches,
+ *         or their order
+ * @param maxNewVotes the most votes any media could still get
+ */
+static bool votesDecided(const Media& needle, const VoteTable& votes, int maxResults,
+                         uint32_t maxNewVotes) {
+  std::vector<uint32_t> counts;
+  votes.forEach([&](const VoteTable::Entry& e) {
+    if (e.mediaId != uint32_t(needle.id())) counts.push_back(e.count);
+  });
+
+  // media that is not a candidate yet has 0 votes
+  const size_t n = std::min(size_t(maxResults) + 1, counts.size() + 1);
+  counts.resize(std::max(counts.size(), n), 0);
+  std::partial_sort(counts.begin(), counts.begin() + int(n), counts.end(),
+                    std::greater<uint32_t>());
+
+  for (size_t i = 0; i + 1 < n; ++i)
+    if (counts[i] <= counts[i + 1] + maxNewVotes) return false;
+
+  return true;
+}
+
+/// @return results scored from votes
+static QVector<Index::Match> score(const Media& needle, const VoteTable& votes,
+                                   uint32_t maxMatches) {
+  QVector<Index::Match> results;
+
+  votes.forEach([&](const VoteTable::Entry& e) {
+    Index::Match match;
+    match.mediaId = e.mediaId;
+    match.score = 0;
+
+    float avgScore = (float)e.distance / e.count;
+
+    // qDebug("score=%.2f matches=%d maxMatches=%d", avgScore, e.count, maxMatches);
+    if (e.mediaId == uint32_t(needle.id()))
+      match.score = -1;
+    else if (maxMatches == 1) {
+      // only one match, use the avg score
+      match.score = 10 * avgScore;
+    } else {
+      // more matches gets lower score
+      // quality of each match is controlled by params.dctThresh
+      match.score = int(maxMatches - e.count);
+    }
+
+    results.append(match);
+  });
+
+  // same order as before (ascending id), ties in the sorted results are repeatable
+  std::sort(results.begin(), results.end(),
+            [](const Index::Match& a, const Index::Match& b) { return a.mediaId < b.mediaId; });
+
+  return results;
+}
+
+bool DctFeaturesIndex::needleHashes(const Media& needle, KeyPointHashList& hashes) const {
+  hashes = needle.keyPointHashes();
 
   if (hashes.size() <= 0) {
     // if we don't have hashes for the needle,
@@ -235,81 +377,97 @@ QVector<Index::Match> DctFeaturesIndex::find(const Media& needle, const SearchPa
 
     if (hashes.size() <= 0) {
       qWarning() << "needle has no hashes" << needle.id() << needle.path();
-      return QVector<Index::Match>();
+      return false;
     }
   }
+  return true;
+}
 
-  const int numNeedleHashes = hashes.size();
-  uint64_t nHash[numNeedleHashes];
+QVector<Index::Match> DctFeaturesIndex::find(const Media& needle, const SearchParams& params) {
+  //
+  // for each needle hash
+  // - find the closest hash
+  // - image with most matches wins
+  //
+  uint64_t now, then = nanoTime();
 
-  for (int j = 0; j < numNeedleHashes; j++) nHash[j] = hashes[j];
+  KeyPointHashList hashes;
+  if (!needleHashes(needle, hashes)) return QVector<Index::Match>();
 
-  // TODO: investigate if it may be possible to prune the search
-  // - if a hash has no matches, nearby hashes probably also have no matches
-  std::vector<HammingTree::Match> cand[numNeedleHashes];
-  for (int j = 0; j < numNeedleHashes; j++) _tree->search(nHash[j], params.dctThresh, cand[j]);
+  const int numNeedleHashes = hashes.size();
 
-  QMap<uint32_t, uint32_t> matches;  // map
-  QMap<uint32_t, int> scores;
+  // search in chunks of needle hashes, and stop when the remaining
+  // hashes can't change the best matches; the scores are from the
+  // votes counted so far
+  const int chunkSize = 64;
+  VoteTable votes(size_t(numNeedleHashes) * NEAREST_PER_HASH);
   uint32_t maxMatches = 0;
+  int numSearched = 0;
 
-  for (int j = 0; j < numNeedleHashes; j++) {
-    // take the first 10, which gives us the 10 best matches
-    int len = std::min(10, (int)cand[j].size());
-    for (int k = 0; k < len; k++) {
-      const HammingTree::Match& match = cand[j][k];
-      int index = match.value.index;
-
-      // zero index means deleted, negative must be bogus
-      if (index <= 0) continue;
+  std::vector<std::vector<DctMultiTree::Match>> cand;
+  KeyPointHashList chunk;
 
-      uint64_t hash = match.value.hash;
-      Q_ASSERT(hamm64(hash, nHash[j]) < params.dctThresh);
+  while (numSearched < numNeedleHashes) {
+    const int len = std::min(chunkSize, numNeedleHashes - numSearched);
+    const uint64_t* nHash = hashes.data() + numSearched;
+    chunk.assign(nHash, nHash + len);
 
-      int mediaId = index;
+    _tree->search(chunk, params.dctThresh, NEAREST_PER_HASH, cand);
 
-      if (matches.contains(mediaId)) {
-        matches[mediaId]++;
-        scores[mediaId] += match.distance;
-      } else {
-        matches[mediaId] = 1;
-        scores[mediaId] = match.distance;
-      }
+    maxMatches = std::max(maxMatches, vote(needle, cand.data(), len, votes));
+    numSearched += len;
 
-      if (needle.id() != mediaId) maxMatches = std::max(matches[mediaId], maxMatches);
-    }
+    const uint32_t maxNewVotes = uint32_t(numNeedleHashes - numSearched) * NEAREST_PER_HASH;
+    if (numSearched < numNeedleHashes && maxMatches > maxNewVotes &&
+        votesDecided(needle, votes, params.maxMatches, maxNewVotes))
+      break;
   }
 
+  QVector<Index::Match> results = score(needle, votes, maxMatches);
+
   now = nanoTime();
   if (params.verbose)
-    qInfo("%d features, %lld results, %.1f ms rate=%.1f Mhash/sec", numNeedleHashes,
-          matches.count(), (now - then) / 1000000.0,
-          (_tree->size() * numNeedleHashes) / ((now - then) / 1000.0));
+    qInfo("%d/%d features, %lld results, %.1f ms rate=%.1f Mhash/sec", numSearched,
+          numNeedleHashes, results.count(), (now - then) / 1000000.0,
+          (_tree->size() * numSearched) / ((now - then) / 1000.0));
 
-  QVector<Index::Match> results;
+  return results;
+}
 
-  for (uint32_t mediaId : matches.keys())
-    if (matches[mediaId] > 0) {
-      Index::Match match;
-      match.mediaId = mediaId;
-      match.score = 0;
-
-      float avgScore = (float)scores[mediaId] / matches[mediaId];
-
-      // qDebug("score=%.2f matches=%d maxMatches=%d", avgScore, matches[mediaId], maxMatches);
-      if (mediaId == uint32_t(needle.id()))
-        match.score = -1;
-      else if (maxMatches == 1) {
-        // only one match, use the avg score
-        match.score = 10 * avgScore;
-      } else {
-        // more matches gets lower score
-        // quality of each match is controlled by params.dctThresh
-        match.score = maxMatches - matches[mediaId];
-      }
+QVector<QVector<Index::Match>> DctFeaturesIndex::findBatch(const MediaGroup& needles,
+                                                           const SearchParams& params) {
+  uint64_t now, then = nanoTime();
+
+  // all needle hashes go into one search so tree leaves are
+  // scanned once for the batch, rather than once per needle
+  KeyPointHashList allHashes;
+  QVector<int> offsets(needles.count() + 1, 0);  // allHashes offset for each needle
+  for (int i = 0; i < needles.count(); ++i) {
+    KeyPointHashList hashes;
+    if (needleHashes(needles[i], hashes))
+      allHashes.insert(allHashes.end(), hashes.begin(), hashes.end());
+    offsets[i + 1] = int(allHashes.size());
+  }
 
-      results.append(match);
+  std::vector<std::vector<DctMultiTree::Match>> cand;
+  _tree->search(allHashes, params.dctThresh, NEAREST_PER_HASH, cand);
+
+  QVector<QVector<Index::Match>> results(needles.count());
+  for (int i = 0; i < needles.count(); ++i) {
+    const int offset = offsets[i];
+    const int numNeedleHashes = offsets[i + 1] - offset;
+    if (numNeedleHashes > 0) {
+      VoteTable votes(size_t(numNeedleHashes) * NEAREST_PER_HASH);
+      const uint32_t maxMatches = vote(needles[i], cand.data() + offset, numNeedleHashes, votes);
+      results[i] = score(needles[i], votes, maxMatches);
     }
+  }
+
+  now = nanoTime();
+  if (params.verbose)
+    qInfo("%lld needles, %d features, %.1f ms rate=%.1f Mhash/sec", needles.count(),
+          int(allHashes.size()), (now - then) / 1000000.0,
+          (_tree->size() * allHashes.size()) / ((now - then) / 1000.0));
 
   return results;
 }
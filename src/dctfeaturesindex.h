@@ -22,7 +22,7 @@
 
 #include "index.h"
 
-class HammingTree;
+class DctMultiTree;
 
 /**
  * @class DctFeaturesIndex
@@ -53,11 +53,17 @@ class DctFeaturesIndex : public Index {
   void remove(const QVector<int>& id) override;
 
   QVector<Index::Match> find(const Media& m, const SearchParams& p) override;
+  QVector<QVector<Index::Match>> findBatch(const MediaGroup& needles,
+                                           const SearchParams& p) override;
 
   Index* slice(const QSet<uint32_t>& mediaIds) const override;
 
  private:
   void init();
   void unload();
-  HammingTree* _tree;
+
+  /// get hashes from needle, or from the tree if the needle is indexed
+  bool needleHashes(const Media& needle, KeyPointHashList& hashes) const;
+
+  DctMultiTree* _tree;
 };
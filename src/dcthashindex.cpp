@@ -20,9 +20,35 @@
    <https://www.gnu.org/licenses/>.  */
 #include "dcthashindex.h"
 
+#include "ioutil.h"
 #include "qtutil.h"
 #include "tree/dcttree.h"
 
+static QString cacheFile(const QString& cachePath) { return cachePath + qq("/dcthash.cache"); }
+
+/**
+ * Header of the cache file, followed by:
+ * - hashes   uint64_t[numHashes]
+ * - mediaIds uint32_t[numHashes]
+ * - padding to 8 bytes
+ * - DctTree::write() from treeOffset to end of file
+ */
+struct DctHashCacheHeader {
+  enum { Version = 1 };
+  char magic[8];
+  uint32_t version;
+  uint32_t hashSize;  // detect incompatible hash/index types
+  uint64_t numHashes;
+  uint64_t treeOffset;
+
+  static constexpr char Magic[8] = {'c', 'b', 'i', 'r', 'd', 'D', 'H', 'I'};
+
+  static uint64_t treeOffsetFor(uint64_t numHashes) {
+    uint64_t offset = sizeof(DctHashCacheHeader) + numHashes * (sizeof(uint64_t) + sizeof(uint32_t));
+    return (offset + 7) & ~uint64_t(7);
+  }
+};
+
 DctHashIndex::DctHashIndex() {
   _id = SearchParams::AlgoDCT;
   init();
@@ -34,6 +60,14 @@ void DctHashIndex::init() {
   _numHashes = 0;
   _isLoaded = false;
   _tree = nullptr;
+  _mapFile = nullptr;
+  _treeSize = 0;
+  _removed.clear();
+  _removedSinceMerge.clear();
+  _merge = QFuture<DctTree*>();
+  _mergeEnd = 0;
+  _merging = false;
+  resetBruteForce();
 }
 
 DctHashIndex::~DctHashIndex() { unload(); }
@@ -43,12 +77,76 @@ void DctHashIndex::unload() {
   // usage could be huge, we could use the savings,
   // plus realloc() is super cheap in case QVector
   // doesn't use it (which would be dumb)
-  free(_hashes);
-  free(_mediaId);
-  delete _tree;
+  if (_merging) delete _merge.result();
+  delete _tree;  // could be using mapped memory
+  if (_mapFile) {
+    delete _mapFile;  // unmaps the arrays
+  } else {
+    free(_hashes);
+    free(_mediaId);
+  }
   init();
 }
 
+void DctHashIndex::detach() {
+  if (!_mapFile) return;
+
+  uint64_t* hashes = strict_malloc(hashes, _numHashes);
+  uint32_t* mediaId = strict_malloc(mediaId, _numHashes);
+  memcpy(hashes, _hashes, sizeof(*hashes) * size_t(_numHashes));
+  memcpy(mediaId, _mediaId, sizeof(*mediaId) * size_t(_numHashes));
+  if (_tree) _tree->detach();
+
+  delete _mapFile;
+  _mapFile = nullptr;
+  _hashes = hashes;
+  _mediaId = mediaId;
+}
+
+bool DctHashIndex::mapCacheFile(const QString& path) {
+  QFile* f = new QFile(path);
+  if (!f->open(QFile::ReadOnly)) {
+    qWarning() << "open failed:" << path << f->errorString();
+    delete f;
+    return false;
+  }
+
+  const qint64 size = f->size();
+  const uchar* data = nullptr;
+  DctHashCacheHeader h;
+
+  if (size >= qint64(sizeof(h))) data = f->map(0, size);
+
+  if (data) memcpy(&h, data, sizeof(h));
+
+  if (!data || memcmp(h.magic, DctHashCacheHeader::Magic, sizeof(h.magic)) != 0 ||
+      h.version != DctHashCacheHeader::Version || h.hashSize != sizeof(*_hashes) ||
+      h.numHashes > INT_MAX || h.treeOffset != DctHashCacheHeader::treeOffsetFor(h.numHashes) ||
+      h.treeOffset > uint64_t(size)) {
+    qWarning() << "invalid or incompatible cache file:" << path;
+    delete f;
+    return false;
+  }
+
+  _mapFile = f;
+  _numHashes = int(h.numHashes);
+  _hashes = reinterpret_cast<uint64_t*>(const_cast<uchar*>(data) + sizeof(h));
+  _mediaId = reinterpret_cast<uint32_t*>(_hashes + _numHashes);
+  _treeSize = _numHashes;
+
+  if (_numHashes > 0) {
+    _tree = new DctTree;
+    if (!_tree->map(reinterpret_cast<const char*>(data + h.treeOffset),
+                    size_t(size - qint64(h.treeOffset)))) {
+      qWarning() << "rebuilding tree, unsupported or incompatible in cache file";
+      buildTree();
+    }
+  }
+  resetBruteForce();
+
+  return true;
+}
+
 size_t DctHashIndex::memoryUsage() const {
   // TODO: tree->memoryUsage
   return (sizeof(*_hashes) + sizeof(*_mediaId)) * size_t(_numHashes);
@@ -61,11 +159,140 @@ void DctHashIndex::buildTree() {
     _tree = new DctTree;
     _tree->create(_hashes, _mediaId, _numHashes);
   }
+  _treeSize = _numHashes;
+  resetBruteForce();
+}
+
+void DctHashIndex::resetBruteForce() {
+  for (auto& v : _bruteForce) v.storeRelaxed(-1);
+}
+
+bool DctHashIndex::useBruteForce(int threshold) const {
+  // tiny index, tree has nothing to offer
+  if (_treeSize < 4096) return true;
+
+  // beyond this the tree visits everything
+  if (threshold >= MaxThreshold) return true;
+
+  // measured on first use of each threshold; concurrent searches
+  // could both measure, which is harmless
+  int v = _bruteForce[threshold].loadRelaxed();
+  if (v < 0) {
+    v = measureBruteForce(threshold);
+    _bruteForce[threshold].storeRelaxed(v);
+  }
+  return v;
+}
+
+bool DctHashIndex::measureBruteForce(int threshold) const {
+  // time both on hashes from the index, which have the same clustering as
+  // real needles; the tree cost depends heavily on it and the threshold,
+  // the scan cost depends on the cpu
+  const int numSamples = 8;
+  std::vector<uint64_t> targets;
+  for (int i = 0; i < numSamples; ++i) {
+    const uint64_t hash = _hashes[size_t(i) * size_t(_treeSize) / numSamples];
+    if (hash) targets.push_back(hash);
+  }
+  if (targets.empty()) return true;
+
+  size_t found = 0;
+  QElapsedTimer timer;
+  timer.start();
+  for (uint64_t target : targets) found += size_t(_tree->search(target, threshold).count());
+  const qint64 treeNs = timer.nsecsElapsed();
+
+  timer.restart();
+  for (uint64_t target : targets)
+    hammScan64(target, _hashes, size_t(_treeSize), threshold,
+               [&found](size_t, int) { found++; });
+  const qint64 scanNs = timer.nsecsElapsed();
+
+  qDebug("threshold %d: tree %lldns scan %lldns (%d hashes, %d found)", threshold, treeNs,
+         scanNs, _treeSize, int(found));
+
+  return scanNs < treeNs;
+}
+
+bool DctHashIndex::needsMerge() const {
+  const int pending = _numHashes - _treeSize + int(_removed.count());
+  return pending > std::max(int(MergeMinSize), _treeSize / MergeRatio);
+}
+
+void DctHashIndex::startMerge() {
+  if (_merging) return;
+
+  // snapshot the live hashes, the arrays can change while the tree builds
+  std::vector<uint64_t> hashes;
+  std::vector<uint32_t> ids;
+  hashes.reserve(size_t(_numHashes));
+  ids.reserve(size_t(_numHashes));
+  for (int i = 0; i < _numHashes; ++i)
+    if (_mediaId[i]) {
+      hashes.push_back(_hashes[i]);
+      ids.push_back(_mediaId[i]);
+    }
+
+  qDebug("merging %d hashes, %d tombstones", _numHashes - _treeSize, int(_removed.count()));
+
+  _mergeEnd = _numHashes;
+  _removedSinceMerge.clear();
+  _merging = true;
+  _merge = QtConcurrent::run([hashes = std::move(hashes), ids = std::move(ids)]() {
+    DctTree* tree = nullptr;
+    if (ids.size() > 0) {
+      tree = new DctTree;
+      tree->create(hashes.data(), ids.data(), int(ids.size()));
+    }
+    return tree;
+  });
+}
+
+void DctHashIndex::finishMerge(bool wait) {
+  if (!_merging) return;
+  if (!wait && !_merge.isFinished()) return;
+
+  delete _tree;
+  _tree = _merge.result();
+  _merge = QFuture<DctTree*>();
+  _merging = false;
+  resetBruteForce();
+
+  // anything removed after the snapshot is still in the new tree
+  _removed = _removedSinceMerge;
+  _removedSinceMerge.clear();
+
+  // compact, keeping what the tree covers in front of the delta
+  int j = 0;
+  for (int i = 0; i < _mergeEnd; ++i)
+    if (_mediaId[i]) {
+      _hashes[j] = _hashes[i];
+      _mediaId[j] = _mediaId[i];
+      j++;
+    }
+  _treeSize = j;
+
+  for (int i = _mergeEnd; i < _numHashes; ++i)
+    if (_mediaId[i]) {
+      _hashes[j] = _hashes[i];
+      _mediaId[j] = _mediaId[i];
+      j++;
+    }
+  _numHashes = j;
+
+  if (_numHashes > 0) {
+    _hashes = strict_realloc(_hashes, _numHashes);
+    _mediaId = strict_realloc(_mediaId, _numHashes);
+  }
+}
+
+void DctHashIndex::merge() {
+  finishMerge(true);
+  startMerge();
+  finishMerge(true);
 }
 
 void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
-  // hashes are always loaded from database, no caching
-  (void)cachePath;
   (void)dataPath;
 
   if (!isLoaded()) {
@@ -73,6 +300,16 @@ void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QStrin
 
     _isLoaded = true;
 
+    const QString path = cacheFile(cachePath);
+    if (!DBHelper::isCacheFileStale(db, path)) {
+      qint64 then = QDateTime::currentMSecsSinceEpoch();
+      if (mapCacheFile(path)) {
+        qInfo("mapped %d hashes in %dms", _numHashes,
+              int(QDateTime::currentMSecsSinceEpoch() - then));
+        return;
+      }
+    }
+
     QSqlQuery query(db);
     query.setForwardOnly(true);
 
@@ -110,48 +347,96 @@ void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QStrin
     buildTree();
 
     pl.end();
+
+    save(db, cachePath);
   }
 }
 
 void DctHashIndex::save(QSqlDatabase& db, const QString& cachePath) {
-  (void)db;
-  (void)cachePath;
-  // TODO: _tree->save()
+  if (!isLoaded()) return;
+
+  // mapped means unmodified since it was loaded, any changes to the
+  // database were made elsewhere so the file must be rebuilt
+  if (_mapFile) return;
+
+  const QString path = cacheFile(cachePath);
+  if (!DBHelper::isCacheFileStale(db, path)) return;
+
+  // the file has no delta or tombstones
+  finishMerge(true);
+  if (_treeSize != _numHashes || !_removed.isEmpty()) merge();
+
+  qInfo() << "writing cache file";
+  writeFileAtomically(path, [this](QFile& f) {
+    DctHashCacheHeader h;
+    memcpy(h.magic, DctHashCacheHeader::Magic, sizeof(h.magic));
+    h.version = DctHashCacheHeader::Version;
+    h.hashSize = sizeof(*_hashes);
+    h.numHashes = uint64_t(_numHashes);
+    h.treeOffset = DctHashCacheHeader::treeOffsetFor(h.numHashes);
+
+    const qint64 hashBytes = qint64(sizeof(*_hashes)) * _numHashes;
+    const qint64 idBytes = qint64(sizeof(*_mediaId)) * _numHashes;
+
+    if (sizeof(h) != f.write(reinterpret_cast<const char*>(&h), sizeof(h)) ||
+        hashBytes != f.write(reinterpret_cast<const char*>(_hashes), hashBytes) ||
+        idBytes != f.write(reinterpret_cast<const char*>(_mediaId), idBytes))
+      throw f.errorString();
+
+    const QByteArray padding(int(qint64(h.treeOffset) - f.pos()), 0);
+    if (padding.length() != f.write(padding)) throw f.errorString();
+
+    if (_tree) _tree->write(f);
+  });
 }
 
 void DctHashIndex::add(const MediaGroup& media) {
+  detach();
+  finishMerge(false);
+
   int end = _numHashes;
   _numHashes += media.count();
 
   _hashes = strict_realloc(_hashes, _numHashes);
   _mediaId = strict_realloc(_mediaId, _numHashes);
 
+  bool reused = false;
   for (int i = 0; i < media.count(); i++) {
     const Media& m = media[i];
     _hashes[i + end] = hashForMedia(m);
     _mediaId[i + end] = uint32_t(m.id());
+    reused |= _removed.contains(uint32_t(m.id())) || _removedSinceMerge.contains(uint32_t(m.id()));
   }
 
-  // TODO: _tree->insert(media);
-  buildTree();
+  // new hashes are in the delta until the next merge; but if an id was
+  // reused its tombstone would hide it, get rid of the tombstone now
+  if (reused)
+    merge();
+  else if (needsMerge())
+    startMerge();
 }
 
 void DctHashIndex::remove(const QVector<int>& removed) {
   if (!isLoaded()) return;
 
-  // rather than realloc the index, nullify the removed items
-  // TODO: track the amount of wasted space and compact at some point
+  // rather than realloc the index, nullify the removed items,
+  // which are compacted by the next merge
+  detach();
+  finishMerge(false);
+
   QSet<int> ids;
   for (int id : removed) ids.insert(id);
 
   for (int i = 0; i < _numHashes; i++)
     if (ids.contains(int(_mediaId[i]))) {
+      // tree has a copy of the value, mark it removed
+      if (i < _treeSize) _removed.insert(_mediaId[i]);
+      if (_merging && i < _mergeEnd) _removedSinceMerge.insert(_mediaId[i]);
       _mediaId[i] = 0;
       _hashes[i] = 0;
     }
 
-  // TODO: _tree->remove()
-  buildTree();
+  if (needsMerge()) startMerge();
 }
 
 QVector<Index::Match> DctHashIndex::find(const Media& m, const SearchParams& p) {
@@ -163,26 +448,72 @@ QVector<Index::Match> DctHashIndex::find(const Media& m, const SearchParams& p)
     return results;
   }
 
-  if (!_tree) {
-    qWarning() << "empty/null tree";
+  if (_numHashes <= 0) {
+    qWarning() << "empty index";
     return results;
   }
-// TODO: maybe use brute if threshold is high
-#if 1
-  results = _tree->search(target, p.dctThresh);
-#else
-  // brute-force search is often fast enough
-  for (int i = 0; i < _numHashes; i++) {
-    int score = hamm64(target, _hashes[i]);
-    if (score < p.dctThresh) {
-      uint32_t id = _mediaId[i];
-      if (id != 0) results.append(Index::Match(id, score));
-    }
+
+  findHashes(&target, 1, p, &results);
+  return results;
+}
+
+QVector<QVector<Index::Match>> DctHashIndex::findBatch(const MediaGroup& needles,
+                                                       const SearchParams& p) {
+  QVector<QVector<Index::Match>> results(needles.count());
+
+  if (_numHashes <= 0) {
+    qWarning() << "empty index";
+    return results;
+  }
+
+  // needles without hashes have target 0 and are skipped
+  std::vector<uint64_t> targets;
+  targets.reserve(size_t(needles.count()));
+  for (const Media& m : needles) {
+    targets.push_back(hashForMedia(m));
+    if (!targets.back()) qWarning() << "no hash for needle:" << m.path();
   }
-#endif
+
+  findHashes(targets.data(), needles.count(), p, results.data());
   return results;
 }
 
+void DctHashIndex::findHashes(const uint64_t* targets, int numTargets, const SearchParams& p,
+                              QVector<Index::Match>* results) const {
+  // brute-force search is often faster than the tree, and its runtime does
+  // not depend on the threshold; if there is no tree everything is in the delta
+  int scanFrom = _treeSize;
+  if (!_tree || useBruteForce(p.dctThresh))
+    scanFrom = 0;
+  else {
+    for (int j = 0; j < numTargets; ++j) {
+      if (!targets[j]) continue;
+      results[j] = _tree->search(targets[j], p.dctThresh);
+      if (!_removed.isEmpty())
+        results[j].removeIf(
+            [this](const Index::Match& m) { return _removed.contains(m.mediaId); });
+    }
+  }
+
+  // scan in tiles that stay in cache while all targets are compared,
+  // instead of streaming the entire array for each target
+  const int tileSize = 4096;
+  for (int begin = scanFrom; begin < _numHashes; begin += tileSize) {
+    const int len = std::min(tileSize, _numHashes - begin);
+    const uint64_t* hashes = _hashes + begin;
+    const uint32_t* mediaId = _mediaId + begin;
+
+    for (int j = 0; j < numTargets; ++j) {
+      if (!targets[j]) continue;
+      QVector<Index::Match>& r = results[j];
+      // removed slots are zeroed so they are skipped here
+      hammScan64(targets[j], hashes, size_t(len), p.dctThresh, [&](size_t i, int score) {
+        if (mediaId[i] != 0) r.append(Index::Match(mediaId[i], score));
+      });
+    }
+  }
+}
+
 Index* DctHashIndex::slice(const QSet<uint32_t>& mediaIds) const {
   Q_ASSERT(isLoaded());
 
@@ -203,6 +534,7 @@ Index* DctHashIndex::slice(const QSet<uint32_t>& mediaIds) const {
 
   // don't use unitialized values
   chunk->_numHashes = j;
+  chunk->_treeSize = j;
 
   // tree may not like empty array
   if (chunk->_numHashes <= 0) return chunk;
@@ -25,6 +25,14 @@
 /**
  * @class DctHashIndex
  * @brief Index for 64-bit dct hash that uses hamming distance
+ *
+ * The hashes and search tree are saved to a flat file in the cache directory,
+ * which is memory-mapped on the next load instead of querying the database
+ * and rebuilding the tree.
+ *
+ * Additions are appended to a delta that is searched by brute-force, and removals
+ * are tombstoned. When these get too large, a new tree is built in the background
+ * and the arrays are compacted.
  */
 class DctHashIndex : public Index {
   Q_DISABLE_COPY_MOVE(DctHashIndex)
@@ -45,6 +53,8 @@ class DctHashIndex : public Index {
   void save(QSqlDatabase& db, const QString& cachePath) override;
 
   QVector<Index::Match> find(const Media& m, const SearchParams& p) override;
+  QVector<QVector<Index::Match>> findBatch(const MediaGroup& needles,
+                                           const SearchParams& p) override;
 
   Index* slice(const QSet<uint32_t>& mediaIds) const override;
 
@@ -58,6 +68,56 @@ class DctHashIndex : public Index {
   uint32_t* _mediaId;
   int _numHashes;
   bool _isLoaded;
+  QFile* _mapFile;  // if non-null, arrays and tree are mapped from the cache file
   void init();
   void buildTree();
+
+  enum {
+    MergeMinSize = 16384,  // minimum delta+tombstones to trigger a merge
+    MergeRatio = 16,       // ...or 1/N of the tree size, whichever is larger
+  };
+
+  int _treeSize;                       // [0,_treeSize) in the tree, the rest is the delta
+  QSet<uint32_t> _removed;             // removed ids that could still be in the tree
+  QSet<uint32_t> _removedSinceMerge;   // ...removed after the merge snapshot
+  QFuture<class DctTree*> _merge;      // tree being built in the background
+  int _mergeEnd;                       // [0,_mergeEnd) are in the merged tree
+  bool _merging;
+
+  /// search for each non-zero target, appending to results[i]
+  void findHashes(const uint64_t* targets, int numTargets, const SearchParams& p,
+                  QVector<Index::Match>* results) const;
+
+  enum { MaxThreshold = 64 };
+
+  /// brute-force or tree by threshold, 1/0, or -1 if not measured for the current tree
+  mutable QAtomicInt _bruteForce[MaxThreshold];
+
+  /// @return true if a brute-force scan is expected to be faster than the tree
+  bool useBruteForce(int threshold) const;
+
+  /// time a few searches both ways, @return true if scan was faster
+  bool measureBruteForce(int threshold) const;
+
+  /// forget measurements when the tree changes
+  void resetBruteForce();
+
+  /// @return true if delta/tombstones are large enough to rebuild the tree
+  bool needsMerge() const;
+
+  /// start building a tree in the background from all live hashes
+  void startMerge();
+
+  /// replace the tree with the merged one and compact the arrays
+  /// @param wait if false, only if the merge has finished
+  void finishMerge(bool wait);
+
+  /// synchronous merge, e.g. before saving
+  void merge();
+
+  /// load arrays/tree from cache file, @return false if file is unusable
+  bool mapCacheFile(const QString& path);
+
+  /// copy mapped arrays/tree to the heap before modifying them
+  void detach();
 };
@@ -21,16 +21,267 @@
 #include "dctvideoindex.h"
 
 #include "qtutil.h"
-#include "tree/hammingtree.h"
+#include "tree/dcttree.h"
+
+#include "ioutil.h"
+
+static QString storeFile(const QString& cachePath) { return cachePath + qq("/dctvideo.cache"); }
+
+// tree values are positions in the store since version 2,
+// and the tree is keyed to the store since version 3
+enum { TreeVersion = 3 };
+
+static QString treeFile(const QString& cachePath, int skipFrames) {
+  return cachePath + QString("/dctvideo-%1-v%2.tree").arg(skipFrames).arg(TreeVersion);
+}
+
+/// remove trees of all versions and skipFrames, their positions refer to the old store
+static void removeTreeFiles(const QString& cachePath) {
+  const QDir dir(cachePath);
+  for (auto& name : dir.entryList({qq("dctvideo-*.tree")}, QDir::Files))
+    if (!QFile::remove(dir.absoluteFilePath(name)))
+      qWarning() << "failed to remove stale cache file:" << name;
+}
+
+/**
+ * @class VideoStore
+ * @brief Frame hashes of many videos packed together
+ *
+ * Replaces reading one .vdx file per video. Entries are in the
+ * same order as DctVideoIndex::_mediaId and can be memory-mapped
+ * from the cache file.
+ */
+class VideoStore {
+  Q_DISABLE_COPY_MOVE(VideoStore)
+
+ public:
+  /// cache file: Header, offsets[numVideos+1], hashes[numFrames], ids[numVideos],
+  ///             steps[numVideos], frames[numFrames]
+  struct Header {
+    enum { Version = 2 };
+    char magic[8];
+    uint32_t version;
+    uint32_t frameSize;  // detect incompatible VideoIndex::frames
+    uint64_t numVideos;
+    uint64_t numFrames;
+    static constexpr char Magic[8] = {'c', 'b', 'i', 'r', 'd', 'V', 'D', 'S'};
+  };
+  typedef decltype(VideoIndex::frames)::value_type frame_t;
+
+  VideoStore() { point(); }
+  ~VideoStore() { delete _file; }
+
+  size_t count() const { return _numVideos; }
+  uint32_t id(size_t i) const { return _ids[i]; }
+  uint32_t frameStep(size_t i) const { return _steps[i]; }
+  size_t length(size_t i) const { return size_t(_offsets[i + 1] - _offsets[i]); }
+  const uint64_t* hashes(size_t i) const { return _hashes + _offsets[i]; }
+  const frame_t* frames(size_t i) const { return _frames + _offsets[i]; }
+
+  /// @return position of the first frame of entry i, unique for all frames in the store
+  uint64_t position(size_t i) const { return _offsets[i]; }
+
+  /// @return entry containing position
+  size_t entryAt(uint64_t pos) const {
+    return size_t(std::upper_bound(_offsets, _offsets + _numVideos + 1, pos) - _offsets) - 1;
+  }
+
+  /// @return frame number at position
+  frame_t frameAt(uint64_t pos) const { return _frames[pos]; }
+  uint64_t numFrames() const { return _offsets[_numVideos]; }
+
+  /// @return value that changes if entries or frame positions change,
+  ///         so a cached tree can be tied to the store
+  uint64_t fingerprint() const {
+    size_t h = qHash(numFrames());
+    h = qHashBits(_offsets, sizeof(*_offsets) * (_numVideos + 1), h);
+    if (_numVideos > 0) h = qHashBits(_ids, sizeof(*_ids) * _numVideos, h);
+    return uint64_t(h);
+  }
+
+  size_t memoryUsage() const {
+    return VECTOR_SIZE(_ownOffsets) + VECTOR_SIZE(_ownHashes) + VECTOR_SIZE(_ownIds) +
+           VECTOR_SIZE(_ownSteps) + VECTOR_SIZE(_ownFrames);
+  }
+
+  /// @return copy of entry i
+  VideoIndex videoIndex(size_t i) const {
+    VideoIndex index;
+    index.frames.assign(frames(i), frames(i) + length(i));
+    index.hashes.assign(hashes(i), hashes(i) + length(i));
+    index.frameStep = frameStep(i);
+    return index;
+  }
+
+  /// add an entry, the index may be empty
+  void append(uint32_t id, const VideoIndex& index) {
+    detach();
+    const size_t len = std::min(index.frames.size(), index.hashes.size());
+    _ownIds.push_back(id);
+    _ownSteps.push_back(index.frameStep);
+    _ownFrames.insert(_ownFrames.end(), index.frames.begin(), index.frames.begin() + len);
+    _ownHashes.insert(_ownHashes.end(), index.hashes.begin(), index.hashes.begin() + len);
+    _ownOffsets.push_back(_ownHashes.size());
+    point();
+  }
+
+  /// remove entries with the given ids
+  void remove(const QSet<int>& ids) {
+    VideoStore copy;
+    for (size_t i = 0; i < _numVideos; ++i)
+      if (!ids.contains(int(_ids[i]))) copy.append(_ids[i], videoIndex(i));
+    delete _file;
+    _file = nullptr;
+    _ownOffsets.swap(copy._ownOffsets);
+    _ownHashes.swap(copy._ownHashes);
+    _ownIds.swap(copy._ownIds);
+    _ownSteps.swap(copy._ownSteps);
+    _ownFrames.swap(copy._ownFrames);
+    point();
+  }
+
+  /**
+   * Use the cache file without reading it
+   * @return false if file is invalid or incompatible
+   */
+  bool map(const QString& path) {
+    QFile* f = new QFile(path);
+    if (!f->open(QFile::ReadOnly)) {
+      qWarning() << "open failed:" << path << f->errorString();
+      delete f;
+      return false;
+    }
+
+    const qint64 size = f->size();
+    const uchar* data = nullptr;
+    Header h;
+
+    if (size >= qint64(sizeof(h))) data = f->map(0, size);
+    if (data) memcpy(&h, data, sizeof(h));
+
+    // counts are bounded by the size first, so fileSize() can't overflow
+    if (!data || memcmp(h.magic, Header::Magic, sizeof(h.magic)) != 0 ||
+        h.version != Header::Version || h.frameSize != sizeof(frame_t) ||
+        h.numVideos > uint64_t(size) || h.numFrames > uint64_t(size) ||
+        uint64_t(size) != fileSize(h.numVideos, h.numFrames)) {
+      qWarning() << "invalid or incompatible cache file:" << path;
+      delete f;
+      return false;
+    }
+
+    // hashes(), frames() and entryAt() need offsets in order and in bounds
+    const uchar* offsets = data + sizeof(h);
+    uint64_t lastOffset = 0;
+    for (uint64_t i = 0; i <= h.numVideos; ++i) {
+      uint64_t offset;
+      memcpy(&offset, offsets + sizeof(offset) * i, sizeof(offset));
+      if ((i == 0 && offset != 0) || offset < lastOffset || offset > h.numFrames ||
+          (i == h.numVideos && offset != h.numFrames)) {
+        qWarning() << "corrupt cache file:" << path;
+        delete f;
+        return false;
+      }
+      lastOffset = offset;
+    }
+
+    delete _file;
+    _file = f;
+    _ownOffsets.clear();
+    _ownHashes.clear();
+    _ownIds.clear();
+    _ownSteps.clear();
+    _ownFrames.clear();
+
+    _numVideos = h.numVideos;
+    _offsets = reinterpret_cast<const uint64_t*>(data + sizeof(h));
+    _hashes = _offsets + h.numVideos + 1;
+    _ids = reinterpret_cast<const uint32_t*>(_hashes + h.numFrames);
+    _steps = _ids + h.numVideos;
+    _frames = reinterpret_cast<const frame_t*>(_steps + h.numVideos);
+    return true;
+  }
+
+  /// copy mapped memory so entries can be changed
+  void detach() {
+    if (!_file) return;
+    const size_t numFrames = _offsets[_numVideos];
+    _ownOffsets.assign(_offsets, _offsets + _numVideos + 1);
+    _ownHashes.assign(_hashes, _hashes + numFrames);
+    _ownIds.assign(_ids, _ids + _numVideos);
+    _ownSteps.assign(_steps, _steps + _numVideos);
+    _ownFrames.assign(_frames, _frames + numFrames);
+    delete _file;
+    _file = nullptr;
+    point();
+  }
+
+  /// write the cache file, throws QString on error
+  void write(QFile& f) const {
+    Header h;
+    memcpy(h.magic, Header::Magic, sizeof(h.magic));
+    h.version = Header::Version;
+    h.frameSize = sizeof(frame_t);
+    h.numVideos = _numVideos;
+    h.numFrames = _offsets[_numVideos];
+
+    const qint64 offsetBytes = qint64(sizeof(*_offsets) * (h.numVideos + 1));
+    const qint64 hashBytes = qint64(sizeof(*_hashes) * h.numFrames);
+    const qint64 idBytes = qint64(sizeof(*_ids) * h.numVideos);
+    const qint64 stepBytes = qint64(sizeof(*_steps) * h.numVideos);
+    const qint64 frameBytes = qint64(sizeof(*_frames) * h.numFrames);
+
+    if (sizeof(h) != f.write(reinterpret_cast<const char*>(&h), sizeof(h)) ||
+        offsetBytes != f.write(reinterpret_cast<const char*>(_offsets), offsetBytes) ||
+        hashBytes != f.write(reinterpret_cast<const char*>(_hashes), hashBytes) ||
+        idBytes != f.write(reinterpret_cast<const char*>(_ids), idBytes) ||
+        stepBytes != f.write(reinterpret_cast<const char*>(_steps), stepBytes) ||
+        frameBytes != f.write(reinterpret_cast<const char*>(_frames), frameBytes))
+      throw f.errorString();
+  }
+
+ private:
+  static uint64_t fileSize(uint64_t numVideos, uint64_t numFrames) {
+    return sizeof(Header) + (numVideos + 1) * sizeof(uint64_t) + numFrames * sizeof(uint64_t) +
+           numVideos * sizeof(uint32_t) * 2 + numFrames * sizeof(frame_t);
+  }
+
+  /// use the owned arrays
+  void point() {
+    if (_ownOffsets.empty()) _ownOffsets.push_back(0);
+    _numVideos = _ownIds.size();
+    _offsets = _ownOffsets.data();
+    _hashes = _ownHashes.data();
+    _ids = _ownIds.data();
+    _steps = _ownSteps.data();
+    _frames = _ownFrames.data();
+  }
+
+  QFile* _file = nullptr;  // if not null, arrays are mapped from it
+  size_t _numVideos;
+  const uint64_t* _offsets;  // entry i is [_offsets[i], _offsets[i+1])
+  const uint64_t* _hashes;
+  const uint32_t* _ids;
+  const uint32_t* _steps;  // VideoIndex::frameStep
+  const frame_t* _frames;
+
+  std::vector<uint64_t> _ownOffsets;
+  std::vector<uint64_t> _ownHashes;
+  std::vector<uint32_t> _ownIds;
+  std::vector<uint32_t> _ownSteps;
+  std::vector<frame_t> _ownFrames;
+};
 
 DctVideoIndex::DctVideoIndex() {
   _id = SearchParams::AlgoVideo;
   _tree = nullptr;
+  _store = nullptr;
   _isLoaded = false;
+  _modified = false;
 }
 
 DctVideoIndex::~DctVideoIndex() {
   delete _tree;
+  delete _store;
   for (auto it : _cachedIndex) delete it.second;
 }
 
@@ -38,40 +289,106 @@ bool DctVideoIndex::isLoaded() const { return _isLoaded; }
 
 int DctVideoIndex::count() const { return _tree ? int(_tree->size()) : 0; }
 
-size_t DctVideoIndex::memoryUsage() const { return _tree ? _tree->stats().memory : 0; }
+size_t DctVideoIndex::memoryUsage() const {
+  return (_tree ? _tree->stats().memory : 0) + (_store ? _store->memoryUsage() : 0);
+}
+
+bool DctVideoIndex::isCacheFileStale(const QString& path) const {
+  QFileInfo info(path);
+  return !info.exists() || _dbModified > info.lastModified();
+}
+
+int DctVideoIndex::indexOf(uint32_t mediaId) const {
+  auto it = std::lower_bound(_mediaId.begin(), _mediaId.end(), mediaId);
+  if (it == _mediaId.end() || *it != mediaId) return -1;
+  return int(it - _mediaId.begin());
+}
 
-void DctVideoIndex::insertHashes(int mediaIndex, HammingTree* tree, const SearchParams& params) {
-  QString indexPath = QString("%1/%2.vdx").arg(_dataPath).arg(_mediaId[uint32_t(mediaIndex)]);
-  if (!QFileInfo(indexPath).exists()) {
-    qWarning() << "index file missing:" << indexPath;
-    return;
+void DctVideoIndex::loadStore() {
+  if (_store) return;
+
+  qint64 then = QDateTime::currentMSecsSinceEpoch();
+
+  auto* store = new VideoStore;
+  const QString path = storeFile(_cachePath);
+
+  if (!_cachePath.isEmpty() && !isCacheFileStale(path) && store->map(path)) {
+    // ids must be the same as the query in load() and any add/remove since then
+    bool valid = store->count() == _mediaId.size();
+    for (size_t i = 0; valid && i < _mediaId.size(); ++i) valid = store->id(i) == _mediaId[i];
+    if (valid) {
+      qInfo("mapped %d videos in %dms", int(store->count()),
+            int(QDateTime::currentMSecsSinceEpoch() - then));
+      _store = store;
+      checkStoreSize();
+      return;
+    }
+    qWarning() << "cache file does not match database:" << path;
+    delete store;
+    store = new VideoStore;
   }
 
-  VideoIndex index;
-  index.load(indexPath);
+  PROGRESS_LOGGER(pl, "<PL>%percent %bignum video indexes", _mediaId.size());
+  for (size_t i = 0; i < _mediaId.size(); i++) {
+    pl.step(i);
 
-  std::vector<HammingTree::Value> values;
-  for (size_t j = 0; j < index.hashes.size(); j++) {
+    VideoIndex index;
+    QString indexPath = QString("%1/%2.vdx").arg(_dataPath).arg(_mediaId[i]);
+    if (QFileInfo(indexPath).exists())
+      index.load(indexPath);
+    else
+      qWarning() << "index file missing:" << indexPath;
+
+    store->append(_mediaId[i], index);
+  }
+  pl.end();
+
+  _store = store;
+  checkStoreSize();
+
+  if (!_cachePath.isEmpty()) {
+    qInfo() << "writing cache file";
+    removeTreeFiles(_cachePath);
+    writeFileAtomically(path, [store](QFile& f) { store->write(f); });
+  }
+}
+
+void DctVideoIndex::checkStoreSize() const {
+  // positions of all frames are the tree values
+  if (_store->numFrames() > std::numeric_limits<DctMultiTree::index_t>::max())
+    qFatal("maximum of %llu video frames can be searched",
+           (unsigned long long)std::numeric_limits<DctMultiTree::index_t>::max());
+}
+
+void DctVideoIndex::insertHashes(int mediaIndex, DctMultiTree* tree, const SearchParams& params) {
+  const size_t len = _store->length(size_t(mediaIndex));
+  if (len == 0) return;
+
+  const auto* frames = _store->frames(size_t(mediaIndex));
+  const uint64_t* hashes = _store->hashes(size_t(mediaIndex));
+
+  std::vector<DctMultiTree::Value> values;
+  for (size_t j = 0; j < len; j++) {
     // drop hashes with < 5 0's or 1's (insufficient detail)
     // TODO: figure out what value is reasonable
     // TODO: drop these when creating the index
     // TODO: params
-    uint64_t hash = index.hashes[j];
+    uint64_t hash = hashes[j];
     if (hamm64(hash, 0) < 5 || hamm64(hash, 0xFFFFFFFFFFFFFFFF) < 5) continue;
 
     // drop begin/end frames if there are enough left over
-    int lastFrame = index.frames[index.frames.size() - 1];
+    int lastFrame = frames[len - 1];
     if (lastFrame > (params.skipFrames * 2)) {
-      if (index.frames[j] < params.skipFrames || index.frames[j] > lastFrame - params.skipFrames)
+      if (frames[j] < params.skipFrames || frames[j] > lastFrame - params.skipFrames)
         continue;
     }
 
-    // the index is a composite of the media index (not id) and
-    // the frame number corresponding to the stored hash. to get back
-    // to the mediaId use _mediaId array
-    uint32_t treeIndex = (uint32_t(mediaIndex) << 16) | index.frames[j];
+    // the index is the position of the frame in the store, which gives
+    // the media index (not id) and frame number. to get back to the
+    // mediaId use _mediaId array
+    const uint64_t treeIndex = _store->position(size_t(mediaIndex)) + j;
 
-    values.push_back(HammingTree::Value(treeIndex, index.hashes[j]));
+    values.push_back(DctMultiTree::Value(DctMultiTree::index_t(treeIndex), hashes[j]));
   }
 
   tree->insert(values);
@@ -85,26 +402,52 @@ void DctVideoIndex::buildTree(const SearchParams& params) {
   QMutexLocker locker(&_mutex);
 
   if (!_tree) {
-    auto* tree = new HammingTree;
-    PROGRESS_LOGGER(pl, "<PL>%percent %bignum videos", _mediaId.size());
-    for (size_t i = 0; i < _mediaId.size(); i++) {
-      pl.step(i);
-      insertHashes(int(i), tree, params);
+    loadStore();
+
+    qint64 then = QDateTime::currentMSecsSinceEpoch();
+
+    auto* tree = new DctMultiTree;
+    const QString path = treeFile(_cachePath, params.skipFrames);
+    bool cached = !_cachePath.isEmpty() && !_modified && !isCacheFileStale(path);
+
+    // tree values are store positions, reject a tree built from another store
+    const uint64_t key = _store->fingerprint();
+
+    if (cached) {
+      qInfo("reading cache file");
+      cached = tree->read(qUtf8Printable(path), key);
     }
-    pl.end();
 
-    HammingTree::Stats stats = tree->stats();
-    qInfo("%d hashes, %.1f MB, %d nodes, depth %d, vtrim %d",
+    if (!cached) {
+      PROGRESS_LOGGER(pl, "<PL>%percent %bignum videos", _mediaId.size());
+      for (size_t i = 0; i < _mediaId.size(); i++) {
+        pl.step(i);
+        insertHashes(int(i), tree, params);
+      }
+      pl.end();
+      tree->freeze();
+    }
+
+    DctMultiTree::Stats stats = tree->stats();
+    qInfo("%d hashes, %.1f MB, %d nodes, depth %d, vtrim %d, %dms",
           stats.numValues, stats.memory / 1024.0 / 1024.0, stats.numNodes, stats.maxHeight,
-          params.skipFrames);
+          params.skipFrames, int(QDateTime::currentMSecsSinceEpoch() - then));
+
+    // tree matches the database even if the store is modified,
+    // since the changes were already committed
+    if (!cached && !_cachePath.isEmpty()) {
+      qInfo() << "writing cache file";
+      writeFileAtomically(path, [tree, key](QFile& f) { tree->write(f, key); });
+    }
 
     _tree = tree;
   }
 }
 
 void DctVideoIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
-  (void)cachePath;
   _dataPath = dataPath;
+  _cachePath = cachePath;
+  _dbModified = DBHelper::lastModified(db);
 
   QSqlQuery query(db);
   query.setForwardOnly(true);
@@ -117,6 +460,11 @@ void DctVideoIndex::load(QSqlDatabase& db, const QString& cachePath, const QStri
 
   delete _tree;
   _tree = nullptr;
+  delete _store;
+  _store = nullptr;
+  for (auto it : _cachedIndex) delete it.second;
+  _cachedIndex.clear();
+  _modified = false;
   _mediaId.clear();
   _isLoaded = false;
 
@@ -128,21 +476,38 @@ void DctVideoIndex::load(QSqlDatabase& db, const QString& cachePath, const QStri
     if (++i % 1000 == 0) pl.step(i);
   }
 
-  if (_mediaId.size() > 0xFFFF) qFatal("maximum of %d videos can be searched", 0xFFFF);
-
-  // lazy load the tree since findFrame may not need it
+  // lazy load the tree and store since findFrame may not need it
   _isLoaded = true;
 
   pl.end();
 }
 
 void DctVideoIndex::save(QSqlDatabase& db, const QString& cachePath) {
-  (void)db;
-  (void)cachePath;
+  if (!_store || !_modified) return;
+
+  const QString path = storeFile(cachePath);
+  if (!DBHelper::isCacheFileStale(db, path)) return;
+
+  qInfo() << "writing cache file";
+  writeFileAtomically(path, [this](QFile& f) { _store->write(f); });
 }
 
 void DctVideoIndex::add(const MediaGroup& media) {
-  for (auto& m : media) _mediaId.push_back(m.id());
+  for (auto& m : media) {
+    if (m.type() != Media::TypeVideo) continue;
+
+    _mediaId.push_back(uint32_t(m.id()));
+    _modified = true;
+
+    if (_store) {
+      // the index was already written to the data path
+      VideoIndex index = m.videoIndex();
+      QString indexPath = QString("%1/%2.vdx").arg(_dataPath).arg(m.id());
+      if (index.isEmpty() && QFileInfo(indexPath).exists()) index.load(indexPath);
+      _store->append(uint32_t(m.id()), index);
+    }
+  }
+  if (_store) checkStoreSize();
   delete _tree;
   _tree = nullptr;
 }
@@ -153,15 +518,17 @@ void DctVideoIndex::remove(const QVector<int>& ids) {
 
   decltype(_mediaId) copy;
   for (auto& id : qAsConst(_mediaId))
-    if (!set.contains(id)) {
-      copy.push_back(id);
-    } else {
-      auto it = _cachedIndex.find(id);
-      if (it != _cachedIndex.end()) {
-        _cachedIndex.erase(it);
-        delete it->second;
-      }
-    }
+    if (!set.contains(int(id))) copy.push_back(id);
+
+  if (copy.size() != _mediaId.size()) {
+    if (_store) _store->remove(set);
+    _modified = true;
+
+    // store positions changed
+    for (auto it : _cachedIndex) delete it.second;
+    _cachedIndex.clear();
+  }
+
   _mediaId = copy;
   delete _tree;
   _tree = nullptr;
@@ -180,7 +547,7 @@ QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const Search
   Q_ASSERT(needle.type() == Media::TypeImage);
   qint64 start = QDateTime::currentMSecsSinceEpoch();
 
-  const HammingTree* queryIndex = _tree;
+  const DctMultiTree* queryIndex = _tree;
 
   // optimization to search only a particular video, (future, small subset)
   if (params.target != 0) {
@@ -197,7 +564,8 @@ QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const Search
       if (it != _mediaId.end()) {
         int mediaIndex = int(it - _mediaId.begin());
 
-        HammingTree* tree = new HammingTree;
+        loadStore();
+        DctMultiTree* tree = new DctMultiTree;
         _cachedIndex[params.target] = tree;
         insertHashes(mediaIndex, tree, params);
         queryIndex = tree;
@@ -223,7 +591,7 @@ QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const Search
     return results;
   }
 
-  std::vector<HammingTree::Match> matches;
+  std::vector<DctMultiTree::Match> matches;
 
   queryIndex->search(hash, params.dctThresh, matches);
 
@@ -237,11 +605,10 @@ QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const Search
         qUtf8Printable(needle.path()));
 
   // get 1 nearest frame for each video matched
-  QMap<int, HammingTree::Match> nearest;
+  QMap<int, DctMultiTree::Match> nearest;
 
   for (const auto& match : matches) {
-    // int dstFrame   = match.index & 0xFFFF;
-    int mediaIndex = match.value.index >> 16;
+    int mediaIndex = int(_store->entryAt(match.value.index));
 
     auto it = nearest.find(mediaIndex);
 
@@ -251,9 +618,10 @@ QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const Search
       nearest.insert(mediaIndex, match);
   }
 
-  for (const auto& match : nearest) {
-    uint32_t dstFrame = match.value.index & 0xFFFF;
-    uint32_t mediaIndex = match.value.index >> 16;
+  for (auto it = nearest.begin(); it != nearest.end(); ++it) {
+    const DctMultiTree::Match& match = it.value();
+    uint32_t dstFrame = _store->frameAt(match.value.index);
+    uint32_t mediaIndex = uint32_t(it.key());
 
     Index::Match result;
     result.mediaId = _mediaId[mediaIndex];
@@ -281,120 +649,196 @@ Index* DctVideoIndex::slice(const QSet<uint32_t>& mediaIds) const {
   copy->_dataPath = _dataPath;
   copy->_isLoaded = true;
   for (auto& id : mediaIds) copy->_mediaId.push_back(id);
+  std::sort(copy->_mediaId.begin(), copy->_mediaId.end());
+
+  // copy from the store rather than reading .vdx files again
+  if (_store) {
+    copy->_store = new VideoStore;
+    for (uint32_t id : copy->_mediaId) {
+      auto it = std::lower_bound(_mediaId.begin(), _mediaId.end(), id);
+      if (it != _mediaId.end() && *it == id)
+        copy->_store->append(id, _store->videoIndex(size_t(it - _mediaId.begin())));
+      else
+        copy->_store->append(id, VideoIndex());
+    }
+  }
   return copy;
 }
 
-QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const SearchParams& params) {
-  Q_ASSERT(needle.type() == Media::TypeVideo);
+QVector<QVector<Index::Match>> DctVideoIndex::findBatch(const MediaGroup& needles,
+                                                        const SearchParams& params) {
+  // video needles are searched together, images are fast enough by themselves
+  MediaGroup videos;
+  QVector<int> videoSlots;
+  QVector<QVector<Index::Match>> results(needles.count());
+  for (int i = 0; i < needles.count(); ++i)
+    if (needles[i].type() == Media::TypeVideo) {
+      videos.append(needles[i]);
+      videoSlots.append(i);
+    } else
+      results[i] = find(needles[i], params);
 
-  VideoIndex srcIndex;
-  QVector<Index::Match> results;
+  if (!videos.isEmpty()) {
+    const auto videoResults = findVideos(videos, params);
+    for (int i = 0; i < videoSlots.count(); ++i) results[videoSlots[i]] = videoResults[i];
+  }
 
-  // if id == 0, it doesn't exist in the db and was indexed separately
-  if (needle.id() == 0)
-    srcIndex = needle.videoIndex();
-  else
-    srcIndex.load(QString("%1/%2.vdx").arg(_dataPath).arg(needle.id()));
+  return results;
+}
 
-  if (srcIndex.isEmpty()) {
-    qWarning() << "needle video index is empty:" << needle.path();
-    return results;
-  }
+QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const SearchParams& params) {
+  return findVideos({needle}, params).first();
+}
 
-  buildTree(params);
-  const HammingTree* queryIndex = _tree;
+QVector<QVector<Index::Match>> DctVideoIndex::findVideos(const MediaGroup& needles,
+                                                         const SearchParams& params) {
+  QVector<QVector<Index::Match>> batchResults(needles.count());
 
-  QMap<uint32_t, std::vector<MatchRange>> cand;
+  // frames of all needles are searched at once, so each tree leaf
+  // is scanned once for the batch instead of once per frame
+  std::vector<int> srcFrames;
+  std::vector<uint64_t> srcHashes;
+  QVector<int> offsets(needles.count() + 1, 0);  // srcFrames offset for each needle
+  QVector<int> srcSteps(needles.count(), 1);      // VideoIndex::frameStep of each needle
 
-  const int lastFrame = srcIndex.frames[srcIndex.frames.size() - 1];
-  for (size_t i = 0; i < srcIndex.hashes.size(); i++) {
-    const int srcFrame = srcIndex.frames[i];
-    const uint64_t srcHash = srcIndex.hashes[i];
+  buildTree(params);
 
-    if (srcFrame < params.skipFrames || srcFrame > (lastFrame - params.skipFrames)) continue;
+  for (int i = 0; i < needles.count(); ++i) {
+    const Media& needle = needles[i];
+    Q_ASSERT(needle.type() == Media::TypeVideo);
 
-    std::vector<HammingTree::Match> matches;
-    queryIndex->search(srcHash, params.dctThresh, matches);
+    VideoIndex srcIndex;
 
-    // we really only need the one closest frame for each matching video,
-    // except in a corner-case where video repeats the same frame over and over (but this is rare)
-    // FIXME: this implies there is a faster/better way to do this? (array of vptree?)
-    struct ScoredMatch { int score; uint32_t frame; };
-    std::unordered_map<int, ScoredMatch> closestMatch;
+    // if id == 0, it doesn't exist in the db and was indexed separately
+    const int storeIndex = needle.id() == 0 ? -1 : indexOf(uint32_t(needle.id()));
+    if (needle.id() == 0)
+      srcIndex = needle.videoIndex();
+    else if (storeIndex >= 0)
+      srcIndex = _store->videoIndex(size_t(storeIndex));
+    else
+      srcIndex.load(QString("%1/%2.vdx").arg(_dataPath).arg(needle.id()));
 
-    for (const HammingTree::Match& match : matches) {
-      const uint32_t dstFrame = match.value.index & 0xFFFF;
-      const uint32_t dstIndex = match.value.index >> 16;
-      const uint64_t dstHash = match.value.hash;
+    srcSteps[i] = int(srcIndex.frameStep);
 
-      const uint32_t id = _mediaId[dstIndex];
-      if (!params.filterSelf || id != uint32_t(needle.id())) {
-        const auto it = closestMatch.find(id);
-        const int score = hamm64(srcHash, dstHash);
-        if (it == closestMatch.end() || score < it->second.score)
-          closestMatch[id] = {score, dstFrame};
+    if (srcIndex.isEmpty())
+      qWarning() << "needle video index is empty:" << needle.path();
+    else {
+      const int lastFrame = srcIndex.frames[srcIndex.frames.size() - 1];
+      for (size_t j = 0; j < srcIndex.hashes.size(); j++) {
+        const int srcFrame = srcIndex.frames[j];
+        if (srcFrame < params.skipFrames || srcFrame > (lastFrame - params.skipFrames)) continue;
+
+        srcFrames.push_back(srcFrame);
+        srcHashes.push_back(srcIndex.hashes[j]);
       }
     }
-
-    for (auto& closest : qAsConst(closestMatch))
-      cand[closest.first].push_back(MatchRange(srcFrame, int(closest.second.frame), 1));
+    offsets[i + 1] = int(srcFrames.size());
   }
 
-  int nearMargin = 15; // TODO: params
+  if (srcHashes.empty()) return batchResults;
 
-  for (auto it = cand.begin(); it != cand.end(); ++it) {
-    auto ranges = it.value();
+  const DctMultiTree* queryIndex = _tree;
 
-    //std::sort(ranges.begin(), ranges.end()); already sorted by srcFrame
+  std::vector<std::vector<DctMultiTree::Match>> frameMatches;
+  queryIndex->search(srcHashes, params.dctThresh, frameMatches);
 
-    int num = int(ranges.size());  // number of frames that matched
+  for (int n = 0; n < needles.count(); ++n) {
+    const Media& needle = needles[n];
+    QVector<Index::Match>& results = batchResults[n];
 
-    // ranges are sorted by src frame, we would expect all matches
-    // to also be in ascending order, so score them based on how
-    // ascending they are
-    int numAscending = 0;
-    int lastFrame = 0;
-    for (const MatchRange& range : qAsConst(ranges)) {
-      // some number of frames before and after are still "nearby" because
-      // the indexer removed similar consecutive frames
-      int frame = range.dstIn;
-      if (abs(frame-lastFrame) < nearMargin) numAscending++;
-      lastFrame = frame;
+    QMap<uint32_t, std::vector<MatchRange>> cand;
+
+    for (int j = offsets[n]; j < offsets[n + 1]; j++) {
+      const int srcFrame = srcFrames[size_t(j)];
+      const uint64_t srcHash = srcHashes[size_t(j)];
+      const std::vector<DctMultiTree::Match>& matches = frameMatches[size_t(j)];
+
+      // we really only need the one closest frame for each matching video,
+      // except in a corner-case where video repeats the same frame over and over (but this is rare)
+      // FIXME: this implies there is a faster/better way to do this? (array of vptree?)
+      struct ScoredMatch { int score; uint32_t frame; };
+      std::unordered_map<int, ScoredMatch> closestMatch;
+
+      for (const DctMultiTree::Match& match : matches) {
+        const uint32_t dstFrame = _store->frameAt(match.value.index);
+        const size_t dstIndex = _store->entryAt(match.value.index);
+        const uint64_t dstHash = match.value.hash;
+
+        const uint32_t id = _mediaId[dstIndex];
+        if (!params.filterSelf || id != uint32_t(needle.id())) {
+          const auto it = closestMatch.find(id);
+          const int score = hamm64(srcHash, dstHash);
+          if (it == closestMatch.end() || score < it->second.score)
+            closestMatch[id] = {score, dstFrame};
+        }
+      }
+
+      for (auto& closest : qAsConst(closestMatch))
+        cand[closest.first].push_back(MatchRange(srcFrame, int(closest.second.frame), 1));
     }
 
-    int percentNear = numAscending * 100 / num;
+    for (auto it = cand.begin(); it != cand.end(); ++it) {
+      auto ranges = it.value();
+
+      // videos indexed from keyframes or every Nth frame have fewer frames
+      // and larger gaps between them, relax locality and match count to suit
+      const int dstIndex = indexOf(it.key());
+      const int frameStep =
+          std::max(srcSteps[n], dstIndex < 0 ? 1 : int(_store->frameStep(size_t(dstIndex))));
+      const int nearMargin = std::max(15, 2 * frameStep);  // TODO: params
+      const int minFramesMatched = std::min(params.minFramesMatched,
+                                            std::max(3, params.minFramesMatched / frameStep));
+
+      //std::sort(ranges.begin(), ranges.end()); already sorted by srcFrame
+
+      int num = int(ranges.size());  // number of frames that matched
+
+      // ranges are sorted by src frame, we would expect all matches
+      // to also be in ascending order, so score them based on how
+      // ascending they are
+      int numAscending = 0;
+      int lastFrame = 0;
+      for (const MatchRange& range : qAsConst(ranges)) {
+        // some number of frames before and after are still "nearby" because
+        // the indexer removed similar consecutive frames
+        int frame = range.dstIn;
+        if (abs(frame-lastFrame) < nearMargin) numAscending++;
+        lastFrame = frame;
+      }
 
-    float shortClipMatches=0.75;
+      int percentNear = numAscending * 100 / num;
 
-    if (num < params.minFramesMatched) {
-      VideoIndex dstIndex;
-      dstIndex.load(QString("%1/%2.vdx").arg(_dataPath).arg(it.key()));
-      if (num < dstIndex.frames.size()*shortClipMatches) {
+      float shortClipMatches=0.75;
+
+      if (num < minFramesMatched) {
+        const size_t numFrames = dstIndex < 0 ? 0 : _store->length(size_t(dstIndex));
+        if (num < numFrames*shortClipMatches) {
+          if (params.verbose)
+            qInfo() << "reject id" << it.key() << "too few matches" << num << "/" << numFrames;
+          continue;
+        }
+      }
+      if (percentNear < params.minFramesNear) {
         if (params.verbose)
-          qInfo() << "reject id" << it.key() << "too few matches" << num << "/" << dstIndex.frames.size();
+          qInfo() << "reject id" << it.key() << "bad match locality" << percentNear;
         continue;
       }
-    }
-    if (percentNear < params.minFramesNear) {
-      if (params.verbose)
-        qInfo() << "reject id" << it.key() << "bad match locality" << percentNear;
-      continue;
-    }
 
-    {
-      Index::Match im;
-      im.mediaId = it.key();
-      im.score = 100 - percentNear;
-      im.range.srcIn = ranges.front().srcIn;
-      im.range.dstIn = it.value().front().dstIn;
+      {
+        Index::Match im;
+        im.mediaId = it.key();
+        im.score = 100 - percentNear;
+        im.range.srcIn = ranges.front().srcIn;
+        im.range.dstIn = it.value().front().dstIn;
 
-      int srcLen = ranges.back().srcIn - ranges.front().srcIn;
-      int dstLen = it.value().back().dstIn - it.value().front().dstIn;
-      im.range.len = std::max(srcLen, dstLen);
+        int srcLen = ranges.back().srcIn - ranges.front().srcIn;
+        int dstLen = it.value().back().dstIn - it.value().front().dstIn;
+        im.range.len = std::max(srcLen, dstLen);
 
-      results.append(im);
+        results.append(im);
+      }
     }
   }
 
-  return results;
+  return batchResults;
 }
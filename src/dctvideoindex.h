@@ -21,11 +21,16 @@
 #pragma once
 #include "index.h"
 
-class HammingTree;
+class DctMultiTree;
+class VideoStore;
 
 /**
  * @class DctVideoIndex
  * @brief Detect similar videos with full-frame dct hashes
+ *
+ * The hashes of all videos (<id>.vdx) are packed into one cache file
+ * which is memory-mapped, and the search tree is cached for each value
+ * of SearchParams::skipFrames. Both are rebuilt if the database changed.
  */
 class DctVideoIndex : public Index {
   Q_DISABLE_COPY_MOVE(DctVideoIndex)
@@ -46,6 +51,8 @@ class DctVideoIndex : public Index {
   void remove(const QVector<int>& ids) override;
 
   QVector<Index::Match> find(const Media& m, const SearchParams& p) override;
+  QVector<QVector<Index::Match>> findBatch(const MediaGroup& needles,
+                                           const SearchParams& p) override;
   Index* slice(const QSet<uint32_t>& mediaIds) const override;
 
   // video index does not use sql, but we need media ids
@@ -54,13 +61,31 @@ class DctVideoIndex : public Index {
  private:
   QVector<Index::Match> findFrame(const Media& needle, const SearchParams& params);
   QVector<Index::Match> findVideo(const Media& needle, const SearchParams& params);
-  void insertHashes(int mediaIndex, HammingTree* tree, const SearchParams& params);
+  QVector<QVector<Index::Match>> findVideos(const MediaGroup& needles,
+                                            const SearchParams& params);
+  void insertHashes(int mediaIndex, DctMultiTree* tree, const SearchParams& params);
   void buildTree(const SearchParams& params);
 
-  HammingTree* _tree;
+  /// map or build the store, requires _mutex
+  void loadStore();
+
+  /// fail if store positions do not fit in tree values
+  void checkStoreSize() const;
+
+  /// @return index of mediaId in _mediaId and _store, or -1
+  int indexOf(uint32_t mediaId) const;
+
+  /// @return true if cache file is older than the database or missing
+  bool isCacheFileStale(const QString& path) const;
+
+  DctMultiTree* _tree;
+  VideoStore* _store;             // hashes for each _mediaId
   std::vector<uint32_t> _mediaId;
   QString _dataPath;
-  std::map<uint32_t, HammingTree*> _cachedIndex;
+  QString _cachePath;
+  QDateTime _dbModified;          // database modification time when loaded
+  bool _modified;                 // videos added/removed since load()
+  std::map<uint32_t, DctMultiTree*> _cachedIndex;
   QMutex _mutex;
   bool _isLoaded;
 };
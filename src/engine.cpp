@@ -26,6 +26,7 @@
 #include "dctfeaturesindex.h"
 #include "dcthashindex.h"
 #include "dctvideoindex.h"
+#include "previewcache.h"
 #include "scanner.h"
 #include "templatematcher.h"
 #include "qtutil.h"
@@ -41,10 +42,11 @@ Engine::Engine(const QString& path, const IndexParams& params) {
 
   scanner = new Scanner;
   scanner->setIndexParams(params);
+  scanner->setPreviewCache(&PreviewCache::forPath(db->cachePath()));
   connect(scanner, &Scanner::mediaProcessed, this, &Engine::add);
   connect(scanner, &Scanner::scanCompleted, this, &Engine::commit);
 
-  matcher = new TemplateMatcher;
+  matcher = new TemplateMatcher(db->cachePath());
 }
 
 Engine::~Engine() {
@@ -65,6 +65,12 @@ class FileId {
     if (stat(qUtf8Printable(path), &st) < 0) st.st_ino = 0;
     // qDebug() << Qt::hex << st.st_dev << st.st_ino << path;
   }
+  /// id from an earlier stat(), e.g. from a directory listing
+  FileId(uint64_t dev, uint64_t ino) {
+    memset(&st, 0, sizeof(st));
+    st.st_dev = dev;
+    st.st_ino = ino;
+  }
   bool isValid() const { return st.st_ino > 0; }
   bool operator==(const FileId& other) const {
     return st.st_ino == other.st.st_ino && st.st_dev == other.st.st_dev;
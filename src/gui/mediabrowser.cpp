@@ -26,10 +26,33 @@
 
 #include "../database.h"
 #include "../engine.h"
+#include "../previewcache.h"
 #include "../qtutil.h"
 #include "../scanner.h"
 #include "../videocontext.h"
 
+/// preview scaled to fit size, made and cached if it isn't there
+static QImage cachedPreview(PreviewCache& cache, const Media& m, int size) {
+  QImage img = cache.load(m.md5(), size);
+  if (!img.isNull()) return img;
+
+  if (m.type() == Media::TypeVideo) {
+    img = VideoContext::frameGrab(m.path(), -1, true);
+  } else {
+    ImageLoadOptions opt;
+    opt.readScaled = true;
+    opt.minSize = size;
+    opt.maxSize = opt.minSize * 1.5;
+    img = m.loadImage(QSize(), nullptr, opt);
+  }
+
+  if (!img.isNull()) {
+    img = PreviewCache::scaled(img, size);
+    cache.store(m.md5(), size, -1, img);
+  }
+  return img;
+}
+
 static QImage loadThumb(const Media& m, const MediaWidgetOptions& options) {
   const qreal dpr = qApp->devicePixelRatio();
   const int iconSize = dpr * options.iconSize;
@@ -42,7 +65,12 @@ static QImage loadThumb(const Media& m, const MediaWidgetOptions& options) {
 
   QImage img;
 
-  if (m.type() == Media::TypeVideo) {
+  // previews are made by the indexer or the first time we get here
+  PreviewCache* cache = nullptr;
+  if (options.db && !m.md5().isEmpty()) {
+    cache = &PreviewCache::forPath(options.db->cachePath());
+    img = cachedPreview(*cache, m, PreviewCache::IndexSize);
+  } else if (m.type() == Media::TypeVideo) {
     img = VideoContext::frameGrab(m.path(), -1, true);
   } else if (doCrop && (origW <= 0 || origH <= 0)) {
     // for crop, we don't know the aspect(yet), can't use fast image loader
@@ -51,6 +79,20 @@ static QImage loadThumb(const Media& m, const MediaWidgetOptions& options) {
     img = m.loadImage();
   }
 
+  // preview could be too small for the icon (e.g. panorama), use a larger
+  // one, or the original if that would be as large
+  const int origMax = std::max(origW, origH);
+  if (!img.isNull() && m.type() != Media::TypeVideo &&
+      std::max(img.width(), img.height()) < origMax) {
+    const bool byWidth = doCrop && float(img.width()) / img.height() < iconAspect;
+    const int have = byWidth ? img.width() : img.height();
+    const int need = byWidth ? iconSize * iconAspect : iconSize;
+    if (have < need) {
+      const int size = PreviewCache::cacheSize(std::max(img.width(), img.height()) * need / have);
+      img = cache && size < origMax ? cachedPreview(*cache, m, size) : QImage();
+    }
+  }
+
   if (!doCrop) {
     QSize size(0, iconSize);
     img = img.isNull() ? m.loadImage(size) : Media(img).loadImage(size);
@@ -31,6 +31,7 @@
 #include "../database.h"
 #include "../env.h"
 #include "../lib/jpegquality.h"
+#include "../previewcache.h"
 #include "../profile.h"
 #include "../qtutil.h"
 #include "../templatematcher.h"
@@ -42,7 +43,8 @@
 
 #define LW_LOW_FREE_MEMORY_KB (1024 * 1024) // start freeing memory here
 #define LW_MIN_FREE_MEMORY_KB (256 * 1024)  // allocations fail after this
-#define LW_MAX_CACHED_ROWS (5)
+#define LW_MAX_CACHED_ROWS (16) // also limited by the prefetch budget
+#define LW_PREFETCH_BUDGET_MB (2048) // default memory for prefetched images
 
 #define LW_PAN_STEP (10.0)
 #define LW_ZOOM_STEP (0.9)
@@ -69,10 +71,32 @@ public:
   MediaPage* page = nullptr; // page it was originally on (could be deleted after job starts)
   int index = -1;            // index in the group (could change due to rotation/deletion)
   bool oom = false;          // out of memory
+  QSize fitSize;             // if valid, decode scaled down to about this size
 };
 
 static auto* __imgAlloc = new PooledImageAllocator(LW_LOW_FREE_MEMORY_KB);
 
+/// true if image was decoded smaller than the original (prefetched)
+static bool isScaled(const Media& m) {
+  const QImage& img = m.image();
+  return !img.isNull() && (m.type() == Media::TypeImage || m.type() == Media::TypeVideo) &&
+         !MediaPage::isAnalysis(m) &&
+         qMax(img.width(), img.height()) < qMax(m.width(), m.height());
+}
+
+/// estimate of memory needed to load page at fitSize
+static size_t prefetchCostKb(const MediaPage* page, const QSize& fitSize) {
+  size_t sum = 0;
+  for (const Media& m : page->group) {
+    if (MediaPage::isLoaded(m)) continue;
+    QSize size = m.resolution() > 0 ? QSize(m.width(), m.height()) : fitSize;
+    if (size.width() > fitSize.width() || size.height() > fitSize.height())
+      size = size.scaled(fitSize, Qt::KeepAspectRatio);
+    sum += size_t(size.width()) * size.height() * 4;
+  }
+  return sum / 1024;
+}
+
 /**
  * @brief False-color image to show differences between two images.
  * @details Black>Blue == small differences, probably unnoticable
@@ -189,9 +213,11 @@ static QImage differenceImage(const Media& ml, const Media& mr,
  * @brief Do background loading things
  * @param work      source/destination of the image/things
  * @param fastSeek if true, then seek video in a faster but less accurate way
+ * @param previews cache for scaled images and video frames, or nullptr
  * @return true if successful
  */
-static void loadImage(QPromise<void>& promise, ImageWork* work, bool fastSeek) {
+static void loadImage(QPromise<void>& promise, ImageWork* work, bool fastSeek,
+                      PreviewCache* previews) {
   Media& m = work->media;
   Q_ASSERT(m.image().isNull());
 
@@ -214,6 +240,7 @@ static void loadImage(QPromise<void>& promise, ImageWork* work, bool fastSeek) {
   }
 
   QImage img;
+  QSize origSize; // if img was scaled down
 
   if (MediaPage::isDifferenceAnalysis(m)) {
     if (work->args.count() == 2) // could be < 2 if deleting items
@@ -232,7 +259,46 @@ static void loadImage(QPromise<void>& promise, ImageWork* work, bool fastSeek) {
 
       ImageLoadOptions opt;
       opt.alloc = __imgAlloc;
-      img = m.loadImage(QSize(), &future, opt);
+      int cacheSize = 0;
+      if (work->fitSize.isValid()) {
+        // idct scaling is much faster, replaced with full size when displayed
+        opt.readScaled = true;
+        opt.minSize = qMax(work->fitSize.width(), work->fitSize.height());
+        opt.maxSize = opt.minSize * 2;
+
+        // cached scaled image is faster yet, if we know the original size
+        if (previews && !m.md5().isEmpty() && m.width() > 0 && m.height() > 0)
+          cacheSize = PreviewCache::cacheSize(opt.minSize);
+      }
+
+      if (cacheSize > 0) {
+        const QByteArray data = previews->loadData(m.md5(), cacheSize);
+        if (!data.isEmpty()) {
+          ImageLoadOptions cacheOpt;
+          cacheOpt.alloc = __imgAlloc;
+          img = Media::loadImage(data, QSize(), m.path(), &future, cacheOpt);
+          if (!img.isNull() && img.text("oom") != "true") {
+            QSize size(m.width(), m.height());
+            if ((size.width() > size.height()) != (img.width() > img.height())) size.transpose();
+            if (size.width() > img.width()) origSize = size;
+          }
+        }
+      }
+
+      if (img.isNull()) {
+        img = m.loadImage(QSize(), &future, opt);
+
+        if (work->fitSize.isValid() && !img.isNull() && img.text("oom") != "true") {
+          // keep the original dimensions, used to tell it was scaled
+          QSize size(img.text(Media::ImgKey_FileWidth).toInt(),
+                     img.text(Media::ImgKey_FileHeight).toInt());
+          if ((size.width() > size.height()) != (img.width() > img.height())) size.transpose();
+          if (size.width() > img.width()) origSize = size;
+
+          if (cacheSize > 0 && !future.isCanceled())
+            previews->store(m.md5(), cacheSize, -1, PreviewCache::scaled(img, cacheSize));
+        }
+      }
 
       if (img.text("oom") == "true") {
         work->oom = true;
@@ -241,8 +307,23 @@ static void loadImage(QPromise<void>& promise, ImageWork* work, bool fastSeek) {
     }
 
   } else if (m.type() == Media::TypeVideo) {
-    VideoContext::DecodeOptions opt;
-    img = VideoContext::frameGrab(m.path(), m.matchRange().dstIn, fastSeek, opt, &future);
+    // video frames need a seek and decode from the keyframe; prefetched frames
+    // are cached at preview size, replaced with full size when displayed
+    const int frame = m.matchRange().dstIn;
+    int cacheSize = 0;
+    if (!fastSeek && previews && !m.md5().isEmpty() && work->fitSize.isValid())
+      cacheSize = PreviewCache::cacheSize(qMax(work->fitSize.width(), work->fitSize.height()));
+
+    if (cacheSize > 0) img = previews->load(m.md5(), cacheSize, frame);
+
+    if (img.isNull()) {
+      VideoContext::DecodeOptions opt;
+      img = VideoContext::frameGrab(m.path(), frame, fastSeek, opt, &future);
+      if (cacheSize > 0 && !img.isNull() && !future.isCanceled()) {
+        img = PreviewCache::scaled(img, cacheSize);
+        previews->store(m.md5(), cacheSize, frame, img);
+      }
+    }
 
     if (future.isCanceled()) return;
 
@@ -250,6 +331,12 @@ static void loadImage(QPromise<void>& promise, ImageWork* work, bool fastSeek) {
     video.open(m.path());
     video.metadata().toMediaAttributes(m);
 
+    if (cacheSize > 0 && !img.isNull()) {
+      QSize size = video.metadata().frameSize;
+      if ((size.width() > size.height()) != (img.width() > img.height())) size.transpose();
+      if (size.width() > img.width()) origSize = size;
+    }
+
     static auto dateFunc = Media::propertyFunc("ffmeta#creation_time");
     m.setAttribute("date", dateFunc(m).toString());
   }
@@ -260,9 +347,10 @@ static void loadImage(QPromise<void>& promise, ImageWork* work, bool fastSeek) {
     if (img.hasAlphaChannel()) fmt = QImage::Format_ARGB32;
     img = img.convertToFormat(fmt);
 
+    const QSize size = origSize.isValid() ? origSize : img.size();
     m.setImage(img);
-    m.setWidth(img.width());
-    m.setHeight(img.height());
+    m.setWidth(size.width());
+    m.setHeight(size.height());
     m.readMetadata();
   }
 
@@ -300,6 +388,9 @@ MediaGroupListWidget::MediaGroupListWidget(const MediaGroupList& list,
 
   settings.beginGroup(staticMetaObject.className() + qq(".view"));
   _autoDifference = settings.value(ll("enableDifferenceImage"), false).toBool();
+  _prefetchCount = qMax(0, settings.value(ll("prefetchPages"), _prefetchCount).toInt());
+  _prefetchBudgetKb =
+      qMax(0, settings.value(ll("prefetchMemoryMB"), LW_PREFETCH_BUDGET_MB).toInt()) * 1024;
 
   _itemDelegate = new MediaItemDelegate(this);
   _itemDelegate->setZoom(_zoom);
@@ -351,13 +442,7 @@ MediaGroupListWidget::MediaGroupListWidget(const MediaGroupList& list,
   // coalesce media loading, scrolling produces a lot of unused requests otherwise
   connect(&_loadTimer, &QTimer::timeout,[this]{
     _loadTimer.stop();
-    MediaPage* page = currentPage();
-    qDebug()  << "loadtimer: page" << page->row  << "preload" << (_preloadPage ? _preloadPage->row : -1);
-
-    if (!page->isLoaded())
-      loadMedia(page);
-    else if (_preloadPage)
-      loadMedia(_preloadPage);
+    prefetch();
   });
 
   // take care of oom on the image loaders
@@ -618,6 +703,8 @@ MediaGroupListWidget::~MediaGroupListWidget() {
   settings.beginGroup(staticMetaObject.className() + qq(".view"));
   settings.setValue(ll("enableDifferenceImage"), _autoDifference);
   settings.setValue(ll("scaleMode"), _itemDelegate->scaleMode());
+  settings.setValue(ll("prefetchPages"), _prefetchCount);
+  settings.setValue(ll("prefetchMemoryMB"), int(_prefetchBudgetKb / 1024));
 
   waitLoaders();
   for (MediaPage* page : _list) delete page;
@@ -1362,7 +1449,8 @@ void MediaGroupListWidget::templateMatchAction() {
   MediaGroup haystack;
   haystack.append(group[targetIndex]);
 
-  TemplateMatcher().match(group[tmplIndex], haystack, params);
+  TemplateMatcher(_options.db ? _options.db->cachePath() : QString())
+      .match(group[tmplIndex], haystack, params);
   if (haystack.count() > 0) group[targetIndex] = haystack[0];
 
   // reload since we may have deleted items
@@ -2167,7 +2255,7 @@ void MediaGroupListWidget::loaderOutOfMemory() {
 
   qDebug() << "desperation" << rows;
   if (__imgAlloc->compact()) {
-    _preloadPage = nullptr;
+    _prefetchPages.clear();
     _loadTimer.start(100);
     return;
   }
@@ -2175,16 +2263,18 @@ void MediaGroupListWidget::loaderOutOfMemory() {
   qWarning() << "giving up" << rows;
 }
 
-void MediaGroupListWidget::loadOne(MediaPage* page, int index) {
+void MediaGroupListWidget::loadOne(MediaPage* page, int index, const QSize& fitSize) {
 
   const Media& m = page->group.at(index);
 
-  Q_ASSERT(!MediaPage::isLoaded(m));
+  Q_ASSERT(!MediaPage::isLoaded(m) || isScaled(m));
 
   ImageWork* w = new ImageWork(this);
   w->page = page;
   w->media = m;
   w->index = index;
+  w->fitSize = fitSize;
+  MediaPage::unload(w->media); // replacing scaled image
 
   if (MediaPage::isAnalysis(m) && page->count() > 2) {
     const Media& left = page->group[0];
@@ -2233,14 +2323,20 @@ void MediaGroupListWidget::loadOne(MediaPage* page, int index) {
       return;
     }
 
+    const bool ok = MediaPage::isLoaded(loaded);
+
     if (purged) {
       // drop image and copy metadata only
       MediaPage::unload(loaded);
     }
 
     bool updated = false;
+    bool refined = false;
     for (Media& m : w->page->group)
       if (m.path() == loaded.path()) {
+        // do not replace full size with scaled (late prefetch), or any image with nothing
+        if (MediaPage::isLoaded(m) && (!ok || (isScaled(loaded) && !isScaled(m)))) continue;
+        refined |= isScaled(m);
         m = loaded;
         updated = true;
       }
@@ -2248,44 +2344,50 @@ void MediaGroupListWidget::loadOne(MediaPage* page, int index) {
     // release memory now (don't wait for deleteLater())
     MediaPage::unload(loaded);
 
-    if (updated && !preload) {
-      _updateTimer.start(1000 / LW_UPDATE_HZ);
-
-      if (w->page->isLoaded() && _preloadPage)
-        _loadTimer.start(LW_PRELOAD_DELAY);
-    }
+    if (updated && !preload) _updateTimer.start(1000 / LW_UPDATE_HZ);
 
-    if (updated && w->page == _preloadPage) {
-      // clear preloadPage or we'll keep trying
-      if (_preloadPage->isLoaded())
-        _preloadPage = nullptr;
-    }
+    // next page, or full size images once we've prefetched
+    if (updated && ok && w->page->isLoaded())
+      _loadTimer.start(preload ? 0 : LW_PRELOAD_DELAY);
 
-    // run difference image once dependents are loaded
-    const MediaGroup& group = w->page->group;
-    if (!purged && group.count() > 2
-        && MediaPage::isDifferenceAnalysis(group[2])
-        && MediaPage::isLoaded(group[0])
-        && MediaPage::isLoaded(group[1])
-        && !MediaPage::isLoaded(group[2])) {
-      loadOne(w->page, 2);
+    // run difference image once dependents are loaded, again if they were scaled
+    MediaGroup& group = w->page->group;
+    if (!purged && group.count() > 2 && MediaPage::isDifferenceAnalysis(group[2])) {
+      if (refined && w->index < 2) MediaPage::unload(group[2]);
+      if (MediaPage::isLoaded(group[0]) && MediaPage::isLoaded(group[1]) &&
+          !MediaPage::isLoaded(group[2]))
+        loadOne(w->page, 2);
     }
   });
 
   bool fastSeek = _options.flags & MediaWidgetOptions::FlagFastSeek;
 
-  w->setFuture(QtConcurrent::run(loadImage, w, fastSeek));
+  PreviewCache* previews = nullptr;
+  if (_options.db) previews = &PreviewCache::forPath(_options.db->cachePath());
+
+  w->setFuture(QtConcurrent::run(loadImage, w, fastSeek, previews));
   _loaders.append(w);
 }
 
-void MediaGroupListWidget::loadMedia(MediaPage* page) {
+void MediaGroupListWidget::loadMedia(MediaPage* page, const QSize& fitSize) {
   static int recursion = 0;
 
   Q_ASSERT(recursion == 0);
   recursion++;
 
-  while (_loadedPages.count() > LW_MAX_CACHED_ROWS) {
-    MediaPage* evicted = _loadedPages.takeFirst();
+  // evict least-recently-used pages we do not expect to see soon
+  QSet<const MediaPage*> keep{page, currentPage()};
+  for (auto* p : qAsConst(_prefetchPages)) keep.insert(p);
+
+  for (int i = 0; i < _loadedPages.count();) {
+    if (_loadedPages.count() <= LW_MAX_CACHED_ROWS && __imgAlloc->usedKb() <= _prefetchBudgetKb)
+      break;
+    MediaPage* evicted = _loadedPages.at(i);
+    if (keep.contains(evicted)) {
+      i++;
+      continue;
+    }
+    _loadedPages.removeAt(i);
     qDebug() << "unload page" << evicted->row;
     evicted->unloadData(false);
   }
@@ -2293,16 +2395,22 @@ void MediaGroupListWidget::loadMedia(MediaPage* page) {
   _loadedPages.removeAll(page);
   _loadedPages.append(page);
 
-  if (page->isLoaded()) {
+  const bool refine = !fitSize.isValid();
+  const auto needsLoad = [refine](const Media& m) {
+    return !MediaPage::isLoaded(m) || (refine && isScaled(m));
+  };
+
+  if (std::none_of(page->group.begin(), page->group.end(), needsLoad)) {
     qDebug() << "page" << page->row << "is already loaded";
     recursion--;
     return;
   }
 
-  qDebug() << "page" << page->row << (page == currentPage() ? "preload" : "");
+  qDebug() << "page" << page->row << (page != currentPage() ? "preload" : "")
+           << (refine ? "" : "scaled");
 
   for (int i = 0; i < page->group.count(); ++i) {
-    if (MediaPage::isLoaded(page->group.at(i))) continue;
+    if (!needsLoad(page->group.at(i))) continue;
 
     if (_loaders.end() != std::find_if(_loaders.begin(), _loaders.end(), [page, i](ImageWork* ww) {
           return ww->page == page && ww->index == i && !ww->isCanceled();
@@ -2311,11 +2419,36 @@ void MediaGroupListWidget::loadMedia(MediaPage* page) {
       continue;
     }
 
-    loadOne(page, i);
+    loadOne(page, i, fitSize);
   }
   recursion--;
 }
 
+void MediaGroupListWidget::prefetch() {
+  // current page at full size first; it could have been prefetched scaled,
+  // we are called again as its images come in
+  MediaPage* current = currentPage();
+  if (!current->isLoaded() ||
+      std::any_of(current->group.cbegin(), current->group.cend(), isScaled))
+    return loadMedia(current);
+
+  // scaled to fit the screen, full size is only needed for the current page
+  const QSize fitSize = screen()->size() * screen()->devicePixelRatio();
+
+  for (MediaPage* page : qAsConst(_prefetchPages)) {
+    if (page->isLoaded()) continue;
+
+    const size_t usedKb = __imgAlloc->usedKb();
+    const size_t costKb = prefetchCostKb(page, fitSize);
+    if (usedKb + costKb > _prefetchBudgetKb) {
+      qDebug() << "prefetch budget reached at page" << page->row << "used:" << usedKb / 1024
+               << "need:" << costKb / 1024;
+      break;
+    }
+    return loadMedia(page, fitSize);
+  }
+}
+
 void MediaGroupListWidget::loadRow(int row, bool preloadNextRow) {
   static uint64_t start = nanoTime();
 
@@ -2324,8 +2457,6 @@ void MediaGroupListWidget::loadRow(int row, bool preloadNextRow) {
   row = qBound(0, row, _list.count() - 1);
   const MediaPage* page = _list.at(row);
 
-  cancelOtherLoaders({page});
-
   QModelIndex selected; // save the selection
   {
     QModelIndexList sel = selectedIndexes();
@@ -2363,17 +2494,28 @@ void MediaGroupListWidget::loadRow(int row, bool preloadNextRow) {
   // store row number, should not be used for control flow (use Page*)
   _list[row]->row = row;
 
-  // preload the next row we expect to see after the displayed page finishes loading
-  _preloadPage = nullptr;
+  // prefetch rows we expect to see after the displayed page finishes loading,
+  // in the direction of travel first, then the ones behind
+  _prefetchPages.clear();
+  if (preloadNextRow) {
+    if (rowSkip == 0) rowSkip = 1; // we removed a row, next one is ok
+    const int dir = rowSkip < 0 ? -1 : 1;
 
-  int nextRow = row + rowSkip;
-  if (nextRow == row) nextRow++; // we removed a row, next one is ok
+    QVector<int> rows;
+    for (int i = 1; i <= _prefetchCount; ++i) rows += row + i * rowSkip;
+    for (int i = 1; i <= (_prefetchCount + 1) / 2; ++i) rows += row - i * dir;
 
-  if (preloadNextRow && nextRow >= 0 && nextRow < _list.count()) {
-    _preloadPage = _list[nextRow];
-    _preloadPage->row = nextRow;
+    for (int nextRow : qAsConst(rows))
+      if (nextRow >= 0 && nextRow < _list.count() && !_prefetchPages.contains(_list[nextRow])) {
+        _prefetchPages.append(_list[nextRow]);
+        _prefetchPages.last()->row = nextRow;
+      }
   }
 
+  QSet<const MediaPage*> keep{page};
+  for (auto* p : qAsConst(_prefetchPages)) keep.insert(p);
+  cancelOtherLoaders(keep);
+
   // if we get a ton of requests (scrolling), delay the start
   _loadTimer.start(1000/LW_UPDATE_HZ);
 
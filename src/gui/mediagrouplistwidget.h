@@ -284,16 +284,23 @@ class MediaGroupListWidget : public QListWidget {
   void loaderOutOfMemory();
 
   /// Load one image/videothumb/analysis in the background
+  /// @param fitSize if valid, decode images scaled down to about this size
   /// @section loading
-  void loadOne(MediaPage* page, int index);
+  void loadOne(MediaPage* page, int index, const QSize& fitSize = QSize());
 
   /// Start background jobs for the given page, not necessarily the displayed page
-  void loadMedia(MediaPage* page);
+  /// @param fitSize if valid, decode images scaled down to about this size,
+  ///        otherwise load full size, replacing scaled images
+  void loadMedia(MediaPage* page, const QSize& fitSize = QSize());
+
+  /// Start loading the next thing: the current page at full size, then
+  /// prefetch pages that fit in the memory budget
+  void prefetch();
 
   /**
    * @brief Clear the list view and add new set of items, slow parts are processed in the background
    * @param row index into _list we are going to display
-   * @param preloadNextRow if true then guess the next row index and
+   * @param preloadNextRow if true then guess the next rows and
    *                       fetch once this row completes
    */
   void loadRow(int row, bool preloadNextRow=true);
@@ -319,8 +326,10 @@ class MediaGroupListWidget : public QListWidget {
 
   QTimer _updateTimer; // delayed calls to updateItems()
 
-  MediaPage* _preloadPage=nullptr; // optional additional page for load timer
-  QTimer _loadTimer; // delayed call to loadMedia()
+  QVector<MediaPage*> _prefetchPages; // pages to load after the current one, in priority order
+  int _prefetchCount = 3;              // number of pages to prefetch ahead (half as many behind)
+  size_t _prefetchBudgetKb = 0;        // stop prefetching when images use this much
+  QTimer _loadTimer; // delayed call to prefetch()
 
   QSet<QString> _lockedFolders; // folders we disallow modifications on
   const char* const _FOLDER_LOCKS_FILE="locks.txt";
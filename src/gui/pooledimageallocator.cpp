@@ -47,6 +47,8 @@ uchar* PooledImageAllocator::alloc(const QSize& size, QImage::Format fmt) {
         if (_free.contains(ptr)) {
           //qInfo() << "reuse" << size << fmt << dataSz  << _free.count()-1;
           _free.remove(ptr);
+          _freeBytes -= dataSz;
+          _usedBytes += dataSz;
           dataPtr = ptr;
           break;
         }
@@ -79,6 +81,8 @@ uchar* PooledImageAllocator::alloc(const QSize& size, QImage::Format fmt) {
       return nullptr;
     }
     _pool[dataSz].append(dataPtr);
+    _sizes.insert(dataPtr, dataSz);
+    _usedBytes += dataSz;
 
     qDebug() << size << fmt;
   }
@@ -92,7 +96,10 @@ void PooledImageAllocator::free(void* ptr) {
   Q_ASSERT(ptr);
   // TODO: maybe also zero the buffer
   QMutexLocker locker(&_mutex);
+  const size_t size = _sizes.value((uchar*) ptr);
   _free.insert((uchar*) ptr);
+  _usedBytes -= size;
+  _freeBytes += size;
 }
 
 size_t PooledImageAllocator::compactInternal() {
@@ -107,11 +114,13 @@ size_t PooledImageAllocator::compactInternal() {
   std::sort(ptrList.begin(), ptrList.end(), [](uchar* a, uchar* b) { return b < a; });
   for (uchar* ptr : qAsConst(ptrList)) {
     bytesFreed += malloc_usable_size(ptr);
+    _sizes.remove(ptr);
     ::free(ptr);
   }
 
   qDebug() << "freed" << _free.count() << "blocks," << bytesFreed / 1024 << "kb";
   _free.clear();
+  _freeBytes = 0;
 
   malloc_trim(64 * 1024);
 
@@ -119,10 +128,11 @@ size_t PooledImageAllocator::compactInternal() {
 }
 
 size_t PooledImageAllocator::freeKb() const {
-  size_t sum = 0;
   QMutexLocker locker(&_mutex);
-  for (size_t size : _pool.keys())
-    for (uchar* ptr : _pool.value(size))
-      if (_free.contains(ptr)) sum += size;
-  return sum / 1024.0;
+  return _freeBytes / 1024;
+}
+
+size_t PooledImageAllocator::usedKb() const {
+  QMutexLocker locker(&_mutex);
+  return _usedBytes / 1024;
 }
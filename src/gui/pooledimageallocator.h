@@ -35,6 +35,9 @@ class PooledImageAllocator : public ImageAllocator
 
   QHash<size_t, QList<uchar*>> _pool;
   QSet<uchar*> _free;
+  QHash<uchar*, size_t> _sizes;  // size of each pooled buffer
+  size_t _usedBytes = 0;         // sum of allocated buffers, not in _free
+  size_t _freeBytes = 0;         // sum of buffers in _free
   mutable QMutex _mutex;
 
   /// return pointer suitable for QImage((uchar*),...)
@@ -62,6 +65,9 @@ class PooledImageAllocator : public ImageAllocator
 
   size_t freeKb() const;
 
+  // memory held by images, i.e. allocated and not freed; O(1)
+  size_t usedKb() const;
+
   // attempt to compact heap on the next failed alloc
   // resets on first successful alloc or compaction
   void setCompactFlag() { _compactOnFail = true; }
@@ -20,5 +20,69 @@
    <https://www.gnu.org/licenses/>.  */
 #pragma once
 
+#if defined(__AVX2__) || defined(__AVX512F__)
+#  include <immintrin.h>
+#endif
+
 /// 64-bit hamming distance using special x86 instruction
 inline int hamm64(uint64_t a, uint64_t b) { return __builtin_popcountll(a ^ b); } // TODO: use std::popcount() - c++20
+
+/**
+ * Brute-force scan for hashes within threshold
+ * @param fn called with (index, distance) for each hamm64(target, hashes[index]) < threshold,
+ *        in order of index
+ * @details blocks of 8 hashes are compared at once when compiled with AVX-512 VPOPCNTQ,
+ *          or 4 with AVX2 (nibble lookup popcount), otherwise popcnt on each hash
+ */
+template <typename Fn>
+inline void hammScan64(uint64_t target, const uint64_t* hashes, size_t count, int threshold,
+                       Fn fn) {
+  size_t i = 0;
+  if (threshold <= 0) return;
+
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+  const __m512i t = _mm512_set1_epi64(int64_t(target));
+  const __m512i thresh = _mm512_set1_epi64(threshold);
+  alignas(64) uint64_t dist[8];
+  for (; i + 8 <= count; i += 8) {
+    const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(hashes + i), t);
+    const __m512i d = _mm512_popcnt_epi64(x);
+    __mmask8 mask = _mm512_cmplt_epi64_mask(d, thresh);
+    if (Q_LIKELY(mask == 0)) continue;
+    _mm512_store_si512(dist, d);
+    while (mask) {
+      const int j = __builtin_ctz(mask);
+      fn(i + size_t(j), int(dist[j]));
+      mask &= mask - 1;
+    }
+  }
+#elif defined(__AVX2__)
+  const __m256i t = _mm256_set1_epi64x(int64_t(target));
+  const __m256i thresh = _mm256_set1_epi64x(threshold);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,  //
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  alignas(32) uint64_t dist[4];
+  for (; i + 4 <= count; i += 4) {
+    const __m256i x = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes + i)), t);
+    const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, nibble));
+    const __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+    const __m256i d = _mm256_sad_epu8(_mm256_add_epi8(lo, hi), zero);
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(thresh, d)));
+    if (Q_LIKELY(mask == 0)) continue;
+    _mm256_store_si256(reinterpret_cast<__m256i*>(dist), d);
+    while (mask) {
+      const int j = __builtin_ctz(uint(mask));
+      fn(i + size_t(j), int(dist[j]));
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i < count; ++i) {
+    const int d = hamm64(target, hashes[i]);
+    if (d < threshold) fn(i, d);
+  }
+}
@@ -82,6 +82,21 @@ SearchParams::SearchParams() {
          GET(cvThresh), NO_NAMES, GET_CONST(range)});
   }
 
+  {
+    static const QVector<int> range{1, 16};
+    add({"otab", "ORB descriptor hash tables to search", Value::Int, counter++, SET_INT(cvTables),
+         GET(cvTables), NO_NAMES, GET_CONST(range)});
+  }
+
+  {
+    static const QVector<int> range{0, 2};
+    add({"oprobe", "ORB descriptor hash probe level (bits away from needle)", Value::Int,
+         counter++, SET_INT(cvProbeLevel), GET(cvProbeLevel), NO_NAMES, GET_CONST(range)});
+  }
+
+  add({"orecall", "Measure ORB descriptor hash recall with brute-force search", Value::Bool,
+       counter++, SET_BOOL(cvRecall), GET(cvRecall), NO_NAMES, NO_RANGE});
+
   add({"mt", "Maximum threshold to try, until minMatches are found", Value::Int, counter++,
        SET_INT(maxThresh), GET(maxThresh), NO_NAMES, GET_CONST(positive)});
 
@@ -74,6 +74,8 @@ class SearchParams : public Params {
   int algo = AlgoDCT,        // AlgoXXX
       dctThresh = 5,         // threshold for DCT hash hamming distance
       cvThresh = 25,         // threshold for ORB descriptors distance
+      cvTables = 1,          // number of ORB descriptor hash tables to search (more==recall)
+      cvProbeLevel = 1,      // ORB hash buckets to search, n bits away from query (more==recall)
       minMatches = 1,        // minimum number of matches required
       maxMatches = 5,        // maximum number of matches after sort by score
       needleFeatures = 100,  // template match: number of needle/template features
@@ -86,6 +88,7 @@ class SearchParams : public Params {
   bool templateMatch = false,  // remove results that don't pass the template matcher
       negativeMatch = false,   // remove results in the negative matches (blacklist)
       autoCrop = false,        // de-letterbox prior to search
+      cvRecall = false,        // measure recall of ORB hash tables with brute-force search
       verbose = false;         // show more information about what the query is doing
 
   QString path;         // subdirectory to search or accept/reject results from
@@ -230,6 +233,20 @@ class Index {
    */
   virtual QVector<Index::Match> find(const Media& m, const SearchParams& p) = 0;
 
+  /**
+   * Find many needles at once
+   * @return find() result for each needle, in the same order
+   * @note subclasses may override to share work between needles, e.g. scan
+   *       each block of the index once for all needles
+   */
+  virtual QVector<QVector<Index::Match>> findBatch(const MediaGroup& needles,
+                                                   const SearchParams& p) {
+    QVector<QVector<Index::Match>> results;
+    results.reserve(needles.count());
+    for (const Media& m : needles) results.append(find(m, p));
+    return results;
+  }
+
   /**
    * Get data such as descriptors that are only stored in the index
    * @param m if m.id() exists in the index then it is populated.
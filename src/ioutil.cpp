@@ -256,3 +256,40 @@ void writeFileAtomically(const QString& path, const std::function<void(QFile&)>&
     qFatal("file system error writing %s: %s", qUtf8Printable(path), qUtf8Printable(error));
   }
 }
+
+qint64 removeLeastRecentFiles(const QString& dirPath, qint64 maxBytes) {
+  struct Entry {
+    qint64 modified;
+    qint64 size;
+    QString path;
+  };
+
+  QVector<Entry> entries;
+  qint64 total = 0;
+
+  QDirIterator it(dirPath, QDir::Files, QDirIterator::Subdirectories);
+  while (it.hasNext()) {
+    it.next();
+    const QFileInfo info = it.fileInfo();
+    entries.append({info.lastModified().toMSecsSinceEpoch(), info.size(), info.filePath()});
+    total += info.size();
+  }
+
+  if (total <= maxBytes) return total;
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry& a, const Entry& b) { return a.modified < b.modified; });
+
+  // go under the limit so we don't remove files on every call
+  const qint64 target = maxBytes / 10 * 9;
+  int removed = 0;
+  for (const Entry& e : qAsConst(entries)) {
+    if (total <= target) break;
+    if (!QFile::remove(e.path)) continue;
+    total -= e.size;
+    removed++;
+  }
+  qDebug("removed %d files, %lldMB in %s", removed, total / 1024 / 1024, qUtf8Printable(dirPath));
+
+  return total;
+}
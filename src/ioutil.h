@@ -56,6 +56,14 @@ QString sparseMd5(QIODevice& file);
 /// all-or-nothing file writing, function must throw QString for errors
 void writeFileAtomically(const QString& path, const std::function<void(QFile&)>& fn);
 
+/**
+ * Remove least recently modified files in a directory tree, if it is
+ * larger than maxBytes, until it is 90% of maxBytes
+ * @return bytes remaining
+ * @note walks the whole tree, call it from a background thread
+ */
+qint64 removeLeastRecentFiles(const QString& dirPath, qint64 maxBytes);
+
 /// read binary blob
 void loadBinaryData(const QString& path, void** data, uint64_t* len, bool compress);
 
@@ -32,6 +32,8 @@
 
 #include "opencv2/features2d/features2d.hpp"
 
+#include <numeric>  // iota
+
 class PropertyCompare {
   QVector<PropertyFunc> _functions;
   QVector<bool> _reverse;
@@ -258,29 +260,92 @@ int Media::indexInGroupByPath(MediaGroup& group, const QString& path) {
   return -1;
 }
 
-void Media::mergeGroupList(MediaGroupList& list) {
-  // merge 1-connected matches
-  // e.g. if a matches b and b matches c, then a matches c;
-  // TODO: probably want to find something better than n*n
-  for (int i = 0; i < list.count(); i++) {
-    MediaGroup& a = list[i];
-    for (int j = 0; j < list.count(); j++)
-      if (i != j) {
-        MediaGroup& b = list[j];
-        if (b.count() > 0 && a.contains(b[0])) {
-          // merge b into a, the match scores could be bogus now
-          for (int k = 1; k < b.count(); k++)
-            if (!a.contains(b[k])) a.append(b[k]);
-          b.clear();
-          std::sort(a.begin(), a.end());
-        }
+int Media::groupKey(const Media& m, QHash<QString, int>& pathKeys) {
+  if (m.id() > 0) return m.id();
+  auto it = pathKeys.find(m.path());
+  if (it == pathKeys.end()) it = pathKeys.insert(m.path(), -1 - int(pathKeys.count()));
+  return it.value();
+}
+
+void Media::mergeGroupList(MediaGroupList& list, int minConnections) {
+  // merge n-connected matches, where groups sharing at least n media are
+  // connected; e.g. if a matches b and b matches c, then a matches c;
+  // groups are merged with union-find over the media they contain
+  minConnections = qMax(1, minConnections);
+
+  // media ids are unique, or use the path if media is not in the database
+  QHash<QString, int> pathKeys;
+  const auto keyOf = [&pathKeys](const Media& m) { return groupKey(m, pathKeys); };
+
+  QVector<int> parent(list.count());
+  std::iota(parent.begin(), parent.end(), 0);
+
+  const auto find = [&parent](int i) {
+    while (parent[i] != i) {
+      parent[i] = parent[parent[i]];  // path halving
+      i = parent[i];
+    }
+    return i;
+  };
+
+  // lowest index is the root, so the first group of a set is kept
+  const auto join = [&parent, &find](int a, int b) {
+    a = find(a);
+    b = find(b);
+    if (a < b)
+      parent[b] = a;
+    else if (b < a)
+      parent[a] = b;
+  };
+
+  // groups containing each media, in ascending order
+  QHash<int, QVector<int>> groupsOf;
+  for (int i = 0; i < list.count(); ++i)
+    for (const Media& m : qAsConst(list[i])) {
+      QVector<int>& groups = groupsOf[keyOf(m)];
+      if (groups.isEmpty() || groups.last() != i) groups.append(i);
+    }
+
+  if (minConnections == 1) {
+    for (const QVector<int>& groups : qAsConst(groupsOf))
+      for (int i = 1; i < groups.count(); ++i) join(groups[0], groups[i]);
+  } else {
+    // count media shared by each pair of groups
+    QHash<QPair<int, int>, int> shared;
+    for (const QVector<int>& groups : qAsConst(groupsOf))
+      for (int i = 0; i < groups.count(); ++i)
+        for (int j = i + 1; j < groups.count(); ++j)
+          if (++shared[qMakePair(groups[i], groups[j])] == minConnections)
+            join(groups[i], groups[j]);
+  }
+
+  // merge into the root group, in order, the match scores could be bogus now
+  QVector<QSet<int>> members(list.count());
+  QVector<bool> merged(list.count(), false);
+  for (int i = 0; i < list.count(); ++i) {
+    const int root = find(i);
+    MediaGroup& dst = list[root];
+    if (root == i) {
+      for (const Media& m : qAsConst(dst)) members[root].insert(keyOf(m));
+      continue;
+    }
+    for (const Media& m : qAsConst(list[i]))
+      if (!members[root].contains(keyOf(m))) {
+        members[root].insert(keyOf(m));
+        dst.append(m);
       }
+    list[i].clear();
+    merged[root] = true;
   }
 
   // remove empty sets resulting from merge
   MediaGroupList final;
-  for (MediaGroup& g : list)
-    if (!g.isEmpty()) final.append(g);
+  for (int i = 0; i < list.count(); ++i) {
+    MediaGroup& g = list[i];
+    if (g.isEmpty()) continue;
+    if (merged[i]) std::sort(g.begin(), g.end());
+    final.append(g);
+  }
   list = final;
 }
 
@@ -849,86 +914,83 @@ void Media::makeKeyPointHashes(const cv::Mat& cvImg, const KeyPointList& keyPoin
   }
 
   // rectangles to hashes
-  const auto& kpRects = rects;
-  for (const cv::Rect& r : kpRects) {
-    // extract sub-image and store hash
-    cv::Mat sub = cvImg.colRange(r.x, r.x + r.width).rowRange(r.y, r.y + r.height);
-
-    uint64_t hash = dctHash64(sub, true);
-
-    /* we could drop near hashes, but typically not many
-    for (uint64_t h : hashes)
-        if (hamm64(h, hash) < 5)
-        {
-            printf("skip near hash\n");
-            continue;
-        }
-    */
+  std::vector<cv::Mat> subs;
+  subs.reserve(rects.size());
+  for (const cv::Rect& r : rects)
+    subs.push_back(cvImg.colRange(r.x, r.x + r.width).rowRange(r.y, r.y + r.height));
+
+  /* we could drop near hashes, but typically not many
+  for (uint64_t h : hashes)
+      if (hamm64(h, hash) < 5)
+      {
+          printf("skip near hash\n");
+          continue;
+      }
+  */
 
-    outHashes.push_back(hash);
-  }
+  size_t offset = outHashes.size();
+  outHashes.resize(offset + subs.size());
+  dctHash64(subs.data(), int(subs.size()), outHashes.data() + offset, true);
 }
 
-void Media::makeVideoIndex(VideoContext& video, int threshold, VideoIndex& outIndex,
+void Media::makeVideoIndex(VideoContext& video, int threshold, int frameStep, int maxHashers,
+                           VideoIndex& outIndex,
                            const std::function<void(int)>& progressCb) const {
   auto& index = outIndex;
   index.hashes.clear();
   index.frames.clear();
-
-  int numFrames = 0;
-  int curFrames = 0;
-
-  int corruptFrames = 0;
-  int nearFrames = 0;
-  int filteredFrames = 0;
-
-  qint64 then = QDateTime::currentMSecsSinceEpoch();
-
+  index.frameStep = 1;
+
+  // sparse sampling: in iframes mode the decoder skips everything else and
+  // gives us the frame number, otherwise decoded frames are counted
+  const bool iframes = video.decodeOptions().iframes;
+  frameStep = std::max(frameStep, 1);
+
+  // decoding (this thread) and hashing (hash pool) are pipelined through
+  // a ring of frame buffers; the decoder reuses each buffer's cv::Mat
+  // so there is no allocation per frame once the ring is full
+  //
+  // hash workers claim slots in the order they were filled, but can finish
+  // out of order; near-frame compression needs frame order, so whichever
+  // worker completes the oldest slot commits the results that are ready
+  // and returns their slots to the decoder
+  constexpr int RingSize = 8;
+  constexpr int MaxBatch = 4;  // frames hashed per wakeup of a worker
+  const int maxWorkers = std::max(maxHashers, 1);
+
+  struct RingSlot {
+    cv::Mat frame;
+    int frameNumber = 0;
+    uint64_t hash = 0;
+    bool hashed = false;  // ready to commit, guarded by commitMutex
+  };
+  std::vector<RingSlot> ring(size_t(RingSize + maxWorkers - 1));
+  const int ringSize = int(ring.size());
+
+  QSemaphore freeSlots(ringSize);  // available to the decoder
+  QSemaphore usedSlots;            // available to the workers
+  QSemaphore hashDone;
+  std::atomic<int> claimed(0);       // sequence number of the next slot to hash
+  std::atomic<int> endSeq(INT_MAX);  // sequence number past the last frame
+  std::atomic<bool> failed(false);   // skip hashing after an error
+  std::exception_ptr hashError;      // rethrown after the pipeline drains
+
+  QMutex commitMutex;  // guards the following and the index
+  int nextCommit = 0;  // sequence number of the next slot to commit
   std::vector<uint64_t> window;
+  int numHashed = 0;
+  uint32_t lastFrame = 0;
 
-  cv::Mat img;
-
-  const int totalFrames = int(video.metadata().frameRate * video.metadata().duration);
-
-  const QString cwd = QFileInfo(QDir::current().absolutePath()).absoluteFilePath();
-  QString path = video.path();
-  if (path.startsWith(cwd)) path = path.mid(cwd.length() + 1);
-
-  cv::Mat cvFrame;
-  if (video.nextFrame(cvFrame)) {
-    grayscale(cvFrame, img);
-    Q_ASSERT(cvFrame.data == img.data); // grayscale should be noop (decoder outputs grayscale)
-
-    autocrop(img, 20); // FIXME: index settings
-    uint64_t hash = dctHash64(img, true);
-    index.hashes.push_back(hash);
-    index.frames.push_back(numFrames & 0xFFFF);
-    numFrames++;
-  }
-
-  while (video.nextFrame(cvFrame)) {
-    qint64 now = QDateTime::currentMSecsSinceEpoch();
-    if (now - then > 1000) {
-      int percent = numFrames * 100 / std::max(totalFrames, 1);
-      qDebug("%dx%d %dpx %d:1 %s(%d) %dfps %d%% ", _width, _height, qMax(img.cols, img.rows),
-             numFrames / std::max(numFrames - nearFrames, 1), (video.isHardware() ? "GPU" : "CPU"),
-             video.threadCount(), int(curFrames * 1000 / (now - then)),
-             percent);
-      curFrames = 0;
-      then = now;
-      progressCb(percent);
-    }
+  std::atomic<int> hashedFrames(0), nearFrames(0);
+  std::atomic<qint64> hashTime(0);  // nanoseconds the workers were not waiting
+  qint64 decodeTime = 0;            // nanoseconds the decoder was not waiting
 
-    grayscale(cvFrame, img);
-
-    // de-letterbox prior to p-hashing
-    autocrop(img, 20); // FIXME: index settings
-
-    uint64_t hash = dctHash64(img, true);
-
-    // compress hash list, since nearby hashes
-    // are likely be similar
-    if (Q_LIKELY(threshold > 0)) {
+  // compress hash list, since nearby hashes are likely be similar
+  const auto commit = [&](uint64_t hash, uint32_t frame) {
+    if (Q_UNLIKELY(numHashed == 0)) {
+      index.hashes.push_back(hash);
+      index.frames.push_back(frame);
+    } else if (Q_LIKELY(threshold > 0)) {
       size_t close = 0;
       for (uint64_t prev : window)
         if (hamm64(prev, hash) < threshold) close++;
@@ -936,50 +998,231 @@ void Media::makeVideoIndex(VideoContext& video, int threshold, VideoIndex& outIn
       if (close != window.size()) {
         window.clear();
         index.hashes.push_back(hash);
-        index.frames.push_back(numFrames & 0xFFFF);
+        index.frames.push_back(frame);
       } else
         nearFrames++;
 
       window.push_back(hash);
     } else {
       index.hashes.push_back(hash);
-      index.frames.push_back(numFrames & 0xFFFF);
+      index.frames.push_back(frame);
     }
+    lastFrame = frame;
+    numHashed++;
+  };
 
-    numFrames++;
-    curFrames++;
+  const auto hashWorker = [&]() {
+    cv::Mat gray[MaxBatch];  // conversion buffers, kept for the next batch
+    cv::Mat imgs[MaxBatch];  // cropped views of gray
+    uint64_t hashes[MaxBatch];
 
-    if (numFrames > 0xFFFF) {
-      qWarning() << "too many frames, skipping the rest";
-      break;
+    for (;;) {
+      usedSlots.acquire();
+      int count = 1;
+      while (count < MaxBatch && usedSlots.tryAcquire()) count++;
+
+      // slots past the end are wakeups to exit, not frames
+      const int first = claimed.fetch_add(count);
+      const int batch = std::max(std::min(count, endSeq - first), 0);
+
+      QElapsedTimer timer;
+      timer.start();
+
+      // after an error keep draining the ring so the decoder can finish
+      if (!failed) {
+        try {
+          for (int i = 0; i < batch; ++i) {
+            grayscale(ring[size_t((first + i) % ringSize)].frame, gray[i]);
+
+            // de-letterbox prior to p-hashing
+            imgs[i] = gray[i];
+            autocrop(imgs[i], 20);  // FIXME: index settings
+          }
+          dctHash64(imgs, batch, hashes, true);
+        } catch (...) {
+          QMutexLocker locker(&commitMutex);
+          if (!hashError) hashError = std::current_exception();
+          failed = true;
+        }
+      }
+
+      for (int i = 0; i < batch; ++i) {
+        imgs[i].release();
+        // gray input is not copied; the buffer goes back to the decoder
+        if (gray[i].u == ring[size_t((first + i) % ringSize)].frame.u) gray[i].release();
+      }
+
+      int committed = 0;
+      {
+        QMutexLocker locker(&commitMutex);
+        for (int i = 0; i < batch; ++i) {
+          RingSlot& slot = ring[size_t((first + i) % ringSize)];
+          slot.hash = hashes[i];
+          slot.hashed = true;
+        }
+        for (;; ++nextCommit, ++committed) {
+          RingSlot& slot = ring[size_t(nextCommit % ringSize)];
+          if (!slot.hashed) break;
+          slot.hashed = false;
+          if (!failed) commit(slot.hash, uint32_t(slot.frameNumber));
+        }
+      }
+
+      hashTime += timer.nsecsElapsed();
+      hashedFrames += committed;
+      if (committed) freeSlots.release(committed);
+
+      if (batch < count) break;
+    }
+
+    hashDone.release();
+  };
+
+  // needs its own pool, if global pool is full it will block; if this pool
+  // is full the worker is queued which only delays its own decoder
+  static QThreadPool* hashPool = [] {
+    auto* pool = new QThreadPool;
+    pool->setMaxThreadCount(1);
+    return pool;
+  }();
+  if (hashPool->maxThreadCount() < maxHashers) hashPool->setMaxThreadCount(maxHashers);
+
+  // start with one worker, add more while the decoder is waiting on them
+  int numWorkers = 0;
+  const auto startWorker = [&] {
+    hashPool->start(hashWorker);
+    numWorkers++;
+  };
+  startWorker();
+
+  // frames per second of a pipeline stage, given nanoseconds not waiting
+  const auto stageFps = [](int frames, qint64 nsecs) {
+    return int(frames * 1000000000LL / std::max(nsecs, 1LL));
+  };
+
+  const int totalFrames = int(video.metadata().frameRate * video.metadata().duration);
+
+  int numFrames = 0;   // frames decoded
+  int numSamples = 0;  // frames sent to the workers, and the sequence number of the next
+  int frameNumber = 0; // of the last decoded frame
+  int nextSample = 0;  // frame number of the next frame to hash
+  int curFrames = 0;
+  int frameSize = 0;
+  qint64 then = QDateTime::currentMSecsSinceEpoch();
+
+  // the end of stream wakes up every worker (each takes at most MaxBatch);
+  // if decoding throws, the workers are still using the ring and semaphores,
+  // so wait for them before they go out of scope
+  const auto joinWorkers = [&] {
+    endSeq = numSamples;
+    usedSlots.release(numWorkers * MaxBatch);
+    hashDone.acquire(numWorkers);
+  };
+  auto joinGuard = qScopeGuard(joinWorkers);
+
+  for (;;) {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (now - then > 1000) {
+      int percent = frameNumber * 100 / std::max(totalFrames, 1);
+      int hashed = hashedFrames;
+      qDebug("%dx%d %dpx %d:1 %s(%d) %dfps %d%% decode:%dfps hash:%dfps x%d", _width, _height,
+             frameSize, hashed / std::max(hashed - nearFrames, 1),
+             (video.isHardware() ? "GPU" : "CPU"), video.threadCount(),
+             int(curFrames * 1000 / (now - then)), percent, stageFps(numFrames, decodeTime),
+             stageFps(hashed, hashTime), numWorkers);
+      curFrames = 0;
+      then = now;
+      progressCb(percent);
     }
+
+    if (!freeSlots.tryAcquire()) {
+      if (numWorkers < maxWorkers) startWorker();
+      freeSlots.acquire();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // in every-Nth mode the skipped frames are decoded into the same slot
+    RingSlot& slot = ring[size_t(numSamples % ringSize)];
+    bool end = false;
+    do {
+      end = !video.nextFrame(slot.frame);
+      if (end) break;
+      frameNumber = iframes ? video.lastFrameNumber() : numFrames;
+      numFrames++;
+      curFrames++;
+    } while (frameNumber < nextSample);
+    slot.frameNumber = frameNumber;
+    nextSample = frameNumber + frameStep;
+
+    decodeTime += timer.nsecsElapsed();
+
+    if (end) break;  // the slot is not returned, the ring is done
+
+    frameSize = qMax(slot.frame.cols, slot.frame.rows);
+    numSamples++;
+    usedSlots.release();
   }
 
+  joinGuard.dismiss();
+  joinWorkers();
+  if (hashError) std::rethrow_exception(hashError);
+
   // always include the last frame so it can be used as a reference
-  if (index.frames.size() > 0 && index.frames.back() != numFrames - 1) {
+  if (index.frames.size() > 0 && index.frames.back() != lastFrame) {
     index.hashes.push_back(window.back());
-    index.frames.push_back((numFrames - 1) & 0xFFFF);
+    index.frames.push_back(lastFrame);
   }
 
-  qDebug("%s nframes=%d near=%d filt=%d corrupt=%d", qUtf8Printable(video.path()), numFrames,
-         nearFrames, filteredFrames, corruptFrames);
+  if (numHashed > 1 && (iframes || frameStep > 1))
+    index.frameStep = std::max((lastFrame - index.frames.front()) / uint32_t(numHashed - 1), 1u);
+
+  // if decode is slower than hash, more decoder threads (-i.dthreads) could help
+  qDebug("%s nframes=%d hashed=%d near=%d decode:%dfps hash:%dfps x%d",
+         qUtf8Printable(video.path()), numFrames, numSamples, int(nearFrames),
+         stageFps(numFrames, decodeTime), stageFps(numSamples, hashTime), numWorkers);
 
   progressCb(100);
 }
 
+/// header of .vdx file since version 2, followed by hashes[numFrames], frames[numFrames]
+struct VideoIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t numFrames;
+  static constexpr char Magic[8] = {'c', 'b', 'i', 'r', 'd', 'V', 'D', 'X'};
+};
+
+/// follows VideoIndexHeader since version 3
+struct VideoIndexHeaderV3 {
+  uint32_t frameStep;
+  uint32_t reserved;
+};
+
 void VideoIndex::save(const QString& file) const {
   MessageContext ctx(file);
   FILE* indexFile = fopen(qUtf8Printable(file), "wb");
   if (!indexFile) qFatal("failed to open");
 
-  uint16_t numFrames = frames.size() & 0xFFFF;
-  if (1 != fwrite(&numFrames, sizeof(numFrames), 1, indexFile)) qFatal("write fail at start");
+  VideoIndexHeader h;
+  memcpy(h.magic, VideoIndexHeader::Magic, sizeof(h.magic));
+  h.version = Version;
+  h.numFrames = uint32_t(std::min(frames.size(), hashes.size()));
 
-  for (uint16_t frame : frames)
-    if (1 != fwrite(&frame, sizeof(frame), 1, indexFile)) qFatal("write fail on frames");
+  VideoIndexHeaderV3 h3;
+  h3.frameStep = frameStep;
+  h3.reserved = 0;
 
-  for (uint64_t hash : hashes)
-    if (1 != fwrite(&hash, sizeof(hash), 1, indexFile)) qFatal("write fail on hashes");
+  if (1 != fwrite(&h, sizeof(h), 1, indexFile) || 1 != fwrite(&h3, sizeof(h3), 1, indexFile))
+    qFatal("write fail at start");
+
+  if (h.numFrames > 0) {
+    if (1 != fwrite(hashes.data(), sizeof(*hashes.data()) * h.numFrames, 1, indexFile))
+      qFatal("write fail on hashes");
+    if (1 != fwrite(frames.data(), sizeof(*frames.data()) * h.numFrames, 1, indexFile))
+      qFatal("write fail on frames");
+  }
 
   fclose(indexFile);
 }
@@ -990,6 +1233,35 @@ void VideoIndex::load(const QString& file) {
 
   frames.clear();
   hashes.clear();
+  frameStep = 1;
+
+  // version 1 cannot start with the magic since the first frame is 0
+  VideoIndexHeader h;
+  if (1 == fread(&h, sizeof(h), 1, indexFile) &&
+      0 == memcmp(h.magic, VideoIndexHeader::Magic, sizeof(h.magic))) {
+    if (h.version < 2 || h.version > Version)
+      qFatal("unsupported video index version %d: %s", h.version, qPrintable(file));
+
+    if (h.version >= 3) {
+      VideoIndexHeaderV3 h3;
+      if (1 != fread(&h3, sizeof(h3), 1, indexFile))
+        qFatal("read fail on video index: %s", qPrintable(file));
+      frameStep = std::max(h3.frameStep, 1u);
+    }
+
+    hashes.resize(h.numFrames);
+    frames.resize(h.numFrames);
+    if (h.numFrames > 0 &&
+        (1 != fread(hashes.data(), sizeof(*hashes.data()) * h.numFrames, 1, indexFile) ||
+         1 != fread(frames.data(), sizeof(*frames.data()) * h.numFrames, 1, indexFile)))
+      qFatal("read fail on video index: %s", qPrintable(file));
+
+    fclose(indexFile);
+    return;
+  }
+
+  // version 1: uint16 numFrames, uint16 frames[numFrames], uint64 hashes[numFrames]
+  if (0 != fseek(indexFile, 0, SEEK_SET)) qFatal("seek fail: %s", qPrintable(file));
 
   uint16_t numFrames = 0;
   if (1 != fread(&numFrames, sizeof(numFrames), 1, indexFile))
@@ -59,14 +59,18 @@ typedef std::function<QVariant(const Media&)> PropertyFunc;
  * Index is compressed by omitting nearby frames,
  * therefore there is also list of frame numbers;
  *
- * @note uint16_t limits video to < 2^16-1 frames indexed
+ * If the video was indexed from keyframes or every Nth frame, the
+ * frame numbers are sparse and frameStep is the average spacing.
  *
- * FIXME: increase this by storing the offset from previous frame (maybe uint8)
+ * @note files written before version 2 have 16-bit frame numbers
+ *       and are limited to 2^16-1 frames, they can still be loaded
  */
 class VideoIndex {
  public:
-  std::vector<uint16_t> frames;  // frame number
+  enum { Version = 3 };          // file format version written by save()
+  std::vector<uint32_t> frames;  // frame number
   VideoHashList hashes;          // dct hash
+  uint32_t frameStep = 1;        // average frames between samples, 1 if every frame was hashed
 
   size_t memSize() const { return sizeof(*this) + VECTOR_SIZE(frames) + VECTOR_SIZE(hashes); }
   bool isEmpty() const { return frames.size() == 0 || hashes.size() == 0; }
@@ -187,7 +191,14 @@ class Media {
   static void printGroup(const MediaGroup& group);
   static void printGroupList(const MediaGroupList& list);
   static bool groupCompareByContents(const MediaGroup& s1, const MediaGroup& s2);
-  static void mergeGroupList(MediaGroupList& list);
+  static void mergeGroupList(MediaGroupList& list, int minConnections = 1);
+
+  /**
+   * Key to tell media of a group list apart: the id, or if the media is not
+   * in the database, a negative key that is the same for the same path
+   * @param pathKeys keys given to paths so far, shared by all media of the list
+   */
+  static int groupKey(const Media& m, QHash<QString, int>& pathKeys);
   static void expandGroupList(MediaGroupList& list);
 
   static void sortGroupList(MediaGroupList& list, const QStringList& properties);
@@ -546,7 +557,7 @@ class Media {
   void makeKeyPointHashes(const cv::Mat& cvImg, const KeyPointList& keyPoints,
                           KeyPointHashList& outHashes) const;              // DctFeaturesIndex
   void makeVideoIndex(
-      VideoContext& video, int threshold, VideoIndex& outIndex,
+      VideoContext& video, int threshold, int frameStep, int maxHashers, VideoIndex& outIndex,
       const std::function<void(int)>& progressCb) const;  // DctVideoIndex
 
   //  const KeyPointList& keyPoints() const;
@@ -0,0 +1,233 @@
+/* Compact table of media records for searching
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#include "mediatable.h"
+
+#include <numeric>  // iota
+
+/// header of the snapshot file, followed by each column padded to 8 bytes
+struct MediaTableHeader {
+  enum { Version = 1 };
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t pathBytes;
+
+  static constexpr char Magic[8] = {'c', 'b', 'i', 'r', 'd', 'M', 'T', 'B'};
+};
+
+/// bytes per row of each column, in file order (paths are last)
+static const int ColumnSizes[] = {4, 2, 4, 4, 8, 16, 8};
+static const int NumColumns = sizeof(ColumnSizes) / sizeof(*ColumnSizes);
+
+static qint64 padded(qint64 size) { return (size + 7) & ~qint64(7); }
+
+void MediaTable::append(uint32_t id, int type, int width, int height, const QString& relPath,
+                        const QString& md5, uint64_t dctHash) {
+  QByteArray md5Bytes = QByteArray::fromHex(md5.toLatin1());
+  if (md5Bytes.length() != 16) md5Bytes = QByteArray(16, 0);
+
+  if (_count > 0 && id < this->id(_count - 1)) _sorted = false;
+
+  _paths.append(relPath.toUtf8());
+
+  put(_ids, id);
+  put(_types, uint16_t(type));
+  put(_widths, int32_t(width));
+  put(_heights, int32_t(height));
+  put(_dctHashes, dctHash);
+  _md5s.append(md5Bytes);
+  put(_pathEnds, uint64_t(_paths.length()));
+  _count++;
+}
+
+void MediaTable::append(const Media& m) {
+  QString relPath = m.path();
+  if (!_basePath.isEmpty() && relPath.startsWith(_basePath + "/"))
+    relPath = relPath.mid(_basePath.length() + 1);
+
+  append(uint32_t(m.id()), m.type(), m.width(), m.height(), relPath, m.md5(), m.dctHash());
+}
+
+void MediaTable::select(const QVector<int>& rows) {
+  MediaTable t(_basePath);
+  for (int i : rows) {
+    const uint64_t start = pathStart(i);
+    t._paths.append(_paths.constData() + start, qsizetype(get<uint64_t>(_pathEnds, i) - start));
+
+    if (t._count > 0 && id(i) < t.id(t._count - 1)) t._sorted = false;
+    put(t._ids, get<uint32_t>(_ids, i));
+    put(t._types, get<uint16_t>(_types, i));
+    put(t._widths, get<int32_t>(_widths, i));
+    put(t._heights, get<int32_t>(_heights, i));
+    put(t._dctHashes, get<uint64_t>(_dctHashes, i));
+    t._md5s.append(reinterpret_cast<const char*>(md5Bytes(i)), 16);
+    put(t._pathEnds, uint64_t(t._paths.length()));
+    t._count++;
+  }
+  *this = t;
+}
+
+void MediaTable::remove(const QSet<uint32_t>& ids) {
+  QVector<int> rows;
+  for (int i = 0; i < _count; ++i)
+    if (!ids.contains(id(i))) rows.append(i);
+
+  if (rows.count() != _count) select(rows);
+}
+
+void MediaTable::sort() {
+  if (_sorted) return;
+
+  QVector<int> rows(_count);
+  std::iota(rows.begin(), rows.end(), 0);
+  std::stable_sort(rows.begin(), rows.end(), [this](int a, int b) { return id(a) < id(b); });
+  select(rows);
+  Q_ASSERT(_sorted);
+}
+
+MediaRecord MediaTable::record(int i) const {
+  MediaRecord r;
+  memset(&r, 0, sizeof(r));
+  r.dctHash = get<uint64_t>(_dctHashes, i);
+  r.pathOffset = pathStart(i);
+  r.pathLength = uint32_t(get<uint64_t>(_pathEnds, i) - r.pathOffset);
+  r.id = id(i);
+  r.width = get<int32_t>(_widths, i);
+  r.height = get<int32_t>(_heights, i);
+  r.type = uint16_t(type(i));
+  memcpy(r.md5, md5Bytes(i), sizeof(r.md5));
+  return r;
+}
+
+int MediaTable::find(uint32_t id) const {
+  int lo = 0, hi = _count;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    if (this->id(mid) < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo < _count && this->id(lo) == id) ? lo : -1;
+}
+
+QString MediaTable::path(int i) const {
+  const uint64_t start = pathStart(i);
+  const QString relPath = QString::fromUtf8(_paths.constData() + start,
+                                            qsizetype(get<uint64_t>(_pathEnds, i) - start));
+  if (_basePath.isEmpty()) return relPath;
+  return _basePath + "/" + relPath;
+}
+
+QString MediaTable::md5(int i) const {
+  const char* bytes = reinterpret_cast<const char*>(md5Bytes(i));
+  if (std::all_of(bytes, bytes + 16, [](char c) { return c == 0; })) return QString();
+  return QByteArray::fromRawData(bytes, 16).toHex();
+}
+
+Media MediaTable::media(int i) const {
+  Media m(path(i), type(i), get<int32_t>(_widths, i), get<int32_t>(_heights, i), md5(i),
+          get<uint64_t>(_dctHashes, i));
+  m.setId(int(id(i)));
+  return m;
+}
+
+bool MediaTable::map(const QString& fileName) {
+  QSharedPointer<QFile> f(new QFile(fileName));
+  if (!f->open(QFile::ReadOnly)) {
+    qWarning() << "open failed:" << fileName << f->errorString();
+    return false;
+  }
+
+  const qint64 size = f->size();
+  const uchar* data = nullptr;
+  MediaTableHeader h;
+
+  if (size >= qint64(sizeof(h))) data = f->map(0, size);
+  if (data) memcpy(&h, data, sizeof(h));
+
+  qint64 expected = sizeof(h);
+  if (data) {
+    for (int columnSize : ColumnSizes) expected += padded(qint64(columnSize) * h.count);
+    expected += padded(qint64(h.pathBytes));
+  }
+
+  if (!data || memcmp(h.magic, MediaTableHeader::Magic, sizeof(h.magic)) != 0 ||
+      h.version != MediaTableHeader::Version || h.count > INT_MAX || expected != size) {
+    qWarning() << "invalid or incompatible cache file:" << fileName;
+    return false;
+  }
+
+  const char* columnData[NumColumns + 1];
+  const char* ptr = reinterpret_cast<const char*>(data) + sizeof(h);
+  for (int i = 0; i < NumColumns; ++i) {
+    columnData[i] = ptr;
+    ptr += padded(qint64(ColumnSizes[i]) * h.count);
+  }
+  columnData[NumColumns] = ptr;
+
+  // find() needs ids in order, path() needs paths in the pool
+  const char* ids = columnData[0];
+  const char* pathEnds = columnData[NumColumns - 1];
+  uint32_t lastId = 0;
+  uint64_t lastEnd = 0;
+  for (uint32_t i = 0; i < h.count; ++i) {
+    uint32_t rowId;
+    uint64_t rowEnd;
+    memcpy(&rowId, ids + sizeof(rowId) * i, sizeof(rowId));
+    memcpy(&rowEnd, pathEnds + sizeof(rowEnd) * i, sizeof(rowEnd));
+    if ((i > 0 && rowId <= lastId) || rowEnd < lastEnd || rowEnd > h.pathBytes) {
+      qWarning() << "corrupt cache file:" << fileName;
+      return false;
+    }
+    lastId = rowId;
+    lastEnd = rowEnd;
+  }
+
+  QByteArray* columns[] = {&_ids, &_types, &_widths, &_heights, &_dctHashes, &_md5s, &_pathEnds};
+  for (int i = 0; i < NumColumns; ++i)
+    *columns[i] = QByteArray::fromRawData(columnData[i], qsizetype(ColumnSizes[i]) * h.count);
+  _paths = QByteArray::fromRawData(columnData[NumColumns], qsizetype(h.pathBytes));
+
+  _count = int(h.count);
+  _sorted = true;
+  _mapFile = f;
+  return true;
+}
+
+void MediaTable::write(QFile& f) const {
+  MediaTableHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MediaTableHeader::Magic, sizeof(h.magic));
+  h.version = MediaTableHeader::Version;
+  h.count = uint32_t(_count);
+  h.pathBytes = uint64_t(_paths.length());
+
+  if (sizeof(h) != f.write(reinterpret_cast<const char*>(&h), sizeof(h))) throw f.errorString();
+
+  const QByteArray* columns[] = {&_ids,       &_types, &_widths,   &_heights,
+                                 &_dctHashes, &_md5s,  &_pathEnds, &_paths};
+  for (const QByteArray* column : columns) {
+    const QByteArray padding(int(padded(column->length()) - column->length()), 0);
+    if (column->length() != f.write(*column) || padding.length() != f.write(padding))
+      throw f.errorString();
+  }
+}
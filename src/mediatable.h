@@ -0,0 +1,124 @@
+/* Compact table of media records for searching
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+#include "media.h"
+
+/**
+ * Fixed-size record of a media row, with only what is needed to
+ * search and filter; use MediaTable::media() to get a full Media
+ */
+struct MediaRecord {
+  uint64_t dctHash;     // Media::dctHash()
+  uint64_t pathOffset;  // relative path, in the path pool (utf8)
+  uint32_t pathLength;  // bytes
+  uint32_t id;          // Media::id()
+  int32_t width, height;
+  uint16_t type;        // Media::Type
+  uint8_t md5[16];      // Media::md5() as bytes, zero if there was none
+};
+
+static_assert(std::is_trivially_copyable<MediaRecord>::value, "MediaRecord must be POD");
+
+/**
+ * Media rows of the database, stored by column and sorted by id.
+ * Much smaller than a MediaGroup, and columns can be mapped from
+ * a snapshot file without parsing anything.
+ *
+ * Copies are cheap, columns are implicitly shared
+ */
+class MediaTable {
+ public:
+  MediaTable() {}
+
+  /// @param basePath prefix of media paths, Database::path()
+  explicit MediaTable(const QString& basePath) : _basePath(basePath) {}
+
+  /// add a row, @param relPath path relative to basePath
+  void append(uint32_t id, int type, int width, int height, const QString& relPath,
+              const QString& md5, uint64_t dctHash);
+
+  /// add a row from Media with a valid id
+  void append(const Media& m);
+
+  /// remove rows with the given ids
+  void remove(const QSet<uint32_t>& ids);
+
+  /// sort by id after appending out of order, required for find()
+  /// @note nothing to do if ids were appended in order
+  void sort();
+
+  int count() const { return _count; }
+  bool isEmpty() const { return _count == 0; }
+
+  uint32_t id(int i) const { return get<uint32_t>(_ids, i); }
+  int type(int i) const { return get<uint16_t>(_types, i); }
+  const uint8_t* md5Bytes(int i) const {
+    return reinterpret_cast<const uint8_t*>(_md5s.constData()) + i * 16;
+  }
+
+  MediaRecord record(int i) const;
+
+  /// @return row with the id or -1
+  int find(uint32_t id) const;
+
+  /// @return absolute path
+  QString path(int i) const;
+
+  /// @return md5 as hex string, same as Media::md5()
+  QString md5(int i) const;
+
+  /// @return media with the fields of the row, as from Database::fillMediaGroup
+  Media media(int i) const;
+
+  /// use the columns of snapshot file
+  /// @return false if it is invalid, ids are not sorted, or paths are out of bounds
+  bool map(const QString& fileName);
+
+  /// write snapshot file, @throw QString error
+  void write(QFile& f) const;
+
+ private:
+  template <typename T>
+  static T get(const QByteArray& column, int i) {
+    T value;
+    memcpy(&value, column.constData() + sizeof(T) * size_t(i), sizeof(T));
+    return value;
+  }
+
+  template <typename T>
+  static void put(QByteArray& column, T value) {
+    column.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  uint64_t pathStart(int i) const { return i > 0 ? get<uint64_t>(_pathEnds, i - 1) : 0; }
+
+  /// replace columns with the given rows, in that order
+  void select(const QVector<int>& rows);
+
+  QString _basePath;
+  int _count = 0;
+  bool _sorted = true;  // ids are in order
+
+  QByteArray _ids, _types, _widths, _heights, _dctHashes, _md5s;
+  QByteArray _pathEnds, _paths;  // path i is [pathEnds[i-1], pathEnds[i])
+
+  QSharedPointer<QFile> _mapFile;  // keeps mapped columns valid
+};
@@ -0,0 +1,137 @@
+/* Disk cache of image previews
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#include "previewcache.h"
+
+#include "ioutil.h"
+
+PreviewCache& PreviewCache::forPath(const QString& cachePath) {
+  static QMutex mutex;
+  static QHash<QString, PreviewCache*> caches;
+
+  QMutexLocker locker(&mutex);
+  PreviewCache*& cache = caches[cachePath];
+  if (!cache) cache = new PreviewCache(cachePath);
+  return *cache;
+}
+
+PreviewCache::PreviewCache(const QString& cachePath) : _path(cachePath + "/previews") {
+  bool ok = false;
+  const int mb = qEnvironmentVariableIntValue("CBIRD_PREVIEW_CACHE_MB", &ok);
+  _maxBytes = qint64(ok && mb > 0 ? mb : 2048) * 1024 * 1024;
+  _evictPool.setMaxThreadCount(1);
+}
+
+QString PreviewCache::filePath(const QString& md5, int size, int frame) const {
+  // no extension, the format is detected on load
+  return QString("%1/%2/%3_%4_%5").arg(_path, md5.left(2), md5).arg(size).arg(frame);
+}
+
+bool PreviewCache::contains(const QString& md5, int size, int frame) const {
+  if (md5.isEmpty()) return false;
+  return QFileInfo::exists(filePath(md5, size, frame));
+}
+
+QByteArray PreviewCache::loadData(const QString& md5, int size, int frame) const {
+  if (md5.isEmpty()) return QByteArray();
+
+  QFile f(filePath(md5, size, frame));
+  if (!f.open(QFile::ReadOnly)) return QByteArray();
+
+  const QByteArray data = f.readAll();
+
+  // modtime is the lru order; an hour is close enough, saves writes
+  const QDateTime now = QDateTime::currentDateTime();
+  if (f.fileTime(QFile::FileModificationTime).secsTo(now) > 3600)
+    f.setFileTime(now, QFile::FileModificationTime);
+
+  return data;
+}
+
+QImage PreviewCache::load(const QString& md5, int size, int frame) const {
+  const QByteArray data = loadData(md5, size, frame);
+  if (data.isEmpty()) return QImage();
+
+  QImage img;
+  if (!img.loadFromData(data))
+    qWarning() << "invalid preview, ignoring:" << filePath(md5, size, frame);
+  return img;
+}
+
+void PreviewCache::store(const QString& md5, int size, int frame, const QImage& img) {
+  if (md5.isEmpty() || img.isNull()) return;
+
+  const QString path = filePath(md5, size, frame);
+  if (QFileInfo::exists(path)) return;
+
+  if (!QDir().mkpath(QFileInfo(path).path())) {
+    qWarning() << "failed to create preview dir:" << path;
+    return;
+  }
+
+  // jpeg is ~10x smaller than png, good enough for scaled images
+  const bool lossless = size <= 0 || img.hasAlphaChannel();
+
+  try {
+    writeFileAtomically(path, [&img, lossless](QFile& f) {
+      QImageWriter writer(&f, lossless ? "png" : "jpg");
+      writer.setQuality(lossless ? 50 : 90);  // png: 50 is fast, still compressed
+      if (!writer.write(img)) throw writer.errorString();
+    });
+  } catch (const QString& error) {
+    qWarning() << "failed to write preview:" << path << error;
+    return;
+  }
+
+  const qint64 bytes = QFileInfo(path).size();
+  {
+    QMutexLocker locker(&_mutex);
+    if (_bytes >= 0) _bytes += bytes;
+
+    // the first store counts what is on disk
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (_evicting || (_bytes >= 0 && (_bytes <= _maxBytes || now - _lastEvict < 60 * 1000)))
+      return;
+    _evicting = true;
+    _lastEvict = now;
+  }
+
+  evict();
+}
+
+void PreviewCache::evict() {
+  // store() is called by indexer and gui threads, don't make them walk the tree
+  (void)QtConcurrent::run(&_evictPool, [this]() {
+    const qint64 total = removeLeastRecentFiles(_path, _maxBytes);
+
+    QMutexLocker locker(&_mutex);
+    _bytes = total;
+    _evicting = false;
+  });
+}
+
+int PreviewCache::cacheSize(int size) {
+  return qMax(int(IndexSize), (size + 255) / 256 * 256);
+}
+
+QImage PreviewCache::scaled(const QImage& img, int size) {
+  if (img.width() <= size && img.height() <= size) return img;
+  return img.scaled(size, size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+}
@@ -0,0 +1,88 @@
+/* Disk cache of image previews
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+
+/**
+ * Disk cache of decoded and scaled images for browsing, content-addressed
+ * by md5, the size they were scaled to, and video frame. When the cache is
+ * full, least recently used files are removed in the background, at most
+ * once a minute.
+ *
+ * Max size is 2GB, or CBIRD_PREVIEW_CACHE_MB
+ *
+ * @note thread-safe
+ */
+class PreviewCache {
+  Q_DISABLE_COPY_MOVE(PreviewCache)
+
+ public:
+  /// size (longest side) of previews written by the indexer
+  enum { IndexSize = 512 };
+
+  /// shared instance, @param cachePath Database::cachePath()
+  static PreviewCache& forPath(const QString& cachePath);
+
+  /**
+   * @param md5 checksum of the media
+   * @param size longest side the image was scaled to fit, 0 if not scaled
+   * @param frame video frame number, or -1
+   * @return null image if not cached
+   */
+  QImage load(const QString& md5, int size, int frame = -1) const;
+
+  /// compressed data of an entry, to decode it another way, @see load()
+  QByteArray loadData(const QString& md5, int size, int frame = -1) const;
+
+  /// true if there is an entry, without loading it
+  bool contains(const QString& md5, int size, int frame = -1) const;
+
+  /**
+   * add image to the cache
+   * @note unscaled images and images with alpha are stored lossless
+   */
+  void store(const QString& md5, int size, int frame, const QImage& img);
+
+  /// scale image down to fit size x size, if larger
+  static QImage scaled(const QImage& img, int size);
+
+  /**
+   * size to cache an image that is needed at some size, rounded up
+   * so similar sizes (e.g. window or screen sizes) share the entry
+   */
+  static int cacheSize(int size);
+
+ private:
+  explicit PreviewCache(const QString& cachePath);
+
+  QString filePath(const QString& md5, int size, int frame) const;
+
+  /// count bytes on disk, remove least recently used files if over the limit
+  void evict();
+
+  QString _path;
+  qint64 _maxBytes;
+
+  QMutex _mutex;
+  qint64 _bytes = -1;  // bytes on disk, -1 if not counted yet
+  bool _evicting = false;
+  qint64 _lastEvict = 0;  // msecs since epoch
+  QThreadPool _evictPool;
+};
@@ -25,12 +25,139 @@
 #include "index.h"
 #include "ioutil.h"
 #include "media.h"
+#include "previewcache.h"
 #include "qtutil.h"
 #include "videocontext.h"
 
 #include "opencv2/features2d.hpp"
 #include "quazip/quazip.h"
 
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#endif
+
+/// directory entry, with attributes of the link target if it is a link
+struct ScanEntry {
+  QString name;
+  bool isLink = false;
+  bool isJunction = false;
+  bool isDir = false;
+  bool isFile = false;
+  qint64 size = 0;
+  QDateTime modified;  // content modified
+  QDateTime changed;   // metadata changed
+  uint64_t dev = 0, ino = 0;
+};
+
+#ifdef Q_OS_LINUX
+
+/// getdents64() record, not declared by older glibc
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static bool statEntry(int dirFd, const char* name, int flags, struct statx& st) {
+  // DONT_SYNC: use cached attributes on network filesystems (filled by readdir)
+  const unsigned mask = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME |
+                        STATX_CTIME;
+  return statx(dirFd, name, flags | AT_STATX_DONT_SYNC, mask, &st) == 0;
+}
+
+static QDateTime statxTime(const struct statx_timestamp& ts) {
+  return QDateTime::fromMSecsSinceEpoch(qint64(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * List directory with as few system calls as possible; getdents64() with
+ * a large buffer, and one statx() per entry (two for symlinks). Same
+ * entries as QDir::entryList(Files|Dirs|NoDotAndDotDot), with the
+ * attributes that need a QFileInfo (and several stat()) each.
+ */
+static bool listDirectory(const QString& dirPath, QVector<ScanEntry>& entries) {
+  const int fd = open(QFile::encodeName(dirPath).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  std::vector<char> buf(256 * 1024);
+  for (;;) {
+    const long len = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+    if (len < 0) {
+      qWarning() << "getdents failed:" << dirPath << strerror(errno);
+      break;
+    }
+    if (len == 0) break;
+
+    for (long pos = 0; pos < len;) {
+      const auto* d = reinterpret_cast<const LinuxDirent64*>(buf.data() + pos);
+      pos += d->d_reclen;
+
+      const char* name = d->d_name;
+      if (name[0] == '.') continue;  // hidden, like QDir without QDir::Hidden
+
+      struct statx st;
+      if (!statEntry(fd, name, AT_SYMLINK_NOFOLLOW, st)) continue;  // removed since readdir
+
+      ScanEntry e;
+      e.isLink = S_ISLNK(st.stx_mode);
+      if (e.isLink && !statEntry(fd, name, 0, st)) continue;  // broken link, like QDir
+
+      e.isDir = S_ISDIR(st.stx_mode);
+      e.isFile = S_ISREG(st.stx_mode);
+      if (!e.isDir && !e.isFile) continue;  // device, socket etc, like QDir without QDir::System
+
+      e.name = QFile::decodeName(name);
+      e.size = qint64(st.stx_size);
+      e.modified = statxTime(st.stx_mtime);
+      e.changed = statxTime(st.stx_ctime);
+      e.dev = makedev(st.stx_dev_major, st.stx_dev_minor);
+      e.ino = st.stx_ino;
+      entries.append(e);
+    }
+  }
+  close(fd);
+
+  // match QDir default sort order
+  std::sort(entries.begin(), entries.end(), [](const ScanEntry& a, const ScanEntry& b) {
+    return a.name.compare(b.name, Qt::CaseInsensitive) < 0;
+  });
+
+  return true;
+}
+
+#else
+
+static bool listDirectory(const QString& dirPath, QVector<ScanEntry>& entries) {
+  const QDir dir(dirPath);
+  if (!dir.exists()) return false;
+
+  QDir::Filters filters = QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot;
+
+  for (const QString& name : dir.entryList(filters)) {
+    const QFileInfo info(dirPath + "/" + name);
+    ScanEntry e;
+    e.name = name;
+    e.isLink = info.isSymLink();
+    e.isJunction = info.isJunction();
+    e.isDir = info.isDir();
+    e.isFile = info.isFile();
+    e.size = info.size();
+    e.modified = info.lastModified();
+    e.changed = info.metadataChangeTime();
+    entries.append(e);
+  }
+
+  return true;
+}
+
+#endif
+
 Scanner::Scanner() {
   // clang-format off
   _imageTypes << "jpg" << "jpeg" << "jfif" << "png" << "bmp" << "gif";
@@ -80,11 +207,18 @@ void Scanner::scanDirectory(const QString& path, QSet<QString>& expected,
   _gpuPool.setMaxThreadCount(_params.gpuThreads);
 
   _topDirPath = path;
-  _existingFiles = 0;
-  _ignoredFiles = 0;
-  _modifiedFiles = 0;
+  _existingFiles.storeRelaxed(0);
+  _ignoredFiles.storeRelaxed(0);
+  _modifiedFiles.storeRelaxed(0);
   _processedFiles = 0;
   _queuedFiles = 0;
+  _newImages.storeRelaxed(0);
+  _newVideos.storeRelaxed(0);
+  _modifiedImages.clear();
+  _modifiedVideos.clear();
+  _scanCancelled.storeRelaxed(0);
+  _holdVideos = _params.estimateCost && (_params.algos & (1 << SearchParams::AlgoVideo));
+  _heldVideos.clear();
   _modifiedSince = modifiedSince;
   _inodes.clear();
   _startTime = QDateTime::currentDateTime();
@@ -98,17 +232,44 @@ void Scanner::scanDirectory(const QString& path, QSet<QString>& expected,
     zipFiles[zipFile].append(path);
   }
 
-  readDirectory(path, zipFiles, expected);
+  // walk the tree in a thread, processing files as they are found; spin until
+  // it is done since the caller needs the final value of expected
+  _scanning = true;
+  {
+    QEventLoop loop;
+    QFutureWatcher<void> walk;
+    connect(&walk, &QFutureWatcher<void>::finished, &loop, &QEventLoop::quit);
+    walk.setFuture(QtConcurrent::run(&_scanPool, [&]() {
+      readDirectory(path, zipFiles, expected);
+    }));
+    loop.exec();
+  }
+  _scanning = false;
+
+  queueScanned();  // in case the last wakeup did not run yet
   scanProgress(path);
 
+  // modified files are removed by the caller, then added back; they can't
+  // be sent before then, which is ok since results are delivered by the
+  // event loop, after we return
+  QStringList images, videos;
+  {
+    QMutexLocker locker(&_scanMutex);
+    images.swap(_modifiedImages);
+    videos.swap(_modifiedVideos);
+  }
+  videos = _heldVideos + videos;
+  _heldVideos.clear();
+
   // estimate the cost of each video, to process longest-job-first (LJF),
+  // before any of them are started
   // - this is slow; so try to avoid it
   // - pointless if codecs are all multithreaded
   // - little difference if there are a lot of jobs
-  if (_params.estimateCost && _params.algos & SearchParams::AlgoVideo &&
-      _videoQueue.count() <= _params.indexThreads) {
+  if (_holdVideos && !_scanCancelled.loadRelaxed() && videos.count() > 1 &&
+      videos.count() <= _params.indexThreads) {
     QMap<QString, float> cost;
-    for (auto& path : qAsConst(_videoQueue)) {
+    for (auto& path : qAsConst(videos)) {
       cost[path] = -1.0f;
 
       const QString context = path.mid(_topDirPath.length() + 1);
@@ -122,27 +283,29 @@ void Scanner::scanDirectory(const QString& path, QSet<QString>& expected,
       cost[path] = d.frameRate * d.duration * d.frameSize.width() * d.frameSize.height();
     }
 
-    std::sort(_videoQueue.begin(), _videoQueue.end(),
+    std::sort(videos.begin(), videos.end(),
               [&cost](const QString& a, const QString& b) { return cost[a] > cost[b]; });
 
-    for (auto path : _videoQueue)
+    for (auto path : videos)
       qDebug("estimate cost=%.2f path=%s", double(cost[path]), qUtf8Printable(path));
   }
+  _holdVideos = false;
+
+  if (!_scanCancelled.loadRelaxed()) queueFiles(images, videos);
 
   if (_params.dryRun) {
     qInfo() << "dry run, flushing queues";
     flush(false);
   }
 
-  _queuedFiles = _imageQueue.count() + _videoQueue.count();
-  if (_imageQueue.count() > 0 || _videoQueue.count() > 0) {
+  if (_queuedFiles > 0)
     qInfo() << "scan completed, removing" << expected.count() << "file(s), adding"
-            << _imageQueue.count() << "image(s)," << _videoQueue.count() << "video(s)";
-    QTimer::singleShot(1, this, &Scanner::processOne);
-  } else {
+            << _newImages.loadRelaxed() << "image(s)," << _newVideos.loadRelaxed() << "video(s)";
+  else
     qInfo() << "scan completed, no changes";
-    QTimer::singleShot(1, this, [&] { emit scanCompleted(); });
-  }
+
+  // processFinished() does not signal while the walk is running
+  if (remainingWork() <= 0) QTimer::singleShot(1, this, [&] { emit scanCompleted(); });
 }
 
 void Scanner::readArchive(const QString& path, QSet<QString>& expected) {
@@ -158,6 +321,8 @@ void Scanner::readArchive(const QString& path, QSet<QString>& expected) {
 
   const auto list = zip.getFileInfoList();
   for (const auto& entry : list) {
+    if (_scanCancelled.loadRelaxed()) return;
+
     QString file = entry.name;
     if (file.endsWith("/")) continue;
 
@@ -168,6 +333,7 @@ void Scanner::readArchive(const QString& path, QSet<QString>& expected) {
       setError(zipPath, ErrorZipFilter, _params.showIgnored);
       continue;
     }
+    bool isModified = false;
     if (expected.contains(zipPath)) {
       if (entry.dateTime < _modifiedSince) {
         skipped.append(zipPath);
@@ -175,6 +341,7 @@ void Scanner::readArchive(const QString& path, QSet<QString>& expected) {
         continue;
       } else {
         _modifiedFiles++;
+        isModified = true;
       }
     }
 
@@ -182,10 +349,7 @@ void Scanner::readArchive(const QString& path, QSet<QString>& expected) {
     const QString type = info.suffix().toLower();
 
     if ((_params.types & IndexParams::TypeImage) && _imageTypes.contains(type)) {
-      if (!isQueued(zipPath)) {
-        _imageQueue.append(zipPath);
-        _queuedWork.insert(zipPath);
-      }
+      addScanned(zipPath, false, isModified);
     } else {
       _ignoredFiles++;
       setError(zipPath, ErrorZipUnsupported, _params.showIgnored);
@@ -218,14 +382,84 @@ void Scanner::scanProgress(const QString& path) const {
 
   QString status =
       QString::asprintf("<NC>checking %s$<PL> new{i:%lld v:%lld} ignored:%d modified:%d ok:%d <EL>%s",
-                        qUtf8Printable(_topDirPath), _imageQueue.count(), _videoQueue.count(),
-                        _ignoredFiles, _modifiedFiles, _existingFiles, qUtf8Printable(elided));
+                        qUtf8Printable(_topDirPath), qint64(_newImages.loadRelaxed()),
+                        qint64(_newVideos.loadRelaxed()), _ignoredFiles.loadRelaxed(),
+                        _modifiedFiles.loadRelaxed(), _existingFiles.loadRelaxed(),
+                        qUtf8Printable(elided));
   qInfo().noquote() << status;
 }
 
+void Scanner::addScanned(const QString& path, bool isVideo, bool isModified) {
+  if (isVideo)
+    _newVideos++;
+  else
+    _newImages++;
+
+  QMutexLocker locker(&_scanMutex);
+  if (isModified) {
+    (isVideo ? _modifiedVideos : _modifiedImages).append(path);
+    return;
+  }
+
+  // wake the main thread when the first file is added, it takes everything
+  // that comes in before it runs
+  const bool wake = _scanImages.empty() && _scanVideos.empty();
+  (isVideo ? _scanVideos : _scanImages).append(path);
+  if (wake) QMetaObject::invokeMethod(this, &Scanner::queueScanned, Qt::QueuedConnection);
+}
+
+void Scanner::queueScanned() {
+  QStringList images, videos;
+  {
+    QMutexLocker locker(&_scanMutex);
+    images.swap(_scanImages);
+    videos.swap(_scanVideos);
+  }
+  if (_scanCancelled.loadRelaxed()) return;  // flushed, the walk is stopping
+
+  if (_holdVideos) {
+    _heldVideos += videos;
+    videos.clear();
+    if (_heldVideos.count() > _params.indexThreads) {
+      _holdVideos = false;
+      videos.swap(_heldVideos);
+    }
+  }
+
+  queueFiles(images, videos);
+}
+
+void Scanner::queueFiles(const QStringList& images, const QStringList& videos) {
+  for (const QString& path : images) {
+    if (_activeWork.contains(path)) {
+      qDebug() << "skipping active work" << path;
+      continue;
+    }
+    if (isQueued(path)) continue;
+    _imageQueue.append(path);
+    _queuedWork.insert(path);
+    _queuedFiles++;
+  }
+
+  for (const QString& path : videos) {
+    if (_activeWork.contains(path)) {
+      qDebug() << "skipping active work" << path;
+      continue;
+    }
+    if (isQueued(path)) continue;
+    _videoQueue.append(path);
+    _queuedWork.insert(path);
+    _queuedFiles++;
+  }
+
+  if (!_params.dryRun) schedule();
+}
+
 void Scanner::readDirectory(const QString& dirPath, const QMap<QString,QStringList> zipFiles, QSet<QString>& expected) {
-  const QDir dir(dirPath);
-  if (!dir.exists()) {
+  if (_scanCancelled.loadRelaxed()) return;
+
+  QVector<ScanEntry> entries;
+  if (!listDirectory(dirPath, entries)) {
     qWarning("%s does not exist", qUtf8Printable(dirPath));
     return;
   }
@@ -233,14 +467,13 @@ void Scanner::readDirectory(const QString& dirPath, const QMap<QString,QStringLi
   QStringList dirs;
   scanProgress(dirPath);
 
-  QDir::Filters filters = QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot;
+  for (const ScanEntry& entry : qAsConst(entries)) {
+    if (_scanCancelled.loadRelaxed()) return;
 
-  for (const QString& name : dir.entryList(filters)) {
-    QString path = dirPath + "/" + name;
-    const QFileInfo entry(path);
+    QString path = dirPath + "/" + entry.name;
 
     // junctions are effectively symlinks
-    if (!_params.followSymlinks && (entry.isSymLink() || entry.isJunction())) {
+    if (!_params.followSymlinks && (entry.isLink || entry.isJunction)) {
       _ignoredFiles++;
       setError(path, ErrorNoLinks, _params.showIgnored);
       continue;
@@ -249,68 +482,68 @@ void Scanner::readDirectory(const QString& dirPath, const QMap<QString,QStringLi
     if (!_params.dupInodes) {
       // if we see the same inode twice, ignore it
       // stops false duplicates and link recursion
+#ifdef Q_OS_LINUX
+      FileId id(entry.dev, entry.ino);
+#else
       FileId id(path);
+#endif
       if (id.isValid()) {
-        const auto& hash = _inodes;
-        auto it = hash.find(id);
-        if (it != hash.end()) {
+        QString firstPath;
+        {
+          QMutexLocker locker(&_scanMutex);
+          const auto& hash = _inodes;
+          auto it = hash.find(id);
+          if (it != hash.end())
+            firstPath = it.value();
+          else
+            _inodes.insert(id, path);
+        }
+        if (!firstPath.isNull()) {
           if (_params.showIgnored) {
             qWarning() << "ignoring dup inode:" << path;
-            qWarning() << "    first instance:" << it.value();
+            qWarning() << "    first instance:" << firstPath;
           }
           _ignoredFiles++;
           setError(path, ErrorDupInode, _params.showIgnored);
           continue;
-        } else
-          _inodes.insert(id, path);
+        }
       }
     }
 
     // prefer not to store symlinks in db
     // - if the link is broken or renamed, forces reindex
     // - allows links to be used for organizing, without re-indexing
-    if (_params.resolveLinks && (entry.isSymLink() || entry.isJunction())) {
+    // the resolved file could be queued twice, queueFiles() drops it
+    if (_params.resolveLinks && (entry.isLink || entry.isJunction)) {
       QString canonical;
 #ifdef Q_OS_WIN
-      if (entry.isJunction())  // qt will not resolve it ...
+      if (entry.isJunction)  // qt will not resolve it ...
         canonical = resolveJunction(path);
       else
 #endif
-        canonical = entry.canonicalFilePath();
-      if (canonical.startsWith(_topDirPath)) {
-        path = canonical;
-        _imageQueue.removeOne(path);
-        _videoQueue.removeOne(path);
-        _queuedWork.remove(path);
-      }
+        canonical = QFileInfo(path).canonicalFilePath();
+      if (canonical.startsWith(_topDirPath)) path = canonical;
     }
 
+    bool isModified = false;
     if (expected.contains(path)) {
       // metadataChangeTime() could be used but will re-index
       // changes that don't modify the file content
-      if (entry.lastModified() < _modifiedSince) {
+      if (entry.modified < _modifiedSince) {
         expected.remove(path);
         _existingFiles++;
         continue;
       }
       _modifiedFiles++;
+      isModified = true;
 
        // files with invalid modtimes will always be re-indexed
-      if (entry.lastModified() > _startTime)
+      if (entry.modified > _startTime)
         qWarning() << "future modtime:" << path;
     }
 
-    if (entry.isFile()) {
-      //            printf("considering: images=%d videos=%d %s \r",
-      //                   _imageQueue.count(), _videoQueue.count(),
-      //                   qPrintable(path));
-      //            fflush(stdout);
-      if (_activeWork.contains(path)) {
-        qDebug() << "skipping active work" << path;
-        continue;
-      }
-
-      const QString type = entry.suffix().toLower();
+    if (entry.isFile) {
+      const QString type = QFileInfo(entry.name).suffix().toLower();
       if (type.isEmpty()) {
         _ignoredFiles++;
         setError(path, ErrorNoType, _params.showIgnored);
@@ -318,25 +551,23 @@ void Scanner::readDirectory(const QString& dirPath, const QMap<QString,QStringLi
       }
 
       if ((_params.types & IndexParams::TypeImage) && _imageTypes.contains(type)) {
-        if (entry.size() < _params.minFileSize) {
+        if (entry.size < _params.minFileSize) {
           _ignoredFiles++;
           setError(path, ErrorTooSmall, _params.showIgnored);
-        } else if (!isQueued(path)) {
-          _imageQueue.append(path);
-          _queuedWork.insert(path);
-        }
+        } else
+          addScanned(path, false, isModified);
       } else if ((_params.types & IndexParams::TypeVideo) && _videoTypes.contains(type)) {
-        if (entry.size() < _params.minFileSize) {
+        if (entry.size < _params.minFileSize) {
           _ignoredFiles++;
           setError(path, ErrorTooSmall, _params.showIgnored);
-        } else if (!isQueued(path))
-          _videoQueue.append(path);
+        } else
+          addScanned(path, true, isModified);
       } else if (_archiveTypes.contains(type)) {
         // skip deep scan of zip files
         // use metadataChangeTime() since lastModified() will not detect the case
         // where a zip is replaced with an older zip with the same name
         // FIXME: metadataChangeTime() may not be available on all filesystems, must validate!
-        if (entry.metadataChangeTime() < _modifiedSince) {
+        if (entry.changed < _modifiedSince) {
           int removed = 0;
           const auto it = zipFiles.find(path);
           if (it != zipFiles.end())
@@ -354,7 +585,7 @@ void Scanner::readDirectory(const QString& dirPath, const QMap<QString,QStringLi
         _ignoredFiles++;
         setError(path, ErrorUnsupported, _params.showIgnored);
       }
-    } else if (entry.fileName() != INDEX_DIRNAME && entry.isDir()) {
+    } else if (entry.name != INDEX_DIRNAME && entry.isDir) {
       dirs.push_back(path);
     }
   }
@@ -372,9 +603,17 @@ void Scanner::flush(bool wait) {
 
   inProgress = true;
 
-  // empty waiting queues
+  // stop the directory walk, and empty waiting queues
+  if (_scanning) _scanCancelled.storeRelaxed(1);
   _imageQueue.clear();
   _videoQueue.clear();
+  _heldVideos.clear();
+  {
+    QMutexLocker locker(&_scanMutex);
+    _scanImages.clear();
+    _scanVideos.clear();
+  }
+  _queuedWork.clear();
 
   // remove unstarted jobs from threadpool (cleanup in processFinished())
   int cancelled = 0;
@@ -411,9 +650,14 @@ void Scanner::flush(bool wait) {
 }
 
 void Scanner::finish() {
+  if (!_scanning && remainingWork() <= 0) return;
+
   QEventLoop loop;
+  connect(this, &Scanner::scanCompleted, &loop, &QEventLoop::quit);
+
+  // progress display only, completion is signalled
   QTimer timer;
-  connect(&timer, &QTimer::timeout, [=, &timer, &loop]() {
+  connect(&timer, &QTimer::timeout, [=]() {
     const int pendingFiles = _imageQueue.count() + _videoQueue.count() + _activeWork.count();
 
     if (_queuedFiles > 0) {
@@ -429,9 +673,9 @@ void Scanner::finish() {
 
       const QString vProgress = vList.count() ? ", videos{" + vList.join(',') + '}' : "";
 
-      int gpuJobs = _gpuPool.activeThreadCount();
-      int cpuJobs = QThreadPool::globalInstance()->activeThreadCount();
-      int threads = totalThreadCount();
+      int gpuJobs = _gpuJobs;
+      int cpuJobs = _work.count() - gpuJobs;
+      int threads = _cpuThreads;
 
       QString runningStatus;
       if (gpuJobs)
@@ -455,189 +699,141 @@ void Scanner::finish() {
       for (const QString& k : qAsConst(vDone))
         _videoProgress.remove(k);
     }
-
-    if (pendingFiles == 0) {
-      timer.stop();
-      loop.exit(0);
-      return;
-    }
-    timer.setInterval(100);
   });
 
-  timer.setInterval(1);
-  timer.start();
+  timer.start(100);
   loop.exec();
 }
 
-int Scanner::totalThreadCount() const {
-//  int extraThreads = 0;
-//  for (const auto* w : _work)
-//    if (w->future().isRunning())
-//      extraThreads += w->property("childThreads").toInt();
+void Scanner::schedule() {
+  // job scheduler
+  // - runs in main thread when jobs are queued or a job completes
+  // - process longest jobs first (video before images), better utilization
+  // - jobs are admitted against a budget of indexThreads, which counts
+  //   the decoder threads of each video, so the pool is never oversubscribed
+  //   and never has queued jobs waiting on a thread
+  // - hardware decoders have their own budget of gpuThreads
 
-  return QThreadPool::globalInstance()->activeThreadCount() + _extraThreads;
-}
+  while (!_videoQueue.empty()) {
+    const QString path = _videoQueue.first();
+    const MessageContext mc(path.mid(_topDirPath.length() + 1));
 
-void Scanner::processOne() {
-  QFuture<IndexResult> f;
-  bool queuedImage = false;
+    const bool tryGpu = _params.useHardwareDec && _gpuJobs < _params.gpuThreads;
 
-  // job scheduler
-  // - runs in main thread when a job completes or until
-  //   queue limits are reached.
-  // - process longest jobs first (video before images), better utilization
-  // - video decoder can be multithreaded, decreases # of parallel jobs
-  //
-  // queue enough work to keep thread pool full
-  // - queue up to _params.writeBatchSize for images to hide database write latency
-  //
-  int queueLimit = _params.indexThreads;
-
-  if (_videoQueue.empty()) {
-    queueLimit = _params.writeBatchSize;
-
-    if (_activeWork.count() < _params.indexThreads &&  // not enough work queued
-        _imageQueue.size() > queueLimit &&             // there is enough available
-        _processedFiles > queueLimit)                  // we have already processed some
-      qWarning() << "worker starvation, maybe increase writeBatchSize (-i.bsize)";
-  }
+    const int availThreads = _params.indexThreads - _cpuThreads;
+    Q_ASSERT(availThreads >= 0);
 
-  if (_activeWork.count() < queueLimit) {
-    QString path;         // file path
-    int childThreads = 0; // additional threads used by job
-    if (!_videoQueue.empty()) {
-      path = _videoQueue.first();
-      const MessageContext mc(path.mid(_topDirPath.length() + 1));
-
-      const bool tryGpu = _params.useHardwareDec &&
-                          _gpuPool.activeThreadCount() < _gpuPool.maxThreadCount();
-
-      const int activeThreads = totalThreadCount();
-      const int availThreads = _params.indexThreads - activeThreads;
-      Q_ASSERT(availThreads >= 0);
-
-      // try to process even if we don't have enough threads, which will max
-      // out the cpu now, at the expense of possibly underutilizing later
-      // BUG: after some time #jobs > indexThreads/decoderThreads
-      //      even when all jobs are mt
-      int cpuThreads = qMin(availThreads, _params.decoderThreads);
-
-      // last video can have all the threads to reduce starvation
-      if (_videoQueue.count() == 1)
-        cpuThreads = availThreads;
-
-      // qWarning() << "threads" << activeThreads << availThreads << cpuThreads;
-
-      if (tryGpu || cpuThreads > 0) {
-        VideoContext* v = initVideoProcess(path, tryGpu, cpuThreads);
-        if (v) {
-          QThreadPool* pool = nullptr;
-          if (v->isHardware()) {
-            pool = &_gpuPool;
-          } else if (cpuThreads > 0) {
-            pool = QThreadPool::globalInstance();
-
-            // subtract the job thread, which means actual threads used are greater
-            // - if indexThreads is divisible by decoderThreads we get expected number of parallel jobs
-            // - the job thread isn't doing much compared to the decoder
-            // - the total utilization is usually much less than 100% of threadCount threads.
-            childThreads += v->threadCount() - 1;
-          }
+    int cpuThreads = qMin(availThreads, _params.decoderThreads);
 
-          if (!pool && tryGpu) {
-            // stop gpu from retrying the same file
-            // FIXME: disable gpu after too many fails
-            // FIXME: search queue for possibly compatible files
-            _videoQueue.removeFirst();
-            _videoQueue.append(path);
-          }
+    // last video can have all the threads to reduce starvation
+    if (_videoQueue.count() == 1) cpuThreads = availThreads;
 
-          if (pool) {
-            f = QtConcurrent::run(pool, &Scanner::processVideo, this, v);
-            _videoQueue.removeFirst();
-          }
-        } else
-          _videoQueue.removeFirst();  // failed to open
-      }
-    } else if (!_imageQueue.empty()) {
-      path = _imageQueue.takeFirst();
-      _queuedWork.remove(path);
-      f = QtConcurrent::run(&Scanner::processImageFile, this, path, QByteArray());
-      queuedImage = true;
-    }
+    if (!tryGpu && cpuThreads <= 0) break;
 
-    if (!f.isCanceled()) {
-      _activeWork.insert(path);
-      QFutureWatcher<IndexResult>* w = new QFutureWatcher<IndexResult>;
-      connect(w, SIGNAL(started()), this, SLOT(processStarted()));
-      connect(w, SIGNAL(finished()), this, SLOT(processFinished()));
-      w->setFuture(f);
-      w->setProperty("path", path);
-      w->setProperty("childThreads", childThreads);
-      _work.append(w);
+    _videoQueue.removeFirst();
+    _queuedWork.remove(path);
+
+    VideoContext* v = initVideoProcess(path, tryGpu, cpuThreads);
+    if (!v) continue;  // failed to open
+
+    if (v->isHardware()) {
+      startJob(QtConcurrent::run(&_gpuPool, &Scanner::processVideo, this, v), {path}, 0, true);
+    } else if (cpuThreads > 0) {
+      // the job thread isn't doing much compared to the decoder, count it as
+      // one of the decoder threads
+      const int threads = qBound(1, v->threadCount(), availThreads);
+      startJob(QtConcurrent::run(QThreadPool::globalInstance(), &Scanner::processVideo, this, v),
+               {path}, threads, false);
+    } else {
+      // hardware decoder failed and there are no threads left,
+      // stop gpu from retrying the same file
+      // FIXME: disable gpu after too many fails
+      // FIXME: search queue for possibly compatible files
+      delete v;
+      _videoQueue.append(path);
+      _queuedWork.insert(path);
+      break;
     }
   }
 
-  // if the queues are not empty, call processOne again.
-  // fixme: seems delay is no longer needed
-  int delay = -1;
-  if (!_videoQueue.empty())
-    delay = 100;
-  else if (!_imageQueue.empty()) {
-    // if we did not queue an image, sleep 1ms to reduce polling,
-    // otherwise run immediately to top-up queue
-    if (queuedImage)
-      delay = 0;
-    else
-      delay = 1;
+  // videos go first, images fill whatever budget is left; a freed thread goes
+  // to the next video before another image batch since this runs again then
+
+  while (!_imageQueue.empty() && _cpuThreads < _params.indexThreads) {
+    // batches amortize the scheduling cost; but not so large that the tail of
+    // the queue can't be spread over all threads
+    const int batchSize = qBound(1, int(_imageQueue.count() / _params.indexThreads), 16);
+
+    const QStringList batch = _imageQueue.mid(0, batchSize);
+    _imageQueue.remove(0, batchSize);
+    for (const QString& path : batch) _queuedWork.remove(path);
+
+    auto f = QtConcurrent::run(
+        [this](QPromise<IndexResult>& promise, const QStringList& paths) {
+          for (const QString& path : paths) {
+            if (promise.isCanceled()) return;
+            promise.addResult(processImageFile(path));
+          }
+        },
+        batch);
+
+    startJob(f, batch, 1, false);
   }
-  if (delay >= 0) QTimer::singleShot(delay, this, &Scanner::processOne);
 }
 
-void Scanner::processStarted() {
-  auto w = dynamic_cast<QFutureWatcher<IndexResult>*>(sender());
-  if (!w) return;
+void Scanner::startJob(const QFuture<IndexResult>& future, const QStringList& paths, int threads,
+                       bool gpu) {
+  for (const QString& path : paths) _activeWork.insert(path);
+
+  _cpuThreads += threads;
+  if (gpu) _gpuJobs++;
+
+  auto* w = new QFutureWatcher<IndexResult>;
+  connect(w, &QFutureWatcher<IndexResult>::resultReadyAt, this,
+          [this, w](int index) { processResult(w->resultAt(index)); });
+  connect(w, &QFutureWatcher<IndexResult>::finished, this, &Scanner::processFinished);
+  w->setProperty("paths", paths);
+  w->setProperty("threads", threads);
+  w->setProperty("gpu", gpu);
+  _work.append(w);
+  w->setFuture(future);
+}
+
+void Scanner::processResult(IndexResult result) {
+  _processedFiles++;
+  if (result.ok) emit mediaProcessed(result.media);
 
-  _extraThreads += w->property("childThreads").toInt();
+  VideoContext* v = result.context;
+  if (v) {
+    delete v;
+    result.context = nullptr;
+  }
+
+  // TODO: indicate when done with a type so caller (engine) can commit early
+  // for example there are no images left and long-running video is holding
+  // up the commit
+
+  _activeWork.remove(result.path);
 }
 
 void Scanner::processFinished() {
   auto w = dynamic_cast<QFutureWatcher<IndexResult>*>(sender());
   if (!w) return;
 
-  _extraThreads -= w->property("childThreads").toInt();
-  Q_ASSERT(_extraThreads >= 0);
+  _cpuThreads -= w->property("threads").toInt();
+  if (w->property("gpu").toBool()) _gpuJobs--;
+  Q_ASSERT(_cpuThreads >= 0 && _gpuJobs >= 0);
 
-  IndexResult result;
-  if (w->future().isCanceled()) {
-    // if cancelled we cannot call .result()
-    result.path = w->property("path").toString();
-    result.ok = false;
-  } else {
-    _processedFiles++;
-    result = w->future().result();
-    Media& m = result.media;
-    if (result.ok) emit mediaProcessed(m);
-
-    VideoContext* v = result.context;
-    if (v) {
-      delete v;
-      result.context = nullptr;
-    }
-
-    // TODO: indicate when done with a type so caller (engine) can commit early
-    // for example there are no images left and long-running video is holding
-    // up the commit
-  }
+  // if cancelled, some paths have no result
+  const QStringList paths = w->property("paths").toStringList();
+  for (const QString& path : paths) _activeWork.remove(path);
 
-  // printf("%c", result.ok ? '+' : 'X');
-  // fflush(stdout);
-
-  _activeWork.remove(result.path);
   _work.removeOne(w);
   w->deleteLater();
 
-  if (_activeWork.empty() && _imageQueue.empty() && _videoQueue.empty()) {
+  schedule();
+
+  if (!_scanning && _activeWork.empty() && _imageQueue.empty() && _videoQueue.empty()) {
     qDebug() << "indexing completed";
     emit scanCompleted();
   }
@@ -850,6 +1046,12 @@ IndexResult Scanner::processImageFile(const QString& path, const QByteArray& dat
     return result;
   }
 
+  // the browser wants a preview, we have one almost ready
+  if (_previews && _params.writePreviews &&
+      !_previews->contains(digest, PreviewCache::IndexSize))
+    _previews->store(digest, PreviewCache::IndexSize, -1,
+                     PreviewCache::scaled(qImg, PreviewCache::IndexSize));
+
   // release the memory now, process will take a while and we could use it
   bytes.clear();
   result = processImage(path, digest, qImg);
@@ -869,6 +1071,8 @@ VideoContext* Scanner::initVideoProcess(const QString& path, bool tryGpu, int cp
   opt.maxW = 128;
   opt.fast = true; // enable speeds ok for indexing
   opt.gray = true; // only look at the "Y" channel, dct algo is grayscale
+  opt.iframes = _params.videoKeyFrames;
+  opt.lowres = _params.videoLowres;
   if (video->open(path, opt) < 0) {
     setError(path, ErrorLoad);
     delete video;
@@ -918,7 +1122,10 @@ IndexResult Scanner::processVideo(VideoContext* video) const {
       });
     };
     VideoIndex index;
-    m.makeVideoIndex(*video, _params.videoThreshold, index, progressCb);
+    // one hasher for each video that can be indexed at once
+    const int maxHashers = _params.indexThreads + _params.gpuThreads;
+    m.makeVideoIndex(*video, _params.videoThreshold, _params.videoFrameStep, maxHashers, index,
+                     progressCb);
     m.setVideoIndex(index);
 
     int64_t end = QDateTime::currentMSecsSinceEpoch();
@@ -998,6 +1205,9 @@ IndexParams::IndexParams() {
   add({"dups", "Follow duplicate inodes (hard links, soft links etc)", Value::Bool, counter++,
        SET_BOOL(dupInodes), GET(dupInodes), NO_NAMES, NO_RANGE});
 
+  add({"preview", "Write image previews for the gui", Value::Bool, counter++,
+       SET_BOOL(writePreviews), GET(writePreviews), NO_NAMES, NO_RANGE});
+
   add({"ljf", "Estimate job cost and process longest jobs first", Value::Bool, counter++,
        SET_BOOL(estimateCost), GET(estimateCost), NO_NAMES, NO_RANGE});
 
@@ -1022,6 +1232,15 @@ IndexParams::IndexParams() {
   add({"vht", "Video index threshold for discarding hashes", Value::Int, counter++,
        SET_INT(videoThreshold), GET(videoThreshold), NO_NAMES, GET_CONST(nonzero)});
 
+  add({"vkey", "Index only keyframes of videos (fast, less accurate)", Value::Bool, counter++,
+       SET_BOOL(videoKeyFrames), GET(videoKeyFrames), NO_NAMES, NO_RANGE});
+
+  add({"vstep", "Index every Nth frame of videos", Value::Int, counter++, SET_INT(videoFrameStep),
+       GET(videoFrameStep), NO_NAMES, GET_CONST(nonzero)});
+
+  add({"vlowres", "Video lowres decoding factor (1=1/2, 2=1/4, etc; old codecs only)", Value::Int,
+       counter++, SET_INT(videoLowres), GET(videoLowres), NO_NAMES, GET_CONST(positive)});
+
   add({"gpu", "Enable gpu video decoding (Nvidia)", Value::Bool, counter++,
        SET_BOOL(useHardwareDec), GET(useHardwareDec), NO_NAMES, NO_RANGE});
 
@@ -24,6 +24,7 @@
 #include "params.h"
 
 class FileId;
+class PreviewCache;
 
 /// settings to control scanning/indexing
 class IndexParams : public Params {
@@ -46,12 +47,16 @@ class IndexParams : public Params {
   int indexThreads = 0;         // total max threads (cpu) <=0 means auto detect
   int gpuThreads = 1;           // number of parallel hardware decoders
   int videoThreshold = 8;       // dct threshold for skipping similar nearby frames
+  bool videoKeyFrames = false;  // only index intra frames of videos (fast, sparse index)
+  int videoFrameStep = 1;       // only index every Nth frame of videos (sparse index)
+  int videoLowres = 0;          // lowres decoding factor for codecs that support it (fast)
   int writeBatchSize = 1024;    // size of item batch when writing to database
   bool estimateCost = true;     // estimate indexing cost to schedule jobs better
   bool showIgnored = false;     // show all ignored files/dirs
   bool dryRun = false;          // scan for changes but do not process
   bool followSymlinks = false;  // follow symlinks to files/dirs
   bool resolveLinks = false;    // index the resolved symlink instead of link
+  bool writePreviews = false;   // write image previews for the gui (PreviewCache)
 #ifdef Q_OS_WIN
   bool dupInodes = true;  // symlinks are rarely used; potentially huge performance drop
 #else
@@ -109,6 +114,9 @@ class Scanner : public QObject {
   void setIndexParams(const IndexParams& params) { _params = params; }
   const IndexParams& indexParams() const { return _params; }
 
+  /// cache for image previews, written while processing if enabled by IndexParams
+  void setPreviewCache(PreviewCache* cache) { _previews = cache; }
+
   /// image file extensions we will try to process
   const QSet<QString>& imageTypes() const { return _imageTypes; }
 
@@ -125,6 +133,11 @@ class Scanner : public QObject {
    *        [out] list of what the scanner did not see (removed files)
    * @param modifiedSince file is "removed" if modified after this
    *
+   * The directory walk runs in a thread, and processing starts on the files
+   * found while it runs; the event loop is spun (QEventLoop::exec()) until the
+   * walk is complete. Modified files are held back until then, since the
+   * caller will remove them first.
+   *
    * @note Connect signals to get the results of the scan
    */
   void scanDirectory(
@@ -185,14 +198,12 @@ class Scanner : public QObject {
   void scanCompleted();
 
  private Q_SLOTS:
-  // remove one item from queue and process; if there is still more to process,
-  // schedule the next call to processOne()
-  void processOne();
+  // start jobs from the queues until the thread budget is used; called when
+  // files are queued or a job finishes
+  void schedule();
 
-  void processStarted();
-
-  // called when a QFuture<Media> finishes processing,
-  // at which point we call fileAdded() and remove it from _work
+  // called when a job finishes (or is cancelled), release its
+  // threads, remove it from _work and schedule more
   void processFinished();
 
   // prepare video to process in the main thread
@@ -206,26 +217,38 @@ class Scanner : public QObject {
   void readArchive(const QString& path, QSet<QString>& expected);
   void scanProgress(const QString& path) const;
 
+  // directory walk found a file to process, pass it to the main thread
+  void addScanned(const QString& path, bool isVideo, bool isModified);
+
+  // take files passed by the walk (main thread)
+  void queueScanned();
+
+  // add files to the queues and schedule them (main thread)
+  void queueFiles(const QStringList& images, const QStringList& videos);
+
   bool isQueued(const QString& path) const { return _queuedWork.contains(path); }
 
   int remainingWork() const {
     return _activeWork.count() + _videoQueue.count() + _imageQueue.count();
   }
 
-  // number of running thread pool and extra threads
-  int totalThreadCount() const;
+  // submit job to the thread pool
+  void startJob(const QFuture<IndexResult>& future, const QStringList& paths, int threads,
+                bool gpu);
+
+  // called for each result of a job
+  void processResult(IndexResult result);
 
   static void setError(const QString& path, const QString& error, bool print=true);
 
   IndexParams _params;
+  PreviewCache* _previews = nullptr;
 
   QSet<QString> _imageTypes;
   QSet<QString> _videoTypes;
   QStringList _jpegTypes;
   QStringList _archiveTypes;
 
-  QHash<FileId, QString> _inodes;  // unique files (inodes) seen during scan (link tracking)
-
   // jobs exist in (only) one of these 3 lists managed by the main thread
   QSet<QString> _activeWork;  // scheduled on thread pool
   QStringList _videoQueue;    // not on thread pool
@@ -236,14 +259,31 @@ class Scanner : public QObject {
   QSet<QString> _queuedWork;  // all jobs; for fast lookup
 
   QThreadPool _gpuPool;       // separate pool since cpu doesn't do much
+  QThreadPool _scanPool;      // directory walk
+
+  // written by the directory walk while it runs
+  QMutex _scanMutex;                             // guards the lists and _inodes
+  QStringList _scanImages, _scanVideos;          // found, not queued yet
+  QStringList _modifiedImages, _modifiedVideos;  // found, held until walk completes
+  QHash<FileId, QString> _inodes;                // unique files seen (link tracking)
+  QAtomicInt _newImages, _newVideos;             // found, for progress
+  QAtomicInt _existingFiles, _ignoredFiles, _modifiedFiles;  // for progress
+  bool _scanning = false;                        // walk is running
+  QAtomicInt _scanCancelled;                     // flush() during the walk
+
+  // videos are held until the walk completes to sort them longest-job-first,
+  // unless there are too many for the order to matter (main thread)
+  bool _holdVideos = false;
+  QStringList _heldVideos;
 
   QString _topDirPath;        // relative path for logging
-  int _existingFiles = 0, _ignoredFiles = 0, _modifiedFiles = 0, _queuedFiles = 0, _processedFiles = 0;
+  int _queuedFiles = 0, _processedFiles = 0;
 
   QDateTime _modifiedSince;   // date index was last updated, to re-index modified files
   QDateTime _startTime;       // time when scan started
 
-  int _extraThreads = 0;      // count threads not managed by thread pool
+  int _cpuThreads = 0;        // threads used by scheduled jobs, including decoder threads
+  int _gpuJobs = 0;           // scheduled hardware decoder jobs
 
   QMutex _progressMutex;      // track video progress for display purposes
   QHash<QString, int> _videoProgress;
@@ -23,14 +23,443 @@
 #include "cvutil.h"
 #include "hamm.h"
 #include "index.h"
+#include "ioutil.h"
 #include "media.h"
 #include "opencv2/features2d.hpp"
 #include "opencv2/video/tracking.hpp"  // estimateRigidTransform
 #include "profile.h"
 
-TemplateMatcher::TemplateMatcher() {}
+#include <numeric>  // iota
+
+/// features of one image, and the scale they were made at
+struct TemplateMatcher::Features {
+  QSize size;          // size of the decoded image, before scaling
+  float scale = 1.0f;  // scale applied before making features
+  KeyPointList keypoints;
+  KeyPointDescriptors descriptors;
+};
+
+/**
+ * Feature cache file, one per md5; holds a few feature sets since the
+ * same image is used with different feature counts and scales
+ *
+ * [header][entry][keypoints][descriptors][entry]...
+ */
+#define TMF_MAGIC "cbirdTMF"
+#define TMF_VERSION (1)
+#define TMF_MAX_ENTRIES (4)
+#define TMF_DESC_COLS (32)  // bytes per ORB descriptor
+
+struct TmfHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t numEntries;
+  int32_t width, height;  // size of decoded image
+};
+
+struct TmfEntry {
+  uint32_t numFeatures;  // requested number of keypoints
+  uint32_t maxSize;      // longest side after scaling, 0 if not scaled
+  uint32_t numKeypoints;
+  int32_t descRows, descCols, descType;
+};
+
+struct TmfKeyPoint {
+  float x, y, size, angle, response;
+  int32_t octave, classId;
+};
+
+struct TmfFeatureSet {
+  TmfEntry entry;
+  KeyPointList keypoints;
+  KeyPointDescriptors descriptors;
+};
+
+static bool readFeatureFile(const QString& path, QSize& size, QVector<TmfFeatureSet>& sets) {
+  QFile f(path);
+  if (!f.open(QFile::ReadOnly)) return false;
+
+  const QByteArray data = f.readAll();
+  const char* ptr = data.constData();
+  const char* end = ptr + data.size();
+
+  TmfHeader header;
+  if (end - ptr < qsizetype(sizeof(header))) return false;
+  memcpy(&header, ptr, sizeof(header));
+  ptr += sizeof(header);
+
+  if (memcmp(header.magic, TMF_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TMF_VERSION || header.numEntries > TMF_MAX_ENTRIES) {
+    qWarning() << "invalid or old version, ignoring:" << path;
+    return false;
+  }
+
+  size = QSize(header.width, header.height);
+
+  for (uint32_t i = 0; i < header.numEntries; ++i) {
+    TmfFeatureSet set;
+    TmfEntry& e = set.entry;
+    if (end - ptr < qsizetype(sizeof(e))) return false;
+    memcpy(&e, ptr, sizeof(e));
+    ptr += sizeof(e);
+
+    if (e.descRows < 0 || e.descCols < 0 || uint32_t(e.descRows) > e.numKeypoints) return false;
+
+    if (uint64_t(end - ptr) < uint64_t(e.numKeypoints) * sizeof(TmfKeyPoint)) return false;
+    set.keypoints.resize(e.numKeypoints);
+    for (cv::KeyPoint& kp : set.keypoints) {
+      TmfKeyPoint tkp;
+      memcpy(&tkp, ptr, sizeof(tkp));
+      ptr += sizeof(tkp);
+      kp = cv::KeyPoint(tkp.x, tkp.y, tkp.size, tkp.angle, tkp.response, tkp.octave,
+                        tkp.classId);
+    }
+
+    if (e.descRows > 0) {
+      // check before allocating, the entry could be anything
+      if (e.descType != CV_8UC1 || e.descCols != TMF_DESC_COLS ||
+          uint64_t(end - ptr) < uint64_t(e.descRows) * TMF_DESC_COLS)
+        return false;
+      set.descriptors.create(e.descRows, e.descCols, e.descType);
+      const size_t rowLen = TMF_DESC_COLS;
+      for (int row = 0; row < e.descRows; ++row) {
+        memcpy(set.descriptors.ptr(row), ptr, rowLen);
+        ptr += rowLen;
+      }
+    }
+    sets.append(set);
+  }
+
+  return true;
+}
+
+static void writeFeatureFile(const QString& path, const QSize& size,
+                             const QVector<TmfFeatureSet>& sets) {
+  writeFileAtomically(path, [&](QFile& f) {
+    auto write = [&f](const void* data, qint64 len) {
+      if (f.write((const char*)data, len) != len) throw f.errorString();
+    };
+
+    TmfHeader header;
+    memcpy(header.magic, TMF_MAGIC, sizeof(header.magic));
+    header.version = TMF_VERSION;
+    header.numEntries = uint32_t(sets.count());
+    header.width = size.width();
+    header.height = size.height();
+    write(&header, sizeof(header));
+
+    for (const TmfFeatureSet& set : sets) {
+      write(&set.entry, sizeof(set.entry));
+
+      for (const cv::KeyPoint& kp : set.keypoints) {
+        const TmfKeyPoint tkp{kp.pt.x,     kp.pt.y,   kp.size,    kp.angle,
+                              kp.response, kp.octave, kp.class_id};
+        write(&tkp, sizeof(tkp));
+      }
+
+      const qint64 rowLen = qint64(set.descriptors.cols * set.descriptors.elemSize());
+      for (int row = 0; row < set.descriptors.rows; ++row) write(set.descriptors.ptr(row), rowLen);
+    }
+  });
+}
+
+/// add feature set to the cache file, replacing the oldest one if it is full
+static void addFeatureSet(const QString& path, const QSize& size, const TmfFeatureSet& set) {
+  static QMutex mutex;  // concurrent match() could write the same file
+  QMutexLocker locker(&mutex);
+
+  if (set.entry.descRows > 0 &&
+      (set.entry.descType != CV_8UC1 || set.entry.descCols != TMF_DESC_COLS)) {
+    qWarning() << "unexpected descriptor format, not cached:" << path;
+    return;
+  }
+
+  QSize oldSize;
+  QVector<TmfFeatureSet> sets;
+  if (!readFeatureFile(path, oldSize, sets) || oldSize != size) sets.clear();
+
+  while (sets.count() >= TMF_MAX_ENTRIES) sets.removeFirst();
+  sets.append(set);
+
+  try {
+    writeFeatureFile(path, size, sets);
+  } catch (const QString& error) {
+    qWarning() << "failed to write feature cache:" << path << error;
+  }
+}
+
+/**
+ * Remove least recently used feature files if the cache is over its limit;
+ * in the background, and at most once a minute per cache
+ */
+static void evictFeatureFiles(const QString& dirPath, qint64 maxBytes) {
+  static QMutex mutex;
+  static QHash<QString, qint64> lastRun;
+  {
+    QMutexLocker locker(&mutex);
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64& last = lastRun[dirPath];
+    if (now - last < 60 * 1000) return;
+    last = now;
+  }
+
+  (void)QtConcurrent::run([dirPath, maxBytes]() { removeLeastRecentFiles(dirPath, maxBytes); });
+}
+
+/**
+ * Score cache file, an array of records holding the md5 pair (in byte order),
+ * the parameters that affect the score, and the score
+ */
+#define TMS_FILENAME "tmscores.dat"
+#define TMS_MAGIC "cbirdTMS"
+#define TMS_VERSION (1)
+#define TMS_KEY_SIZE (48)
+
+struct TmsHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+};
+
+struct TmsRecord {
+  char key[TMS_KEY_SIZE];  // see scoreKey()
+  int32_t score;
+};
+
+static QMutex scoreFileMutex;  // cache file is read-modify-write
+
+/// key for the score of a pair, same for either order; null if an md5 is invalid
+static QByteArray scoreKey(const QString& md5a, const QString& md5b, const SearchParams& params) {
+  QByteArray a = QByteArray::fromHex(md5a.toLatin1());
+  QByteArray b = QByteArray::fromHex(md5b.toLatin1());
+  if (a.size() != 16 || b.size() != 16) return QByteArray();
+  if (b < a) std::swap(a, b);
+
+  const int32_t p[4] = {params.needleFeatures, params.haystackFeatures, params.cvThresh,
+                        params.tmScalePct};
+  QByteArray key = a + b;
+  key.append((const char*)p, sizeof(p));
+  Q_ASSERT(key.size() == TMS_KEY_SIZE);
+  return key;
+}
+
+static bool readScoreFile(const QString& path, QHash<QByteArray, int>& scores) {
+  QFile f(path);
+  if (!f.open(QFile::ReadOnly)) return false;
+
+  TmsHeader header;
+  if (f.read((char*)&header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, TMS_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TMS_VERSION ||
+      uint64_t(f.size()) != sizeof(header) + uint64_t(header.count) * sizeof(TmsRecord)) {
+    qWarning() << "invalid or old version, ignoring:" << path;
+    return false;
+  }
+
+  const QByteArray data = f.readAll();
+  const TmsRecord* records = reinterpret_cast<const TmsRecord*>(data.constData());
+
+  scores.reserve(scores.count() + int(header.count));
+  for (uint32_t i = 0; i < header.count; ++i)
+    scores.insert(QByteArray(records[i].key, TMS_KEY_SIZE), records[i].score);
+
+  return true;
+}
 
-TemplateMatcher::~TemplateMatcher() {}
+static void writeScoreFile(const QString& path, const QHash<QByteArray, int>& scores) {
+  writeFileAtomically(path, [&scores](QFile& f) {
+    TmsHeader header;
+    memcpy(header.magic, TMS_MAGIC, sizeof(header.magic));
+    header.version = TMS_VERSION;
+    header.count = uint32_t(scores.count());
+
+    QByteArray data;
+    data.reserve(int(sizeof(header) + scores.count() * sizeof(TmsRecord)));
+    data.append((const char*)&header, sizeof(header));
+
+    for (auto it = scores.constBegin(); it != scores.constEnd(); ++it) {
+      TmsRecord record;
+      Q_ASSERT(it.key().size() == TMS_KEY_SIZE);
+      memcpy(record.key, it.key().constData(), TMS_KEY_SIZE);
+      record.score = it.value();
+      data.append((const char*)&record, sizeof(record));
+    }
+
+    if (f.write(data) != data.size()) throw f.errorString();
+  });
+}
+
+/**
+ * If the candidate image is much larger than the template, it generates
+ * too many features that don't show up in the template. If we have some
+ * idea of how much cropping there is we can shrink the candidate first.
+ * @param maxSize longest side after scaling, or 0 if not scaled
+ */
+static float candidateScale(const QSize& cand, const QSize& tmpl, int scalePct, int& maxSize) {
+  maxSize = 0;
+  if (tmpl.isEmpty() || tmpl.width() * tmpl.height() >= cand.width() * cand.height()) return 1.0f;
+
+  const int cSize = std::max(cand.width(), cand.height());
+  const int tSize = std::max(tmpl.width(), tmpl.height());
+  const int size = tSize * scalePct / 100.0;
+  if (cSize <= size) return 1.0f;
+
+  maxSize = size;
+  return float(size) / cSize;
+}
+
+TemplateMatcher::TemplateMatcher(const QString& cachePath) {
+  if (cachePath.isEmpty()) return;
+
+  _scorePath = cachePath + "/" TMS_FILENAME;
+
+  _featurePath = cachePath + "/tmfeatures";
+  if (!QDir().mkpath(_featurePath)) {
+    qWarning() << "cannot create feature cache, disabled:" << _featurePath;
+    _featurePath.clear();
+  }
+
+  bool ok = false;
+  const int mb = qEnvironmentVariableIntValue("CBIRD_FEATURE_CACHE_MB", &ok);
+  _featureMaxBytes = qint64(ok && mb > 0 ? mb : 1024) * 1024 * 1024;
+}
+
+TemplateMatcher::~TemplateMatcher() {
+  saveScores();
+  if (_featuresAdded.loadRelaxed()) evictFeatureFiles(_featurePath, _featureMaxBytes);
+}
+
+void TemplateMatcher::loadScores() {
+  if (_scoresLoaded.loadAcquire()) return;
+
+  QWriteLocker locker(&_lock);
+  if (_scoresLoaded.loadRelaxed()) return;
+
+  if (!_scorePath.isEmpty()) {
+    QMutexLocker fileLocker(&scoreFileMutex);
+    uint64_t then = nanoTime();
+    if (readScoreFile(_scorePath, _cache))
+      qDebug("loaded %d scores in %dms", int(_cache.count()),
+             int((nanoTime() - then) / 1000000));
+  }
+
+  _scoresLoaded.storeRelease(1);
+}
+
+void TemplateMatcher::saveScores() {
+  QWriteLocker locker(&_lock);
+  if (_scorePath.isEmpty() || _added.isEmpty()) return;
+
+  // merge, since another instance or process could have saved since we loaded
+  QMutexLocker fileLocker(&scoreFileMutex);
+  QHash<QByteArray, int> scores;
+  readScoreFile(_scorePath, scores);
+  for (const QByteArray& key : qAsConst(_added)) scores.insert(key, _cache.value(key));
+
+  try {
+    writeScoreFile(_scorePath, scores);
+    _added.clear();
+  } catch (const QString& error) {
+    qWarning() << "failed to write score cache:" << _scorePath << error;
+  }
+}
+
+void TemplateMatcher::removeFeatures(const QString& cachePath, const QStringList& md5s) {
+  const QString dirPath = cachePath + "/tmfeatures";
+  for (const QString& md5 : md5s) QFile::remove(dirPath + "/" + md5 + ".tmf");
+}
+
+void TemplateMatcher::removeScores(const QString& cachePath, const QStringList& md5s) {
+  const QString path = cachePath + "/" TMS_FILENAME;
+  if (md5s.isEmpty() || !QFileInfo::exists(path)) return;
+
+  QSet<QByteArray> removed;
+  for (const QString& md5 : md5s) removed.insert(QByteArray::fromHex(md5.toLatin1()));
+
+  QMutexLocker locker(&scoreFileMutex);
+  QHash<QByteArray, int> scores;
+  if (!readScoreFile(path, scores)) return;
+
+  const int count = scores.count();
+  for (auto it = scores.begin(); it != scores.end();)
+    if (removed.contains(it.key().left(16)) || removed.contains(it.key().mid(16, 16)))
+      it = scores.erase(it);
+    else
+      ++it;
+
+  if (scores.count() == count) return;
+
+  try {
+    writeScoreFile(path, scores);
+  } catch (const QString& error) {
+    qWarning() << "failed to write score cache:" << path << error;
+  }
+}
+
+bool TemplateMatcher::features(const Media& m, int numFeatures, const QSize& tmplSize,
+                               int scalePct, Features& f, cv::Mat& img) const {
+  QString path;
+  if (!_featurePath.isEmpty() && !m.md5().isEmpty()) path = _featurePath + "/" + m.md5() + ".tmf";
+
+  int maxSize = 0;
+
+  if (!path.isEmpty()) {
+    QSize size;
+    QVector<TmfFeatureSet> sets;
+    if (readFeatureFile(path, size, sets)) {
+      const float scale = candidateScale(size, tmplSize, scalePct, maxSize);
+      for (const TmfFeatureSet& set : qAsConst(sets))
+        if (set.entry.numFeatures == uint32_t(numFeatures) &&
+            set.entry.maxSize == uint32_t(maxSize)) {
+          // modtime is the lru order; an hour is close enough, saves writes
+          QFile file(path);
+          const QDateTime now = QDateTime::currentDateTime();
+          if (file.fileTime(QFile::FileModificationTime).secsTo(now) > 3600 &&
+              file.open(QFile::ReadWrite))
+            file.setFileTime(now, QFile::FileModificationTime);
+
+          f.size = size;
+          f.scale = scale;
+          f.keypoints = set.keypoints;
+          f.descriptors = set.descriptors;
+          return true;
+        }
+    } else if (QFileInfo::exists(path)) {
+      QFile::remove(path);  // corrupt or old version
+    }
+  }
+
+  const QImage qImg = m.loadImage();
+  if (qImg.isNull()) {
+    qWarning() << "failure to load image:" << m.path();
+    return false;
+  }
+
+  qImageToCvImg(qImg, img);
+
+  f.size = QSize(img.cols, img.rows);
+  f.scale = candidateScale(f.size, tmplSize, scalePct, maxSize);
+  if (f.scale < 1.0f) sizeScaleFactor(img, f.scale);
+
+  m.makeKeyPoints(img, numFeatures, f.keypoints);
+  m.makeKeyPointDescriptors(img, f.keypoints, f.descriptors);
+
+  if (!path.isEmpty()) {
+    TmfFeatureSet set;
+    set.entry.numFeatures = uint32_t(numFeatures);
+    set.entry.maxSize = uint32_t(maxSize);
+    set.entry.numKeypoints = uint32_t(f.keypoints.size());
+    set.entry.descRows = f.descriptors.rows;
+    set.entry.descCols = f.descriptors.cols;
+    set.entry.descType = f.descriptors.type();
+    set.keypoints = f.keypoints;
+    set.descriptors = f.descriptors;
+    addFeatureSet(path, f.size, set);
+    _featuresAdded.storeRelaxed(1);
+  }
+
+  return true;
+}
 
 void TemplateMatcher::match(const Media& tmplMedia, MediaGroup& group, const SearchParams& params) {
   if (group.count() <= 0) return;
@@ -38,49 +467,34 @@ void TemplateMatcher::match(const Media& tmplMedia, MediaGroup& group, const Sea
   uint64_t then = nanoTime();
 
   // matching is slow, look for results in our cache first
-  bool useCache = true;
-
-  if (tmplMedia.md5().isEmpty()) {
-    if (params.verbose) qWarning() << "tmpl image has no md5 sum, won't cache:" << tmplMedia.path();
-    useCache = false;
-  }
+  loadScores();
 
-  for (const Media& m : group)
-    if (m.md5().isEmpty()) {
-      if (params.verbose) qWarning() << "cand image has no md5 sum, won't cache:" << m.path();
-      useCache = false;
-    }
+  if (tmplMedia.md5().isEmpty() && params.verbose)
+    qWarning() << "tmpl image has no md5 sum, won't cache:" << tmplMedia.path();
 
   MediaGroup good, notCached;
+  QVector<QByteArray> keys;  // cache key of each notCached, or null
 
-  if (useCache) {
+  {
     QReadLocker locker(&_lock);
 
-    for (int i = 0; i < group.count(); i++) {
-      Media& m = group[i];
-      Q_ASSERT(!m.md5().isEmpty());
-
-      // cache stores one key (md5(a)+md5(b)) for each pair of images that have
-      // been template matched; check both possible keys
-      const QString cacheKey(m.md5() + tmplMedia.md5());
-      const QString key2(tmplMedia.md5() + m.md5());
+    for (Media& m : group) {
+      if (m.md5().isEmpty() && params.verbose)
+        qWarning() << "cand image has no md5 sum, won't cache:" << m.path();
 
-      QString key;
+      const QByteArray key = scoreKey(tmplMedia.md5(), m.md5(), params);
+      const auto it = key.isNull() ? _cache.constEnd() : _cache.constFind(key);
 
-      if (_cache.contains(cacheKey))
-        key = cacheKey;
-      else if (_cache.contains(key2))
-        key = key2;
-
-      if (!key.isNull()) {
-        int dist = _cache[key];
+      if (it != _cache.constEnd()) {
+        int dist = *it;
         m.setScore(dist);
         if (dist < params.tmThresh) good.append(m);
-      } else
+      } else {
         notCached.append(m);
+        keys.append(key);
+      }
     }
-  } else
-    notCached = group;
+  }
 
   group.clear();
 
@@ -92,176 +506,159 @@ void TemplateMatcher::match(const Media& tmplMedia, MediaGroup& group, const Sea
     return;
   }
 
-  // decompress target image and build high-res
-  // feature keypoints and descriptors
-  QImage qImg = tmplMedia.loadImage();
-  if (qImg.isNull()) {
-    qWarning() << "failure to load tmpl image:" << tmplMedia.path();
-    return;
-  }
-
+  // stage 1: features of the template (made once, shared by all candidates)
+  // and candidates (in parallel); reject candidates without a transform.
+  // stage 2: validate the transform with the image, which is decoded only if
+  // the features came from the cache
+  Features tmpl;
   cv::Mat tmplImg;
-  qImageToCvImg(qImg, tmplImg);
-
-  // Media needle = tmplMedia;
-
-  KeyPointList tmplKeypoints;
-  KeyPointDescriptors tmplDescriptors;
-  tmplMedia.makeKeyPoints(tmplImg, params.needleFeatures, tmplKeypoints);
-  tmplMedia.makeKeyPointDescriptors(tmplImg, tmplKeypoints, tmplDescriptors);
+  if (!features(tmplMedia, params.needleFeatures, QSize(), 0, tmpl, tmplImg)) return;
 
   if (params.verbose)
-    qInfo("tmpl kp=%d descriptors=%d (max %d)", int(tmplKeypoints.size()),
-          int(tmplDescriptors.cols), params.needleFeatures);
+    qInfo("tmpl kp=%d descriptors=%d (max %d)", int(tmpl.keypoints.size()),
+          int(tmpl.descriptors.rows), params.needleFeatures);
 
-  if (tmplDescriptors.cols <= 0) {
+  if (tmpl.descriptors.cols <= 0) {
     qWarning() << "no keypoints in template:" << tmplMedia.path();
     return;
   }
 
-  // build brute force matcher for the target image
-  // TODO: FLANN should be faster, but does other overhead dominate?
-  cv::BFMatcher matcher(cv::NORM_HAMMING, true);
-  std::vector<cv::Mat> haystack;
+  QMutex tmplMutex;  // guards lazy decode of tmplImg
 
-  haystack.push_back(tmplDescriptors);
-  matcher.add(haystack);
+  // brute force matcher; two-set radiusMatch() is const and safe to share
+  // TODO: FLANN should be faster, but does other overhead dominate?
+  const cv::BFMatcher matcher(cv::NORM_HAMMING, true);
 
-  struct {
-    uint64_t candResize;
-    uint64_t candLoad;
-    uint64_t candKeypoints;
-    uint64_t candFeatures;
+  struct Timing {
+    uint64_t features;
     uint64_t radiusMatch;
     uint64_t matchSort;
     uint64_t estimateTransform;
+    uint64_t load;
     uint64_t matchResize;
     uint64_t matchPhash;
   } timing;
 
   memset(&timing, 0, sizeof(timing));
-  uint64_t ns0 = nanoTime(), ns1 = 0;
+  QMutex timingMutex;
 
 #define PROFILE(x)  \
   ns1 = nanoTime(); \
   x += (ns1 - ns0); \
   ns0 = ns1;
 
-  // check each candidate image against the template
-  for (int i = 0; i < notCached.count(); i++) {
-    Media& m = notCached[i];
-    QString cacheKey(m.md5() + tmplMedia.md5());
-    if (!useCache) cacheKey = "invalid-cache-key";
-
-    qImg = m.loadImage();
-    if (qImg.isNull()) {
-      qWarning() << "failure to load cand image:" << m.path();
-      continue;
-    }
+  // score of each candidate, -1 if it could not be compared
+  QVector<int> scores(notCached.count(), -1);
+  QVector<QImage> debugImages(notCached.count());
+  Media* cands = notCached.data();
 
+  // check each candidate image against the template
+  auto matchCandidate = [&tmpl, &tmplImg, &tmplMutex, &tmplMedia, &matcher, &timing, &timingMutex,
+                         &scores, &debugImages, cands, &params, this](int i) {
+    Media& m = cands[i];
+    Timing t;
+    memset(&t, 0, sizeof(t));
+    uint64_t ns0 = nanoTime(), ns1 = 0;
+
+    auto finish = [&timing, &timingMutex, &t]() {
+      QMutexLocker locker(&timingMutex);
+      timing.features += t.features;
+      timing.radiusMatch += t.radiusMatch;
+      timing.matchSort += t.matchSort;
+      timing.estimateTransform += t.estimateTransform;
+      timing.load += t.load;
+      timing.matchResize += t.matchResize;
+      timing.matchPhash += t.matchPhash;
+    };
+
+    Features cand;
     cv::Mat img;
-    qImageToCvImg(qImg, img);
-
-    PROFILE(timing.candLoad);
-
-    // if the candidate image is much larger than the
-    // target image, we generate too many features that
-    // don't show up in the template. If we have some
-    // idea of how much cropping there is we can
-    // shrink the cand first.
-    float candScale = 1.0;
-
-    if (tmplImg.rows * tmplImg.cols < img.rows * img.cols) {
-      int cSize = std::max(img.cols, img.rows);
-      int tSize = std::max(tmplImg.rows, tmplImg.cols);
-      int maxSize = tSize * params.tmScalePct / 100.0;
-      if (cSize > maxSize) {
-        candScale = float(maxSize) / cSize;
-        sizeScaleFactor(img, candScale);
-      }
+    if (!features(m, params.haystackFeatures, tmpl.size, params.tmScalePct, cand, img)) {
+      finish();
+      return;
     }
 
-    PROFILE(timing.candResize);
-
-    KeyPointList queryKeypoints;
-    m.makeKeyPoints(img, params.haystackFeatures, queryKeypoints);
-
-    PROFILE(timing.candKeypoints);
-
-    KeyPointDescriptors queryDescriptors;
-    m.makeKeyPointDescriptors(img, queryKeypoints, queryDescriptors);
-
-    PROFILE(timing.candFeatures);
+    PROFILE(t.features);
 
     if (params.verbose)
-      qInfo("(%d) cand scale=%.2f kp=%d descriptors=%d (max %d)", i, double(candScale),
-            int(queryKeypoints.size()), int(queryDescriptors.rows), params.haystackFeatures);
+      qInfo("(%d) cand scale=%.2f kp=%d descriptors=%d (max %d)", i, double(cand.scale),
+            int(cand.keypoints.size()), int(cand.descriptors.rows), params.haystackFeatures);
 
-    if (queryDescriptors.cols <= 0) {
+    if (cand.descriptors.cols <= 0) {
       if (params.verbose) qWarning("(%d) no keypoints in cand", i);
-      continue;
+      finish();
+      return;
     }
 
     // match descriptors in the template and candidate
     std::vector<std::vector<cv::DMatch> > dmatch;
-    matcher.radiusMatch(queryDescriptors, dmatch, params.cvThresh);
+    matcher.radiusMatch(cand.descriptors, tmpl.descriptors, dmatch, params.cvThresh);
 
-    PROFILE(timing.radiusMatch);
-
-    int nMatches = 0;
-    MatchList matches;
-
-    for (size_t k = 0; k < dmatch.size(); k++)
-      for (size_t j = 0; j < dmatch[k].size(); j++) {
-        matches.push_back(dmatch[k][j]);
-        nMatches++;
-      }
-
-    if (nMatches <= 0) {
-      if (params.verbose) qInfo("(%d) no keypoint matches", i);
-      QWriteLocker locker(&_lock);
-      _cache[cacheKey] = INT_MAX;
-      continue;
-    }
+    PROFILE(t.radiusMatch);
 
     // get the x,y coordinates of each match in the target and candidate
-    const KeyPointList& trainKp = tmplKeypoints;
-    const KeyPointList& queryKp = queryKeypoints;
-
     std::vector<cv::Point2f> tmplPoints, matchPoints;
 
-    for (const cv::DMatch& match : matches) {
-      Q_ASSERT(match.trainIdx < int(trainKp.size()));
-
-      const cv::KeyPoint& kp = trainKp[uint(match.trainIdx)];
-
-      tmplPoints.push_back(kp.pt);
-      matchPoints.push_back(queryKp[uint(match.queryIdx)].pt);
-    }
+    for (const auto& matches : dmatch)
+      for (const cv::DMatch& match : matches) {
+        Q_ASSERT(match.trainIdx < int(tmpl.keypoints.size()));
+        tmplPoints.push_back(tmpl.keypoints[uint(match.trainIdx)].pt);
+        matchPoints.push_back(cand.keypoints[uint(match.queryIdx)].pt);
+      }
 
-    PROFILE(timing.matchSort);
+    PROFILE(t.matchSort);
 
     // need at least 3 points to estimate transform
     if (tmplPoints.size() < 3) {
       if (params.verbose) qInfo("(%d) less than 3 keypoint matches", i);
-      QWriteLocker locker(&_lock);
-      _cache[cacheKey] = INT_MAX;
-      continue;
+      scores[i] = INT_MAX;
+      finish();
+      return;
     }
 
     // find an affine transform from the target points to the candidate.
     // if there is such a transform, it is most likely a good match.
     cv::Mat transform = cv::estimateRigidTransform(tmplPoints, matchPoints, false);
 
-    PROFILE(timing.estimateTransform);
+    PROFILE(t.estimateTransform);
 
     if (transform.empty()) {
       if (params.verbose) qInfo("(%d) no transform found", i);
-      QWriteLocker locker(&_lock);
-      _cache[cacheKey] = INT_MAX;
-      continue;
+      scores[i] = INT_MAX;
+      finish();
+      return;
+    }
+
+    // stage 2, need both images
+    cv::Mat tmplMasked;
+    {
+      QMutexLocker locker(&tmplMutex);
+      if (tmplImg.empty()) {
+        const QImage qImg = tmplMedia.loadImage();
+        if (!qImg.isNull()) qImageToCvImg(qImg, tmplImg);
+      }
+      tmplMasked = tmplImg.clone();
+    }
+
+    if (tmplMasked.empty()) {
+      qWarning() << "failure to load tmpl image:" << tmplMedia.path();
+      finish();
+      return;
     }
 
+    if (img.empty()) {
+      const QImage qImg = m.loadImage();
+      if (qImg.isNull()) {
+        qWarning() << "failure to load cand image:" << m.path();
+        finish();
+        return;
+      }
+      qImageToCvImg(qImg, img);
+      if (cand.scale < 1.0f) sizeScaleFactor(img, cand.scale);
+    }
+
+    PROFILE(t.load);
+
     // validate the match
     // take section from candidate that should represent
     // the target, then compare with the template image
@@ -273,20 +670,22 @@ void TemplateMatcher::match(const Media& tmplMedia, MediaGroup& group, const Sea
 
     std::vector<cv::Point2f> tmplRect;
     tmplRect.push_back(cv::Point2f(0, 0));
-    tmplRect.push_back(cv::Point2f(tmplImg.cols, 0));
-    tmplRect.push_back(cv::Point2f(tmplImg.cols, tmplImg.rows));
-    tmplRect.push_back(cv::Point2f(0, tmplImg.rows));
+    tmplRect.push_back(cv::Point2f(tmplMasked.cols, 0));
+    tmplRect.push_back(cv::Point2f(tmplMasked.cols, tmplMasked.rows));
+    tmplRect.push_back(cv::Point2f(0, tmplMasked.rows));
 
     std::vector<cv::Point2f> candRect;
 
     cv::transform(tmplRect, candRect, transform);
 
     {
+      const float candScale = cand.scale;
+
       // set the roi rect in the match;
       // TODO: instead of the image corners, map the image borders
       QVector<QPoint> roi;
-      for (uint i = 0; i < 4; i++)
-        roi.append(QPoint(int(candRect[i].x / candScale), int(candRect[i].y / candScale)));
+      for (uint j = 0; j < 4; j++)
+        roi.append(QPoint(int(candRect[j].x / candScale), int(candRect[j].y / candScale)));
       m.setRoi(roi);
 
       // make qt-compatible transform matrix
@@ -319,12 +718,10 @@ void TemplateMatcher::match(const Media& tmplMedia, MediaGroup& group, const Sea
     //
     //
     cv::invertAffineTransform(transform, transform);
-    cv::warpAffine(img, img, transform, tmplImg.size(), cv::INTER_AREA,
+    cv::warpAffine(img, img, transform, tmplMasked.size(), cv::INTER_AREA,
                    cv::BORDER_CONSTANT, cv::Scalar(0,0,0,255));
 
-    PROFILE(timing.matchResize);
-
-    cv::Mat tmplMasked = tmplImg.clone();
+    PROFILE(t.matchResize);
 
     // make "0" the mask indicator, dctHash needs gray anyways
     grayscale(img, img);
@@ -363,13 +760,11 @@ void TemplateMatcher::match(const Media& tmplMedia, MediaGroup& group, const Sea
 
     int dist = hamm64(candHash, tmplHash);
 
-    PROFILE(timing.matchPhash);
+    PROFILE(t.matchPhash);
 
-    m.setScore(dist);
+    scores[i] = dist;
 
-    if (dist < params.tmThresh)
-      good.append(m);
-    else {
+    if (dist >= params.tmThresh) {
       if (params.verbose) qInfo("(%d) match above threshold (%d), consider raising tmThresh", i, dist);
 
       if (getenv("TEMPLATE_MATCHER_DEBUG")) {
@@ -389,36 +784,63 @@ void TemplateMatcher::match(const Media& tmplMedia, MediaGroup& group, const Sea
         painter.drawImage(10, 10, tImg);
         painter.translate(10+5+tImg.width(), 10);
         painter.drawImage(0,0, txImg);
+        painter.end();
 
-        static auto *window = new QLabel();
-        window->setWindowTitle(QString("template|cand score:%1").arg(dist));
-        window->setFixedSize(test.size());
-        window->setPixmap(QPixmap::fromImage(test));
-        window->show();
+        debugImages[i] = test;
       }
     }
 
-    QWriteLocker locker(&_lock);
-    _cache[cacheKey] = dist;
+    finish();
+  };
+
+  QVector<int> indices(notCached.count());
+  std::iota(indices.begin(), indices.end(), 0);
+  QtConcurrent::blockingMap(indices, matchCandidate);
+
+#undef PROFILE
+
+  for (int i = 0; i < notCached.count(); ++i) {
+    Media& m = notCached[i];
+    const int dist = scores[i];
+    if (dist < 0) continue;  // not comparable, don't cache
+
+    m.setScore(dist);
+    if (dist < params.tmThresh) good.append(m);
+
+    // widgets belong to the gui thread, show the last rejected match
+    if (!debugImages[i].isNull() && QThread::currentThread() == qApp->thread()) {
+      static auto* window = new QLabel();
+      window->setWindowTitle(QString("template|cand score:%1").arg(dist));
+      window->setFixedSize(debugImages[i].size());
+      window->setPixmap(QPixmap::fromImage(debugImages[i]));
+      window->show();
+    }
+
+    const QByteArray& key = keys[i];
+    if (!key.isNull()) {
+      QWriteLocker locker(&_lock);
+      _cache.insert(key, dist);
+      _added.insert(key);
+    }
   }
 
   uint64_t now = nanoTime();
   uint64_t total = now - then;
 
+  // stage times are summed over threads, show them relative to each other
+  const uint64_t cpu = std::max(uint64_t(1), timing.features + timing.radiusMatch +
+                                                 timing.matchSort + timing.estimateTransform +
+                                                 timing.load + timing.matchResize +
+                                                 timing.matchPhash);
   if (params.verbose)
     qInfo(
-        "%lld/%lld %dms:tot %lldms:ea | ld=%.2f rz=%.2f kp=%.2f "
-        "ft=%.2f rm=%.2f ms=%.2f ert=%.2f mr=%.2f mp=%.2f ttl=%.2f",
+        "%lld/%lld %dms:tot %lldms:ea | ft=%.2f rm=%.2f ms=%.2f ert=%.2f ld=%.2f mr=%.2f "
+        "mp=%.2f par=%.2f",
         good.count(), notCached.count(), int(total) / 1000000, total / 1000000 / notCached.count(),
-        timing.candLoad * 100.0 / total, timing.candResize * 100.0 / total,
-        timing.candKeypoints * 100.0 / total, timing.candFeatures * 100.0 / total,
-        timing.radiusMatch * 100.0 / total, timing.matchSort * 100.0 / total,
-        timing.estimateTransform * 100.0 / total, timing.matchResize * 100.0 / total,
-        timing.matchPhash * 100.0 / total,
-        (timing.candLoad + timing.candResize + timing.candKeypoints + timing.candFeatures +
-         timing.radiusMatch + timing.matchSort + timing.estimateTransform + timing.matchResize +
-         timing.matchPhash) *
-            100.0 / total);
+        timing.features * 100.0 / cpu, timing.radiusMatch * 100.0 / cpu,
+        timing.matchSort * 100.0 / cpu, timing.estimateTransform * 100.0 / cpu,
+        timing.load * 100.0 / cpu, timing.matchResize * 100.0 / cpu,
+        timing.matchPhash * 100.0 / cpu, double(cpu) / total);
 
   group = good;
   std::sort(group.begin(), group.end()); // sort by score
@@ -27,7 +27,11 @@ class TemplateMatcher {
   Q_DISABLE_COPY_MOVE(TemplateMatcher)
 
  public:
-  TemplateMatcher();
+  /**
+   * @param cachePath directory for the keypoint/descriptor and score caches,
+   *        empty to keep scores in memory only
+   */
+  explicit TemplateMatcher(const QString& cachePath = QString());
   virtual ~TemplateMatcher();
 
   /**
@@ -48,13 +52,54 @@ class TemplateMatcher {
    * On exit, candidate images are removed that do not match. Matches have their
    * roi() and transform() set
    *
-   * @note results are cached, so long as instance is not destructed
+   * Candidates are matched in parallel. Features of each image are stored
+   * on disk (by md5), so a candidate is only decoded if it has no cached features
+   * or its transform needs to be validated. Least recently used features are
+   * removed when there are more than 1GB, or CBIRD_FEATURE_CACHE_MB
+   *
+   * @note scores are cached by md5 pair and the parameters that affect them;
+   *       with a cachePath they are loaded on first use and saved on destruction
    */
   void match(const Media& tmplMedia, MediaGroup& group, const SearchParams& params);
 
-  // TODO: cache load/save/update
+  /**
+   * Remove cached scores of images, e.g. when they are removed from the database
+   * @param cachePath as passed to constructor
+   * @param md5s of the removed images
+   */
+  static void removeScores(const QString& cachePath, const QStringList& md5s);
+
+  /// Remove cached features of images, @see removeScores()
+  static void removeFeatures(const QString& cachePath, const QStringList& md5s);
 
  private:
-  QHash<QString, int> _cache;
+  struct Features;
+
+  /**
+   * Get features from the cache, or make them and add to the cache
+   * @param m image to load
+   * @param numFeatures max keypoints
+   * @param tmplSize size of the template, if m is a candidate, to scale it down
+   * @param scalePct max size of candidate relative to template
+   * @param f features and the scale they were made at
+   * @param img if the image had to be decoded, the (scaled) image
+   * @return false if the image could not be loaded
+   */
+  bool features(const Media& m, int numFeatures, const QSize& tmplSize, int scalePct,
+                Features& f, cv::Mat& img) const;
+
+  /// load score cache file, if it was not loaded yet
+  void loadScores();
+
+  /// merge scores added by this instance into the cache file
+  void saveScores();
+
+  QString _featurePath;
+  qint64 _featureMaxBytes = 0;
+  mutable QAtomicInt _featuresAdded;  // evict on destruction if we added any
+  QString _scorePath;
+  QAtomicInt _scoresLoaded;
+  QHash<QByteArray, int> _cache;  // scoreKey() => score
+  QSet<QByteArray> _added;        // keys not in the cache file yet
   QReadWriteLock _lock;
 };
@@ -23,21 +23,25 @@
 #include "../hamm.h"
 #include "../index.h"
 
-#define VPTREE (1)
+// DctTree is our vptree unless one of these is defined
 // #define LIBVPTREE (1)
 // #define HAMMINGTREE (1)
+// #define MIHINDEX (1)
+
+// DctMultiTree is HammingTree unless this is defined
+// #define MULTI_MIHINDEX (1)
 
 // least-significant-bit tree for dct hash,
 // very fast but lower hit rate ~90%
 // runtime does not vary with threshold value
-#if HAMMINGTREE
+#if defined(HAMMINGTREE)
 #include "hammingtree.h"
 
 class DctTree {
  public:
   HammingTree _tree;
 
-  void create(uint64_t* hashes, uint32_t* ids, int numHashes) {
+  void create(const uint64_t* hashes, const uint32_t* ids, int numHashes) {
     std::vector<HammingTree::Value> values;
     for (int i = 0; i < numHashes; ++i) values.push_back(HammingTree::Value(ids[i], hashes[i]));
     _tree.insert(values);
@@ -52,14 +56,20 @@ class DctTree {
     for (auto& r : results) matches.append(Index::Match(r.value.index, r.distance));
     return matches;
   }
+  // serialization is unsupported, tree is rebuilt instead
+  void write(QIODevice& f) const { (void)f; }
+  bool map(const char* data, size_t len) {
+    (void)data;
+    (void)len;
+    return false;
+  }
+  void detach() {}
 };
 
-#endif
-
 // vptree library, slower but has knn
 // runtime gets much worse as threshold increases
 // use to validate our own implementation
-#if LIBVPTREE
+#elif defined(LIBVPTREE)
 #include "lib/vptree/include/vptree/vptree.hh"
 class DctPoint {
  public:
@@ -73,7 +83,7 @@ class DctTree : public VPTree<DctPoint> {
     return hamm64(p1.hash, p2.hash);
   }
 
-  void create(uint64_t* hashes, uint32_t* ids, int numHashes) {
+  void create(const uint64_t* hashes, const uint32_t* ids, int numHashes) {
     std::vector<DctPoint> points;
     for (int i = 0; i < numHashes; ++i) points.push_back(DctPoint{hashes[i], ids[i]});
 
@@ -92,12 +102,51 @@ class DctTree : public VPTree<DctPoint> {
     }
     return matches;
   }
+  // serialization is unsupported, tree is rebuilt instead
+  void write(QIODevice& f) const { (void)f; }
+  bool map(const char* data, size_t len) {
+    (void)data;
+    (void)len;
+    return false;
+  }
+  void detach() {}
+};
+
+// multi-index hashing, exact like vptree but much faster for
+// thresholds up to ~12, then it is a brute-force scan.
+#elif defined(MIHINDEX)
+#include "mihindex.h"
+
+class DctTree {
+  MihIndex _index;
+
+ public:
+  void create(const uint64_t* hashes, const uint32_t* ids, int numHashes) {
+    std::vector<MihIndex::Value> values;
+    for (int i = 0; i < numHashes; ++i) values.push_back(MihIndex::Value(ids[i], hashes[i]));
+    _index.insert(values);
+  }
+
+  QVector<Index::Match> search(uint64_t target, int threshold) {
+    QVector<Index::Match> matches;
+    std::vector<MihIndex::Match> results;
+    _index.search(target, threshold, results);
+    for (auto& r : results) matches.append(Index::Match(r.value.index, r.distance));
+    return matches;
+  }
+  // serialization is unsupported, tables are rebuilt instead (fast)
+  void write(QIODevice& f) const { (void)f; }
+  bool map(const char* data, size_t len) {
+    (void)data;
+    (void)len;
+    return false;
+  }
+  void detach() {}
 };
-#endif
 
 // diy vptree, faster than libvptree and tuned for dct hash
 // runtime gets much worse as threshold increases
-#if VPTREE
+#else
 #include "vptree.h"
 
 class DctTree {
@@ -111,10 +160,17 @@ class DctTree {
   };
   static inline int vpDistance(vpValue v1, vpValue v2) { return hamm64(v1.hash, v2.hash); };
 
-  VpTree<vpValue, int, vpDistance> _tree;
+  typedef VpTree<vpValue, int, vpDistance> Tree;
+  Tree _tree;
+
+  /// header of the serialized tree, followed by node and value arrays
+  struct Header {
+    uint32_t nodeSize, valueSize;  // detect incompatible layout
+    uint64_t numNodes, numValues;
+  };
 
  public:
-  void create(uint64_t* hashes, uint32_t* ids, int numHashes) {
+  void create(const uint64_t* hashes, const uint32_t* ids, int numHashes) {
     std::vector<vpValue> values;
     for (int i = 0; i < numHashes; ++i) values.push_back(vpValue(hashes[i], ids[i]));
     _tree.create(values);
@@ -135,5 +191,70 @@ class DctTree {
     }
     return matches;
   }
+
+  /// Write flat tree layout, which can be used later with map()
+  void write(QIODevice& f) const {
+    const Header h{uint32_t(sizeof(Tree::Node)), uint32_t(sizeof(vpValue)), _tree.numNodes(),
+                   _tree.numValues()};
+    const qint64 nodeBytes = qint64(h.numNodes * sizeof(Tree::Node));
+    const qint64 valueBytes = qint64(h.numValues * sizeof(vpValue));
+
+    if (sizeof(h) != f.write(reinterpret_cast<const char*>(&h), sizeof(h)) ||
+        nodeBytes != f.write(reinterpret_cast<const char*>(_tree.nodes()), nodeBytes) ||
+        valueBytes != f.write(reinterpret_cast<const char*>(_tree.values()), valueBytes))
+      throw f.errorString();
+  }
+
+  /**
+   * Use tree layout from write() without copying it
+   * @param data start of the layout, 8-byte aligned (e.g. from QFile::map)
+   * @return false if the layout is incompatible or corrupt, tree is unchanged
+   * @note memory must outlive the tree, or call detach()
+   */
+  bool map(const char* data, size_t len) {
+    Header h;
+    if (len < sizeof(h)) return false;
+    memcpy(&h, data, sizeof(h));
+    if (h.nodeSize != sizeof(Tree::Node) || h.valueSize != sizeof(vpValue)) return false;
+
+    // counts are bounded by the length first, so the sizes can't overflow
+    if (h.numNodes > len || h.numValues > len) return false;
+    const size_t nodeBytes = h.numNodes * sizeof(Tree::Node);
+    if (len < sizeof(h) + nodeBytes + h.numValues * sizeof(vpValue)) return false;
+
+    return _tree.map(reinterpret_cast<const Tree::Node*>(data + sizeof(h)), h.numNodes,
+                     reinterpret_cast<const vpValue*>(data + sizeof(h) + nodeBytes),
+                     h.numValues);
+  }
+
+  /// Copy mapped memory so it can be released
+  void detach() { _tree.detach(); }
 };
 #endif
+
+// multi-index hashing can also replace HammingTree for
+// DctFeaturesIndex/DctVideoIndex, independently of DctTree
+#if defined(MULTI_MIHINDEX)
+#include "mihindex.h"
+typedef MihIndex DctMultiTreeBase;
+#else
+#include "hammingtree.h"
+typedef HammingTree DctMultiTreeBase;
+#endif
+
+/**
+ * @class DctMultiTree
+ * @brief Search tree for indexes with many hashes per media (features, video frames)
+ * @note a class so it can be forward-declared
+ * @note cache files are not compatible between the two, delete them when switching
+ */
+class DctMultiTree : public DctMultiTreeBase {
+ public:
+  /// Copy a subtree; method to multithread searches
+  DctMultiTree* slice(const std::unordered_set<index_t>& indexSet) const {
+    DctMultiTree* tree = new DctMultiTree;
+    copyTo(indexSet, *tree);
+    tree->freeze();
+    return tree;
+  }
+};
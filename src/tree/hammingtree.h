@@ -20,6 +20,7 @@
    <https://www.gnu.org/licenses/>.  */
 #pragma once
 #include "../hamm.h"
+#include "../profile.h"
 
 #if defined(Q_OS_DARWIN)
 #  include <malloc/malloc.h>
@@ -31,6 +32,8 @@
 #  include <malloc.h>
 #  define malloc_size(x) malloc_usable_size((void*)(x))
 #endif
+#include <algorithm>
+#include <numeric>
 #include <unordered_set>
 
 /**
@@ -51,6 +54,15 @@
  *
  * The leaves of the tree are large chunks (CLUSTER_SIZE) which can be searched
  * very quickly and reduce the miss rate somewhat.
+ *
+ * Inserting partitions the values in-place, then the two subtrees are
+ * built in parallel (PARALLEL_SIZE) on a thread pool. The shape of the tree
+ * only depends on the values, not the order or batches they are inserted in.
+ *
+ * For searching, the tree can be frozen into a compact layout: one node array
+ * in breadth-first order, and all leaves packed in one array of hashes and
+ * one of indices. This is what write() stores, and read() maps it from the file
+ * as-is. Inserting into a frozen tree unfreezes it first.
  */
 class HammingTree {
  public:
@@ -58,6 +70,9 @@ class HammingTree {
   // on a full tree (depth 64) can grow indefinitely
   enum { CLUSTER_SIZE = 64 * 1024 };
 
+  // minimum number of values to build a subtree in another thread
+  enum { PARALLEL_SIZE = 64 * 1024 };
+
   typedef uint32_t index_t;
   typedef uint64_t hash_t;
   typedef int distance_t;
@@ -84,74 +99,251 @@ class HammingTree {
     int numNodes;
     int maxHeight;
     int numValues;
-    Stats() : memory(sizeof(HammingTree)), numNodes(0), maxHeight(0), numValues(0) {}
+    int buildTasks;      // subtrees built in another thread, by all insert()
+    uint64_t buildTime;  // nanoseconds spent in insert()
+    Stats()
+        : memory(sizeof(HammingTree)),
+          numNodes(0),
+          maxHeight(0),
+          numValues(0),
+          buildTasks(0),
+          buildTime(0) {}
   };
 
   HammingTree() { init(); }
   ~HammingTree() { clear(); }
+  HammingTree(const HammingTree&) = delete;
+  HammingTree& operator=(const HammingTree&) = delete;
 
   /// Find hash with distance(hash, cand) < threshold
   void search(hash_t hash, distance_t threshold, std::vector<Match>& matches) const {
-    if (_root) {
-      search(_root, hash, threshold, matches);
+    withRoot([&](auto root) {
+      search(root, hash, threshold, matches);
       std::sort(matches.begin(), matches.end());
-    }
+    });
+  }
+
+  /// Find many hashes at once, matches[i] are the results for hashes[i]
+  /// @note each leaf is scanned once for all hashes that reach it, which is much
+  ///       faster than separate searches when there are many hashes
+  void search(const std::vector<hash_t>& hashes, distance_t threshold,
+              std::vector<std::vector<Match>>& matches) const {
+    matches.resize(hashes.size());
+    if (hashes.empty()) return;
+    withRoot([&](auto root) {
+      std::vector<uint32_t> queries(hashes.size());
+      std::iota(queries.begin(), queries.end(), 0);
+      search(root, hashes.data(), queries.data(), queries.size(), threshold, matches.data());
+      for (auto& m : matches) std::sort(m.begin(), m.end());
+    });
+  }
+
+  /// Find many hashes at once, keeping the k nearest matches of each hash
+  /// @note once a hash has k matches, the threshold for it drops to the worst
+  ///       of them, and the leaf scan stops if they are all exact
+  void search(const std::vector<hash_t>& hashes, distance_t threshold, int k,
+              std::vector<std::vector<Match>>& matches) const {
+    matches.resize(hashes.size());
+    if (hashes.empty() || k <= 0) return;
+    withRoot([&](auto root) {
+      std::vector<uint32_t> queries(hashes.size());
+      std::iota(queries.begin(), queries.end(), 0);
+      for (auto& m : matches) m.reserve(size_t(k) + 1);
+      searchNearest(root, hashes.data(), queries.data(), queries.size(), threshold, size_t(k),
+                    matches.data());
+    });
   }
 
   /// Find Value with index
   void findIndex(index_t index, std::vector<hash_t>& results) const {
-    if (_root) findIndex(_root, index, results);
+    withRoot([&](auto root) { findIndex(root, index, results); });
   }
 
   /// Add more nodes
+  /// @note values are reordered
+  /// @note not reentrant, subtrees are built in parallel
   void insert(std::vector<Value>& values) {
+    const uint64_t then = nanoTime();
+
+    if (isFrozen()) unfreeze();
+
     _count += values.size();
 
     if (!_root) _root = new Level;
 
-    insert(_root, values, 0);
+    int tasks = 0;
+    insert(_root, values.data(), values.size(), 0, tasks);
+
+    _buildTasks += tasks;
+    _buildTime += nanoTime() - then;
   }
 
   /// Remove nodes
   void remove(std::unordered_set<index_t>& indexSet) {
-    if (_root) remove(_root, indexSet);
+    if (_root)
+      remove(_root, indexSet);
+    else if (isFrozen()) {
+      detach();
+      const auto& end = indexSet.cend();
+      for (index_t& index : _ownIndices)
+        if (indexSet.find(index) != end) index = 0;
+    }
   }
 
   /// Copy a subtree; method to multithread searches
-  HammingTree* slice(const std::unordered_set<index_t>& indexSet) {
+  HammingTree* slice(const std::unordered_set<index_t>& indexSet) const {
     HammingTree* tree = new HammingTree;
-    if (_root) {
-      std::vector<HammingTree::Value> values;
-      tree->slice(_root, indexSet, tree, values);
-      tree->insert(values);
-    }
+    copyTo(indexSet, *tree);
     return tree;
   }
 
+  /// Copy values with index in indexSet to another tree
+  void copyTo(const std::unordered_set<index_t>& indexSet, HammingTree& tree) const {
+    withRoot([&](auto root) {
+      std::vector<HammingTree::Value> values;
+      slice(root, indexSet, &tree, values);
+      tree.insert(values);
+    });
+  }
+
   /// Get some stats, like memory usage
+  /// @note memory of a frozen tree mapped from a file is not counted
   Stats stats() const {
     Stats st;
 
-    if (_root) stats(_root, st, 0);
+    withRoot([&](auto root) { stats(root, st, 0); });
 
+    st.memory += _ownNodes.capacity() * sizeof(Node) +
+                 _ownHashes.capacity() * sizeof(hash_t) + _ownIndices.capacity() * sizeof(index_t);
+    st.buildTasks = _buildTasks;
+    st.buildTime = _buildTime;
     return st;
   }
 
-  /// Read tree from file
-  void read(const char* file) {
-    FILE* fp = fopen(file, "rb");
-    Q_ASSERT(fp);
-    _root = read(fp);
-    fclose(fp);
+  /**
+   * Pack the tree into the compact layout for searching
+   * @note nodes and leaves are contiguous instead of separate allocations
+   * @note values are copied before the pointer layout is freed, so peak
+   *       memory is about twice the size of the tree
+   */
+  void freeze() {
+    if (!_root) return;
+
+    Layout layout;
+    pack(_root, _count, layout);
+    layout.nodes.shrink_to_fit();
+    delete _root;
+    _root = nullptr;
+
+    _ownNodes.swap(layout.nodes);
+    _ownHashes.swap(layout.hashes);
+    _ownIndices.swap(layout.indices);
+    point();
+  }
+
+  /// @return true if the tree is in the compact layout
+  bool isFrozen() const { return _numNodes > 0; }
+
+  /**
+   * Map tree written by write(), the tree is frozen
+   * @param key must be the same as given to write()
+   * @return false if file is missing, incompatible or has another key, tree is unchanged
+   */
+  bool read(const char* file, uint64_t key = 0) {
+    QFile* f = new QFile(file);
+    if (!f->open(QFile::ReadOnly)) {
+      qWarning() << "open failed:" << file << f->errorString();
+      delete f;
+      return false;
+    }
+
+    const qint64 size = f->size();
+    const uchar* data = nullptr;
+    Header h;
+
+    if (size >= qint64(sizeof(h))) data = f->map(0, size);
+    if (data) memcpy(&h, data, sizeof(h));
+
+    if (!data || memcmp(h.magic, Header::Magic, sizeof(h.magic)) != 0 ||
+        h.version != Header::Version || h.nodeSize != sizeof(Node) || h.numNodes < 1 ||
+        h.numNodes > UINT32_MAX ||
+        uint64_t(size) != sizeof(h) + h.numNodes * sizeof(Node) +
+                              h.numValues * (sizeof(hash_t) + sizeof(index_t))) {
+      qWarning() << "invalid or incompatible cache file:" << file;
+      delete f;
+      return false;
+    }
+
+    if (h.key != key) {
+      qWarning() << "cache file is out of date:" << file;
+      delete f;
+      return false;
+    }
+
+    const Node* nodes = reinterpret_cast<const Node*>(data + sizeof(h));
+    for (uint64_t i = 0; i < h.numNodes; ++i) {
+      const Node& n = nodes[i];
+      // children follow their parent, split bits index the hash
+      if (n.bit > 63 || (n.bit >= 0 && (n.child <= i || n.child + uint64_t(1) >= h.numNodes)) ||
+          n.begin > n.end || n.end > h.numValues) {
+        qWarning() << "corrupt cache file:" << file;
+        delete f;
+        return false;
+      }
+    }
+
+    clear();
+    _file = f;
+    _numNodes = h.numNodes;
+    _count = h.numValues;
+    _nodes = nodes;
+    _hashes = reinterpret_cast<const hash_t*>(_nodes + h.numNodes);
+    _indices = reinterpret_cast<const index_t*>(_hashes + h.numValues);
+    return true;
   }
 
-  /// Write tree to file
-  void write(QFile& f) {
-    if (_root) write(_root, f);
+  /**
+   * Write tree in the compact layout, throws QString on error
+   * @param key identifies what the tree was built from, checked by read()
+   */
+  void write(QFile& f, uint64_t key = 0) const {
+    Layout layout;
+    const Node* nodes = _nodes;
+    const hash_t* hashes = _hashes;
+    const index_t* indices = _indices;
+    uint64_t numNodes = _numNodes;
+
+    if (_root) {
+      pack(_root, _count, layout);
+      nodes = layout.nodes.data();
+      hashes = layout.hashes.data();
+      indices = layout.indices.data();
+      numNodes = layout.nodes.size();
+    }
+
+    Header h;
+    memcpy(h.magic, Header::Magic, sizeof(h.magic));
+    h.version = Header::Version;
+    h.nodeSize = sizeof(Node);
+    h.numNodes = numNodes;
+    h.numValues = _count;
+    h.key = key;
+
+    const qint64 nodeBytes = qint64(h.numNodes * sizeof(Node));
+    const qint64 hashBytes = qint64(h.numValues * sizeof(hash_t));
+    const qint64 indexBytes = qint64(h.numValues * sizeof(index_t));
+
+    if (Q_UNLIKELY(sizeof(h) != f.write(reinterpret_cast<const char*>(&h), sizeof(h)) ||
+                   nodeBytes != f.write(reinterpret_cast<const char*>(nodes), nodeBytes) ||
+                   hashBytes != f.write(reinterpret_cast<const char*>(hashes), hashBytes) ||
+                   indexBytes != f.write(reinterpret_cast<const char*>(indices), indexBytes)))
+      throw f.errorString();
   }
 
   /// Print the tree structure
   void print() {
+    if (!_root) return;
+
     size_t bytes = printLevel(_root, 0);
 
     qInfo("size=%d MB", (int)(bytes / 1024 / 1024));
@@ -180,31 +372,166 @@ class HammingTree {
     }
   };
 
-  static void partition(int bit, const std::vector<Value>& values, std::vector<Value>& left,
-                        std::vector<Value>& right) {
-    for (const Value& v : values)
-      if (v.hash & (1 << bit))
-        left.push_back(v);
-      else
-        right.push_back(v);
+  /// node of the compact layout, must be POD so it can be written/mapped
+  struct Node {
+    int32_t bit;     // split bit, or -1 if leaf
+    uint32_t child;  // index of left child, right child follows it
+    uint64_t begin;  // leaf values are [begin, end)
+    uint64_t end;
+  };
+
+  /// file: Header, nodes[numNodes], hashes[numValues], indices[numValues]
+  struct Header {
+    enum { Version = 3 };  // v3: split bits >= 32 were (1 << bit), the wrong bit
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;  // detect incompatible layout
+    uint64_t numNodes;
+    uint64_t numValues;
+    uint64_t key;       // caller's check value
+    static constexpr char Magic[8] = {'c', 'b', 'i', 'r', 'd', 'H', 'M', 'T'};
+  };
+
+  /// compact layout being built
+  struct Layout {
+    std::vector<Node> nodes;
+    std::vector<hash_t> hashes;
+    std::vector<index_t> indices;
+  };
+
+  /// traversal of the pointer layout
+  struct LevelRef {
+    const Level* level;
+    bool isLeaf() const { return level->left == nullptr; }
+    int bit() const { return level->bit; }
+    LevelRef left() const { return {level->left}; }
+    LevelRef right() const { return {level->right}; }
+    const hash_t* hashes() const { return level->hashes; }
+    const index_t* indices() const { return level->indices; }
+    size_t count() const { return level->count; }
+  };
+
+  /// traversal of the compact layout
+  struct NodeRef {
+    const HammingTree* tree;
+    const Node* node;
+    bool isLeaf() const { return node->bit < 0; }
+    int bit() const { return node->bit; }
+    NodeRef left() const { return {tree, tree->_nodes + node->child}; }
+    NodeRef right() const { return {tree, tree->_nodes + node->child + 1}; }
+    const hash_t* hashes() const { return tree->_hashes + node->begin; }
+    const index_t* indices() const { return tree->_indices + node->begin; }
+    size_t count() const { return size_t(node->end - node->begin); }
+  };
+
+  /// call fn with the root of whichever layout is in use, if any
+  template <typename Fn>
+  void withRoot(Fn fn) const {
+    if (_root)
+      fn(LevelRef{_root});
+    else if (isFrozen())
+      fn(NodeRef{this, _nodes});
+  }
+
+  /// breadth-first, so that children are next to each other
+  static void pack(const Level* root, size_t count, Layout& layout) {
+    std::vector<const Level*> queue{root};
+    layout.hashes.reserve(count);
+    layout.indices.reserve(count);
+    for (size_t i = 0; i < queue.size(); ++i) {
+      const Level* level = queue[i];
+      Node node{-1, 0, layout.hashes.size(), 0};
+      if (level->left) {
+        node.bit = level->bit;
+        node.child = uint32_t(queue.size());
+        queue.push_back(level->left);
+        queue.push_back(level->right);
+      } else {
+        layout.hashes.insert(layout.hashes.end(), level->hashes, level->hashes + level->count);
+        layout.indices.insert(layout.indices.end(), level->indices,
+                              level->indices + level->count);
+      }
+      node.end = layout.hashes.size();
+      layout.nodes.push_back(node);
+    }
+  }
+
+  /// rebuild the pointer layout to allow insert
+  void unfreeze() {
+    Q_ASSERT(!_root);
+    Level* root = unpack(NodeRef{this, _nodes});
+    const size_t count = _count;
+    const int buildTasks = _buildTasks;
+    const uint64_t buildTime = _buildTime;
+    freeLayout();
+    _root = root;
+    _count = count;
+    _buildTasks = buildTasks;
+    _buildTime = buildTime;
+  }
+
+  static Level* unpack(NodeRef ref) {
+    Level* level = new Level;
+    if (!ref.isLeaf()) {
+      level->bit = ref.bit();
+      level->left = unpack(ref.left());
+      level->right = unpack(ref.right());
+    } else if (ref.count() > 0) {
+      level->count = ref.count();
+      level->hashes = strict_malloc(level->hashes, level->count);
+      level->indices = strict_malloc(level->indices, level->count);
+      memcpy(level->hashes, ref.hashes(), level->count * sizeof(hash_t));
+      memcpy(level->indices, ref.indices(), level->count * sizeof(index_t));
+    }
+    return level;
+  }
+
+  /// copy mapped layout so it can be modified
+  void detach() {
+    if (!_file) return;
+    _ownNodes.assign(_nodes, _nodes + _numNodes);
+    _ownHashes.assign(_hashes, _hashes + _count);
+    _ownIndices.assign(_indices, _indices + _count);
+    delete _file;
+    _file = nullptr;
+    point();
+  }
+
+  /// use the owned layout
+  void point() {
+    _nodes = _ownNodes.data();
+    _hashes = _ownHashes.data();
+    _indices = _ownIndices.data();
+    _numNodes = _ownNodes.size();
+  }
+
+  /// partition in-place, left values first
+  /// @return number of left values
+  static size_t partition(int bit, Value* values, size_t count) {
+    Value* mid = std::partition(values, values + count,
+                                [bit](const Value& v) { return v.hash & (uint64_t(1) << bit); });
+    return size_t(mid - values);
+  }
+
+  /// pool for building subtrees, its own so that it can't be starved by other tasks
+  static QThreadPool* buildPool() {
+    static QThreadPool pool;
+    return &pool;
   }
 
   static int getBit(int depth) { return depth; }
 
-  static void search(const Level* level, hash_t hash, distance_t threshold,
-                     std::vector<Match>& matches) {
-    if (level->left != nullptr) {
-      if ((1 << level->bit) & hash)
-        search(level->left, hash, threshold, matches);
+  template <typename Ref>
+  static void search(Ref level, hash_t hash, distance_t threshold, std::vector<Match>& matches) {
+    if (!level.isLeaf()) {
+      if ((1 << level.bit()) & hash)
+        search(level.left(), hash, threshold, matches);
       else
-        search(level->right, hash, threshold, matches);
+        search(level.right(), hash, threshold, matches);
     } else {
-      const hash_t* hashes = level->hashes;
-      const index_t* indices = level->indices;
-      const size_t count = level->count;
-
-      Q_ASSERT(malloc_size(hashes) >= count * sizeof(*hashes));
-      Q_ASSERT(malloc_size(indices) >= count * sizeof(*indices));
+      const hash_t* hashes = level.hashes();
+      const index_t* indices = level.indices();
+      const size_t count = level.count();
 
       for (size_t i = 0; i < count; i++) {
         distance_t distance = hamm64(hash, hashes[i]);
@@ -213,33 +540,111 @@ class HammingTree {
     }
   }
 
-  static void findIndex(const Level* level, index_t index, std::vector<hash_t>& results) {
-    if (level->left) {
-      findIndex(level->left, index, results);
-      findIndex(level->right, index, results);
+  template <typename Ref>
+  static void search(Ref level, const hash_t* hashes, uint32_t* queries, size_t numQueries,
+                     distance_t threshold, std::vector<Match>* matches) {
+    if (numQueries == 0) return;
+
+    if (!level.isLeaf()) {
+      // split queries the same way the single-hash search would go
+      const int bit = level.bit();
+      uint32_t* mid = std::partition(queries, queries + numQueries, [&](uint32_t q) {
+        return ((uint64_t(1) << bit) & hashes[q]) != 0;
+      });
+      size_t numLeft = size_t(mid - queries);
+      search(level.left(), hashes, queries, numLeft, threshold, matches);
+      search(level.right(), hashes, mid, numQueries - numLeft, threshold, matches);
     } else {
-      const hash_t* hashes = level->hashes;
-      const index_t* indices = level->indices;
-      const size_t count = level->count;
+      const hash_t* leafHashes = level.hashes();
+      const index_t* indices = level.indices();
+      const size_t count = level.count();
+
+      // leaf (CLUSTER_SIZE) stays in cache while every query is compared
+      for (size_t j = 0; j < numQueries; j++) {
+        std::vector<Match>& m = matches[queries[j]];
+        hammScan64(hashes[queries[j]], leafHashes, count, threshold, [&](size_t i, int distance) {
+          m.push_back(Match(Value(indices[i], leafHashes[i]), distance));
+        });
+      }
+    }
+  }
+
+  template <typename Ref>
+  static void searchNearest(Ref level, const hash_t* hashes, uint32_t* queries,
+                            size_t numQueries, distance_t threshold, size_t k,
+                            std::vector<Match>* matches) {
+    if (numQueries == 0) return;
+
+    if (!level.isLeaf()) {
+      const int bit = level.bit();
+      uint32_t* mid = std::partition(queries, queries + numQueries, [&](uint32_t q) {
+        return ((uint64_t(1) << bit) & hashes[q]) != 0;
+      });
+      size_t numLeft = size_t(mid - queries);
+      searchNearest(level.left(), hashes, queries, numLeft, threshold, k, matches);
+      searchNearest(level.right(), hashes, mid, numQueries - numLeft, threshold, k, matches);
+    } else {
+      const hash_t* leafHashes = level.hashes();
+      const index_t* indices = level.indices();
+      const size_t count = level.count();
+
+      // scan in blocks so the threshold can tighten as matches are found
+      const size_t blockSize = 512;
+
+      for (size_t j = 0; j < numQueries; j++) {
+        std::vector<Match>& m = matches[queries[j]];
+        const hash_t hash = hashes[queries[j]];
+        distance_t limit = threshold;
+
+        for (size_t block = 0; block < count && limit > 0; block += blockSize) {
+          const hash_t* blockHashes = leafHashes + block;
+          const index_t* blockIndices = indices + block;
+          const size_t blockCount = std::min(blockSize, count - block);
+
+          auto insert = [&m, k, blockHashes, blockIndices](size_t i, int distance) {
+            if (m.size() >= k && distance >= m.back().distance) return;
+            const Match match(Value(blockIndices[i], blockHashes[i]), distance);
+            m.insert(std::upper_bound(m.begin(), m.end(), match), match);
+            if (m.size() > k) m.pop_back();
+          };
+          hammScan64(hash, blockHashes, blockCount, limit, insert);
+
+          if (m.size() >= k) limit = m.back().distance;
+        }
+      }
+    }
+  }
+
+  template <typename Ref>
+  static void findIndex(Ref level, index_t index, std::vector<hash_t>& results) {
+    if (!level.isLeaf()) {
+      findIndex(level.left(), index, results);
+      findIndex(level.right(), index, results);
+    } else {
+      const hash_t* hashes = level.hashes();
+      const index_t* indices = level.indices();
+      const size_t count = level.count();
 
       for (size_t i = 0; i < count; i++)
         if (indices[i] == index) results.push_back(hashes[i]);
     }
   }
 
-  static void slice(const Level* level, const std::unordered_set<index_t>& indexSet,
-                    HammingTree* tree, std::vector<HammingTree::Value>& values) {
-    if (level->left) {
-      slice(level->left, indexSet, tree, values);
-      slice(level->right, indexSet, tree, values);
+  template <typename Ref>
+  static void slice(Ref level, const std::unordered_set<index_t>& indexSet, HammingTree* tree,
+                    std::vector<HammingTree::Value>& values) {
+    if (!level.isLeaf()) {
+      slice(level.left(), indexSet, tree, values);
+      slice(level.right(), indexSet, tree, values);
     } else {
-      index_t* indices = level->indices;
-      const size_t count = level->count;
+      const hash_t* hashes = level.hashes();
+      const index_t* indices = level.indices();
+      const size_t count = level.count();
       const auto& end = indexSet.cend();
 
       for (size_t i = 0; i < count; i++)
         if (indexSet.find(indices[i]) != end)
-          values.push_back(HammingTree::Value(level->indices[i], level->hashes[i]));
+          values.push_back(HammingTree::Value(indices[i], hashes[i]));
 
       if (values.size() > 100000) {
         tree->insert(values);
@@ -262,34 +667,19 @@ class HammingTree {
     }
   }
 
-  static void insert(Level* level, const std::vector<Value>& values, int depth) {
+  static void insert(Level* level, Value* values, size_t count, int depth, int& tasks) {
     Q_ASSERT(depth < 64);
-    if (values.size() <= 0) return;
+    if (count == 0) return;
 
     if (depth < 63 && level->left) {
       // level is internal, keep traversing
-      std::vector<Value> left, right;
-      partition(level->bit, values, left, right);
-
-      insert(level->left, left, depth + 1);
-      insert(level->right, right, depth + 1);
-    } else if (depth < 63 && level->count + values.size() > (CLUSTER_SIZE / sizeof(hash_t))) {
+      insertChildren(level, values, count, depth, tasks);
+    } else if (depth < 63 && level->count + count > (CLUSTER_SIZE / sizeof(hash_t))) {
       // level (cluster) is full, chop it up
-      int bit = getBit(depth);
-      level->bit = bit;
-      std::vector<Value> left, right;
-      partition(level->bit, values, left, right);
-
-      // this is almost the same as partition, can it be changed?
-      for (size_t i = 0; i < level->count; i++) {
-        index_t index = level->indices[i];
-        hash_t hash = level->hashes[i];
-        Value value(index, hash);
-        if (hash & (1 << bit))
-          left.push_back(value);
-        else
-          right.push_back(value);
-      }
+      std::vector<Value> existing;
+      existing.reserve(level->count);
+      for (size_t i = 0; i < level->count; i++)
+        existing.push_back(Value(level->indices[i], level->hashes[i]));
 
       free(level->indices);
       free(level->hashes);
@@ -297,16 +687,18 @@ class HammingTree {
       level->hashes = nullptr;
       level->count = 0;
 
+      level->bit = getBit(depth);
       level->left = new Level;
       level->right = new Level;
 
-      insert(level->left, left, depth + 1);
-      insert(level->right, right, depth + 1);
+      // the result is the same as inserting them together
+      insertChildren(level, existing.data(), existing.size(), depth, tasks);
+      insertChildren(level, values, count, depth, tasks);
     } else {
       // leaf is not full, add some more
       size_t offset = level->count;
 
-      level->count += values.size();
+      level->count += count;
       level->indices = strict_realloc(level->indices, level->count);
       level->hashes = strict_realloc(level->hashes, level->count);
 
@@ -316,89 +708,77 @@ class HammingTree {
       Q_ASSERT(malloc_size(level->hashes) >= level->count * sizeof(*level->hashes));
       Q_ASSERT(malloc_size(level->indices) >= level->count * sizeof(*level->indices));
 
-      for (size_t i = 0; i < values.size(); i++) {
+      for (size_t i = 0; i < count; i++) {
         level->indices[offset + i] = values[i].index;
         level->hashes[offset + i] = values[i].hash;
       }
     }
   }
 
-  static Level* read(FILE* fp) {
-    Level* level = new Level;
-
-    bool isLeaf;
-    Q_ASSERT(fread(&isLeaf, sizeof(isLeaf), 1, fp) == 1);
+  static void insertChildren(Level* level, Value* values, size_t count, int depth, int& tasks) {
+    const size_t numLeft = partition(level->bit, values, count);
+    Value* right = values + numLeft;
+    const size_t numRight = count - numLeft;
 
-    if (feof(fp))
-      ;
-    else if (!isLeaf) {
-      Q_ASSERT(fread(&level->bit, sizeof(level->bit), 1, fp) == 1);
-
-      level->left = read(fp);
-      level->right = read(fp);
-    } else {
-      Q_ASSERT(fread(&level->count, sizeof(level->count), 1, fp) == 1);
-      if (level->count > 0) {
-        size_t size = sizeof(*level->indices) * level->count;
-        level->indices = (index_t*)malloc(size);
-        Q_ASSERT(fread(level->indices, size, 1, fp) == 1);
-
-        size = sizeof(*level->hashes) * level->count;
-        level->hashes = (hash_t*)malloc(size);
-        Q_ASSERT(fread(level->hashes, size, 1, fp) == 1);
-
-        Q_ASSERT(malloc_size(level->hashes) >= level->count * sizeof(*level->hashes));
-        Q_ASSERT(malloc_size(level->indices) >= level->count * sizeof(*level->indices));
-      }
+    if (numLeft < PARALLEL_SIZE || numRight < PARALLEL_SIZE) {
+      insert(level->left, values, numLeft, depth + 1, tasks);
+      insert(level->right, right, numRight, depth + 1, tasks);
+      return;
     }
 
-    return level;
-  }
+    // if the pool is busy, waitForFinished() runs the task in this thread
+    int leftTasks = 0;
+    QFuture<void> f = QtConcurrent::run(buildPool(), [=, &leftTasks]() {
+      insert(level->left, values, numLeft, depth + 1, leftTasks);
+    });
+    insert(level->right, right, numRight, depth + 1, tasks);
+    f.waitForFinished();
 
-  static void write(const Level* level, QFile& f) {
-    bool isLeaf = level->left == nullptr;
-    if (isLeaf) {
-      // TODO: compact entries that have been "removed" (index == 0)
-      QByteArray data;
-      data.append((char*)&isLeaf, sizeof(isLeaf));
-      data.append((char*)&level->count, sizeof(level->count));
-
-      if (level->count > 0) {
-        data.append((char*)level->indices, sizeof(*level->indices) * level->count);
-        data.append((char*)level->hashes, sizeof(*level->hashes) * level->count);
-      }
+    tasks += leftTasks + 1;
+  }
 
-      if (Q_UNLIKELY(data.length() != f.write(data))) throw f.errorString();
-    } else {
-      QByteArray data;
-      data.append((char*)&isLeaf, sizeof(isLeaf));
-      data.append((char*)&level->bit, sizeof(level->bit));
-      if (Q_UNLIKELY(data.length() != f.write(data))) throw f.errorString();
+  static void stats(LevelRef level, Stats& st, int height) {
+    st.numNodes++;
+    st.maxHeight = std::max(st.maxHeight, height);
+    st.memory += sizeof(Level);
+    st.memory += level.count() * (sizeof(index_t) + sizeof(hash_t));
+    st.numValues += level.count();
 
-      write(level->left, f);
-      write(level->right, f);
+    if (!level.isLeaf()) {
+      stats(level.left(), st, height + 1);
+      stats(level.right(), st, height + 1);
     }
   }
 
-  static void stats(const Level* level, Stats& st, int height) {
+  /// memory is counted by stats()
+  static void stats(NodeRef level, Stats& st, int height) {
     st.numNodes++;
     st.maxHeight = std::max(st.maxHeight, height);
-    st.memory += sizeof(Level);
-    st.memory += level->count * (sizeof(index_t) + sizeof(hash_t));
-    st.numValues += level->count;
+    st.numValues += level.count();
 
-    if (level->left) {
-      stats(level->left, st, height + 1);
-      stats(level->right, st, height + 1);
+    if (!level.isLeaf()) {
+      stats(level.left(), st, height + 1);
+      stats(level.right(), st, height + 1);
     }
   }
 
-  void init() { _root = nullptr, _count = 0; }
+  void init() {
+    _root = nullptr, _count = 0, _buildTasks = 0, _buildTime = 0;
+    _file = nullptr;
+    point();
+  }
+  void freeLayout() {
+    delete _file;
+    _ownNodes = std::vector<Node>();
+    _ownHashes = std::vector<hash_t>();
+    _ownIndices = std::vector<index_t>();
+    init();
+  }
   void clear() {
     delete _root;
-    init();
+    _root = nullptr;
+    freeLayout();
   }
-  bool empty() const { return _root == nullptr; }
 
   size_t printLevel(Level* level, int depth) {
     size_t bytes = sizeof(*level) + sizeof(Value) * level->count + sizeof(Level*) * 2;
@@ -414,6 +794,19 @@ class HammingTree {
     return bytes;
   }
 
-  Level* _root;
+  Level* _root;  // pointer layout, or null if frozen
   size_t _count;
+  int _buildTasks;      // stats from insert()
+  uint64_t _buildTime;
+
+  // compact layout, if _numNodes > 0
+  QFile* _file;  // if not null, layout is mapped from it
+  size_t _numNodes;
+  const Node* _nodes;
+  const hash_t* _hashes;
+  const index_t* _indices;
+
+  std::vector<Node> _ownNodes;
+  std::vector<hash_t> _ownHashes;
+  std::vector<index_t> _ownIndices;
 };
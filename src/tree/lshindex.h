@@ -0,0 +1,439 @@
+/* Locality-sensitive hashing for binary feature descriptors
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+/**
+ * @class LshIndex
+ * @brief Approximate k-nearest search of 256-bit (ORB) descriptors
+ *
+ * Same method as the flann LSH index: each table hashes a descriptor
+ * to a bucket using keySize randomly chosen bits, and a query probes its
+ * own bucket plus the buckets one or two bits away (multi-probe).
+ *
+ * Each table keeps a copy of the descriptors in bucket order, so probing
+ * a bucket is a linear scan instead of a gather from the descriptor matrix.
+ *
+ * Unlike flann, the tables can be written to a file and memory-mapped,
+ * so they don't have to be rebuilt when the program starts.
+ *
+ * The descriptors are passed to each function and must be contiguous
+ * (row stride == DESC_BYTES), they are only read after build() for the tail.
+ *
+ * Descriptors added after build() go to an unindexed tail that is
+ * searched by brute-force, until there are enough to justify a rebuild.
+ */
+class LshIndex {
+ public:
+  enum {
+    DESC_BYTES = 32,
+    DESC_WORDS = DESC_BYTES / 8,
+    MAX_KEY_SIZE = 24,
+    MAX_TABLES = 16,
+    MAX_PROBE_LEVEL = 2,
+    MIN_TAIL = 10000,  // minimum unindexed descriptors before rebuild
+  };
+
+  typedef uint32_t index_t;
+  typedef int distance_t;
+
+  /// Build parameters
+  struct Params {
+    int tables = 1;   // number of hash tables
+    int keySize = 0;  // bits per key, 0 == choose based on count
+  };
+
+  /// Search parameters, trade speed for recall
+  struct SearchParams {
+    int tables = 1;      // number of tables to probe, <= numTables()
+    int probeLevel = 1;  // 0==query bucket only, 1==+buckets 1 bit away, 2==+2 bits away
+  };
+
+  /// Search result type
+  struct Match {
+    index_t index;
+    distance_t distance;
+    bool operator<(const Match& m) const { return distance < m.distance; }
+  };
+
+  LshIndex() { point(); }
+  ~LshIndex() { delete _file; }
+  LshIndex(const LshIndex&) = delete;
+  LshIndex& operator=(const LshIndex&) = delete;
+
+  /// key size giving buckets of roughly 4k bytes of descriptors
+  static int defaultKeySize(size_t count) {
+    const size_t descPerBucket = 4096 / DESC_BYTES;
+    int keySize = 1;
+    while (keySize < MAX_KEY_SIZE && (count / descPerBucket) >> (keySize + 1)) keySize++;
+    return keySize;
+  }
+
+  /// index descriptors [0, count)
+  void build(const uint8_t* descriptors, size_t count, const Params& params) {
+    delete _file;
+    _file = nullptr;
+
+    _header.numTables = uint32_t(std::clamp(params.tables, 1, int(MAX_TABLES)));
+    _header.keySize = uint32_t(params.keySize > 0 ? std::min(int(params.keySize), int(MAX_KEY_SIZE))
+                                                  : defaultKeySize(count));
+    _header.count = count;
+    _numDescriptors = count;
+
+    const size_t numBuckets = size_t(1) << _header.keySize;
+
+    _ownMasks.resize(_header.numTables * DESC_WORDS);
+    _ownOffsets.assign(_header.numTables * (numBuckets + 1), 0);
+    _ownEntries.resize(_header.numTables * count);
+    _ownCodes.resize(_header.numTables * count * DESC_WORDS);
+
+    // same seed every time, the tables are repeatable
+    std::mt19937 rng(uint32_t(_header.keySize * 31 + _header.numTables));
+
+    std::vector<uint32_t> keys(count);
+
+    for (uint32_t t = 0; t < _header.numTables; ++t) {
+      uint64_t* masks = _ownMasks.data() + t * DESC_WORDS;
+      std::fill(masks, masks + DESC_WORDS, 0);
+
+      // choose keySize bits
+      int bits[DESC_BYTES * 8];
+      for (int i = 0; i < DESC_BYTES * 8; ++i) bits[i] = i;
+      std::shuffle(bits, bits + DESC_BYTES * 8, rng);
+      for (uint32_t i = 0; i < _header.keySize; ++i)
+        masks[bits[i] / 64] |= uint64_t(1) << (bits[i] % 64);
+
+      // counting sort into buckets
+      uint32_t* offsets = _ownOffsets.data() + t * (numBuckets + 1);
+      uint32_t* entries = _ownEntries.data() + t * count;
+      uint64_t* codes = _ownCodes.data() + t * count * DESC_WORDS;
+
+      for (size_t i = 0; i < count; ++i) {
+        keys[i] = key(masks, descriptors + i * DESC_BYTES);
+        offsets[keys[i] + 1]++;
+      }
+      for (size_t b = 0; b < numBuckets; ++b) offsets[b + 1] += offsets[b];
+
+      std::vector<uint32_t> pos(offsets, offsets + numBuckets);
+      for (size_t i = 0; i < count; ++i) {
+        const uint32_t e = pos[keys[i]]++;
+        entries[e] = index_t(i);
+        memcpy(codes + e * DESC_WORDS, descriptors + i * DESC_BYTES, DESC_BYTES);
+      }
+    }
+
+    point();
+  }
+
+  /// descriptors [size(), count) were added, rebuild if the tail is too large
+  void add(const uint8_t* descriptors, size_t count, const Params& params) {
+    if (count <= _numDescriptors) return;
+    _numDescriptors = count;
+    const size_t tail = count - _header.count;
+    if (tail >= std::max(size_t(MIN_TAIL), size_t(_header.count / 16)))
+      build(descriptors, count, params);
+  }
+
+  /**
+   * Find k nearest descriptors
+   * @param descriptors the indexed descriptors, at least size() of them
+   * @param query descriptor to search for
+   * @param k max number of matches
+   * @param params tables and probes to search
+   * @param matches [out] up to k matches sorted by distance
+   */
+  void knnSearch(const uint8_t* descriptors, const uint8_t* query, int k,
+                 const SearchParams& params, std::vector<Match>& matches) const {
+    matches.clear();
+    if (k <= 0) return;
+
+    uint64_t q[DESC_WORDS];
+    memcpy(q, query, sizeof(q));
+
+    TopK top(k, matches);
+
+    const uint32_t keySize = _header.keySize;
+    const size_t numBuckets = size_t(1) << keySize;
+    const uint32_t numTables =
+        uint32_t(std::clamp(params.tables, 1, int(_header.numTables)));
+    const int level = std::clamp(params.probeLevel, 0, int(MAX_PROBE_LEVEL));
+
+    // with one table, a descriptor is in exactly one bucket, no duplicates
+    const bool checkDuplicate = numTables > 1;
+
+    for (uint32_t t = 0; t < numTables; ++t) {
+      const uint64_t* masks = _masks + t * DESC_WORDS;
+      const uint32_t* offsets = _offsets + t * (numBuckets + 1);
+      const uint32_t* entries = _entries + t * _header.count;
+      const uint64_t* codes = _codes + t * _header.count * DESC_WORDS;
+
+      const uint32_t qKey = key(masks, query);
+
+      auto probe = [&](uint32_t bucket) {
+        const uint32_t begin = offsets[bucket], end = offsets[bucket + 1];
+        const uint64_t* code = codes + size_t(begin) * DESC_WORDS;
+        for (uint32_t e = begin; e < end; ++e, code += DESC_WORDS)
+          top.insert(entries[e], distance(q, code), checkDuplicate);
+      };
+
+      probe(qKey);
+      if (level >= 1)
+        for (uint32_t i = 0; i < keySize; ++i) probe(qKey ^ (1u << i));
+      if (level >= 2)
+        for (uint32_t i = 1; i < keySize; ++i)
+          for (uint32_t j = 0; j < i; ++j) probe(qKey ^ (1u << i) ^ (1u << j));
+    }
+
+    // unindexed tail
+    for (size_t i = _header.count; i < _numDescriptors; ++i)
+      top.insert(index_t(i), distance(q, descriptors + i * DESC_BYTES), false);
+  }
+
+  /**
+   * Find k nearest descriptors by brute force
+   * @note for measuring the recall of knnSearch()
+   */
+  void exhaustiveSearch(const uint8_t* descriptors, const uint8_t* query, int k,
+                        std::vector<Match>& matches) const {
+    matches.clear();
+    if (k <= 0) return;
+
+    uint64_t q[DESC_WORDS];
+    memcpy(q, query, sizeof(q));
+
+    TopK top(k, matches);
+    for (size_t i = 0; i < _numDescriptors; ++i)
+      top.insert(index_t(i), distance(q, descriptors + i * DESC_BYTES), false);
+  }
+
+  /**
+   * Use the file written by write() without reading it
+   * @param count number of descriptors, must be the same as when written
+   * @return false if file is invalid or incompatible
+   */
+  bool map(const QString& path, size_t count) {
+    QFile* f = new QFile(path);
+    if (!f->open(QFile::ReadOnly)) {
+      qWarning() << "open failed:" << path << f->errorString();
+      delete f;
+      return false;
+    }
+
+    const qint64 size = f->size();
+    const uchar* data = nullptr;
+    Header h;
+
+    if (size >= qint64(sizeof(h))) data = f->map(0, size);
+    if (data) memcpy(&h, data, sizeof(h));
+
+    if (!data || memcmp(h.magic, Header::Magic, sizeof(h.magic)) != 0 ||
+        h.version != Header::Version || h.keySize < 1 || h.keySize > MAX_KEY_SIZE ||
+        h.numTables < 1 || h.numTables > MAX_TABLES || h.count != count ||
+        uint64_t(size) != fileSize(h.numTables, h.keySize, h.count)) {
+      qWarning() << "invalid or incompatible cache file:" << path;
+      delete f;
+      return false;
+    }
+
+    // knnSearch() needs buckets in order and in bounds, and returns entries as row numbers
+    const size_t numBuckets = size_t(1) << h.keySize;
+    const uint32_t* offsets =
+        reinterpret_cast<const uint32_t*>(data + sizeof(h) + h.numTables * DESC_BYTES);
+    const uint32_t* entries = offsets + h.numTables * (numBuckets + 1);
+    bool valid = true;
+    for (uint32_t t = 0; valid && t < h.numTables; ++t) {
+      const uint32_t* o = offsets + t * (numBuckets + 1);
+      valid = o[0] == 0 && o[numBuckets] == h.count;
+      for (size_t b = 0; valid && b < numBuckets; ++b) valid = o[b] <= o[b + 1];
+    }
+    for (size_t e = 0; valid && e < h.numTables * h.count; ++e) valid = entries[e] < h.count;
+    if (!valid) {
+      qWarning() << "corrupt cache file:" << path;
+      delete f;
+      return false;
+    }
+
+    delete _file;
+    _file = f;
+    _ownMasks.clear();
+    _ownOffsets.clear();
+    _ownEntries.clear();
+    _ownCodes.clear();
+
+    _header = h;
+    _numDescriptors = count;
+
+    _masks = reinterpret_cast<const uint64_t*>(data + sizeof(h));
+    _offsets = offsets;
+    _entries = entries;
+    _codes = reinterpret_cast<const uint64_t*>(data + codesOffset(h.numTables, h.keySize, h.count));
+    return true;
+  }
+
+  /// write the tables, throws QString on error; the tail is not written
+  void write(QFile& f) const {
+    Header h = _header;
+    memcpy(h.magic, Header::Magic, sizeof(h.magic));
+    h.version = Header::Version;
+
+    const size_t numBuckets = size_t(1) << h.keySize;
+    const qint64 maskBytes = qint64(h.numTables * DESC_WORDS * sizeof(*_masks));
+    const qint64 offsetBytes = qint64(h.numTables * (numBuckets + 1) * sizeof(*_offsets));
+    const qint64 entryBytes = qint64(h.numTables * h.count * sizeof(*_entries));
+    const qint64 codeBytes = qint64(h.numTables * h.count * DESC_BYTES);
+
+    const char pad[DESC_BYTES] = {0};
+    const qint64 padBytes = qint64(codesOffset(h.numTables, h.keySize, h.count)) -
+                            qint64(sizeof(h)) - maskBytes - offsetBytes - entryBytes;
+
+    if (sizeof(h) != f.write(reinterpret_cast<const char*>(&h), sizeof(h)) ||
+        maskBytes != f.write(reinterpret_cast<const char*>(_masks), maskBytes) ||
+        offsetBytes != f.write(reinterpret_cast<const char*>(_offsets), offsetBytes) ||
+        entryBytes != f.write(reinterpret_cast<const char*>(_entries), entryBytes) ||
+        padBytes != f.write(pad, padBytes) ||
+        codeBytes != f.write(reinterpret_cast<const char*>(_codes), codeBytes))
+      throw f.errorString();
+  }
+
+  /// @return number of descriptors searched, including unindexed
+  size_t size() const { return _numDescriptors; }
+
+  /// @return number of descriptors added since build(), they are searched linearly
+  size_t tailSize() const { return _numDescriptors - size_t(_header.count); }
+
+  /// @return true if tables are mapped from a file
+  bool isMapped() const { return _file != nullptr; }
+
+  int keySize() const { return int(_header.keySize); }
+  int numTables() const { return int(_header.numTables); }
+
+  /// @return heap memory used, excluding mapped file
+  size_t memoryUsage() const {
+    return _ownMasks.capacity() * sizeof(uint64_t) + _ownOffsets.capacity() * sizeof(uint32_t) +
+           _ownEntries.capacity() * sizeof(uint32_t) + _ownCodes.capacity() * sizeof(uint64_t);
+  }
+
+  /// hamming distance of 256-bit descriptors
+  static inline distance_t distance(const uint64_t* q, const void* desc) {
+    uint64_t d[DESC_WORDS];
+    memcpy(d, desc, sizeof(d));
+    return distance_t(__builtin_popcountll(q[0] ^ d[0]) + __builtin_popcountll(q[1] ^ d[1]) +
+                      __builtin_popcountll(q[2] ^ d[2]) + __builtin_popcountll(q[3] ^ d[3]));
+  }
+
+ private:
+  /**
+   * file: Header, masks[numTables][4], offsets[numTables][2^keySize+1],
+   * entries[numTables][count], padding, codes[numTables][count][DESC_BYTES]
+   */
+  struct Header {
+    enum { Version = 4 };
+    char magic[8];
+    uint32_t version;
+    uint32_t numTables;
+    uint32_t keySize;
+    uint32_t reserved;
+    uint64_t count;  // number of indexed descriptors
+    static constexpr char Magic[8] = {'c', 'b', 'i', 'r', 'd', 'L', 'S', 'H'};
+  };
+
+  /// the k best matches, sorted by distance
+  class TopK {
+   public:
+    TopK(int k, std::vector<Match>& matches) : _k(size_t(k)), _matches(matches) {
+      _matches.reserve(_k + 1);
+    }
+    inline void insert(index_t index, distance_t distance, bool checkDuplicate) {
+      if (_matches.size() >= _k && distance >= _matches.back().distance) return;
+      if (checkDuplicate)
+        for (const Match& m : _matches)
+          if (m.index == index) return;
+      Match m{index, distance};
+      _matches.insert(std::upper_bound(_matches.begin(), _matches.end(), m), m);
+      if (_matches.size() > _k) _matches.pop_back();
+    }
+
+   private:
+    size_t _k;
+    std::vector<Match>& _matches;
+  };
+
+  /// codes are aligned to DESC_BYTES from the start of the file
+  static uint64_t codesOffset(uint64_t numTables, uint64_t keySize, uint64_t count) {
+    const uint64_t offset = sizeof(Header) + numTables * DESC_WORDS * sizeof(uint64_t) +
+                            numTables * ((uint64_t(1) << keySize) + 1) * sizeof(uint32_t) +
+                            numTables * count * sizeof(uint32_t);
+    return (offset + DESC_BYTES - 1) / DESC_BYTES * DESC_BYTES;
+  }
+
+  static uint64_t fileSize(uint64_t numTables, uint64_t keySize, uint64_t count) {
+    return codesOffset(numTables, keySize, count) + numTables * count * DESC_BYTES;
+  }
+
+  /// gather the masked bits of the descriptor into the key
+  static inline uint32_t key(const uint64_t* masks, const uint8_t* desc) {
+    uint64_t d[DESC_WORDS];
+    memcpy(d, desc, sizeof(d));
+    uint32_t key = 0;
+    int shift = 0;
+    for (int i = 0; i < DESC_WORDS; ++i) {
+#ifdef __BMI2__
+      key |= uint32_t(_pext_u64(d[i], masks[i])) << shift;
+      shift += __builtin_popcountll(masks[i]);
+#else
+      for (uint64_t m = masks[i]; m; m &= m - 1) {
+        key |= uint32_t((d[i] & (m & -m)) != 0) << shift;
+        shift++;
+      }
+#endif
+    }
+    return key;
+  }
+
+  /// use the owned arrays
+  void point() {
+    _masks = _ownMasks.data();
+    _offsets = _ownOffsets.data();
+    _entries = _ownEntries.data();
+    _codes = _ownCodes.data();
+  }
+
+  Header _header = {{}, Header::Version, 0, 0, 0, 0};
+  size_t _numDescriptors = 0;  // indexed + unindexed tail
+
+  QFile* _file = nullptr;  // if not null, arrays are mapped from it
+  const uint64_t* _masks;
+  const uint32_t* _offsets;
+  const uint32_t* _entries;
+  const uint64_t* _codes;  // descriptors in bucket order
+
+  std::vector<uint64_t> _ownMasks;
+  std::vector<uint32_t> _ownOffsets;
+  std::vector<uint32_t> _ownEntries;
+  std::vector<uint64_t> _ownCodes;
+};
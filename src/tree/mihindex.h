@@ -0,0 +1,377 @@
+/* Multi-index hashing for DCT hashes
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+#include "../hamm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * @class MihIndex
+ * @brief Exact search for 64-bit dct hash using multi-index hashing
+ *
+ * Each hash is split into NUM_TABLES substrings of 16 bits, and each
+ * substring indexes a table of buckets. If two hashes are within distance r,
+ * then by the pigeonhole principle at least one substring is within r/NUM_TABLES,
+ * so probing every bucket within that radius finds all matches (unlike HammingTree).
+ *
+ * With thresholds up to ~12 only a few hundred buckets are probed, so the query
+ * time is sublinear. Larger thresholds fall back to a brute-force scan.
+ *
+ * Tables are built lazily by the first search after insert(). Small inserts go
+ * to an unindexed tail (scanned by brute-force) to avoid rebuilding every time.
+ *
+ * The interface is the same as HammingTree so they can be swapped (see dcttree.h)
+ */
+class MihIndex {
+ public:
+  enum {
+    NUM_TABLES = 4,
+    SUBSTRING_BITS = 64 / NUM_TABLES,
+    NUM_BUCKETS = 1 << SUBSTRING_BITS,
+    MIN_TAIL = 4096,  // minimum unindexed values before tables are rebuilt
+  };
+
+  typedef uint32_t index_t;
+  typedef uint64_t hash_t;
+  typedef int distance_t;
+
+  /// Node value type
+  struct Value {
+    index_t index;
+    hash_t hash;
+    Value(index_t index_, hash_t hash_) : index(index_), hash(hash_) {}
+  };
+
+  /// Search result type
+  struct Match {
+    Value value;
+    distance_t distance;
+    Match() : value(-1, 0), distance(-1) {}
+    Match(const Value& value_, distance_t distance_) : value(value_), distance(distance_) {}
+    bool operator<(const Match& m) const { return distance < m.distance; }
+  };
+
+  /// Stats type; numNodes is the number of buckets, maxHeight the largest bucket
+  struct Stats {
+    size_t memory;
+    int numNodes;
+    int maxHeight;
+    int numValues;
+    int buildTasks;      // always 0, tables are built by the first search
+    uint64_t buildTime;  // always 0
+    Stats()
+        : memory(sizeof(MihIndex)),
+          numNodes(0),
+          maxHeight(0),
+          numValues(0),
+          buildTasks(0),
+          buildTime(0) {}
+  };
+
+  MihIndex() {}
+  MihIndex(const MihIndex&) = delete;
+  MihIndex& operator=(const MihIndex&) = delete;
+
+  /// Find hash with distance(hash, cand) < threshold
+  void search(hash_t hash, distance_t threshold, std::vector<Match>& matches) const {
+    if (_hashes.empty() || threshold <= 0) return;
+    const size_t tableSize = buildTables();
+    searchTables(hash, threshold, tableSize, matches);
+    scan(hash, threshold, tableSize, _hashes.size(), matches);
+    std::sort(matches.begin(), matches.end());
+  }
+
+  /// Find many hashes at once, matches[i] are the results for hashes[i]
+  void search(const std::vector<hash_t>& hashes, distance_t threshold,
+              std::vector<std::vector<Match>>& matches) const {
+    matches.resize(hashes.size());
+    for (size_t i = 0; i < hashes.size(); ++i) search(hashes[i], threshold, matches[i]);
+  }
+
+  /// Find many hashes at once, keeping the k nearest matches of each hash
+  void search(const std::vector<hash_t>& hashes, distance_t threshold, int k,
+              std::vector<std::vector<Match>>& matches) const {
+    search(hashes, threshold, matches);
+    for (auto& m : matches)
+      if (m.size() > size_t(k)) m.resize(size_t(k));
+  }
+
+  /// Find Value with index
+  void findIndex(index_t index, std::vector<hash_t>& results) const {
+    for (size_t i = 0; i < _indices.size(); ++i)
+      if (_indices[i] == index) results.push_back(_hashes[i]);
+  }
+
+  /// Add more values
+  void insert(std::vector<Value>& values) {
+    _hashes.reserve(_hashes.size() + values.size());
+    _indices.reserve(_indices.size() + values.size());
+    for (const Value& v : values) {
+      _hashes.push_back(v.hash);
+      _indices.push_back(v.index);
+    }
+  }
+
+  /// Remove values; like HammingTree the index is zeroed
+  void remove(std::unordered_set<index_t>& indexSet) {
+    const auto& end = indexSet.cend();
+    for (index_t& index : _indices)
+      if (indexSet.find(index) != end) index = 0;
+  }
+
+  /// Copy values with index in indexSet to another tree
+  void copyTo(const std::unordered_set<index_t>& indexSet, MihIndex& tree) const {
+    const auto& end = indexSet.cend();
+    for (size_t i = 0; i < _indices.size(); ++i)
+      if (indexSet.find(_indices[i]) != end) {
+        tree._hashes.push_back(_hashes[i]);
+        tree._indices.push_back(_indices[i]);
+      }
+  }
+
+  /// Copy a subset; method to multithread searches
+  MihIndex* slice(const std::unordered_set<index_t>& indexSet) const {
+    MihIndex* tree = new MihIndex;
+    copyTo(indexSet, *tree);
+    return tree;
+  }
+
+  /// Get some stats, like memory usage
+  Stats stats() const {
+    buildTables();
+    Stats st;
+    st.numValues = int(_hashes.size());
+    st.memory += _hashes.capacity() * sizeof(hash_t) + _indices.capacity() * sizeof(index_t);
+    for (int k = 0; k < NUM_TABLES; ++k) {
+      const Table& t = _tables[k];
+      st.memory += t.offsets.capacity() * sizeof(uint32_t) + t.slots.capacity() * sizeof(uint32_t);
+      for (size_t b = 0; b + 1 < t.offsets.size(); ++b) {
+        const int len = int(t.offsets[b + 1] - t.offsets[b]);
+        if (len) st.numNodes++;
+        st.maxHeight = std::max(st.maxHeight, len);
+      }
+    }
+    return st;
+  }
+
+  /// Read values from file, tables are rebuilt on first search
+  /// @param key must be the same as given to write()
+  /// @return false if file is missing, invalid or has another key, index is empty
+  bool read(const char* file, uint64_t key = 0) {
+    _hashes.clear();
+    _indices.clear();
+    _tableSize = 0;
+
+    FILE* fp = fopen(file, "rb");
+    if (!fp) {
+      qWarning() << "failed to open" << file;
+      return false;
+    }
+
+    char magic[sizeof(MAGIC)];
+    uint64_t count = 0, fileKey = 0;
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, MAGIC, sizeof(magic)) != 0 ||
+        fread(&count, sizeof(count), 1, fp) != 1 || fread(&fileKey, sizeof(fileKey), 1, fp) != 1) {
+      qWarning() << "invalid or incompatible cache file" << file;
+      fclose(fp);
+      return false;
+    }
+    if (fileKey != key) {
+      qWarning() << "cache file is out of date" << file;
+      fclose(fp);
+      return false;
+    }
+
+    _hashes.resize(count);
+    _indices.resize(count);
+    if (count > 0 && (fread(_hashes.data(), sizeof(hash_t) * count, 1, fp) != 1 ||
+                      fread(_indices.data(), sizeof(index_t) * count, 1, fp) != 1)) {
+      qWarning() << "truncated cache file" << file;
+      _hashes.clear();
+      _indices.clear();
+      fclose(fp);
+      return false;
+    }
+    fclose(fp);
+    return true;
+  }
+
+  /// Same as HammingTree::freeze(), values are already compact
+  void freeze() {}
+
+  /// Write live values to file; tables are not written since they are fast to rebuild
+  /// @param key identifies what the index was built from, checked by read()
+  void write(QFile& f, uint64_t key = 0) const {
+    // removed values (index 0) are dropped, but only copy if there are any
+    std::vector<hash_t> liveHashes;
+    std::vector<index_t> liveIndices;
+    const bool compact = std::find(_indices.begin(), _indices.end(), 0) != _indices.end();
+    if (compact)
+      for (size_t i = 0; i < _indices.size(); ++i)
+        if (_indices[i]) {
+          liveHashes.push_back(_hashes[i]);
+          liveIndices.push_back(_indices[i]);
+        }
+    const std::vector<hash_t>& outHashes = compact ? liveHashes : _hashes;
+    const std::vector<index_t>& outIndices = compact ? liveIndices : _indices;
+
+    const uint64_t count = outHashes.size();
+    const qint64 countBytes = sizeof(count);  // ...and key
+    const qint64 hashBytes = qint64(count * sizeof(hash_t));
+    const qint64 indexBytes = qint64(count * sizeof(index_t));
+    const char* hashes = reinterpret_cast<const char*>(outHashes.data());
+    const char* indices = reinterpret_cast<const char*>(outIndices.data());
+    if (Q_UNLIKELY(qint64(sizeof(MAGIC)) != f.write(MAGIC, sizeof(MAGIC)) ||
+                   countBytes != f.write(reinterpret_cast<const char*>(&count), countBytes) ||
+                   countBytes != f.write(reinterpret_cast<const char*>(&key), countBytes) ||
+                   hashBytes != f.write(hashes, hashBytes) ||
+                   indexBytes != f.write(indices, indexBytes)))
+      throw f.errorString();
+  }
+
+  /// @return number of Values
+  size_t size() const { return _hashes.size(); }
+
+ private:
+  static constexpr char MAGIC[8] = {'c', 'b', 'i', 'r', 'd', 'M', 'I', '2'};
+
+  /// buckets for one substring, bucket b is slots[offsets[b]..offsets[b+1])
+  struct Table {
+    std::vector<uint32_t> offsets;  // NUM_BUCKETS+1
+    std::vector<uint32_t> slots;    // index into _hashes
+  };
+
+  static inline uint32_t substring(hash_t hash, int k) {
+    return uint32_t(hash >> (k * SUBSTRING_BITS)) & (NUM_BUCKETS - 1);
+  }
+
+  /**
+   * All substring masks, ordered by number of set bits
+   * @param radius max bits set
+   * @param count [out] number of masks with <= radius bits
+   */
+  static const uint32_t* probeMasks(int radius, int& count) {
+    struct Masks {
+      std::vector<uint32_t> masks;
+      int countForRadius[SUBSTRING_BITS + 1];
+      Masks() {
+        for (int bits = 0; bits <= SUBSTRING_BITS; ++bits) {
+          for (uint32_t m = 0; m < NUM_BUCKETS; ++m)
+            if (__builtin_popcount(m) == bits) masks.push_back(m);
+          countForRadius[bits] = int(masks.size());
+        }
+      }
+    };
+    static const Masks m;
+    count = m.countForRadius[std::min(radius, int(SUBSTRING_BITS))];
+    return m.masks.data();
+  }
+
+  /**
+   * (re)build tables if the unindexed tail is too large
+   * @return number of values in the tables
+   */
+  size_t buildTables() const {
+    size_t tableSize = _tableSize.load(std::memory_order_acquire);
+    if (_hashes.size() - tableSize < std::max(size_t(MIN_TAIL), tableSize / 16)) return tableSize;
+
+    std::lock_guard<std::mutex> lock(_buildMutex);
+    tableSize = _tableSize.load(std::memory_order_relaxed);
+    if (tableSize == _hashes.size()) return tableSize;
+
+    // counting sort on each substring
+    const uint32_t count = uint32_t(_hashes.size());
+    for (int k = 0; k < NUM_TABLES; ++k) {
+      Table& t = _tables[k];
+      t.offsets.assign(NUM_BUCKETS + 1, 0);
+      t.slots.resize(count);
+
+      for (uint32_t i = 0; i < count; ++i) t.offsets[substring(_hashes[i], k) + 1]++;
+      for (int b = 0; b < NUM_BUCKETS; ++b) t.offsets[b + 1] += t.offsets[b];
+
+      std::vector<uint32_t> next(t.offsets.begin(), t.offsets.end() - 1);
+      for (uint32_t i = 0; i < count; ++i) t.slots[next[substring(_hashes[i], k)]++] = i;
+    }
+
+    _tableSize.store(count, std::memory_order_release);
+    return count;
+  }
+
+  /// exact search of [0,tableSize) using the tables
+  void searchTables(hash_t hash, distance_t threshold, size_t tableSize,
+                    std::vector<Match>& matches) const {
+    // distance < threshold => at least one substring within radius
+    const int radius = (threshold - 1) / NUM_TABLES;
+    int numMasks;
+    const uint32_t* masks = probeMasks(radius, numMasks);
+
+    // if we would probe a large fraction of the table, brute-force is faster
+    if (numMasks * NUM_TABLES * 32 > NUM_BUCKETS || size_t(numMasks) * NUM_TABLES * 4 > tableSize) {
+      scan(hash, threshold, 0, tableSize, matches);
+      return;
+    }
+
+    uint32_t needle[NUM_TABLES];
+    for (int k = 0; k < NUM_TABLES; ++k) needle[k] = substring(hash, k);
+
+    for (int k = 0; k < NUM_TABLES; ++k) {
+      const Table& t = _tables[k];
+      for (int m = 0; m < numMasks; ++m) {
+        const uint32_t bucket = needle[k] ^ masks[m];
+        for (uint32_t j = t.offsets[bucket]; j < t.offsets[bucket + 1]; ++j) {
+          const uint32_t slot = t.slots[j];
+          const hash_t cand = _hashes[slot];
+          const distance_t distance = hamm64(hash, cand);
+          if (distance >= threshold) continue;
+
+          // report only from the first table the candidate is found in
+          bool seen = false;
+          for (int p = 0; p < k && !seen; ++p)
+            seen = __builtin_popcount(needle[p] ^ substring(cand, p)) <= radius;
+          if (!seen) matches.push_back(Match(Value(_indices[slot], cand), distance));
+        }
+      }
+    }
+  }
+
+  /// brute-force search of [begin,end)
+  void scan(hash_t hash, distance_t threshold, size_t begin, size_t end,
+            std::vector<Match>& matches) const {
+    if (begin >= end) return;
+    const hash_t* hashes = _hashes.data() + begin;
+    const index_t* indices = _indices.data() + begin;
+    hammScan64(hash, hashes, end - begin, threshold, [&](size_t i, int distance) {
+      matches.push_back(Match(Value(indices[i], hashes[i]), distance));
+    });
+  }
+
+  std::vector<hash_t> _hashes;
+  std::vector<index_t> _indices;
+
+  // tables are built on demand by const methods that may run concurrently
+  mutable Table _tables[NUM_TABLES];
+  mutable std::atomic<size_t> _tableSize{0};  // [0,_tableSize) indexed, the rest is scanned
+  mutable std::mutex _buildMutex;
+};
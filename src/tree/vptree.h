@@ -30,29 +30,44 @@
 /**
  * @class VpTree
  * @brief Vantage-Point Tree tuned for 64-bit dct hashes
+ *
+ * Nodes and leaf values are kept in two flat arrays (no pointers) so the
+ * tree can be written to disk and used directly from a memory-mapped file
+ * with map(), instead of rebuilding it every time.
  */
 template <typename ValueType, typename DistanceType,
           DistanceType (*distance)(ValueType, ValueType)>
 class VpTree {
  public:
+  /// Tree node, must be POD so it can be written/mapped
+  struct Node {
+    ValueType value;
+    DistanceType threshold = 0;
+    int32_t left = -1;   // index of child nodes, -1 for leaf node
+    int32_t right = -1;
+    uint32_t first = 0;  // leaf values are values()[first..first+count)
+    uint32_t count = 0;
+  };
+
   VpTree() {
     //qDebug("node == %d bytes, value == %d bytes, distance == %d bytes",
     //       int(sizeof(Node)), int(sizeof(ValueType)), int(sizeof(DistanceType)));
   }
 
-  ~VpTree() { delete _root; }
-
   void create(std::vector<ValueType>& items) {
-    delete _root;
-    _root = buildFromPoints(items, 0, items.size(), nullptr);
+    _ownNodes.clear();
+    _ownValues.clear();
+    if (items.size() > 0) (void)buildFromPoints(items, 0, int(items.size()), -1);
+    _mapped = false;
+    detach();
   }
 
   void search(const ValueType target, const DistanceType threshold,
               std::vector<ValueType>* results,
-              std::vector<DistanceType>* distances) {
+              std::vector<DistanceType>* distances) const {
 
     std::priority_queue<HeapItem> heap;
-    thresholdSearch(_root, target, threshold, heap);
+    if (_numNodes > 0) thresholdSearch(0, target, threshold, heap);
 
     results->clear();
     distances->clear();
@@ -69,23 +84,75 @@ class VpTree {
   }
 
   void printStats() const {
-    int maxDepth = depth(_root);
-    int numNodes = count(_root);
+    int maxDepth = _numNodes > 0 ? depth(0) : 0;
+    int numNodes = _numNodes > 0 ? count(0) : 0;
     qInfo("hashes=%d depth=%d 2^d=%d", numNodes, maxDepth, 1 << maxDepth);
   }
 
- private:
-  struct Node {
-    ValueType value;
-    DistanceType threshold = 0;
-    Node* left = nullptr;
-    Node* right = nullptr;
-    std::vector<ValueType> leaf;
-    ~Node() {
-      delete left;
-      delete right;
+  /// @return flat node array (root is the first element), for serialization
+  const Node* nodes() const { return _nodes; }
+  size_t numNodes() const { return _numNodes; }
+
+  /// @return flat array of leaf values, for serialization
+  const ValueType* values() const { return _values; }
+  size_t numValues() const { return _numValues; }
+
+  /**
+   * Use external storage (e.g. mmap) previously obtained from nodes()/values()
+   * @return false if the nodes are not a valid tree, tree is unchanged
+   * @note the memory is not copied, it must outlive the tree or detach() must be called
+   */
+  bool map(const Node* nodes, size_t numNodes, const ValueType* values, size_t numValues) {
+    if (numNodes > size_t(std::numeric_limits<int32_t>::max())) return false;
+    for (size_t i = 0; i < numNodes; ++i) {
+      const Node& n = nodes[i];
+      // children follow their parent, leaf values are in the array
+      if (n.left < 0) {
+        if (n.right >= 0 || uint64_t(n.first) + n.count > numValues) return false;
+      } else if (size_t(n.left) <= i || size_t(n.left) >= numNodes || n.right < 0 ||
+                 size_t(n.right) <= i || size_t(n.right) >= numNodes)
+        return false;
+    }
+
+    std::vector<Node>().swap(_ownNodes);
+    std::vector<ValueType>().swap(_ownValues);
+    _mapped = true;
+    _nodes = nodes;
+    _numNodes = numNodes;
+    _values = values;
+    _numValues = numValues;
+    return true;
+  }
+
+  /// @return true if using external storage
+  bool isMapped() const { return _mapped; }
+
+  /// Copy external storage so it can be released
+  void detach() {
+    if (_mapped) {
+      _ownNodes.assign(_nodes, _nodes + _numNodes);
+      _ownValues.assign(_values, _values + _numValues);
+      _mapped = false;
     }
-  } *_root = nullptr;
+    _nodes = _ownNodes.data();
+    _numNodes = _ownNodes.size();
+    _values = _ownValues.data();
+    _numValues = _ownValues.size();
+  }
+
+  /// @return heap memory used, excluding external storage
+  size_t memoryUsage() const {
+    return _ownNodes.capacity() * sizeof(Node) + _ownValues.capacity() * sizeof(ValueType);
+  }
+
+ private:
+  std::vector<Node> _ownNodes;       // storage when not mapped
+  std::vector<ValueType> _ownValues;
+  const Node* _nodes = nullptr;      // storage used for searching
+  size_t _numNodes = 0;
+  const ValueType* _values = nullptr;
+  size_t _numValues = 0;
+  bool _mapped = false;
 
   enum {
     // tuning: minimum 3, maximum number of elements in a leaf node
@@ -115,8 +182,17 @@ class VpTree {
     }
   };
 
-  Node* buildFromPoints(std::vector<ValueType>& items,
-                        int lower, const int upper, Node* parent) {
+  /// make leaf node from items[lower..upper)
+  void makeLeaf(int index, const std::vector<ValueType>& items, int lower, int upper) {
+    Node& node = _ownNodes[size_t(index)];
+    node.first = uint32_t(_ownValues.size());
+    node.count = uint32_t(upper - lower);
+    _ownValues.insert(_ownValues.end(), items.begin() + lower, items.begin() + upper);
+  }
+
+  /// @return index of new node in _ownNodes
+  int buildFromPoints(std::vector<ValueType>& items,
+                      int lower, const int upper, int parent) {
 
     Q_ASSERT(lower >= 0 && lower < int(items.size()));
     Q_ASSERT(upper > 0 && upper <= int(items.size()));
@@ -124,8 +200,9 @@ class VpTree {
 
     //if (upper == lower) return nullptr;
 
-    Node* node = new Node();
-    //node->value = items[lower];
+    // note: do not hold references to nodes, recursion reallocates
+    const int index = int(_ownNodes.size());
+    _ownNodes.emplace_back();
 
     if (upper - lower > MaxLeafSize) {
 
@@ -134,9 +211,9 @@ class VpTree {
 #define MAX_FROM_PARENT (1)
 
 #if MAX_FROM_PARENT
-      if (parent) {
+      if (parent >= 0) {
         auto it = std::max_element(items.begin()+lower, items.begin()+upper,
-                                   DistanceComparator(parent->value));
+                                   DistanceComparator(_ownNodes[size_t(parent)].value));
         std::swap(items[lower], *it);
       }
       else
@@ -180,8 +257,8 @@ class VpTree {
 
       if (median == lower || median == upper) {
 //        qWarning() << "partition failed, size=" << upper-lower << "midDist" << midDist;
-        node->leaf.assign(items.begin() + lower-1, items.begin() + upper);
-        return node;
+        makeLeaf(index, items, lower-1, upper);
+        return index;
       }
       else {
 
@@ -198,8 +275,8 @@ class VpTree {
 #endif
       }
 
-      node->threshold = midDist;
-      node->value = value;
+      _ownNodes[size_t(index)].threshold = midDist;
+      _ownNodes[size_t(index)].value = value;
 
       //const int split = (median-lower)*100 / (upper-lower);
 
@@ -216,25 +293,26 @@ class VpTree {
         Q_ASSERT(lower < median);
         Q_ASSERT(median < upper);
 
-        node->left = buildFromPoints(items, lower, median, node);
-        node->right = buildFromPoints(items, median, upper, node);
+        const int left = buildFromPoints(items, lower, median, index);
+        const int right = buildFromPoints(items, median, upper, index);
+        _ownNodes[size_t(index)].left = left;
+        _ownNodes[size_t(index)].right = right;
 
     } else
-      node->leaf.assign(items.begin() + lower, items.begin() + upper);
+      makeLeaf(index, items, lower, upper);
 
-    return node;
+    return index;
   }
 
-  void thresholdSearch(const Node* node, const ValueType& target, const DistanceType threshold,
+  void thresholdSearch(int index, const ValueType& target, const DistanceType threshold,
                        std::priority_queue<HeapItem>& matches) const {
 
-    const std::vector<ValueType>& leaf = node->leaf;
+    const Node& node = _nodes[index];
 
-    if (leaf.size()) {
-      Q_ASSERT(node->left == nullptr && node->right == nullptr);
-      const std::vector<ValueType>& leaf = node->leaf;
-      for (auto it = leaf.begin(); it != leaf.end(); ++it) {
-        const ValueType& value = *it;
+    if (node.left < 0) {
+      const ValueType* leaf = _values + node.first;
+      for (uint32_t i = 0; i < node.count; ++i) {
+        const ValueType& value = leaf[i];
         const DistanceType dist = distance(value, target);
         if (dist < threshold)
           matches.push(HeapItem(dist, value));
@@ -242,32 +320,34 @@ class VpTree {
       return;
     }
 
-    const DistanceType t = node->threshold;
-    const DistanceType d = distance(node->value, target);
+    const DistanceType t = node.threshold;
+    const DistanceType d = distance(node.value, target);
 
     if (d < threshold)
-      matches.push(HeapItem(d, node->value));
+      matches.push(HeapItem(d, node.value));
 
     if ( d - threshold < t )
-      thresholdSearch(node->left, target, threshold, matches);
+      thresholdSearch(node.left, target, threshold, matches);
     if ( d + threshold >= t )
-      thresholdSearch(node->right, target, threshold, matches);
+      thresholdSearch(node.right, target, threshold, matches);
   }
 
-  static int depth(Node* node) {
+  int depth(int index) const {
+    const Node& node = _nodes[index];
     int left = 0;
     int right = 0;
-    if (node->left) left = 1 + depth(node->left);
-    if (node->right) right = 1 + depth(node->right);
+    if (node.left >= 0) left = 1 + depth(node.left);
+    if (node.right >= 0) right = 1 + depth(node.right);
     return std::max(left, right);
   }
 
-  static int count(Node* node) {
+  int count(int index) const {
+    const Node& node = _nodes[index];
     int val = 0;
-    if (node->leaf.size()) val += int(node->leaf.size());
+    if (node.left < 0) val += int(node.count);
     else val += 1;
-    if (node->left) val += count(node->left);
-    if (node->right) val += count(node->right);
+    if (node.left >= 0) val += count(node.left);
+    if (node.right >= 0) val += count(node.right);
     return val;
   }
 };
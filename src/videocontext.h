@@ -159,6 +159,7 @@ class VideoContext {
   bool isHardware() const { return _isHardware; }
   int deviceIndex() const { return _deviceIndex; }
   int threadCount() const { return _numThreads; }
+  const DecodeOptions& decodeOptions() const { return _opt; }
 
   /// @note only public for benchmarking
   bool decodeFrame();
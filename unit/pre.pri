@@ -30,7 +30,8 @@ QT += widgets
 LIBS_PHASH = -lpHash -lpng -ljpeg
 
 # deps for core 
-FILES_INDEX = index ioutil media videocontext cvutil qtutil database scanner templatematcher params
+FILES_INDEX = index ioutil media mediatable videocontext cvutil qtutil database scanner templatematcher params \
+    previewcache
 
 # deps for gui
 FILES_GUI = gui/mediagrouplistwidget gui/mediafolderlistwidget env \
@@ -23,9 +23,10 @@ class TestColorDescIndex : public TestIndexBase {
 };
 
 void TestColorDescIndex::testMemoryUsage() {
-  // descriptor size plus media id size
+  // colors and number of colors (no padding) plus media id size
   QCOMPARE(_index->memoryUsage(),
-           (sizeof(ColorDescriptor) + 4) * size_t(_index->count()));
+           (sizeof(ColorDescriptor::colors) + sizeof(ColorDescriptor::numColors) + 4) *
+               size_t(_index->count()));
 }
 
 QTEST_MAIN(TestColorDescIndex)
@@ -21,7 +21,40 @@ class TestCvFeaturesIndex : public TestIndexBase {
   void testLoad() { baseTestLoad(_params); }
   void testAddRemove() { baseTestAddRemove(_params, 40); };
   void testMemoryUsage() { QVERIFY(_index->memoryUsage() > 0); }
+  void testEmptyMatrix();
 };
 
+void TestCvFeaturesIndex::testEmptyMatrix() {
+  // no descriptors is an empty index, not an unloaded one
+  QTemporaryDir dir;
+  QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "testEmptyMatrix");
+  {
+    db.setDatabaseName(dir.filePath("empty.db"));
+    QVERIFY(db.open());
+
+    CvFeaturesIndex index;
+    index.createTables(db);
+    index.load(db, dir.path(), "");
+    QVERIFY(index.isLoaded());
+    QCOMPARE(index.count(), 0);
+
+    KeyPointDescriptors desc(10, 32, CV_8UC1);
+    cv::randu(desc, 0, 256);
+    Media needle;
+    needle.setKeyPointDescriptors(desc);
+    QCOMPARE(index.find(needle, _params).count(), 0);
+
+    // loading again uses the cache files of the empty matrix
+    index.save(db, dir.path());
+    CvFeaturesIndex cached;
+    cached.load(db, dir.path(), "");
+    QVERIFY(cached.isLoaded());
+    QCOMPARE(cached.find(needle, _params).count(), 0);
+    db.close();
+  }
+  db = QSqlDatabase();
+  QSqlDatabase::removeDatabase("testEmptyMatrix");
+}
+
 QTEST_MAIN(TestCvFeaturesIndex)
 #include "testcvfeaturesindex.moc"
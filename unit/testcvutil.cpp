@@ -4,6 +4,7 @@
 #include "hamm.h"
 
 #include "opencv2/highgui/highgui.hpp"  // imread
+#include "opencv2/imgproc/imgproc.hpp"  // blur, resize
 
 #if ENABLE_DEPRECATED
 #include "pHash.h"
@@ -45,6 +46,10 @@ class TestCvUtil : public TestBase {
   void testDctHashCv_data();
   void testDctHashCv();
 
+  void testDctHashCvReference_data() { commonPhashData(); }
+  void testDctHashCvReference();
+  void testDctHashCvRandom();
+
 #ifdef ENABLE_DEPRECATED
   void testPhash_data();
   void testPhash();
@@ -362,6 +367,102 @@ void TestCvUtil::testDctHashCv() {
   Q_UNUSED(result);
 }
 
+/// v4 hash of a 32x32 image, as computed before the 9x9 kernel: full
+/// 32x32 float cv::dct(), float threshold; hashes in existing indexes
+/// came from this, so the kernel must be bit-exact with it
+static uint64_t referenceDctKernel(const cv::Mat& gray) {
+  cv::Mat freq;
+  gray.convertTo(freq, CV_32F);
+  cv::dct(freq, freq);
+  freq = freq.rowRange(cv::Range(0, 9)).colRange(cv::Range(0, 9)).clone();
+  freq = freq.reshape(1, 1);
+
+  constexpr char zigZag[] = {0,  9,  1,  2,  10, 18, 27, 19, 11, 3,  4,  12, 20, 28, 36, 45, 37,
+                             29, 21, 13, 5,  6,  14, 22, 30, 38, 46, 54, 63, 55, 47, 39, 31, 23,
+                             15, 7,  8,  16, 24, 32, 40, 48, 56, 64, 72, 73, 65, 57, 49, 41, 33,
+                             25, 17, 26, 34, 42, 50, 58, 66, 74, 75, 67, 59, 51, 43, 35, 44, 52,
+                             60, 68, 76, 77, 69, 61, 53, 62, 70, 78, 79, 71, 80};
+  {
+    cv::Mat tmp = freq.clone();
+    float* dst = reinterpret_cast<float*>(tmp.ptr(0));
+    float* src = reinterpret_cast<float*>(freq.ptr(0));
+    for (int i = 0; i < 81; i++) dst[i] = src[int(zigZag[i])];
+    freq = tmp.colRange(6, 70).clone();
+  }
+
+  float sum = float(cv::sum(freq)[0]);
+  float thresh = sum / 64;
+
+  uint64_t hash = 0;
+  float* row = reinterpret_cast<float*>(freq.ptr(0));
+  for (int i = 1; i < 64; i++)
+    if (row[i] > thresh) hash |= 1ULL << i;
+  return hash;
+}
+
+/// v4 dct hash using the full 32x32 cv::dct(), to validate the 9x9 kernel
+static uint64_t referenceDctHash64(const cv::Mat& cvImg) {
+  cv::Mat gray = cvImg.clone();
+  int kernelSize = 7;
+  int area = gray.size().area();
+  if (area <= 32 * 32)
+    kernelSize = 0;
+  else if (area <= 64 * 64)
+    kernelSize = 3;
+  else if (area <= 128 * 128)
+    kernelSize = 5;
+  if (kernelSize) cv::blur(gray, gray, cv::Size(kernelSize, kernelSize));
+  cv::resize(gray, gray, cv::Size(32, 32), 0, 0, cv::INTER_AREA);
+  return referenceDctKernel(gray);
+}
+
+void TestCvUtil::testDctHashCvReference() {
+  QFETCH(QString, file);
+
+  cv::Mat img = cv::imread(qCString(file), cv::IMREAD_GRAYSCALE);
+  QVERIFY(!img.empty());
+
+  const uint64_t expected = referenceDctHash64(img);
+  QCOMPARE(dctHash64(img), expected);
+
+  // batch entry point, inputs may be modified in-place
+  cv::Mat copies[2] = {img.clone(), img.clone()};
+  uint64_t hashes[2] = {0, 0};
+  dctHash64(copies, 2, hashes, true);
+  QCOMPARE(hashes[0], expected);
+  QCOMPARE(hashes[1], expected);
+}
+
+void TestCvUtil::testDctHashCvRandom() {
+  // 32x32 inputs go straight to the kernel; noise, gradients and flat
+  // areas, which have many coefficients near the threshold
+  QRandomGenerator rng(4321);
+  for (int n = 0; n < 20000; ++n) {
+    cv::Mat img(32, 32, CV_8UC1);
+    const int kind = n % 4;
+    const int a = int(rng.bounded(256)), b = int(rng.bounded(256));
+    for (int y = 0; y < 32; ++y)
+      for (int x = 0; x < 32; ++x) {
+        int v;
+        switch (kind) {
+          case 0: v = int(rng.bounded(256)); break;
+          case 1: v = a + (b - a) * (x + y) / 62; break;
+          case 2: v = (x < 16) == (y < 16) ? a : b; break;
+          default: v = a + int(rng.bounded(8)); break;
+        }
+        img.at<uchar>(y, x) = uchar(qBound(0, v, 255));
+      }
+
+    const uint64_t expected = referenceDctKernel(img);
+    const uint64_t actual = dctHash64(img);
+    if (actual != expected) {
+      qWarning("input %d (kind %d): %016llx != %016llx", n, kind, (unsigned long long)actual,
+               (unsigned long long)expected);
+      QFAIL("hash is different from the float cv::dct pipeline");
+    }
+  }
+}
+
 #if ENABLE_DEPRECATED
 
 void TestCvUtil::testPhash_data() {
@@ -2,6 +2,7 @@
 
 #include "database.h"
 #include "dcthashindex.h"
+#include "templatematcher.h"
 #include "testindexbase.h"
 
 #include <sys/stat.h>
@@ -31,6 +32,8 @@ class TestDatabase : public TestIndexBase {
 
   void testNegativeMatch();
   void testWeeds();
+  void testMergeGroups();
+  void testRemoveTemplateCache();
 
  private:
   void existingPaths(bool archived, QString& path1, QString& path2);
@@ -423,5 +426,84 @@ void TestDatabase::testWeeds() {
   QVERIFY(_database->isWeed(weed2));
 }
 
+void TestDatabase::testMergeGroups() {
+  QVector<Media> m;
+  for (int i = 1; i <= 6; ++i) {
+    m.append(Media(QString("/%1.jpg").arg(i)));
+    m.last().setId(i);
+  }
+
+  const MediaGroupList list{{m[0], m[1]}, {m[1], m[2]}, {m[3], m[4]}, {m[2], m[0]}, {m[4], m[5]}};
+
+  // 1-connected: a=>b, b=>c merge into (a,b,c), order of first group kept
+  MediaGroupList merged = list;
+  Media::mergeGroupList(merged);
+  QCOMPARE(merged.count(), 2);
+  QCOMPARE(merged[0].count(), 3);
+  QCOMPARE(merged[1].count(), 3);
+  QVERIFY(merged[0].contains(m[2]));
+  QVERIFY(merged[1].contains(m[5]));
+
+  // 2-connected: no two groups share two media
+  merged = list;
+  Media::mergeGroupList(merged, 2);
+  QCOMPARE(merged.count(), list.count());
+
+  // duplicate groups removed by filterMatches
+  SearchParams params;
+  merged = {{m[0], m[1]}, {m[1], m[0]}, {m[0], m[2]}};
+  _database->filterMatches(params, merged);
+  QCOMPARE(merged.count(), 2);
+
+  // needles not in the database have no id, they differ by path
+  const Media a("/external/a.jpg"), b("/external/b.jpg");
+  QCOMPARE(a.id(), 0);
+  merged = {{a, m[0]}, {b, m[0]}, {m[0], a}, {a, m[1]}};
+  _database->filterMatches(params, merged);
+  QCOMPARE(merged.count(), 3);
+
+  merged = {{a, m[0]}, {b, m[0]}, {m[0], b}};
+  params.mergeGroups = 1;
+  _database->filterMatches(params, merged);
+  QCOMPARE(merged.count(), 1);
+  QCOMPARE(merged[0].count(), 3);
+}
+
+void TestDatabase::testRemoveTemplateCache() {
+  MediaGroupList dups = _database->dupsByMd5(SearchParams());
+  QVERIFY(dups.count() >= 2);
+  const MediaGroup a = dups[0], b = dups[1];
+  QVERIFY(a.count() >= 2);
+
+  const QString scoreFile = _database->cachePath() + "/tmscores.dat";
+  const QString aFeatures = _database->cachePath() + "/tmfeatures/" + a[0].md5() + ".tmf";
+  const QString bFeatures = _database->cachePath() + "/tmfeatures/" + b[0].md5() + ".tmf";
+  QFile::remove(scoreFile);
+
+  {
+    MediaGroup g{b[0]};
+    TemplateMatcher(_database->cachePath()).match(a[0], g, SearchParams());
+  }
+  QVERIFY(QFileInfo::exists(aFeatures));
+  QVERIFY(QFileInfo::exists(bFeatures));
+  const qint64 scoreSize = QFileInfo(scoreFile).size();
+  QVERIFY(scoreSize > 0);
+
+  // a duplicate still has the md5, caches are kept
+  _database->remove(a[0].id());
+  QVERIFY(QFileInfo::exists(aFeatures));
+  QCOMPARE(QFileInfo(scoreFile).size(), scoreSize);
+
+  // last one with the md5, caches are removed
+  _database->remove(b);
+  QVERIFY(!QFileInfo::exists(bFeatures));
+  QVERIFY(QFileInfo(scoreFile).size() < scoreSize);
+  QVERIFY(QFileInfo::exists(aFeatures));
+
+  MediaGroup removed = b;
+  removed.append(a[0]);
+  _database->add(removed);
+}
+
 QTEST_MAIN(TestDatabase)
 #include "testdatabase.moc"
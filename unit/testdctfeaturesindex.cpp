@@ -20,11 +20,38 @@ class TestDctFeaturesIndex : public TestIndexBase {
   void testLoad() { baseTestLoad(_params); }
   void testAddRemove() { baseTestAddRemove(_params, 40); }
   void testMemoryUsage();
+  void testEarlyExit();
 };
 
 void TestDctFeaturesIndex::testMemoryUsage() {
   QVERIFY(_index->memoryUsage() > 0);
 }
 
+/// @return ids of the n best matches, excluding the needle
+static QVector<uint32_t> bestMatches(QVector<Index::Match> matches, const Media& needle, int n) {
+  std::sort(matches.begin(), matches.end(), [](const Index::Match& a, const Index::Match& b) {
+    return a.score < b.score || (a.score == b.score && a.mediaId < b.mediaId);
+  });
+  QVector<uint32_t> ids;
+  for (const Index::Match& m : matches)
+    if (m.mediaId != uint32_t(needle.id()) && ids.count() < n) ids.append(m.mediaId);
+  return ids;
+}
+
+void TestDctFeaturesIndex::testEarlyExit() {
+  // find() may stop before searching all needle hashes, findBatch() never
+  // does; the best matches and their order must be the same
+  SearchParams params = _params;
+  params.maxMatches = 3;
+
+  for (const Media& needle : _database->mediaWithType(Media::TypeImage)) {
+    const auto early = _index->find(needle, params);
+    const auto full = _index->findBatch({needle}, params);
+    QCOMPARE(full.count(), 1);
+    QCOMPARE(bestMatches(early, needle, params.maxMatches),
+             bestMatches(full[0], needle, params.maxMatches));
+  }
+}
+
 QTEST_MAIN(TestDctFeaturesIndex)
 #include "testdctfeaturesindex.moc"
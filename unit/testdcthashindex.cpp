@@ -1,9 +1,12 @@
 
 #include "testindexbase.h"
 #include "dcthashindex.h"
+#include "tree/dcttree.h"
 
 #include <QtTest/QtTest>
 
+#include <memory>
+
 class TestDctHashIndex : public TestIndexBase {
   Q_OBJECT
   SearchParams _params;
@@ -20,8 +23,13 @@ class TestDctHashIndex : public TestIndexBase {
   void testDefaults() { baseTestDefaults(new DctHashIndex); }
   void testEmpty() { baseTestEmpty(new DctHashIndex); }
   void testLoad() { baseTestLoad(_params); }
+  void testCacheFile();
+  void testMapTree_data();
+  void testMapTree();
+  void testFindBatch();
   void testAddRemove() { baseTestAddRemove(_params, 40); }
   void testMemoryUsage();
+  void testMerge();
 };
 
 void TestDctHashIndex::testMemoryUsage() {
@@ -29,5 +37,185 @@ void TestDctHashIndex::testMemoryUsage() {
   QCOMPARE(_index->memoryUsage(), (size_t)(8 + 4) * _index->count());
 }
 
+void TestDctHashIndex::testCacheFile() {
+  // cache file was written when the index was loaded,
+  // loading again should map it and give the same results
+  const QString cachePath = _database->cachePath();
+  QVERIFY(QFileInfo(cachePath + "/dcthash.cache").exists());
+  {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "testCacheFile");
+    db.setDatabaseName(_database->dbPath());
+    QVERIFY(db.open());
+
+    DctHashIndex cached;
+    cached.load(db, cachePath, "");
+    QVERIFY(cached.isLoaded());
+    QCOMPARE(cached.count(), _index->count());
+
+    for (const Media& m : _database->mediaWithType(Media::TypeImage)) {
+      compareMatches(cached.find(m, _params), _index->find(m, _params));
+      if (QTest::currentTestFailed()) break;
+    }
+    db.close();
+  }
+  QSqlDatabase::removeDatabase("testCacheFile");
+}
+
+void TestDctHashIndex::testMapTree_data() {
+  // tree layout: 24-byte header (nodeSize, valueSize, numNodes, numValues), then
+  // 40-byte nodes: value (hash, id), threshold, left, right, first, count
+  QTest::addColumn<int>("field");  // byte offset in the node, -1 for no change
+  QTest::addColumn<bool>("leaf");  // change the first leaf, or the root
+  QTest::addColumn<qint64>("value");
+
+  QTest::newRow("valid") << -1 << false << qint64(0);
+  QTest::newRow("left loops") << 20 << false << qint64(0);
+  QTest::newRow("left out of bounds") << 20 << false << qint64(INT_MAX);
+  QTest::newRow("right missing") << 24 << false << qint64(-1);
+  QTest::newRow("right on leaf") << 24 << true << qint64(1);
+  QTest::newRow("first out of bounds") << 28 << true << qint64(INT_MAX);
+  QTest::newRow("count out of bounds") << 32 << true << qint64(INT_MAX);
+}
+
+void TestDctHashIndex::testMapTree() {
+  QFETCH(int, field);
+  QFETCH(bool, leaf);
+  QFETCH(qint64, value);
+
+  std::vector<uint64_t> hashes;
+  std::vector<uint32_t> ids;
+  QRandomGenerator rng(1);
+  for (uint32_t i = 1; i <= 1000; ++i) {
+    hashes.push_back(rng.generate64());
+    ids.push_back(i);
+  }
+
+  DctTree tree;
+  tree.create(hashes.data(), ids.data(), int(hashes.size()));
+
+  QBuffer buf;
+  QVERIFY(buf.open(QBuffer::WriteOnly));
+  tree.write(buf);
+  const QByteArray& layout = buf.data();
+
+  uint32_t nodeSize;
+  uint64_t numNodes;
+  memcpy(&nodeSize, layout.constData(), sizeof(nodeSize));
+  memcpy(&numNodes, layout.constData() + 8, sizeof(numNodes));
+  QCOMPARE(nodeSize, uint32_t(40));
+  QVERIFY(numNodes > 1);
+
+  // 8-byte aligned copy, as if mapped from a file
+  std::vector<uint64_t> data((size_t(layout.size()) + 7) / 8);
+  memcpy(data.data(), layout.constData(), size_t(layout.size()));
+  char* nodes = reinterpret_cast<char*>(data.data()) + 24;
+
+  uint64_t node = 0;
+  if (leaf) {
+    int32_t left = 0;
+    for (node = 0; node < numNodes; ++node) {
+      memcpy(&left, nodes + node * nodeSize + 20, sizeof(left));
+      if (left < 0) break;
+    }
+    QVERIFY(node < numNodes);
+  }
+
+  const bool valid = field < 0;
+  if (!valid) {
+    const int32_t v = int32_t(value);
+    memcpy(nodes + node * nodeSize + uint64_t(field), &v, sizeof(v));
+  }
+
+  DctTree mapped;
+  QCOMPARE(mapped.map(reinterpret_cast<const char*>(data.data()), size_t(layout.size())),
+           valid);
+  if (!valid) return;
+
+  for (size_t i = 0; i < hashes.size(); i += 97)
+    compareMatches(mapped.search(hashes[i], 12), tree.search(hashes[i], 12));
+}
+
+void TestDctHashIndex::testFindBatch() {
+  // batch results must be the same as searching each needle
+  const MediaGroup needles = _database->mediaWithType(Media::TypeImage);
+  QVERIFY(needles.count() > 0);
+
+  const auto batch = _index->findBatch(needles, _params);
+  QCOMPARE(batch.count(), needles.count());
+
+  for (int i = 0; i < needles.count(); ++i) {
+    compareMatches(batch[i], _index->find(needles[i], _params));
+    if (QTest::currentTestFailed()) return;
+  }
+}
+
+void TestDctHashIndex::testMerge() {
+  // enough additions to start a background merge, then removals, additions and
+  // reused ids while it runs; results must be the same as a fresh build
+  QRandomGenerator rng(1234);
+  QHash<int, Media> all, live;
+  auto makeMedia = [&rng](int id) {
+    // clusters of near-duplicates so searches have something to find
+    uint64_t hash = uint64_t(id / 8 + 1) * 0x9E3779B97F4A7C15ULL;
+    hash ^= uint64_t(1) << rng.bounded(64);
+    Media m(QString("%1.jpg").arg(id), Media::TypeImage, 100, 100, "", hash);
+    m.setId(id);
+    return m;
+  };
+  auto addRange = [&](Index* index, int first, int last) {
+    MediaGroup group;
+    for (int id = first; id <= last; ++id) {
+      const Media m = makeMedia(id);
+      all[id] = live[id] = m;
+      group.append(m);
+    }
+    index->add(group);
+  };
+  auto removeEvery = [&](Index* index, int first, int last, int step) {
+    QVector<int> ids;
+    for (int id = first; id <= last; ++id)
+      if (id % step == 0) ids.append(id);
+    for (int id : ids) live.remove(id);
+    index->remove(ids);
+  };
+
+  std::unique_ptr<Index> index(_index->slice({}));
+  QVERIFY(index->isLoaded());
+
+  addRange(index.get(), 1, 20000);          // > MergeMinSize, merge starts
+  removeEvery(index.get(), 1, 20000, 3);    // tombstones during the merge
+  addRange(index.get(), 20001, 22000);      // delta during the merge
+  removeEvery(index.get(), 20001, 22000, 5);
+
+  // let the merge finish, the next add swaps in the merged tree
+  QThreadPool::globalInstance()->waitForDone();
+  addRange(index.get(), 22001, 22100);
+  removeEvery(index.get(), 1, 22100, 7);    // tombstones in the merged tree
+
+  // reusing a removed id forces a synchronous merge
+  addRange(index.get(), 21, 21);
+
+  // fresh build from the live media only
+  MediaGroup liveGroup;
+  QSet<uint32_t> liveIds;
+  for (const Media& m : live) {
+    liveGroup.append(m);
+    liveIds.insert(uint32_t(m.id()));
+  }
+  std::unique_ptr<Index> delta(_index->slice({}));
+  delta->add(liveGroup);
+  std::unique_ptr<Index> fresh(delta->slice(liveIds));
+  QCOMPARE(fresh->count(), live.count());
+
+  // needles include removed media, which must not be found
+  SearchParams params = _params;
+  params.dctThresh = 4;
+  for (int id = 1; id <= 22100; id += 37) {
+    const Media& needle = all[id];
+    compareMatches(index->find(needle, params), fresh->find(needle, params));
+    if (QTest::currentTestFailed()) return;
+  }
+}
+
 QTEST_MAIN(TestDctHashIndex)
 #include "testdcthashindex.moc"
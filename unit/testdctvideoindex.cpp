@@ -30,6 +30,10 @@ class TestDctVideoIndex : public TestIndexBase {
   void testAddRemove() { baseTestAddRemove(_params, numVideos); }
   void testMemoryUsage();
   void testLoad();
+  void testCacheFile();
+  void testCorruptStore_data();
+  void testCorruptStore();
+  void testStaleTree();
 };
 
 void TestDctVideoIndex::testMemoryUsage() {
@@ -76,5 +80,152 @@ void TestDctVideoIndex::testLoad() {
   }
 }
 
+void TestDctVideoIndex::testCacheFile() {
+  // store and tree were written when the tree was built,
+  // loading again should use them and give the same results
+  const QString cachePath = _database->cachePath();
+  QVERIFY(QFileInfo(cachePath + "/dctvideo.cache").exists());
+  const QString treeFile = QString("/dctvideo-%1-v3.tree").arg(_params.skipFrames);
+  QVERIFY(QFileInfo(cachePath + treeFile).exists());
+  {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "testCacheFile");
+    db.setDatabaseName(_database->dbPath());
+    QVERIFY(db.open());
+
+    DctVideoIndex cached;
+    cached.load(db, cachePath, _database->videoPath());
+    QVERIFY(cached.isLoaded());
+
+    QCOMPARE(cached.count(), _index->count());
+    for (const Media& m : _database->mediaWithType(Media::TypeVideo)) {
+      compareMatches(cached.find(m, _params), _index->find(m, _params));
+      if (QTest::currentTestFailed()) break;
+    }
+    db.close();
+  }
+  QSqlDatabase::removeDatabase("testCacheFile");
+}
+
+void TestDctVideoIndex::testCorruptStore_data() {
+  // store layout: 32-byte header (magic, version, frameSize, numVideos, numFrames),
+  // then offsets[numVideos+1]
+  QTest::addColumn<int>("index");  // offset to change, -1 for the last one
+  QTest::addColumn<qint64>("value");
+  QTest::addColumn<bool>("fromEnd");  // value is added to numFrames
+
+  QTest::newRow("first offset") << 0 << qint64(1) << false;
+  QTest::newRow("decreasing") << 2 << qint64(0) << false;
+  QTest::newRow("out of bounds") << 1 << qint64(1) << true;
+  QTest::newRow("last offset") << -1 << qint64(-1) << true;
+}
+
+void TestDctVideoIndex::testCorruptStore() {
+  QFETCH(int, index);
+  QFETCH(qint64, value);
+  QFETCH(bool, fromEnd);
+
+  const QString cachePath = _database->cachePath();
+  const QString storePath = cachePath + "/dctvideo.cache";
+  QFile store(storePath);
+  QVERIFY(store.open(QFile::ReadOnly));
+  const QByteArray storeData = store.readAll();
+  store.close();
+  QVERIFY(storeData.size() > 32);
+
+  uint64_t numVideos, numFrames;
+  memcpy(&numVideos, storeData.constData() + 16, sizeof(numVideos));
+  memcpy(&numFrames, storeData.constData() + 24, sizeof(numFrames));
+  QVERIFY(numVideos > 2 && numFrames > 0);
+
+  if (index < 0) index = int(numVideos);
+  if (fromEnd) value += qint64(numFrames);
+
+  // _index has the file mapped, replace it instead of writing to it
+  QByteArray corrupt = storeData;
+  memcpy(corrupt.data() + 32 + 8 * index, &value, sizeof(value));
+  QVERIFY(QFile::remove(storePath));
+  QVERIFY(store.open(QFile::WriteOnly));
+  QCOMPARE(store.write(corrupt), corrupt.size());
+  store.close();
+
+  // the store is rejected and rebuilt, which also repairs the file
+  {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "testCorruptStore");
+    db.setDatabaseName(_database->dbPath());
+    QVERIFY(db.open());
+
+    DctVideoIndex cached;
+    cached.load(db, cachePath, _database->videoPath());
+    for (const Media& m : _database->mediaWithType(Media::TypeVideo)) {
+      compareMatches(cached.find(m, _params), _index->find(m, _params));
+      if (QTest::currentTestFailed()) break;
+    }
+    db.close();
+  }
+  QSqlDatabase::removeDatabase("testCorruptStore");
+
+  QVERIFY(store.open(QFile::ReadOnly));
+  QCOMPARE(store.readAll(), storeData);
+}
+
+void TestDctVideoIndex::testStaleTree() {
+  // rebuild the store so positions change, then put back the tree
+  // file of the old store; it must be rejected and rebuilt
+  const QString cachePath = _database->cachePath();
+  const QString storePath = cachePath + "/dctvideo.cache";
+  const QString treePath =
+      cachePath + QString("/dctvideo-%1-v3.tree").arg(_params.skipFrames);
+
+  QFile oldTree(treePath);
+  QVERIFY(oldTree.open(QFile::ReadOnly));
+  const QByteArray oldTreeData = oldTree.readAll();
+  oldTree.close();
+
+  // the first video will have no frames in the new store
+  const MediaGroup videos = _database->mediaWithType(Media::TypeVideo);
+  QVERIFY(videos.count() > 1);
+  const QString vdxPath = QString("%1/%2.vdx").arg(_database->videoPath()).arg(videos[0].id());
+  QVERIFY(QFile::rename(vdxPath, vdxPath + ".bak"));
+  QVERIFY(QFile::remove(storePath));
+
+  auto readTree = [&treePath]() {
+    QFile f(treePath);
+    return f.open(QFile::ReadOnly) ? f.readAll() : QByteArray();
+  };
+
+  QVector<QVector<Index::Match>> expected;
+  {
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", "testStaleTree");
+    db.setDatabaseName(_database->dbPath());
+    QVERIFY(db.open());
+
+    DctVideoIndex rebuilt;
+    rebuilt.load(db, cachePath, _database->videoPath());
+    for (const Media& m : videos) expected.append(rebuilt.find(m, _params));
+    QVERIFY(QFileInfo(storePath).exists());
+    QVERIFY(readTree() != oldTreeData);
+
+    // old tree is newer than the database, only the key can reject it
+    QFile f(treePath);
+    QVERIFY(f.open(QFile::WriteOnly | QFile::Truncate));
+    QCOMPARE(f.write(oldTreeData), oldTreeData.size());
+    f.close();
+
+    DctVideoIndex cached;
+    cached.load(db, cachePath, _database->videoPath());
+    for (int i = 0; i < videos.count(); ++i) {
+      compareMatches(cached.find(videos[i], _params), expected[i]);
+      if (QTest::currentTestFailed()) break;
+    }
+    QVERIFY(readTree() != oldTreeData);
+    db.close();
+  }
+  QSqlDatabase::removeDatabase("testStaleTree");
+
+  // leave the cache as it was for other tests
+  QVERIFY(QFile::rename(vdxPath + ".bak", vdxPath));
+  QVERIFY(QFile::remove(storePath));
+}
+
 QTEST_MAIN(TestDctVideoIndex)
 #include "testdctvideoindex.moc"
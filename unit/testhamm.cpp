@@ -0,0 +1,86 @@
+#include <QtTest/QtTest>
+
+#include "hamm.h"
+
+class TestHamm : public QObject {
+  Q_OBJECT
+
+ private Q_SLOTS:
+  void initTestCase();
+  void testHamm64();
+  void testScan64_data();
+  void testScan64();
+};
+
+/// scalar reference for hammScan64()
+static QVector<QPair<int, int>> scanReference(uint64_t target, const uint64_t* hashes,
+                                              int count, int threshold) {
+  QVector<QPair<int, int>> result;
+  for (int i = 0; i < count; ++i) {
+    int d = 0;
+    for (uint64_t x = target ^ hashes[i]; x; x >>= 1) d += int(x & 1);
+    if (d < threshold) result.append({i, d});
+  }
+  return result;
+}
+
+void TestHamm::initTestCase() {
+#if defined(__x86_64__) && defined(__AVX2__)
+  // the binary has AVX2 instructions anywhere, this only makes the failure obvious
+  if (!__builtin_cpu_supports("avx2")) QSKIP("cpu does not support avx2");
+#endif
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+  qInfo("testing AVX-512 hammScan64");
+#elif defined(__AVX2__)
+  qInfo("testing AVX2 hammScan64");
+#else
+  qInfo("testing scalar hammScan64");
+#endif
+}
+
+void TestHamm::testHamm64() {
+  QCOMPARE(hamm64(0, 0), 0);
+  QCOMPARE(hamm64(0, ~uint64_t(0)), 64);
+  QCOMPARE(hamm64(uint64_t(1) << 63, 1), 2);
+}
+
+void TestHamm::testScan64_data() {
+  QTest::addColumn<int>("count");
+  QTest::addColumn<int>("threshold");
+
+  // counts with and without a tail for the vector loops
+  for (int count : {0, 1, 3, 4, 7, 8, 9, 31, 1000, 1003})
+    for (int threshold : {0, 1, 2, 5, 10, 32, 64, 65})
+      QTest::addRow("%d/%d", count, threshold) << count << threshold;
+}
+
+void TestHamm::testScan64() {
+  QFETCH(int, count);
+  QFETCH(int, threshold);
+
+  QRandomGenerator rng(uint(count * 100 + threshold));
+  const uint64_t target = rng.generate64();
+
+  // random hashes are ~32 bits away, flip a few bits of the target
+  // in some of them so small thresholds have matches
+  std::vector<uint64_t> hashes(size_t(count) + 1);
+  for (uint64_t& h : hashes) {
+    h = rng.generate64();
+    if (rng.bounded(2)) {
+      h = target;
+      for (int n = int(rng.bounded(12)); n > 0; --n) h ^= uint64_t(1) << rng.bounded(64);
+    }
+  }
+
+  // unaligned start to catch aligned loads
+  const uint64_t* data = hashes.data() + 1;
+
+  QVector<QPair<int, int>> actual;
+  hammScan64(target, data, size_t(count), threshold,
+             [&actual](size_t i, int d) { actual.append({int(i), d}); });
+
+  QCOMPARE(actual, scanReference(target, data, count, threshold));
+}
+
+QTEST_MAIN(TestHamm)
+#include "testhamm.moc"
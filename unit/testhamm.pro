@@ -0,0 +1,8 @@
+include("pre.pri")
+
+FILES += hamm
+
+include("post.pri")
+
+# exercise the vector paths of hammScan64(), on top of whatever -march gives
+contains(QT_ARCH, x86_64): QMAKE_CXXFLAGS += -mpopcnt -mavx2
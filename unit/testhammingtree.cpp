@@ -0,0 +1,180 @@
+#include <QtTest/QtTest>
+
+#include "tree/hammingtree.h"
+
+class TestHammingTree : public QObject {
+  Q_OBJECT
+
+  std::vector<HammingTree::Value> _values;
+
+ private Q_SLOTS:
+  void initTestCase();
+  void testParallelBuild();
+  void testWriteRead();
+  void testReadCorrupt();
+  void testRemoveMapped();
+
+ private:
+  QTemporaryDir _dir;
+  QString writeTree(const QString& name);
+};
+
+/// (distance, index) of matches, in a repeatable order
+static QVector<QPair<int, uint32_t>> sorted(const std::vector<HammingTree::Match>& matches) {
+  QVector<QPair<int, uint32_t>> result;
+  for (const auto& m : matches) result.append({m.distance, m.value.index});
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+/// compare searches for every 997th value
+static void compareSearches(const HammingTree& a, const HammingTree& b,
+                            const std::vector<HammingTree::Value>& values) {
+  for (size_t i = 0; i < values.size(); i += 997)
+    for (int threshold : {1, 4, 8}) {
+      std::vector<HammingTree::Match> ma, mb;
+      a.search(values[i].hash, threshold, ma);
+      b.search(values[i].hash, threshold, mb);
+      QCOMPARE(sorted(ma), sorted(mb));
+    }
+}
+
+void TestHammingTree::initTestCase() {
+  // clusters of near-duplicates, enough for subtrees larger than PARALLEL_SIZE
+  QRandomGenerator rng(2468);
+  uint64_t center = 0;
+  for (uint32_t id = 1; id <= 300000; ++id) {
+    if (id % 8 == 1) center = rng.generate64();
+    uint64_t hash = center;
+    for (int n = int(rng.bounded(6)); n > 0; --n) hash ^= uint64_t(1) << rng.bounded(64);
+    _values.push_back({id, hash});
+  }
+}
+
+void TestHammingTree::testParallelBuild() {
+  // one insert builds subtrees in parallel, small batches are all serial;
+  // the shape only depends on the values, so the trees are the same
+  std::vector<HammingTree::Value> values = _values;
+  HammingTree parallel;
+  parallel.insert(values);
+
+  HammingTree serial;
+  const size_t batchSize = HammingTree::PARALLEL_SIZE / 4;
+  for (size_t i = 0; i < _values.size(); i += batchSize) {
+    std::vector<HammingTree::Value> batch(
+        _values.begin() + long(i), _values.begin() + long(std::min(i + batchSize, _values.size())));
+    serial.insert(batch);
+  }
+
+  const HammingTree::Stats ps = parallel.stats(), ss = serial.stats();
+  QVERIFY(ps.buildTasks > 0);
+  QCOMPARE(ss.buildTasks, 0);
+  QCOMPARE(ps.numValues, ss.numValues);
+  QCOMPARE(ps.numNodes, ss.numNodes);
+  QCOMPARE(ps.maxHeight, ss.maxHeight);
+
+  compareSearches(parallel, serial, _values);
+}
+
+QString TestHammingTree::writeTree(const QString& name) {
+  std::vector<HammingTree::Value> values = _values;
+  HammingTree tree;
+  tree.insert(values);
+  tree.freeze();
+
+  const QString path = _dir.filePath(name);
+  QFile f(path);
+  if (!f.open(QFile::WriteOnly)) return QString();
+  tree.write(f, 1234);
+  return path;
+}
+
+void TestHammingTree::testWriteRead() {
+  std::vector<HammingTree::Value> values = _values;
+  HammingTree tree;
+  tree.insert(values);
+
+  // frozen tree searches the same as the pointer layout
+  HammingTree frozen;
+  values = _values;
+  frozen.insert(values);
+  frozen.freeze();
+  QVERIFY(frozen.isFrozen());
+  compareSearches(tree, frozen, _values);
+  if (QTest::currentTestFailed()) return;
+
+  const QString path = writeTree("tree.cache");
+  QVERIFY(!path.isEmpty());
+
+  // key must match
+  HammingTree wrongKey;
+  QVERIFY(!wrongKey.read(qUtf8Printable(path), 4321));
+
+  HammingTree mapped;
+  QVERIFY(mapped.read(qUtf8Printable(path), 1234));
+  QVERIFY(mapped.isFrozen());
+  QCOMPARE(mapped.size(), _values.size());
+  QCOMPARE(mapped.stats().numNodes, tree.stats().numNodes);
+  compareSearches(tree, mapped, _values);
+}
+
+void TestHammingTree::testReadCorrupt() {
+  const QString path = writeTree("corrupt.cache");
+  QVERIFY(!path.isEmpty());
+
+  // the root node follows the 40-byte header; root is not a leaf
+  // with this many values, so it has a split bit and children
+  const qint64 rootOffset = 40;
+  auto patchRoot = [&](int32_t bit, uint32_t child) {
+    QFile f(path);
+    if (!f.open(QFile::ReadWrite) || !f.seek(rootOffset)) return false;
+    return f.write(reinterpret_cast<const char*>(&bit), sizeof(bit)) == sizeof(bit) &&
+           f.write(reinterpret_cast<const char*>(&child), sizeof(child)) == sizeof(child);
+  };
+
+  // a valid split bit and child are accepted
+  HammingTree tree;
+  QVERIFY(patchRoot(0, 1));
+  QVERIFY(tree.read(qUtf8Printable(path), 1234));
+
+  HammingTree badBit;
+  QVERIFY(patchRoot(64, 1));
+  QVERIFY(!badBit.read(qUtf8Printable(path), 1234));
+
+  HammingTree badChild;
+  QVERIFY(patchRoot(0, UINT32_MAX - 1));
+  QVERIFY(!badChild.read(qUtf8Printable(path), 1234));
+}
+
+void TestHammingTree::testRemoveMapped() {
+  const QString path = writeTree("remove.cache");
+  QVERIFY(!path.isEmpty());
+
+  QFile f(path);
+  QVERIFY(f.open(QFile::ReadOnly));
+  const QByteArray before = f.readAll();
+  f.close();
+
+  std::unordered_set<HammingTree::index_t> removed;
+  for (size_t i = 0; i < _values.size(); i += 5) removed.insert(_values[i].index);
+
+  std::vector<HammingTree::Value> values = _values;
+  HammingTree expected;
+  expected.insert(values);
+  expected.remove(removed);
+
+  HammingTree mapped;
+  QVERIFY(mapped.read(qUtf8Printable(path), 1234));
+  mapped.remove(removed);
+
+  // removed values have index 0 in both
+  compareSearches(expected, mapped, _values);
+  if (QTest::currentTestFailed()) return;
+
+  // the file is not modified, the mapped tree was copied first
+  QVERIFY(f.open(QFile::ReadOnly));
+  QVERIFY(f.readAll() == before);
+}
+
+QTEST_MAIN(TestHammingTree)
+#include "testhammingtree.moc"
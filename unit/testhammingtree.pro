@@ -0,0 +1,5 @@
+include("pre.pri")
+
+FILES += $$FILES_INDEX
+
+include("post.pri")
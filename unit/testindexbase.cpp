@@ -16,6 +16,20 @@ void TestIndexBase::mediaProcessed(const Media& m) {
   _mediaProcessed->append(m);
 }
 
+void TestIndexBase::compareMatches(QVector<Index::Match> actual,
+                                   QVector<Index::Match> expected) {
+  auto byScoreAndId = [](const Index::Match& a, const Index::Match& b) {
+    return a.score < b.score || (a.score == b.score && a.mediaId < b.mediaId);
+  };
+  std::sort(expected.begin(), expected.end(), byScoreAndId);
+  std::sort(actual.begin(), actual.end(), byScoreAndId);
+  QCOMPARE(actual.count(), expected.count());
+  for (int i = 0; i < actual.count(); ++i) {
+    QCOMPARE(actual[i].mediaId, expected[i].mediaId);
+    QCOMPARE(actual[i].score, expected[i].score);
+  }
+}
+
 void TestIndexBase::baseInitTestCase(Index* index, const QString& dataSet) {
   _index = index;
 
@@ -1,4 +1,5 @@
 #pragma once
+#include "index.h"
 
 class Scanner;
 class Database;
@@ -22,6 +23,9 @@ protected:
     void baseTestLoad(const SearchParams& params);
     void baseTestAddRemove(const SearchParams& params, int expectedMatches);
 
+    /// verify matches are the same, ignoring order
+    static void compareMatches(QVector<Index::Match> actual, QVector<Index::Match> expected);
+
     QString _dataDir;
     Database* _database;
     Scanner*  _scanner;
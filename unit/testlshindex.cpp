@@ -0,0 +1,258 @@
+#include <QtTest/QtTest>
+
+#include "tree/lshindex.h"
+
+class TestLshIndex : public QObject {
+  Q_OBJECT
+
+  std::vector<uint8_t> _descriptors;
+  std::vector<uint8_t> _queries;
+  std::vector<uint32_t> _queryRows;  // row the query was made from
+
+  QTemporaryDir _dir;
+
+ private Q_SLOTS:
+  void initTestCase();
+  void testSearch_data();
+  void testSearch();
+  void testAllBuckets();
+  void testWriteMap();
+  void testMapCorrupt_data();
+  void testMapCorrupt();
+  void testTail();
+
+ private:
+  size_t count() const { return _descriptors.size() / LshIndex::DESC_BYTES; }
+  const uint8_t* query(size_t i) const { return _queries.data() + i * LshIndex::DESC_BYTES; }
+};
+
+enum { NumDescriptors = 20000, NumQueries = 200, Knn = 10 };
+
+/// matches must have the right distance, be sorted and unique
+static void checkMatches(const std::vector<LshIndex::Match>& matches, const uint8_t* descriptors,
+                         const uint8_t* query) {
+  uint64_t q[LshIndex::DESC_WORDS];
+  memcpy(q, query, sizeof(q));
+
+  QVERIFY(matches.size() <= size_t(Knn));
+  QSet<uint32_t> seen;
+  for (size_t i = 0; i < matches.size(); ++i) {
+    const LshIndex::Match& m = matches[i];
+    QVERIFY(m.index < uint32_t(NumDescriptors));
+    QCOMPARE(m.distance,
+             LshIndex::distance(q, descriptors + size_t(m.index) * LshIndex::DESC_BYTES));
+    QVERIFY(i == 0 || matches[i - 1].distance <= m.distance);
+    QVERIFY(!seen.contains(m.index));
+    seen.insert(m.index);
+  }
+}
+
+/// (distance, index) of matches, in a repeatable order
+static QVector<QPair<int, uint32_t>> sorted(const std::vector<LshIndex::Match>& matches) {
+  QVector<QPair<int, uint32_t>> result;
+  for (const auto& m : matches) result.append({m.distance, m.index});
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+void TestLshIndex::initTestCase() {
+  // random descriptors, queries are a few bits away from one of them
+  QRandomGenerator rng(1357);
+  _descriptors.resize(NumDescriptors * LshIndex::DESC_BYTES);
+  rng.fillRange(reinterpret_cast<quint32*>(_descriptors.data()), _descriptors.size() / 4);
+
+  for (int i = 0; i < NumQueries; ++i) {
+    const uint32_t row = rng.bounded(uint32_t(NumDescriptors));
+    const uint8_t* desc = _descriptors.data() + row * LshIndex::DESC_BYTES;
+    _queries.insert(_queries.end(), desc, desc + LshIndex::DESC_BYTES);
+    uint8_t* q = _queries.data() + size_t(i) * LshIndex::DESC_BYTES;
+    for (int n = 0; n < 4; ++n) {
+      const int bit = int(rng.bounded(LshIndex::DESC_BYTES * 8));
+      q[bit / 8] ^= uint8_t(1 << (bit % 8));
+    }
+    _queryRows.push_back(row);
+  }
+}
+
+void TestLshIndex::testSearch_data() {
+  QTest::addColumn<int>("tables");
+  QTest::addColumn<int>("probeLevel");
+  QTest::addColumn<int>("minRecall");  // percent of queries finding their row
+
+  // about 7 key bits; 4 flipped bits miss all of them ~90% of the time
+  QTest::newRow("1 table, probe 0") << 1 << 0 << 80;
+  QTest::newRow("1 table, probe 1") << 1 << 1 << 95;
+  QTest::newRow("1 table, probe 2") << 1 << 2 << 99;
+  QTest::newRow("2 tables, probe 0") << 2 << 0 << 90;
+  QTest::newRow("2 tables, probe 1") << 2 << 1 << 99;
+  QTest::newRow("2 tables, probe 2") << 2 << 2 << 99;
+}
+
+void TestLshIndex::testSearch() {
+  QFETCH(int, tables);
+  QFETCH(int, probeLevel);
+  QFETCH(int, minRecall);
+
+  LshIndex index;
+  index.build(_descriptors.data(), count(), {tables, 0});
+  QCOMPARE(index.numTables(), tables);
+  QCOMPARE(index.size(), count());
+  QCOMPARE(index.tailSize(), size_t(0));
+
+  const uint8_t* data = _descriptors.data();
+  int found = 0;
+  std::vector<LshIndex::Match> nearest, fewer, exact;
+  for (int i = 0; i < NumQueries; ++i) {
+    index.knnSearch(data, query(i), Knn, {tables, probeLevel}, nearest);
+    index.exhaustiveSearch(data, query(i), Knn, exact);
+    checkMatches(nearest, data, query(i));
+    checkMatches(exact, data, query(i));
+    if (QTest::currentTestFailed()) return;
+
+    // brute-force is the lower bound of every distance
+    QCOMPARE(exact.size(), size_t(Knn));
+    for (size_t j = 0; j < nearest.size(); ++j) QVERIFY(nearest[j].distance >= exact[j].distance);
+
+    // probing more buckets or tables can only improve the matches
+    if (probeLevel > 0 || tables > 1) {
+      const LshIndex::SearchParams less = probeLevel > 0
+                                              ? LshIndex::SearchParams{tables, probeLevel - 1}
+                                              : LshIndex::SearchParams{tables - 1, 0};
+      index.knnSearch(data, query(i), Knn, less, fewer);
+      QVERIFY(nearest.size() >= fewer.size());
+      for (size_t j = 0; j < fewer.size(); ++j) QVERIFY(nearest[j].distance <= fewer[j].distance);
+    }
+
+    for (const auto& m : nearest)
+      if (m.index == _queryRows[size_t(i)]) found++;
+  }
+
+  QVERIFY2(found * 100 >= minRecall * NumQueries,
+           qPrintable(QString("recall %1/%2").arg(found).arg(NumQueries)));
+}
+
+void TestLshIndex::testAllBuckets() {
+  // with a 2-bit key, probe level 2 visits every bucket, so it is exact
+  LshIndex index;
+  index.build(_descriptors.data(), count(), {2, 2});
+  QCOMPARE(index.keySize(), 2);
+
+  std::vector<LshIndex::Match> nearest, exact;
+  for (int i = 0; i < NumQueries; ++i) {
+    index.knnSearch(_descriptors.data(), query(i), Knn, {1, 2}, nearest);
+    index.exhaustiveSearch(_descriptors.data(), query(i), Knn, exact);
+    QCOMPARE(nearest.size(), exact.size());
+    for (size_t j = 0; j < exact.size(); ++j) QCOMPARE(nearest[j].distance, exact[j].distance);
+  }
+}
+
+void TestLshIndex::testWriteMap() {
+  LshIndex index;
+  index.build(_descriptors.data(), count(), {2, 0});
+  QVERIFY(!index.isMapped());
+  QVERIFY(index.memoryUsage() > 0);
+
+  const QString path = _dir.filePath("lsh.cache");
+  {
+    QFile f(path);
+    QVERIFY(f.open(QFile::WriteOnly));
+    index.write(f);
+  }
+
+  // count must be the same as when written
+  LshIndex wrongCount;
+  QVERIFY(!wrongCount.map(path, count() - 1));
+
+  LshIndex mapped;
+  QVERIFY(mapped.map(path, count()));
+  QVERIFY(mapped.isMapped());
+  QCOMPARE(mapped.memoryUsage(), size_t(0));
+  QCOMPARE(mapped.numTables(), index.numTables());
+  QCOMPARE(mapped.keySize(), index.keySize());
+  QCOMPARE(mapped.size(), index.size());
+
+  std::vector<LshIndex::Match> a, b;
+  for (int probeLevel = 0; probeLevel <= 2; ++probeLevel)
+    for (int i = 0; i < NumQueries; ++i) {
+      index.knnSearch(_descriptors.data(), query(i), Knn, {2, probeLevel}, a);
+      mapped.knnSearch(_descriptors.data(), query(i), Knn, {2, probeLevel}, b);
+      QCOMPARE(sorted(b), sorted(a));
+    }
+}
+
+void TestLshIndex::testMapCorrupt_data() {
+  // file layout of one table: 32-byte header, masks[4], offsets[2^keySize+1], entries[count]
+  QTest::addColumn<int>("offset");  // index of the offset to change, or -1 for the first entry
+  QTest::addColumn<qint64>("value");
+  QTest::addColumn<bool>("fromEnd");  // value is added to count
+
+  QTest::newRow("first offset") << 0 << qint64(1) << false;
+  QTest::newRow("decreasing") << 2 << qint64(0) << false;
+  QTest::newRow("out of bounds") << 1 << qint64(1) << true;
+  QTest::newRow("last offset") << 128 << qint64(-1) << true;
+  QTest::newRow("entry out of bounds") << -1 << qint64(0) << true;
+}
+
+void TestLshIndex::testMapCorrupt() {
+  QFETCH(int, offset);
+  QFETCH(qint64, value);
+  QFETCH(bool, fromEnd);
+
+  LshIndex index;
+  index.build(_descriptors.data(), count(), {1, 0});
+  QCOMPARE(index.keySize(), 7);
+
+  const QString path = _dir.filePath(QString("corrupt-%1.cache").arg(QTest::currentDataTag()));
+  QFile f(path);
+  QVERIFY(f.open(QFile::ReadWrite));
+  index.write(f);
+
+  const int numBuckets = 1 << index.keySize();
+  const qint64 offsets = 32 + LshIndex::DESC_BYTES;
+  const qint64 pos = offset < 0 ? offsets + 4 * (numBuckets + 1) : offsets + 4 * offset;
+  const uint32_t v = uint32_t(fromEnd ? value + qint64(count()) : value);
+  QVERIFY(f.seek(pos));
+  QCOMPARE(f.write(reinterpret_cast<const char*>(&v), sizeof(v)), qint64(sizeof(v)));
+  f.close();
+
+  LshIndex mapped;
+  QVERIFY(!mapped.map(path, count()));
+  QVERIFY(!mapped.isMapped());
+}
+
+void TestLshIndex::testTail() {
+  // descriptors added after build are searched linearly, so the rows
+  // of queries in the tail are always found
+  const size_t built = count() - 1000;
+  LshIndex index;
+  index.build(_descriptors.data(), built, {1, 0});
+  index.add(_descriptors.data(), count(), {1, 0});
+  QCOMPARE(index.size(), count());
+  QCOMPARE(index.tailSize(), size_t(1000));
+
+  std::vector<LshIndex::Match> nearest;
+  int tailQueries = 0;
+  for (int i = 0; i < NumQueries; ++i) {
+    index.knnSearch(_descriptors.data(), query(i), Knn, {1, 0}, nearest);
+    checkMatches(nearest, _descriptors.data(), query(i));
+    if (_queryRows[size_t(i)] < built) continue;
+    tailQueries++;
+    QVERIFY(!nearest.empty());
+    QCOMPARE(nearest[0].index, _queryRows[size_t(i)]);
+  }
+  QVERIFY(tailQueries > 0);
+
+  // a tail larger than MIN_TAIL is indexed by a rebuild
+  LshIndex small;
+  small.build(_descriptors.data(), count() - LshIndex::MIN_TAIL, {1, 0});
+  small.add(_descriptors.data(), count(), {1, 0});
+  QCOMPARE(small.size(), count());
+  QCOMPARE(small.tailSize(), size_t(0));
+
+  // fewer descriptors is ignored
+  small.add(_descriptors.data(), count() - 1, {1, 0});
+  QCOMPARE(small.size(), count());
+}
+
+QTEST_MAIN(TestLshIndex)
+#include "testlshindex.moc"
@@ -0,0 +1,192 @@
+#include <QtTest/QtTest>
+
+#include "mediatable.h"
+
+class TestMediaTable : public QObject {
+  Q_OBJECT
+
+  QTemporaryDir _dir;
+  MediaTable _table;
+
+ private Q_SLOTS:
+  void initTestCase();
+  void testSortFind();
+  void testPath();
+  void testWriteMap();
+  void testMapCorrupt_data();
+  void testMapCorrupt();
+
+ private:
+  QString writeTable(const QString& name) const;
+};
+
+/// rows appended out of order, some without md5
+static const struct {
+  uint32_t id;
+  int type;
+  const char* path;
+  const char* md5;
+} Rows[] = {
+    {7, Media::TypeImage, "a/one.jpg", "0123456789abcdef0123456789abcdef"},
+    {2, Media::TypeVideo, "b/two.mp4", ""},
+    {11, Media::TypeImage, "three.png", "fedcba9876543210fedcba9876543210"},
+    {5, Media::TypeImage, "a/b/c/four \xc3\xa9.jpg", "00000000000000000000000000000001"},
+};
+static const int NumRows = sizeof(Rows) / sizeof(*Rows);
+
+void TestMediaTable::initTestCase() {
+  _table = MediaTable("/base");
+  for (int i = 0; i < NumRows; ++i)
+    _table.append(Rows[i].id, Rows[i].type, 100 + i, 200 + i, QString::fromUtf8(Rows[i].path),
+                  Rows[i].md5, uint64_t(i) << 32 | Rows[i].id);
+  _table.sort();
+}
+
+/// compare every row of a table with Rows[]
+static void compareRows(const MediaTable& table) {
+  QCOMPARE(table.count(), NumRows);
+  for (int i = 0; i < NumRows; ++i) {
+    const int row = table.find(Rows[i].id);
+    QVERIFY(row >= 0);
+    QCOMPARE(table.id(row), Rows[i].id);
+    QCOMPARE(table.type(row), Rows[i].type);
+    QCOMPARE(table.path(row), "/base/" + QString::fromUtf8(Rows[i].path));
+    QCOMPARE(table.md5(row), QString(Rows[i].md5));
+
+    const MediaRecord r = table.record(row);
+    QCOMPARE(r.width, 100 + i);
+    QCOMPARE(r.height, 200 + i);
+    QCOMPARE(r.dctHash, uint64_t(i) << 32 | Rows[i].id);
+
+    const Media m = table.media(row);
+    QCOMPARE(m.id(), int(Rows[i].id));
+    QCOMPARE(m.path(), table.path(row));
+    QCOMPARE(m.md5(), table.md5(row));
+  }
+}
+
+void TestMediaTable::testSortFind() {
+  for (int i = 1; i < _table.count(); ++i) QVERIFY(_table.id(i - 1) < _table.id(i));
+
+  compareRows(_table);
+  if (QTest::currentTestFailed()) return;
+
+  QCOMPARE(_table.find(0), -1);
+  QCOMPARE(_table.find(3), -1);
+  QCOMPARE(_table.find(100), -1);
+
+  // remove keeps the order
+  MediaTable removed = _table;
+  removed.remove({7, 2});
+  QCOMPARE(removed.count(), NumRows - 2);
+  QCOMPARE(removed.find(7), -1);
+  QCOMPARE(removed.path(removed.find(11)), QString("/base/three.png"));
+  QCOMPARE(_table.count(), NumRows);  // copy is not modified
+}
+
+void TestMediaTable::testPath() {
+  // stored relative to the base
+  MediaTable table("/base");
+  Media inside("/base/x/y.jpg", Media::TypeImage, 1, 1);
+  inside.setId(1);
+  table.append(inside);
+
+  QCOMPARE(table.path(0), inside.path());
+  QCOMPARE(table.record(0).pathLength, uint32_t(strlen("x/y.jpg")));
+
+  MediaTable noBase;
+  noBase.append(3, Media::TypeImage, 1, 1, "rel/path.jpg", "", 0);
+  QCOMPARE(noBase.path(0), QString("rel/path.jpg"));
+  QCOMPARE(noBase.md5(0), QString());
+}
+
+QString TestMediaTable::writeTable(const QString& name) const {
+  const QString path = _dir.filePath(name);
+  QFile f(path);
+  if (!f.open(QFile::WriteOnly)) return QString();
+  _table.write(f);
+  return path;
+}
+
+void TestMediaTable::testWriteMap() {
+  const QString path = writeTable("table.dat");
+  QVERIFY(!path.isEmpty());
+
+  MediaTable mapped("/base");
+  QVERIFY(mapped.map(path));
+  compareRows(mapped);
+  if (QTest::currentTestFailed()) return;
+
+  // appending to a mapped table copies it
+  mapped.append(1, Media::TypeImage, 1, 1, "new.jpg", "", 0);
+  mapped.sort();
+  QCOMPARE(mapped.id(0), uint32_t(1));
+  QCOMPARE(mapped.path(mapped.find(11)), QString("/base/three.png"));
+
+  MediaTable remapped("/base");
+  QVERIFY(remapped.map(path));
+  QCOMPARE(remapped.count(), NumRows);
+
+  // empty table
+  MediaTable empty;
+  const QString emptyPath = _dir.filePath("empty.dat");
+  {
+    QFile f(emptyPath);
+    QVERIFY(f.open(QFile::WriteOnly));
+    empty.write(f);
+  }
+  QVERIFY(empty.map(emptyPath));
+  QCOMPARE(empty.count(), 0);
+  QCOMPARE(empty.find(1), -1);
+}
+
+void TestMediaTable::testMapCorrupt_data() {
+  // file layout: 24-byte header (magic, version, count, pathBytes),
+  // then columns padded to 8 bytes: ids, types, widths, heights, dct hashes,
+  // md5s, pathEnds, paths
+  const auto padded = [](int size) { return (size + 7) & ~7; };
+  const int idsOffset = 24;
+  int pathEndsOffset = idsOffset;
+  for (int size : {4, 2, 4, 4, 8, 16}) pathEndsOffset += padded(size * NumRows);
+
+  QTest::addColumn<int>("offset");
+  QTest::addColumn<qint64>("value");
+  QTest::addColumn<int>("valueSize");
+
+  QTest::newRow("magic") << 0 << qint64(0) << 1;
+  QTest::newRow("version") << 8 << qint64(99) << 4;
+  QTest::newRow("count") << 12 << qint64(NumRows + 1) << 4;
+  QTest::newRow("pathBytes") << 16 << qint64(1) << 8;
+  QTest::newRow("id not sorted") << idsOffset + 4 << qint64(1000) << 4;
+  QTest::newRow("id repeated") << idsOffset + 4 << qint64(Rows[1].id) << 4;
+  QTest::newRow("pathEnd decreasing") << pathEndsOffset + 8 << qint64(0) << 8;
+  QTest::newRow("pathEnd out of bounds")
+      << pathEndsOffset + 8 * (NumRows - 1) << qint64(1 << 20) << 8;
+  QTest::newRow("truncated") << -1 << qint64(0) << 0;
+}
+
+void TestMediaTable::testMapCorrupt() {
+  QFETCH(int, offset);
+  QFETCH(qint64, value);
+  QFETCH(int, valueSize);
+
+  const QString path = writeTable(QString("corrupt-%1.dat").arg(QTest::currentDataTag()));
+  QVERIFY(!path.isEmpty());
+  {
+    QFile f(path);
+    QVERIFY(f.open(QFile::ReadWrite));
+    if (offset < 0)
+      QVERIFY(f.resize(f.size() - 1));
+    else {
+      QVERIFY(f.seek(offset));
+      QCOMPARE(f.write(reinterpret_cast<const char*>(&value), valueSize), qint64(valueSize));
+    }
+  }
+
+  MediaTable table("/base");
+  QVERIFY(!table.map(path));
+  QCOMPARE(table.count(), 0);
+}
+
+QTEST_MAIN(TestMediaTable)
+#include "testmediatable.moc"
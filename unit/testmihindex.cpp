@@ -0,0 +1,106 @@
+#include <QtTest/QtTest>
+
+#include "tree/dcttree.h"
+
+static_assert(std::is_base_of<MihIndex, DctMultiTree>::value, "MULTI_MIHINDEX is not in effect");
+
+class TestMihIndex : public QObject {
+  Q_OBJECT
+
+  std::vector<uint64_t> _hashes;
+  std::vector<uint32_t> _ids;
+
+ private Q_SLOTS:
+  void initTestCase();
+  void testDctTree();
+  void testMultiTree();
+};
+
+/// (id, distance) of hashes within threshold by brute-force, ignoring removed (id 0)
+static QVector<QPair<uint32_t, int>> scanReference(const std::vector<uint64_t>& hashes,
+                                                   const std::vector<uint32_t>& ids,
+                                                   uint64_t target, int threshold) {
+  QVector<QPair<uint32_t, int>> result;
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    const int d = hamm64(target, hashes[i]);
+    if (ids[i] && d < threshold) result.append({ids[i], d});
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+void TestMihIndex::initTestCase() {
+  // clusters of near-duplicates, more than MihIndex::MIN_TAIL so tables are used
+  QRandomGenerator rng(5678);
+  uint64_t center = 0;
+  for (uint32_t id = 1; id <= 20000; ++id) {
+    if (id % 16 == 1) center = rng.generate64();
+    uint64_t hash = center;
+    for (int n = int(rng.bounded(8)); n > 0; --n) hash ^= uint64_t(1) << rng.bounded(64);
+    _hashes.push_back(hash);
+    _ids.push_back(id);
+  }
+}
+
+void TestMihIndex::testDctTree() {
+  DctTree tree;
+  tree.create(_hashes.data(), _ids.data(), int(_hashes.size()));
+
+  for (int threshold : {1, 4, 8, 12, 16, 24})
+    for (size_t i = 0; i < _hashes.size(); i += 997) {
+      QVector<QPair<uint32_t, int>> actual;
+      for (auto& m : tree.search(_hashes[i], threshold)) actual.append({m.mediaId, m.score});
+      std::sort(actual.begin(), actual.end());
+      QCOMPARE(actual, scanReference(_hashes, _ids, _hashes[i], threshold));
+    }
+}
+
+void TestMihIndex::testMultiTree() {
+  std::vector<DctMultiTree::Value> values;
+  for (size_t i = 0; i < _hashes.size(); ++i) values.push_back({_ids[i], _hashes[i]});
+
+  DctMultiTree tree;
+  tree.insert(values);
+
+  std::unordered_set<DctMultiTree::index_t> removed;
+  std::vector<uint32_t> liveIds = _ids;
+  for (size_t i = 0; i < liveIds.size(); i += 3) {
+    removed.insert(liveIds[i]);
+    liveIds[i] = 0;
+  }
+  tree.remove(removed);
+  tree.freeze();
+
+  auto check = [this, &liveIds](const DctMultiTree& t) {
+    for (int threshold : {1, 6, 12, 20})
+      for (size_t i = 0; i < _hashes.size(); i += 991) {
+        std::vector<DctMultiTree::Match> matches;
+        t.search(_hashes[i], threshold, matches);
+        QVector<QPair<uint32_t, int>> actual;
+        for (auto& m : matches)
+          if (m.value.index) actual.append({m.value.index, m.distance});
+        std::sort(actual.begin(), actual.end());
+        QCOMPARE(actual, scanReference(_hashes, liveIds, _hashes[i], threshold));
+      }
+  };
+  check(tree);
+  if (QTest::currentTestFailed()) return;
+
+  // removed values are not written
+  QTemporaryDir dir;
+  QVERIFY(dir.isValid());
+  const QString path = dir.filePath("mih.cache");
+  {
+    QFile f(path);
+    QVERIFY(f.open(QFile::WriteOnly));
+    tree.write(f);
+  }
+
+  DctMultiTree loaded;
+  QVERIFY(loaded.read(qUtf8Printable(path)));
+  QCOMPARE(loaded.size(), _hashes.size() - removed.size());
+  check(loaded);
+}
+
+QTEST_MAIN(TestMihIndex)
+#include "testmihindex.moc"
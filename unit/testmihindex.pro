@@ -0,0 +1,8 @@
+include("pre.pri")
+
+# the alternate trees are not in the default build, keep them compiling and correct
+DEFINES += MIHINDEX MULTI_MIHINDEX
+
+FILES += $$FILES_INDEX dcthashindex
+
+include("post.pri")
@@ -0,0 +1,111 @@
+#include <QtTest/QtTest>
+
+#include "previewcache.h"
+
+class TestPreviewCache : public QObject {
+  Q_OBJECT
+
+  QTemporaryDir _dir;
+
+ private Q_SLOTS:
+  void testCacheSize();
+  void testStoreLoad();
+  void testEvict();
+};
+
+/// noise compresses poorly, so files are about as large as they can be
+static QImage noiseImage(int width, int height, int seed) {
+  QImage img(width, height, QImage::Format_RGB32);
+  QRandomGenerator rng(seed);
+  for (int y = 0; y < height; ++y) {
+    QRgb* line = reinterpret_cast<QRgb*>(img.scanLine(y));
+    for (int x = 0; x < width; ++x) line[x] = rng.generate() | 0xff000000;
+  }
+  return img;
+}
+
+void TestPreviewCache::testCacheSize() {
+  QCOMPARE(PreviewCache::cacheSize(0), int(PreviewCache::IndexSize));
+  QCOMPARE(PreviewCache::cacheSize(100), int(PreviewCache::IndexSize));
+  QCOMPARE(PreviewCache::cacheSize(1920), 2048);
+  QCOMPARE(PreviewCache::cacheSize(2048), 2048);
+  QCOMPARE(PreviewCache::cacheSize(2049), 2304);
+
+  // always large enough
+  for (int size = 1; size < 5000; size += 7) QVERIFY(PreviewCache::cacheSize(size) >= size);
+}
+
+void TestPreviewCache::testStoreLoad() {
+  PreviewCache& cache = PreviewCache::forPath(_dir.filePath("storeload"));
+  const QString md5 = "0123456789abcdef0123456789abcdef";
+  const QImage img = noiseImage(300, 200, 1);
+
+  QVERIFY(!cache.contains(md5, 256));
+  QVERIFY(cache.load(md5, 256).isNull());
+  QVERIFY(cache.loadData(md5, 256).isEmpty());
+
+  // scaled images are lossy, sizes and frames are separate entries
+  cache.store(md5, 256, -1, PreviewCache::scaled(img, 256));
+  QVERIFY(cache.contains(md5, 256));
+  QVERIFY(!cache.contains(md5, 512));
+  QVERIFY(!cache.contains(md5, 256, 10));
+
+  const QImage scaled = cache.load(md5, 256);
+  QCOMPARE(scaled.width(), 256);
+  QVERIFY(qAbs(scaled.height() - 171) <= 1);
+  QVERIFY(!cache.loadData(md5, 256).isEmpty());
+
+  cache.store(md5, 256, 10, PreviewCache::scaled(img, 256));
+  QVERIFY(cache.contains(md5, 256, 10));
+
+  // unscaled images are lossless
+  cache.store(md5, 0, -1, img);
+  QCOMPARE(cache.load(md5, 0).convertToFormat(img.format()), img);
+
+  // no md5, nothing cached
+  cache.store("", 256, -1, img);
+  QVERIFY(cache.load("", 256).isNull());
+}
+
+void TestPreviewCache::testEvict() {
+  // files from a previous run, oldest first, over the 1MB limit
+  const QString cachePath = _dir.filePath("evict");
+  const QString previewPath = cachePath + "/previews/00";
+  QVERIFY(QDir().mkpath(previewPath));
+
+  const QDateTime now = QDateTime::currentDateTime();
+  QStringList oldFiles;
+  for (int i = 0; i < 8; ++i) {
+    QFile f(previewPath + QString("/old%1").arg(i));
+    QVERIFY(f.open(QFile::WriteOnly));
+    QCOMPARE(f.write(QByteArray(256 * 1024, 'x')), qint64(256 * 1024));
+    QVERIFY(f.flush());  // or the modtime is set on close
+    QVERIFY(f.setFileTime(now.addDays(i - 10), QFile::FileModificationTime));
+    oldFiles.append(f.fileName());
+  }
+
+  qputenv("CBIRD_PREVIEW_CACHE_MB", "1");
+  PreviewCache& cache = PreviewCache::forPath(cachePath);
+  qunsetenv("CBIRD_PREVIEW_CACHE_MB");
+
+  // store() returns right away, files are removed in the background
+  const QString md5 = "fedcba9876543210fedcba9876543210";
+  cache.store(md5, 256, -1, noiseImage(256, 256, 2));
+  QVERIFY(cache.contains(md5, 256));
+
+  // least recently used go first, until under 90% of the limit
+  QTRY_VERIFY(!QFileInfo::exists(oldFiles.first()));
+  QTRY_VERIFY(QFileInfo::exists(oldFiles.last()) && !QFileInfo::exists(oldFiles[4]));
+  QVERIFY(cache.contains(md5, 256));
+
+  qint64 total = 0;
+  QDirIterator it(cachePath + "/previews", QDir::Files, QDirIterator::Subdirectories);
+  while (it.hasNext()) {
+    it.next();
+    total += it.fileInfo().size();
+  }
+  QVERIFY(total <= 1024 * 1024 / 10 * 9);
+}
+
+QTEST_MAIN(TestPreviewCache)
+#include "testpreviewcache.moc"
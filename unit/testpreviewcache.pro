@@ -0,0 +1,5 @@
+include("pre.pri")
+
+FILES += previewcache ioutil
+
+include("post.pri")
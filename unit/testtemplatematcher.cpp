@@ -18,8 +18,57 @@ class TestTemplateMatcher : public TestIndexBase {
 
   void testMatch_data();
   void testMatch();
+  void testFeatureCache();
+  void testCorruptFeatureCache_data();
+  void testCorruptFeatureCache();
+
+ private:
+  bool matchCached(const QString& cachePath, const Media& cand);
 };
 
+static QMutex messagesMutex;  // candidates are matched in other threads
+static QStringList messages;
+
+static void saveMessage(QtMsgType type, const QMessageLogContext& context, const QString& msg) {
+  (void)type;
+  (void)context;
+  QMutexLocker locker(&messagesMutex);
+  messages.append(msg);
+}
+
+/// noise doesn't match anything, so candidates are only decoded to make features
+static Media noiseMedia() {
+  QImage img(256, 256, QImage::Format_Grayscale8);
+  QRandomGenerator rng(1234);
+  for (int y = 0; y < img.height(); ++y)
+    for (int x = 0; x < img.width(); ++x) img.scanLine(y)[x] = uchar(rng.bounded(256));
+
+  Media m(img);
+  m.setPath("noise");
+  m.setMd5("0123456789abcdef0123456789abcdef");
+  return m;
+}
+
+/**
+ * match noise to cand, with the score file removed so features are used
+ * @return true if cand had to be decoded
+ */
+bool TestTemplateMatcher::matchCached(const QString& cachePath, const Media& cand) {
+  QFile::remove(cachePath + "/tmscores.dat");
+
+  SearchParams params;
+  MediaGroup g{cand};
+
+  messages.clear();
+  QtMessageHandler oldHandler = qInstallMessageHandler(saveMessage);
+  TemplateMatcher(cachePath).match(noiseMedia(), g, params);
+  qInstallMessageHandler(oldHandler);
+
+  for (const QString& msg : qAsConst(messages))
+    if (msg.contains("failure to load image")) return true;
+  return false;
+}
+
 void TestTemplateMatcher::testMatch_data() {
   QTest::addColumn<QString>("file");
   QTest::addColumn<QImage>("img");
@@ -174,5 +223,78 @@ void TestTemplateMatcher::testMatch() {
   QVERIFY(g.contains(original));
 }
 
+void TestTemplateMatcher::testFeatureCache() {
+  QTemporaryDir dir;
+  QVERIFY(dir.isValid());
+
+  const Media m = _database->mediaWithType(Media::TypeImage).first();
+  const QString featureFile = dir.path() + "/tmfeatures/" + m.md5() + ".tmf";
+
+  QVERIFY(!matchCached(dir.path(), m));
+  QVERIFY(QFileInfo::exists(featureFile));
+
+  // features come from the cache; nothing to decode
+  Media missing(m);
+  missing.setPath("/nonexistent/" + m.name());
+  QVERIFY(!matchCached(dir.path(), missing));
+
+  // features are removed with the image
+  TemplateMatcher::removeFeatures(dir.path(), {m.md5()});
+  QVERIFY(!QFileInfo::exists(featureFile));
+  QVERIFY(matchCached(dir.path(), missing));
+}
+
+void TestTemplateMatcher::testCorruptFeatureCache_data() {
+  // header (24 bytes) then first entry: numFeatures, maxSize, numKeypoints,
+  // descRows, descCols, descType
+  QTest::addColumn<int>("offset");
+  QTest::addColumn<int>("value");
+  QTest::addColumn<bool>("truncate");
+
+  QTest::newRow("version") << 8 << 99 << false;
+  QTest::newRow("numEntries") << 12 << 1000 << false;
+  QTest::newRow("numKeypoints") << 32 << INT_MAX << false;
+  QTest::newRow("descRows") << 36 << INT_MAX << false;
+  QTest::newRow("descCols") << 40 << 33 << false;
+  QTest::newRow("descType") << 44 << int(CV_32FC1) << false;
+  QTest::newRow("truncated") << 0 << 0 << true;
+}
+
+void TestTemplateMatcher::testCorruptFeatureCache() {
+  QFETCH(int, offset);
+  QFETCH(int, value);
+  QFETCH(bool, truncate);
+
+  QTemporaryDir dir;
+  QVERIFY(dir.isValid());
+
+  const Media m = _database->mediaWithType(Media::TypeImage).first();
+  const QString featureFile = dir.path() + "/tmfeatures/" + m.md5() + ".tmf";
+
+  QVERIFY(!matchCached(dir.path(), m));
+
+  {
+    QFile f(featureFile);
+    QVERIFY(f.open(QFile::ReadWrite));
+    if (truncate)
+      QVERIFY(f.resize(f.size() - 1));
+    else {
+      QVERIFY(f.seek(offset));
+      QCOMPARE(f.write(reinterpret_cast<const char*>(&value), sizeof(value)),
+               qint64(sizeof(value)));
+    }
+  }
+
+  // rejected, so it has to be decoded, which fails
+  Media missing(m);
+  missing.setPath("/nonexistent/" + m.name());
+  QVERIFY(matchCached(dir.path(), missing));
+  QVERIFY(!QFileInfo::exists(featureFile));
+
+  // replaced with a valid file
+  QVERIFY(!matchCached(dir.path(), m));
+  QVERIFY(!matchCached(dir.path(), missing));
+}
+
 QTEST_MAIN(TestTemplateMatcher)
 #include "testtemplatematcher.moc"